@@ -109,12 +109,14 @@ BencodeNode *parseDict(BencodeContext *ctx) {
     peekedChar = fpeek(ctx->file);
     if (peekedChar == 'e') {
         node->dict.keys = NULL;
+        node->dict.key_lengths = NULL;
         node->dict.values = NULL;
         fgetc(ctx->file);
         return node;
     }
 
     node->dict.keys = malloc(sizeof(char *) * DEFAULT_COLLECTION_ITEMS);
+    node->dict.key_lengths = malloc(sizeof(size_t) * DEFAULT_COLLECTION_ITEMS);
     node->dict.values = malloc(sizeof(BencodeNode *) * DEFAULT_COLLECTION_ITEMS);
     node->dict.capacity = DEFAULT_COLLECTION_ITEMS;
 
@@ -143,10 +145,12 @@ BencodeNode *parseDict(BencodeContext *ctx) {
             const size_t newCapacity = node->dict.capacity + DEFAULT_COLLECTION_ITEMS;
             node->dict.capacity = newCapacity;
             node->dict.keys = realloc(node->dict.keys, sizeof(char *) * newCapacity);
+            node->dict.key_lengths = realloc(node->dict.key_lengths, sizeof(size_t) * newCapacity);
             node->dict.values = realloc(node->dict.values, sizeof(BencodeNode *) * newCapacity);
         }
 
         node->dict.keys[node->dict.length - 1] = (char *) key->string.data;
+        node->dict.key_lengths[node->dict.length - 1] = key->string.length;
         node->dict.values[node->dict.length - 1] = value;
         free(key);
     }
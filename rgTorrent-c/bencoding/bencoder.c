@@ -27,6 +27,7 @@ void freeBencodeNode(BencodeNode *node) {
                 freeBencodeNode(node->dict.values[i]);
             }
             free(node->dict.keys);
+            free(node->dict.key_lengths);
             free(node->dict.values);
     }
 
@@ -56,3 +57,14 @@ BencodeNode *getDictValue(const BencodeNode *dict, const char *key) {
     }
     return NULL;
 }
+
+BencodeNode *getDictValueRaw(const BencodeNode *dict, const void *key, const size_t key_length) {
+    if (dict == NULL || dict->type != BEN_DICT) return NULL;
+
+    for (size_t i = 0; i < dict->dict.length; i++) {
+        if (dict->dict.key_lengths[i] == key_length && memcmp(dict->dict.keys[i], key, key_length) == 0) {
+            return dict->dict.values[i];
+        }
+    }
+    return NULL;
+}
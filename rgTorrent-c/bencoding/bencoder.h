@@ -34,6 +34,8 @@ struct BencodeNode {
 
         struct {
             char **keys;
+            // keys are byte strings, info hashes used as keys can contain NULs
+            size_t *key_lengths;
             BencodeNode **values;
             size_t length;
             size_t capacity;
@@ -54,4 +56,6 @@ void reportError(BencodeContext *ctx, const char *format, ...);
 
 BencodeNode *getDictValue(const BencodeNode *dict, const char *key);
 
+BencodeNode *getDictValueRaw(const BencodeNode *dict, const void *key, size_t key_length);
+
 #endif
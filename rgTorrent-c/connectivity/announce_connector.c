@@ -12,11 +12,20 @@
 #include <sys/poll.h>
 
 #include "request_helpers.h"
+#include "http_response.h"
 #include "bencode_parser.h"
 #include "bencoder.h"
 
 #define PROTOCOL_ID 0x41727101980LL
 
+// one generator per thread, seeded once, so tracker requests running in parallel draw different ids
+static __thread unsigned int random_seed;
+
+static int32_t next_random(void) {
+    if (random_seed == 0) random_seed = (unsigned int) time(NULL) ^ (unsigned int) (uintptr_t) &random_seed;
+    return rand_r(&random_seed);
+}
+
 char *udp_send_announce_request(int sockfd, const struct addrinfo *server_info, int64_t connection_id,
                                 const UdpAnnounceRequest *announce, size_t *out_len, int *out_seeders,
                                 int *out_leechers);
@@ -24,11 +33,8 @@ char *udp_send_announce_request(int sockfd, const struct addrinfo *server_info,
 char *udp_get_peers_list(const char *tracker_host, const char *tracker_port, const UdpAnnounceRequest *announce,
                          size_t *out_len, int *out_seeders, int *out_leechers);
 
-char *http_get_peers_list(char *tracker_host, const char *tracker_port, const UdpAnnounceRequest *announce,
-                          size_t *out_len, int *out_seeders, int *out_leechers);
-
-char *parse_peers_from_http_body(char *body, size_t body_length, size_t *out_peers_length, int *out_seeders,
-                                 int *out_leechers);
+char *http_get_peers_list(char *tracker_host, const char *tracker_port, const char *target,
+                          const UdpAnnounceRequest *announce, size_t *out_len, int *out_seeders, int *out_leechers);
 
 char *get_peers_list(const UdpAnnounceRequest *announce, size_t *out_len, int *out_seeders, int *out_leechers) {
     UriUriA announce_uri;
@@ -66,7 +72,13 @@ char *get_peers_list(const UdpAnnounceRequest *announce, size_t *out_len, int *o
     }
     if ((scheme_len == 4 && strncmp(announce_uri.scheme.first, "http", 4) == 0) ||
         (scheme_len == 5 && strncmp(announce_uri.scheme.first, "https", 5) == 0)) {
-        char *http_result = http_get_peers_list(tracker_host, tracker_port, announce, out_len, out_seeders,
+        // path and query of the announce url go to the tracker unchanged
+        const char *rest = port_len > 0 ? announce_uri.portText.afterLast : announce_uri.hostText.afterLast;
+        if (*rest == ']') rest++;
+        char target[1024];
+        snprintf(target, sizeof target, "%s%.*s", *rest == '/' ? "" : "/", (int) strcspn(rest, "#"), rest);
+
+        char *http_result = http_get_peers_list(tracker_host, tracker_port, target, announce, out_len, out_seeders,
                                                 out_leechers);
         uriFreeUriMembersA(&announce_uri);
         return http_result;
@@ -77,12 +89,13 @@ char *get_peers_list(const UdpAnnounceRequest *announce, size_t *out_len, int *o
     return NULL;
 }
 
-char *http_get_peers_list(char *tracker_host, const char *tracker_port, const UdpAnnounceRequest *announce,
-                          size_t *out_len, int *out_seeders, int *out_leechers) {
+char *http_get_peers_list(char *tracker_host, const char *tracker_port, const char *target,
+                          const UdpAnnounceRequest *announce, size_t *out_len, int *out_seeders, int *out_leechers) {
     struct addrinfo hints = {0}, *server_info;
     memset(&hints, 0, sizeof hints);
 
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_flags = AI_ADDRCONFIG;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
@@ -125,66 +138,74 @@ char *http_get_peers_list(char *tracker_host, const char *tracker_port, const Ud
 
     char request[2048];
     snprintf(request, sizeof(request),
-             "GET /announce?info_hash=%s&peer_id=%s&port=%d&uploaded=0&downloaded=0&left=%ld&compact=1&event=started HTTP/1.1\r\n"
+             "GET %s%cinfo_hash=%s&peer_id=%s&port=%d&uploaded=0&downloaded=0&left=%ld&compact=1&event=started HTTP/1.1\r\n"
              "Host: %s\r\n"
              "Connection: close\r\n\r\n",
-             encoded_hash, encoded_peer_id, announce->port, announce->left, tracker_host
+             target, strchr(target, '?') ? '&' : '?', encoded_hash, encoded_peer_id, announce->port, announce->left,
+             tracker_host
     );
 
     send(sockfd, request, strlen(request), 0);
 
-    char response_buf[16384];
-    ssize_t total_received = 0;
-
-    while (total_received < sizeof(response_buf) - 1) {
+    // the response grows with the body, large peer lists are not cut off
+    HttpResponse response;
+    http_response_init(&response);
+    bool valid = true;
+    while (valid && !response.complete) {
         pfd.events = POLLIN;
         if (poll(&pfd, 1, 5000) <= 0) {
             printf("[INFO] HTTP Tracker timed out. Skipping.\n");
+            valid = false;
             break;
         }
-
-        const ssize_t received = recv(sockfd, response_buf + total_received, sizeof(response_buf) - 1 - total_received,
-                                      0);
-        if (received <= 0) break;
-        total_received += received;
+        if (!http_response_reserve(&response, 4096)) {
+            valid = false;
+            break;
+        }
+        const ssize_t received = recv(sockfd, response.buf + response.len, response.capacity - response.len - 1, 0);
+        if (received < 0) {
+            valid = false;
+        } else if (received == 0) {
+            valid = http_response_finish(&response);
+            break;
+        } else {
+            response.len += received;
+            valid = http_response_advance(&response);
+        }
     }
+    close(sockfd);
 
-    if (total_received <= 0) {
-        close(sockfd);
+    if (!valid || !response.complete) {
+        if (response.len > 0) fprintf(stderr, "Invalid HTTP response\n");
+        http_response_free(&response);
         return NULL;
     }
 
-    response_buf[total_received] = '\0';
-    close(sockfd);
-
-    if (strncmp(response_buf, "HTTP/1.1 200", 12) != 0 &&
-        strncmp(response_buf, "HTTP/1.0 200", 12) != 0) {
+    if (response.status != 200) {
         printf("[INFO] HTTP Tracker returned an error/redirect. Skipping.\n");
+        http_response_free(&response);
         return NULL;
     }
 
-    // HTTP separates headers and body with "\r\n\r\n"
-    char *body = strstr(response_buf, "\r\n\r\n");
-    if (!body) {
-        body = strstr(response_buf, "\n\n");
-        if (!body) {
-            fprintf(stderr, "Invalid HTTP response\n");
-            return NULL;
-        }
-        body += 2;
-    } else {
-        body += 4;
-    }
-
-    const long body_offset = body - response_buf;
-    const size_t body_length = total_received - body_offset;
-
-    char *peers = parse_peers_from_http_body(body, body_length, out_len, out_seeders, out_leechers);
+    char *peers = parse_peers_from_http_body(response.buf + response.header_len, response.body_len, out_len,
+                                             NULL, NULL, out_seeders, out_leechers, NULL, NULL);
+    http_response_free(&response);
     return peers;
 }
 
-char *parse_peers_from_http_body(char *body, const size_t body_length, size_t *out_peers_length, int *out_seeders,
-                                 int *out_leechers) {
+// malloc'd copy of a compact peer string, an empty one when the key is missing
+static char *copy_compact_peers(const BencodeNode *root, const char *key, size_t *out_length) {
+    const BencodeNode *node = getDictValue(root, key);
+    const size_t data_len = node && node->type == BEN_STR ? node->string.length : 0;
+    char *copy = malloc(data_len ? data_len : 1);
+    if (copy && data_len) memcpy(copy, node->string.data, data_len);
+    if (out_length) *out_length = copy ? data_len : 0;
+    return copy;
+}
+
+char *parse_peers_from_http_body(char *body, const size_t body_length, size_t *out_peers_length, char **out_peers6,
+                                 size_t *out_peers6_length, int *out_seeders, int *out_leechers, int *out_interval,
+                                 int *out_min_interval) {
     FILE *mem_file = fmemopen(body, body_length, "rb");
     if (!mem_file) {
         perror("fmemopen failed");
@@ -206,22 +227,22 @@ char *parse_peers_from_http_body(char *body, const size_t body_length, size_t *o
         return NULL;
     }
 
-    BencodeNode *peers_node = getDictValue(root, "peers");
-
-    if (!peers_node || peers_node->type != BEN_STR) {
+    // BEP 7: a tracker may answer with IPv6 peers only
+    const BencodeNode *peers_node = getDictValue(root, "peers");
+    const BencodeNode *peers6_node = getDictValue(root, "peers6");
+    if ((!peers_node || peers_node->type != BEN_STR) && (!peers6_node || peers6_node->type != BEN_STR)) {
         fprintf(stderr, "No valid 'peers' key found in response.\n");
         freeBencodeNode(root);
         fclose(mem_file);
         return NULL;
     }
 
-    const size_t data_len = peers_node->string.length;
-    char *peers_copy = malloc(data_len);
-
-    if (peers_copy) {
-        memcpy(peers_copy, peers_node->string.data, data_len);
-        if (out_peers_length) {
-            *out_peers_length = data_len;
+    char *peers_copy = copy_compact_peers(root, "peers", out_peers_length);
+    if (out_peers6) {
+        *out_peers6 = copy_compact_peers(root, "peers6", out_peers6_length);
+        if (!*out_peers6) {
+            free(peers_copy);
+            peers_copy = NULL;
         }
     }
 
@@ -232,17 +253,72 @@ char *parse_peers_from_http_body(char *body, const size_t body_length, size_t *o
         *out_leechers = (incomplete && incomplete->type == BEN_INT) ? incomplete->intValue : 0;
     }
 
+    if (out_interval) {
+        const BencodeNode *interval = getDictValue(root, "interval");
+        *out_interval = (interval && interval->type == BEN_INT) ? interval->intValue : 0;
+    }
+    if (out_min_interval) {
+        const BencodeNode *min_interval = getDictValue(root, "min interval");
+        *out_min_interval = (min_interval && min_interval->type == BEN_INT) ? min_interval->intValue : 0;
+    }
+
     freeBencodeNode(root);
     fclose(mem_file);
     return peers_copy;
 }
 
+bool parse_scrape_response(char *body, const size_t body_length, const uint8_t (*info_hashes)[20], const int count,
+                           ScrapeCounts *out, int *out_min_interval) {
+    FILE *mem_file = fmemopen(body, body_length, "rb");
+    if (!mem_file) {
+        perror("fmemopen failed");
+        return false;
+    }
+
+    BencodeContext ctx;
+    ctx.file = mem_file;
+    ctx.hasError = false;
+    ctx.errorPosition = 0;
+    memset(ctx.errorMsg, 0, sizeof(ctx.errorMsg));
+
+    BencodeNode *root = parseDict(&ctx);
+    fclose(mem_file);
+    const BencodeNode *files = root && !ctx.hasError ? getDictValue(root, "files") : NULL;
+    if (!files || files->type != BEN_DICT) {
+        if (ctx.hasError) fprintf(stderr, "Parser Error: %s\n", ctx.errorMsg);
+        else fprintf(stderr, "No valid 'files' key found in scrape response.\n");
+        if (root) freeBencodeNode(root);
+        return false;
+    }
+
+    // the files are keyed by the raw 20 byte info hashes
+    for (int i = 0; i < count; i++) {
+        const BencodeNode *file = getDictValueRaw(files, info_hashes[i], 20);
+        const BencodeNode *complete = getDictValue(file, "complete");
+        const BencodeNode *downloaded = getDictValue(file, "downloaded");
+        const BencodeNode *incomplete = getDictValue(file, "incomplete");
+        out[i].found = file && file->type == BEN_DICT;
+        out[i].seeders = complete && complete->type == BEN_INT ? complete->intValue : 0;
+        out[i].completed = downloaded && downloaded->type == BEN_INT ? downloaded->intValue : 0;
+        out[i].leechers = incomplete && incomplete->type == BEN_INT ? incomplete->intValue : 0;
+    }
+
+    if (out_min_interval) {
+        const BencodeNode *min_interval = getDictValue(getDictValue(root, "flags"), "min_request_interval");
+        *out_min_interval = min_interval && min_interval->type == BEN_INT ? min_interval->intValue : 0;
+    }
+
+    freeBencodeNode(root);
+    return true;
+}
+
 char *udp_get_peers_list(const char *tracker_host, const char *tracker_port, const UdpAnnounceRequest *announce,
                          size_t *out_len, int *out_seeders, int *out_leechers) {
     struct addrinfo hints = {0}, *server_info;
     memset(&hints, 0, sizeof hints);
 
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_flags = AI_ADDRCONFIG;
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_protocol = IPPROTO_UDP;
 
@@ -267,9 +343,7 @@ char *udp_get_peers_list(const char *tracker_host, const char *tracker_port, con
     connect_request.protocol_id = htobe64(PROTOCOL_ID);
     connect_request.action = htobe32(ConnectRequest);
 
-    // TODO: true random?
-    srand(time(NULL));
-    const int32_t transaction_id = rand();
+    const int32_t transaction_id = next_random();
     connect_request.transaction_id = htobe32(transaction_id);
 
     if (sendto(sockfd, &connect_request, sizeof(connect_request), 0,
@@ -330,7 +404,7 @@ char *udp_send_announce_request(const int sockfd, const struct addrinfo *server_
     announce_req.connection_id = htobe64(connection_id);
     announce_req.action = htobe32(1); // TODO: 1 = Announce, use enum
 
-    const int32_t transaction_id = rand();
+    const int32_t transaction_id = next_random();
     announce_req.transaction_id = htobe32(transaction_id);
 
     memcpy(announce_req.info_hash, announce->info_hash, 20);
@@ -341,7 +415,7 @@ char *udp_send_announce_request(const int sockfd, const struct addrinfo *server_
     announce_req.uploaded = htobe64(0);
     announce_req.event = htobe32(0); // TODO: 0 = None, use enum
     announce_req.ip_address = htobe32(0);
-    announce_req.key = htobe32(rand());
+    announce_req.key = htobe32(next_random());
     announce_req.num_want = htobe32(-1); // TODO: -1 = Default, use enum
     announce_req.port = htobe16(announce->port);
 
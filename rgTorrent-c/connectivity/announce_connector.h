@@ -1,6 +1,7 @@
 #ifndef ANNOUNCE_CONNECTOR_H
 #define ANNOUNCE_CONNECTOR_H
 #define DEFAULT_ANNOUNCE_PORT 6881;
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -52,6 +53,13 @@ typedef struct {
     int32_t seeders;
 } __attribute__((packed)) UdpAnnounceResponsePacket;
 
+typedef struct {
+    int64_t connection_id;
+    int32_t action;
+    int32_t transaction_id;
+    // followed by the info hashes, 20 bytes each
+} __attribute__((packed)) UdpScrapeRequestHeader;
+
 enum NormalAnnounce{
     ConnectRequest = 0,
     ConnectResponse = 1,
@@ -60,4 +68,25 @@ enum NormalAnnounce{
 };
 
 char* get_peers_list(const UdpAnnounceRequest *announce, size_t *out_len, int *out_seeders, int *out_leechers);
+
+// returns a malloc'd copy of the compact IPv4 peers in a bencoded announce response, and of the BEP 7
+// peers6 through out_peers6 when it is given; either list may be empty. The interval outputs are optional
+// and left at 0 when the tracker does not send them
+char *parse_peers_from_http_body(char *body, size_t body_length, size_t *out_peers_length, char **out_peers6,
+                                 size_t *out_peers6_length, int *out_seeders, int *out_leechers, int *out_interval,
+                                 int *out_min_interval);
+
+typedef struct {
+    // false when the tracker does not know the torrent
+    bool found;
+    int seeders;
+    // peers that ever finished the download
+    int completed;
+    int leechers;
+} ScrapeCounts;
+
+// fills out[i] with the counts of info_hashes[i] from a bencoded BEP 48 scrape response; min interval is the
+// tracker's flags.min_request_interval, 0 when not sent
+bool parse_scrape_response(char *body, size_t body_length, const uint8_t (*info_hashes)[20], int count,
+                           ScrapeCounts *out, int *out_min_interval);
 #endif // ANNOUNCE_CONNECTOR_H
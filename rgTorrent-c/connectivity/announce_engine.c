@@ -0,0 +1,1261 @@
+#include "announce_engine.h"
+#include "announce_connector.h"
+#include "dns_cache.h"
+#include "http_response.h"
+#include "request_helpers.h"
+#include "helpers.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <uriparser/Uri.h>
+
+#define PROTOCOL_ID 0x41727101980LL
+// per step of an HTTP announce: connecting, or waiting for an answer
+#define TRACKER_TIMEOUT_MS 5000
+#define HTTP_MAX_REDIRECTS 5
+// kept-alive tracker connections, most trackers close idle ones within a minute anyway
+#define HTTP_POOL_SIZE 16
+#define HTTP_IDLE_MS 30000
+
+#define UDP_ACTION_CONNECT 0
+#define UDP_ACTION_ANNOUNCE 1
+#define UDP_ACTION_SCRAPE 2
+#define UDP_ACTION_ERROR 3
+// BEP 15: a UDP request unanswered after UDP_TIMEOUT_BASE_MS * 2^n is sent again, n counting the retransmissions.
+// The BEP goes up to n = 8, but the engine's own retry backoff takes over long before that
+#define UDP_TIMEOUT_BASE_MS 15000
+#define UDP_MAX_RETRANSMITS 2
+// BEP 15: a connection id can be used for a minute after it was received
+#define UDP_CONNECTION_ID_MS 60000
+// connection ids of this many tracker endpoints are kept
+#define UDP_CONNECTION_SLOTS 64
+// info hashes in one scrape request; the bound of BEP 15, whose answer has to fit in one datagram,
+// also keeps HTTP scrape urls at a length every server accepts
+#define SCRAPE_BATCH_MAX 74
+
+typedef enum {
+    JOB_NEW,
+    // waiting for the tracker's host to be resolved
+    JOB_RESOLVING,
+    JOB_HTTP_CONNECTING,
+    JOB_HTTP_SENDING,
+    JOB_HTTP_RECEIVING,
+    JOB_UDP_CONNECTING,
+    // waiting for the answer to an announce or scrape
+    JOB_UDP_REQUESTING,
+    JOB_DONE,
+} JobState;
+
+// failed trackers are retried after AE_RETRY_BASE seconds, doubling up to AE_RETRY_MAX
+#define AE_RETRY_BASE 60
+#define AE_RETRY_MAX 3600
+
+typedef struct {
+    char url[256];
+    // the tracker accepted our started announce and has to be sent stopped eventually
+    bool started;
+    bool in_flight;
+    bool answered;
+    // the announce in flight carries outdated totals, another one follows as soon as it is answered
+    bool refresh;
+    // completed waits here until the tracker has been told started
+    AnnounceEvent pending;
+    // 0 while no announce is scheduled
+    uint64_t next_announce_ms;
+    uint64_t last_announce_ms;
+    int interval;
+    int min_interval;
+    int failures;
+    // BEP 48 needs an announce url ending in "announce" to derive the scrape url from; UDP trackers always scrape
+    bool scrapable;
+    // 0 while a scrape is in flight
+    uint64_t next_scrape_ms;
+    // swarm size of the last announce or scrape answer
+    bool counted;
+    int seeders;
+    int leechers;
+} AnnounceTracker;
+
+typedef struct AnnounceTorrent {
+    void *owner;
+    AnnounceParams params;
+    bool active;
+    bool succeeded;
+    // all_failed was reported
+    bool gave_up;
+    int tracker_count;
+    AnnounceTracker trackers[AE_MAX_TRACKERS];
+    struct AnnounceTorrent *next;
+} AnnounceTorrent;
+
+// torrents scraped together from one tracker; owners are looked up again when the answer arrives
+typedef struct {
+    int count;
+    void *owners[SCRAPE_BATCH_MAX];
+    uint8_t info_hashes[SCRAPE_BATCH_MAX][20];
+} ScrapeBatch;
+
+typedef struct AnnounceJob {
+    // NULL for stopped announces, which outlive their torrent and report to nobody, and for scrapes
+    AnnounceTorrent *torrent;
+    // set for scrape jobs, which carry no announce
+    ScrapeBatch *scrape;
+    int tracker;
+    // set when the torrent no longer wants the answer, the engine thread frees the job on its next pass
+    bool cancelled;
+    AnnounceEvent event;
+    char url[256];
+    char host[256];
+    char port[10];
+    bool udp;
+    // HTTP: path and query of the announce url, or the whole request target after a redirect
+    char target[1024];
+    int redirects;
+    // the connection came out of the keep-alive pool and may have been closed by the tracker meanwhile
+    bool reused;
+    HttpResponse response;
+    AnnounceParams params;
+    JobState state;
+    int fd;
+    uint64_t deadline_ms;
+    int32_t transaction_id;
+    // UDP: the resolved tracker endpoint, connection ids are cached per endpoint
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int64_t connection_id;
+    uint64_t connection_expires_ms;
+    // how often the datagram in buf was sent again
+    int retransmits;
+    // HTTP: the request while sending; UDP: the last datagram sent
+    char *buf;
+    size_t len;
+    size_t capacity;
+    size_t sent;
+    struct AnnounceJob *next;
+} AnnounceJob;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    // as received, in network byte order; expires_ms is 0 for a free slot
+    int64_t connection_id;
+    uint64_t expires_ms;
+} UdpConnection;
+
+typedef struct {
+    char host[256];
+    char port[10];
+    int fd;
+    uint64_t idle_since_ms;
+} IdleConnection;
+
+struct AnnounceEngine {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // written when work is queued or cancelled, and to stop the thread
+    int wake_fd;
+    bool stop;
+    uint64_t stop_deadline_ms;
+    AnnounceCallbacks callbacks;
+    // trackers of different torrents mostly share a few hosts, each is looked up once
+    DnsCache *dns;
+    AnnounceTorrent *torrents;
+    AnnounceJob *jobs;
+    int job_count;
+    unsigned int seed;
+    UdpConnection udp_connections[UDP_CONNECTION_SLOTS];
+    IdleConnection idle[HTTP_POOL_SIZE];
+    int idle_count;
+};
+
+static void *engine_thread(void *arg);
+
+static void wake_engine(const AnnounceEngine *ae) {
+    const uint64_t one = 1;
+    write(ae->wake_fd, &one, sizeof one);
+}
+
+static void dns_ready(void *ctx) {
+    wake_engine(ctx);
+}
+
+AnnounceEngine *ae_create(const AnnounceCallbacks *callbacks) {
+    AnnounceEngine *ae = calloc(1, sizeof *ae);
+    if (!ae) return NULL;
+    ae->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ae->wake_fd < 0) {
+        free(ae);
+        return NULL;
+    }
+    ae->dns = dns_create(dns_ready, ae);
+    if (!ae->dns) {
+        close(ae->wake_fd);
+        free(ae);
+        return NULL;
+    }
+    ae->callbacks = *callbacks;
+    ae->seed = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+    pthread_mutex_init(&ae->lock, NULL);
+    if (pthread_create(&ae->thread, NULL, engine_thread, ae) != 0) {
+        pthread_mutex_destroy(&ae->lock);
+        dns_destroy(ae->dns);
+        close(ae->wake_fd);
+        free(ae);
+        return NULL;
+    }
+    return ae;
+}
+
+static void free_job(AnnounceJob *job) {
+    if (job->fd != -1) close(job->fd);
+    free(job->scrape);
+    http_response_free(&job->response);
+    free(job->buf);
+    free(job);
+}
+
+void ae_destroy(AnnounceEngine *ae) {
+    pthread_mutex_lock(&ae->lock);
+    ae->stop = true;
+    ae->stop_deadline_ms = monotonic_ms() + AE_STOP_GRACE_MS;
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+    pthread_join(ae->thread, NULL);
+    // no lookup wakes the engine from here on
+    dns_destroy(ae->dns);
+
+    while (ae->jobs) {
+        AnnounceJob *next = ae->jobs->next;
+        free_job(ae->jobs);
+        ae->jobs = next;
+    }
+    while (ae->torrents) {
+        AnnounceTorrent *next = ae->torrents->next;
+        free(ae->torrents);
+        ae->torrents = next;
+    }
+    for (int i = 0; i < ae->idle_count; i++) close(ae->idle[i].fd);
+    pthread_mutex_destroy(&ae->lock);
+    close(ae->wake_fd);
+    free(ae);
+}
+
+// splits an announce url, or the target of a redirect, into host, port, scheme and request target
+static bool parse_tracker_url(AnnounceJob *job, const char *url) {
+    UriUriA uri;
+    const char *error_pos;
+    if (uriParseSingleUriA(&uri, url, &error_pos) != URI_SUCCESS) {
+        fprintf(stderr, "Invalid URI at: %s\n", error_pos);
+        return false;
+    }
+
+    const long host_len = uri.hostText.afterLast - uri.hostText.first;
+    const long port_len = uri.portText.afterLast - uri.portText.first;
+    const long scheme_len = uri.scheme.afterLast - uri.scheme.first;
+    bool ok = host_len > 0 && host_len < (long) sizeof job->host;
+
+    if (ok) snprintf(job->host, sizeof job->host, "%.*s", (int) host_len, uri.hostText.first);
+
+    const bool https = scheme_len == 5 && strncmp(uri.scheme.first, "https", 5) == 0;
+    if (port_len > 0 && port_len < (long) sizeof job->port) {
+        snprintf(job->port, sizeof job->port, "%.*s", (int) port_len, uri.portText.first);
+    } else {
+        strcpy(job->port, https ? "443" : "80");
+    }
+
+    // whatever follows the authority is sent as it is, private trackers keep a passkey in the path or query
+    const char *rest = port_len > 0 ? uri.portText.afterLast : uri.hostText.afterLast;
+    if (*rest == ']') rest++;
+    const int rest_len = (int) strcspn(rest, "#");
+    snprintf(job->target, sizeof job->target, "%s%.*s", *rest == '/' ? "" : "/", rest_len, rest);
+
+    if (scheme_len == 3 && strncmp(uri.scheme.first, "udp", 3) == 0) {
+        job->udp = true;
+    } else if (!https && !(scheme_len == 4 && strncmp(uri.scheme.first, "http", 4) == 0)) {
+        fprintf(stderr, "Failed to resolve scheme for announce address\n");
+        ok = false;
+    }
+
+    uriFreeUriMembersA(&uri);
+    return ok;
+}
+
+// caller holds ae->lock
+static AnnounceTorrent *find_torrent(const AnnounceEngine *ae, const void *owner) {
+    for (AnnounceTorrent *t = ae->torrents; t; t = t->next) {
+        if (t->owner == owner) return t;
+    }
+    return NULL;
+}
+
+// BEP 48: the scrape url replaces "announce" right after the last '/' of the path with "scrape".
+// Works on whole urls and on request targets, false when the tracker has no scrape url.
+static bool scrape_path(char *target) {
+    const size_t path_len = strcspn(target, "?");
+    char *name = NULL;
+    for (size_t i = path_len; i > 0 && !name; i--) {
+        if (target[i - 1] == '/') name = target + i;
+    }
+    if (!name || strncmp(name, "announce", 8) != 0) return false;
+    memcpy(name, "scrape", 6);
+    memmove(name + 6, name + 8, strlen(name + 8) + 1);
+    return true;
+}
+
+// caller holds ae->lock; tells the owner the largest swarm its trackers know of
+static void report_swarm_size(const AnnounceEngine *ae, const AnnounceTorrent *t) {
+    const AnnounceTracker *best = NULL;
+    for (int i = 0; i < t->tracker_count; i++) {
+        const AnnounceTracker *tr = &t->trackers[i];
+        if (tr->counted && (!best || tr->seeders + tr->leechers > best->seeders + best->leechers)) best = tr;
+    }
+    if (best) ae->callbacks.on_swarm_size(t->owner, best->seeders, best->leechers);
+}
+
+// caller holds ae->lock; the job is picked up by the engine thread on its next pass
+static void queue_job(AnnounceEngine *ae, AnnounceTorrent *t, const int tracker, const AnnounceEvent event) {
+    AnnounceJob *job = calloc(1, sizeof *job);
+    if (!job) return;
+    job->torrent = event == ANNOUNCE_STOPPED ? NULL : t;
+    job->tracker = tracker;
+    job->event = event;
+    job->fd = -1;
+    job->params = t->params;
+    ae->callbacks.fill_totals(t->owner, &job->params);
+    memcpy(job->url, t->trackers[tracker].url, sizeof job->url);
+
+    job->next = ae->jobs;
+    ae->jobs = job;
+    ae->job_count++;
+    if (job->torrent) t->trackers[tracker].in_flight = true;
+}
+
+// caller holds ae->lock; drops the torrent's announces in flight and says stopped where it said started
+static void stop_torrent(AnnounceEngine *ae, AnnounceTorrent *t) {
+    for (AnnounceJob *job = ae->jobs; job; job = job->next) {
+        if (job->torrent == t) job->cancelled = true;
+    }
+    for (int i = 0; i < t->tracker_count; i++) {
+        AnnounceTracker *tr = &t->trackers[i];
+        if (tr->started) queue_job(ae, t, i, ANNOUNCE_STOPPED);
+        tr->started = false;
+        tr->in_flight = false;
+        tr->next_announce_ms = 0;
+    }
+}
+
+bool ae_add_torrent(AnnounceEngine *ae, void *owner, const AnnounceParams *params, char urls[][256],
+                    const int url_count) {
+    AnnounceTorrent *t = calloc(1, sizeof *t);
+    if (!t) return false;
+    t->owner = owner;
+    t->params = *params;
+
+    const uint64_t now = monotonic_ms();
+    for (int i = 0; i < url_count && t->tracker_count < AE_MAX_TRACKERS; i++) {
+        // the announce key is usually repeated in the announce-list
+        bool duplicate = false;
+        for (int j = 0; j < t->tracker_count && !duplicate; j++) {
+            duplicate = strcmp(t->trackers[j].url, urls[i]) == 0;
+        }
+        if (duplicate) continue;
+
+        AnnounceTracker *tr = &t->trackers[t->tracker_count++];
+        snprintf(tr->url, sizeof tr->url, "%s", urls[i]);
+        char scrape_url[256];
+        memcpy(scrape_url, tr->url, sizeof scrape_url);
+        tr->scrapable = strncmp(tr->url, "udp://", 6) == 0 || scrape_path(scrape_url);
+        tr->next_scrape_ms = tr->scrapable ? now + AE_SCRAPE_DELAY_MS : 0;
+    }
+
+    pthread_mutex_lock(&ae->lock);
+    t->next = ae->torrents;
+    ae->torrents = t;
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+    return true;
+}
+
+void ae_set_active(AnnounceEngine *ae, const void *owner, const bool active) {
+    pthread_mutex_lock(&ae->lock);
+    AnnounceTorrent *t = find_torrent(ae, owner);
+    if (t && !t->gave_up && t->active != active) {
+        t->active = active;
+        if (active) {
+            const uint64_t now = monotonic_ms();
+            for (int i = 0; i < t->tracker_count; i++) t->trackers[i].next_announce_ms = now;
+        } else {
+            stop_torrent(ae, t);
+        }
+    }
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+}
+
+void ae_announce_completed(AnnounceEngine *ae, const void *owner) {
+    pthread_mutex_lock(&ae->lock);
+    AnnounceTorrent *t = find_torrent(ae, owner);
+    if (t && t->active) {
+        const uint64_t now = monotonic_ms();
+        for (int i = 0; i < t->tracker_count; i++) {
+            AnnounceTracker *tr = &t->trackers[i];
+            tr->pending = ANNOUNCE_COMPLETED;
+            // a tracker that was not told started yet hears about it with left=0 instead
+            if (tr->started && !tr->in_flight) tr->next_announce_ms = now;
+        }
+    }
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+}
+
+void ae_update_totals(AnnounceEngine *ae, const void *owner) {
+    pthread_mutex_lock(&ae->lock);
+    AnnounceTorrent *t = find_torrent(ae, owner);
+    if (t && t->active) {
+        const uint64_t now = monotonic_ms();
+        for (int i = 0; i < t->tracker_count; i++) {
+            AnnounceTracker *tr = &t->trackers[i];
+            if (tr->in_flight) tr->refresh = true;
+            else if (tr->started) tr->next_announce_ms = now;
+        }
+    }
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+}
+
+void ae_request_peers(AnnounceEngine *ae, const void *owner) {
+    pthread_mutex_lock(&ae->lock);
+    AnnounceTorrent *t = find_torrent(ae, owner);
+    if (t && t->active) {
+        for (int i = 0; i < t->tracker_count; i++) {
+            AnnounceTracker *tr = &t->trackers[i];
+            // failing trackers keep their backoff
+            if (tr->in_flight || !tr->answered || tr->failures > 0) continue;
+            const int min_interval = tr->min_interval > 0 ? tr->min_interval : AE_DEFAULT_MIN_INTERVAL;
+            const uint64_t allowed = tr->last_announce_ms + (uint64_t) min_interval * 1000;
+            if (tr->next_announce_ms == 0 || allowed < tr->next_announce_ms) tr->next_announce_ms = allowed;
+        }
+    }
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+}
+
+void ae_remove_torrent(AnnounceEngine *ae, const void *owner) {
+    pthread_mutex_lock(&ae->lock);
+    AnnounceTorrent **link = &ae->torrents;
+    while (*link && (*link)->owner != owner) link = &(*link)->next;
+    AnnounceTorrent *t = *link;
+    if (t) {
+        *link = t->next;
+        stop_torrent(ae, t);
+        free(t);
+    }
+    pthread_mutex_unlock(&ae->lock);
+    wake_engine(ae);
+}
+
+// caller holds ae->lock; schedules the tracker's next announce and reports the answer
+static void finish_job(AnnounceEngine *ae, AnnounceJob *job, AnnounceResult *result) {
+    if (job->fd != -1) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    job->state = JOB_DONE;
+    if (job->cancelled || !job->torrent) return;
+
+    AnnounceTorrent *t = job->torrent;
+    AnnounceTracker *tr = &t->trackers[job->tracker];
+    const uint64_t now = monotonic_ms();
+    tr->in_flight = false;
+    tr->answered = true;
+    tr->last_announce_ms = now;
+
+    uint64_t wait_s;
+    if (result->ok) {
+        t->succeeded = true;
+        tr->failures = 0;
+        if (job->event == ANNOUNCE_STARTED) tr->started = true;
+        if (job->event == tr->pending) tr->pending = ANNOUNCE_NONE;
+        tr->interval = result->interval > 0 ? result->interval : AE_DEFAULT_INTERVAL;
+        tr->min_interval = result->min_interval;
+        tr->counted = true;
+        tr->seeders = result->seeders;
+        tr->leechers = result->leechers;
+        // the announce told us the swarm size, a scrape would only repeat it
+        if (tr->next_scrape_ms != 0) tr->next_scrape_ms = now + (uint64_t) AE_SCRAPE_INTERVAL * 1000;
+        wait_s = tr->interval > tr->min_interval ? tr->interval : tr->min_interval;
+        // completed is due right after the started it was waiting for
+        if (tr->pending == ANNOUNCE_COMPLETED || tr->refresh) wait_s = 0;
+        tr->refresh = false;
+    } else {
+        const int shift = tr->failures < 6 ? tr->failures : 6;
+        tr->failures++;
+        wait_s = (uint64_t) AE_RETRY_BASE << shift;
+        if (wait_s > AE_RETRY_MAX) wait_s = AE_RETRY_MAX;
+    }
+    tr->next_announce_ms = t->active ? now + wait_s * 1000 : 0;
+
+    if (!t->succeeded && !t->gave_up) {
+        bool all_answered = true;
+        for (int i = 0; i < t->tracker_count && all_answered; i++) all_answered = t->trackers[i].answered;
+        if (all_answered) {
+            result->all_failed = true;
+            t->gave_up = true;
+            t->active = false;
+            for (int i = 0; i < t->tracker_count; i++) t->trackers[i].next_announce_ms = 0;
+        }
+    }
+
+    ae->callbacks.on_result(t->owner, result);
+    if (result->ok) report_swarm_size(ae, t);
+}
+
+// caller holds ae->lock; counts is NULL when the scrape failed. Every torrent of the batch that is still
+// registered gets its next scrape scheduled, and its swarm size where the tracker knew it.
+static void finish_scrape(AnnounceEngine *ae, AnnounceJob *job, const ScrapeCounts *counts, const int min_interval) {
+    if (job->fd != -1) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    job->state = JOB_DONE;
+    if (job->cancelled) return;
+
+    const uint64_t now = monotonic_ms();
+    const int wait_s = min_interval > AE_SCRAPE_INTERVAL ? min_interval : AE_SCRAPE_INTERVAL;
+    const ScrapeBatch *batch = job->scrape;
+    for (int i = 0; i < batch->count; i++) {
+        // the torrent may have been removed, and its owner reused, while the scrape was out
+        AnnounceTorrent *t = find_torrent(ae, batch->owners[i]);
+        if (!t || memcmp(t->params.info_hash, batch->info_hashes[i], 20) != 0) continue;
+        for (int j = 0; j < t->tracker_count; j++) {
+            AnnounceTracker *tr = &t->trackers[j];
+            if (strcmp(tr->url, job->url) != 0) continue;
+            tr->next_scrape_ms = now + (uint64_t) wait_s * 1000;
+            if (counts && counts[i].found) {
+                tr->counted = true;
+                tr->seeders = counts[i].seeders;
+                tr->leechers = counts[i].leechers;
+                report_swarm_size(ae, t);
+            }
+            break;
+        }
+    }
+}
+
+static void fail_job(AnnounceEngine *ae, AnnounceJob *job) {
+    if (job->scrape) {
+        finish_scrape(ae, job, NULL, 0);
+        return;
+    }
+    AnnounceResult result = {.url = job->url, .ok = false};
+    finish_job(ae, job, &result);
+}
+
+static bool reserve_buf(AnnounceJob *job, const size_t capacity) {
+    if (job->capacity >= capacity) return true;
+    char *grown = realloc(job->buf, capacity);
+    if (!grown) return false;
+    job->buf = grown;
+    job->capacity = capacity;
+    return true;
+}
+
+static const char *http_event_param(const AnnounceEvent event) {
+    switch (event) {
+        case ANNOUNCE_COMPLETED: return "&event=completed";
+        case ANNOUNCE_STARTED: return "&event=started";
+        case ANNOUNCE_STOPPED: return "&event=stopped";
+        default: return "";
+    }
+}
+
+static void build_http_request(AnnounceJob *job) {
+    // a redirect target already carries the parameters
+    const int hashes = job->redirects == 0 && job->scrape ? job->scrape->count : 0;
+    const size_t query_capacity = 512 + (size_t) hashes * 72;
+    char *query = malloc(query_capacity);
+    if (!query) return;
+    query[0] = '\0';
+    char separator = strchr(job->target, '?') ? '&' : '?';
+
+    if (job->redirects == 0 && job->scrape) {
+        size_t used = 0;
+        for (int i = 0; i < hashes; i++) {
+            char encoded_hash[61];
+            url_encode(job->scrape->info_hashes[i], 20, encoded_hash);
+            used += snprintf(query + used, query_capacity - used, "%cinfo_hash=%s", separator, encoded_hash);
+            separator = '&';
+        }
+    } else if (job->redirects == 0) {
+        char encoded_hash[61];
+        char encoded_peer_id[61];
+        url_encode(job->params.info_hash, 20, encoded_hash);
+        url_encode(job->params.peer_id, 20, encoded_peer_id);
+        snprintf(query, query_capacity,
+                 "%cinfo_hash=%s&peer_id=%s&port=%d&uploaded=%lu&downloaded=%lu&left=%lu&compact=1%s",
+                 separator, encoded_hash, encoded_peer_id, job->params.port, job->params.uploaded,
+                 job->params.downloaded, job->params.left, http_event_param(job->event));
+    }
+
+    char host[300];
+    const bool ipv6 = strchr(job->host, ':') != NULL;
+    const bool default_port = strcmp(job->port, "80") == 0;
+    snprintf(host, sizeof host, "%s%s%s%s%s", ipv6 ? "[" : "", job->host, ipv6 ? "]" : "",
+             default_port ? "" : ":", default_port ? "" : job->port);
+
+    job->len = 0;
+    job->sent = 0;
+    const size_t capacity = strlen(job->target) + strlen(query) + 512;
+    if (reserve_buf(job, capacity)) {
+        const int n = snprintf(job->buf, job->capacity,
+                               "GET %s%s HTTP/1.1\r\n"
+                               "Host: %s\r\n"
+                               "Connection: keep-alive\r\n\r\n",
+                               job->target, query, host);
+        job->len = n > 0 && (size_t) n < job->capacity ? (size_t) n : 0;
+    }
+    free(query);
+}
+
+// sends the request once the socket is writable and reads the answer into a fresh response
+static bool begin_http_request(AnnounceJob *job) {
+    build_http_request(job);
+    if (job->len == 0) return false;
+    http_response_reset(&job->response);
+    job->state = JOB_HTTP_SENDING;
+    job->deadline_ms = monotonic_ms() + TRACKER_TIMEOUT_MS;
+    return true;
+}
+
+// caller holds ae->lock; a kept-alive connection to the job's tracker, -1 when there is none
+static int take_idle_connection(AnnounceEngine *ae, const AnnounceJob *job) {
+    // newest first, the swap below only moves entries that were checked already
+    for (int i = ae->idle_count - 1; i >= 0; i--) {
+        const IdleConnection *c = &ae->idle[i];
+        if (strcmp(c->host, job->host) != 0 || strcmp(c->port, job->port) != 0) continue;
+        const int fd = c->fd;
+        ae->idle[i] = ae->idle[--ae->idle_count];
+
+        // a connection the tracker closed, or one with unexpected bytes on it, is readable
+        char byte;
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+// caller holds ae->lock; hands the job's connection to the pool, evicting the longest idle one if it is full
+static void keep_idle_connection(AnnounceEngine *ae, AnnounceJob *job) {
+    IdleConnection *slot = &ae->idle[ae->idle_count];
+    if (ae->idle_count == HTTP_POOL_SIZE) {
+        slot = &ae->idle[0];
+        for (int i = 1; i < ae->idle_count; i++) {
+            if (ae->idle[i].idle_since_ms < slot->idle_since_ms) slot = &ae->idle[i];
+        }
+        close(slot->fd);
+    } else {
+        ae->idle_count++;
+    }
+    memcpy(slot->host, job->host, sizeof slot->host);
+    memcpy(slot->port, job->port, sizeof slot->port);
+    slot->fd = job->fd;
+    slot->idle_since_ms = monotonic_ms();
+    job->fd = -1;
+}
+
+// caller holds ae->lock; closes connections idle for too long and returns the ms until the next one is due, -1 if none
+static int expire_idle_connections(AnnounceEngine *ae, const uint64_t now) {
+    int timeout = -1;
+    for (int i = ae->idle_count - 1; i >= 0; i--) {
+        const uint64_t due = ae->idle[i].idle_since_ms + HTTP_IDLE_MS;
+        if (now >= due) {
+            close(ae->idle[i].fd);
+            ae->idle[i] = ae->idle[--ae->idle_count];
+        } else if (timeout < 0 || due - now < (uint64_t) timeout) {
+            timeout = (int) (due - now);
+        }
+    }
+    return timeout;
+}
+
+// caller holds ae->lock
+static UdpConnection *find_udp_connection(AnnounceEngine *ae, const AnnounceJob *job) {
+    for (int i = 0; i < UDP_CONNECTION_SLOTS; i++) {
+        UdpConnection *c = &ae->udp_connections[i];
+        if (c->expires_ms != 0 && c->addr_len == job->addr_len && memcmp(&c->addr, &job->addr, job->addr_len) == 0) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+// caller holds ae->lock; takes the endpoint's slot, or the one that expires first
+static void remember_udp_connection(AnnounceEngine *ae, const AnnounceJob *job) {
+    UdpConnection *slot = find_udp_connection(ae, job);
+    for (int i = 0; i < UDP_CONNECTION_SLOTS && !slot; i++) {
+        if (ae->udp_connections[i].expires_ms == 0) slot = &ae->udp_connections[i];
+    }
+    if (!slot) {
+        slot = &ae->udp_connections[0];
+        for (int i = 1; i < UDP_CONNECTION_SLOTS; i++) {
+            if (ae->udp_connections[i].expires_ms < slot->expires_ms) slot = &ae->udp_connections[i];
+        }
+    }
+    slot->addr = job->addr;
+    slot->addr_len = job->addr_len;
+    slot->connection_id = job->connection_id;
+    slot->expires_ms = job->connection_expires_ms;
+}
+
+static void forget_udp_connection(AnnounceEngine *ae, const AnnounceJob *job) {
+    UdpConnection *c = find_udp_connection(ae, job);
+    if (c) c->expires_ms = 0;
+}
+
+// sends the datagram in buf and gives the tracker 15 * 2^n seconds to answer it
+static void send_udp_datagram(AnnounceEngine *ae, AnnounceJob *job) {
+    if (send(job->fd, job->buf, job->len, 0) < 0) {
+        fail_job(ae, job);
+        return;
+    }
+    job->deadline_ms = monotonic_ms() + ((uint64_t) UDP_TIMEOUT_BASE_MS << job->retransmits);
+}
+
+static void send_udp_connect(AnnounceEngine *ae, AnnounceJob *job) {
+    UdpConnectRequestPacket request;
+    request.protocol_id = htobe64(PROTOCOL_ID);
+    request.action = htobe32(UDP_ACTION_CONNECT);
+    job->transaction_id = rand_r(&ae->seed);
+    request.transaction_id = htobe32(job->transaction_id);
+
+    if (!reserve_buf(job, sizeof request)) {
+        fail_job(ae, job);
+        return;
+    }
+    memcpy(job->buf, &request, sizeof request);
+    job->len = sizeof request;
+    job->state = JOB_UDP_CONNECTING;
+    send_udp_datagram(ae, job);
+}
+
+// announces or scrapes with the job's connection id
+static void send_udp_request(AnnounceEngine *ae, AnnounceJob *job) {
+    job->transaction_id = rand_r(&ae->seed);
+    if (job->scrape) {
+        UdpScrapeRequestHeader header;
+        header.connection_id = job->connection_id;
+        header.action = htobe32(UDP_ACTION_SCRAPE);
+        header.transaction_id = htobe32(job->transaction_id);
+
+        const size_t hashes_len = (size_t) job->scrape->count * 20;
+        if (!reserve_buf(job, sizeof header + hashes_len)) {
+            fail_job(ae, job);
+            return;
+        }
+        memcpy(job->buf, &header, sizeof header);
+        memcpy(job->buf + sizeof header, job->scrape->info_hashes, hashes_len);
+        job->len = sizeof header + hashes_len;
+    } else {
+        UdpAnnounceRequestPacket request;
+        request.connection_id = job->connection_id;
+        request.action = htobe32(UDP_ACTION_ANNOUNCE);
+        request.transaction_id = htobe32(job->transaction_id);
+        memcpy(request.info_hash, job->params.info_hash, 20);
+        memcpy(request.peer_id, job->params.peer_id, 20);
+        request.downloaded = htobe64(job->params.downloaded);
+        request.left = htobe64(job->params.left);
+        request.uploaded = htobe64(job->params.uploaded);
+        request.event = htobe32(job->event);
+        request.ip_address = htobe32(0);
+        request.key = htobe32(rand_r(&ae->seed));
+        request.num_want = htobe32(-1);
+        request.port = htobe16(job->params.port);
+
+        if (!reserve_buf(job, sizeof request)) {
+            fail_job(ae, job);
+            return;
+        }
+        memcpy(job->buf, &request, sizeof request);
+        job->len = sizeof request;
+    }
+    job->state = JOB_UDP_REQUESTING;
+    send_udp_datagram(ae, job);
+}
+
+// caller holds ae->lock; skips the connect round trip while the endpoint's connection id is fresh
+static void begin_udp(AnnounceEngine *ae, AnnounceJob *job) {
+    const UdpConnection *c = find_udp_connection(ae, job);
+    if (c && monotonic_ms() < c->expires_ms) {
+        job->connection_id = c->connection_id;
+        job->connection_expires_ms = c->expires_ms;
+        send_udp_request(ae, job);
+    } else {
+        send_udp_connect(ae, job);
+    }
+}
+
+// caller holds ae->lock; the last datagram went unanswered
+static void retransmit_udp(AnnounceEngine *ae, AnnounceJob *job) {
+    job->retransmits++;
+    // a request is only sent again while its connection id is good, otherwise the connect is redone
+    if (job->state == JOB_UDP_REQUESTING && monotonic_ms() >= job->connection_expires_ms) {
+        forget_udp_connection(ae, job);
+        send_udp_connect(ae, job);
+    } else {
+        send_udp_datagram(ae, job);
+    }
+}
+
+// caller holds ae->lock; resolves the tracker through the cache and opens its socket once the address is known
+static void start_job(AnnounceEngine *ae, AnnounceJob *job) {
+    if (job->state == JOB_NEW) {
+        if (!parse_tracker_url(job, job->url) || (job->scrape && !job->udp && !scrape_path(job->target))) {
+            fail_job(ae, job);
+            return;
+        }
+        job->state = JOB_RESOLVING;
+    }
+
+    const DnsStatus status = dns_resolve(ae->dns, job->host, job->port, &job->addr, &job->addr_len);
+    if (status == DNS_PENDING) return;
+    if (status == DNS_FAILED) {
+        fail_job(ae, job);
+        return;
+    }
+
+    if (!job->udp) {
+        job->fd = take_idle_connection(ae, job);
+        job->reused = job->fd != -1;
+        if (job->reused) {
+            if (!begin_http_request(job)) fail_job(ae, job);
+            return;
+        }
+    }
+
+    const int type = job->udp ? SOCK_DGRAM : SOCK_STREAM;
+    job->fd = socket(job->addr.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (job->fd < 0) {
+        fail_job(ae, job);
+        return;
+    }
+
+    // a connected UDP socket only delivers datagrams from the tracker
+    const int rc = connect(job->fd, (struct sockaddr *) &job->addr, job->addr_len);
+    if (rc < 0 && errno != EINPROGRESS) {
+        fail_job(ae, job);
+    } else if (job->udp) {
+        begin_udp(ae, job);
+    } else {
+        printf("Connecting to HTTP Tracker: %s:%s\n", job->host, job->port);
+        job->state = JOB_HTTP_CONNECTING;
+        job->deadline_ms = monotonic_ms() + TRACKER_TIMEOUT_MS;
+    }
+}
+
+// a kept-alive connection can be closed by the tracker just as the request goes out; the request is then
+// made again on a new connection instead of failing the announce
+static bool retry_on_new_connection(AnnounceJob *job) {
+    if (!job->reused || job->response.len > 0) return false;
+    close(job->fd);
+    job->fd = -1;
+    job->reused = false;
+    job->state = JOB_RESOLVING;
+    return true;
+}
+
+// caller holds ae->lock; the next request goes to the redirect target, on a pooled connection if possible
+static void follow_redirect(AnnounceEngine *ae, AnnounceJob *job) {
+    const char *location = job->response.location;
+    if (++job->redirects > HTTP_MAX_REDIRECTS) {
+        printf("[INFO] HTTP Tracker redirected too often. Skipping.\n");
+        fail_job(ae, job);
+        return;
+    }
+
+    if (job->response.keep_alive) keep_idle_connection(ae, job);
+    else close(job->fd);
+    job->fd = -1;
+
+    if (location[0] == '/') {
+        snprintf(job->target, sizeof job->target, "%s", location);
+    } else if (strncmp(location, "http://", 7) != 0 || !parse_tracker_url(job, location) || job->udp) {
+        // the engine does not speak TLS
+        printf("[INFO] HTTP Tracker redirected to %s. Skipping.\n", location);
+        fail_job(ae, job);
+        return;
+    }
+    job->reused = false;
+    job->state = JOB_RESOLVING;
+}
+
+// caller holds ae->lock
+static void complete_http(AnnounceEngine *ae, AnnounceJob *job) {
+    HttpResponse *r = &job->response;
+    if (r->status >= 300 && r->status < 400 && r->location[0]) {
+        follow_redirect(ae, job);
+        return;
+    }
+    if (r->status != 200) {
+        printf("[INFO] HTTP Tracker returned %d. Skipping.\n", r->status);
+        fail_job(ae, job);
+        return;
+    }
+    if (r->keep_alive) keep_idle_connection(ae, job);
+
+    if (job->scrape) {
+        ScrapeCounts counts[SCRAPE_BATCH_MAX];
+        int min_interval = 0;
+        const bool ok = parse_scrape_response(r->buf + r->header_len, r->body_len,
+                                              (const uint8_t (*)[20]) job->scrape->info_hashes, job->scrape->count,
+                                              counts, &min_interval);
+        finish_scrape(ae, job, ok ? counts : NULL, min_interval);
+        return;
+    }
+
+    AnnounceResult result = {.url = job->url};
+    char *peers6 = NULL;
+    char *peers = parse_peers_from_http_body(r->buf + r->header_len, r->body_len, &result.peers_len, &peers6,
+                                             &result.peers6_len, &result.seeders, &result.leechers,
+                                             &result.interval, &result.min_interval);
+    result.ok = peers != NULL;
+    result.peers = (unsigned char *) peers;
+    result.peers6 = (unsigned char *) peers6;
+    finish_job(ae, job, &result);
+    free(peers);
+    free(peers6);
+}
+
+static void handle_http(AnnounceEngine *ae, AnnounceJob *job, const short revents) {
+    if (job->state == JOB_HTTP_CONNECTING) {
+        int socket_error = 0;
+        socklen_t len = sizeof socket_error;
+        getsockopt(job->fd, SOL_SOCKET, SO_ERROR, &socket_error, &len);
+        if (socket_error != 0 || !begin_http_request(job)) {
+            fail_job(ae, job);
+            return;
+        }
+    }
+
+    if (job->state == JOB_HTTP_SENDING) {
+        const ssize_t n = send(job->fd, job->buf + job->sent, job->len - job->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !retry_on_new_connection(job)) fail_job(ae, job);
+            return;
+        }
+        job->sent += n;
+        if (job->sent < job->len) return;
+
+        job->state = JOB_HTTP_RECEIVING;
+        job->deadline_ms = monotonic_ms() + TRACKER_TIMEOUT_MS;
+        return;
+    }
+
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) return;
+
+    // the body is parsed as it streams in, it ends where its length or the last chunk says or when the tracker closes
+    HttpResponse *r = &job->response;
+    for (;;) {
+        if (!http_response_reserve(r, 4096)) {
+            fail_job(ae, job);
+            return;
+        }
+        const ssize_t n = recv(job->fd, r->buf + r->len, r->capacity - r->len - 1, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                job->deadline_ms = monotonic_ms() + TRACKER_TIMEOUT_MS;
+                return;
+            }
+            if (!retry_on_new_connection(job)) fail_job(ae, job);
+            return;
+        }
+        if (n == 0) {
+            if (retry_on_new_connection(job)) return;
+            if (!http_response_finish(r)) {
+                fprintf(stderr, "Invalid HTTP response\n");
+                fail_job(ae, job);
+                return;
+            }
+            break;
+        }
+        r->len += n;
+        if (!http_response_advance(r)) {
+            fail_job(ae, job);
+            return;
+        }
+        if (r->complete) break;
+    }
+    complete_http(ae, job);
+}
+
+// the answer lists seeders, completed and leechers for each info hash, in the order they were asked
+static void finish_udp_scrape(AnnounceEngine *ae, AnnounceJob *job, const unsigned char *response, const ssize_t n) {
+    ScrapeCounts counts[SCRAPE_BATCH_MAX];
+    for (int i = 0; i < job->scrape->count; i++) {
+        counts[i].found = 8 + 12 * (i + 1) <= n;
+        if (!counts[i].found) continue;
+        uint32_t seeders, completed, leechers;
+        memcpy(&seeders, response + 8 + 12 * i, 4);
+        memcpy(&completed, response + 12 + 12 * i, 4);
+        memcpy(&leechers, response + 16 + 12 * i, 4);
+        counts[i].seeders = (int) be32toh(seeders);
+        counts[i].completed = (int) be32toh(completed);
+        counts[i].leechers = (int) be32toh(leechers);
+    }
+    finish_scrape(ae, job, counts, 0);
+}
+
+static void handle_udp(AnnounceEngine *ae, AnnounceJob *job) {
+    unsigned char response[2048];
+    const ssize_t n = recv(job->fd, response, sizeof response, 0);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) fail_job(ae, job);
+        return;
+    }
+
+    int32_t action, transaction_id;
+    if (n < 8) return;
+    memcpy(&action, response, 4);
+    memcpy(&transaction_id, response + 4, 4);
+    // a stray datagram or the answer to an earlier transmission, the request stays in flight
+    if ((int32_t) be32toh(transaction_id) != job->transaction_id) return;
+    action = (int32_t) be32toh(action);
+
+    if (action == UDP_ACTION_ERROR) {
+        fprintf(stderr, "Tracker Error: %.*s\n", (int) (n - 8), (const char *) response + 8);
+        // the tracker may no longer know our connection id
+        forget_udp_connection(ae, job);
+        fail_job(ae, job);
+        return;
+    }
+
+    if (job->state == JOB_UDP_CONNECTING) {
+        if (n < (ssize_t) sizeof(UdpConnectResponsePacket) || action != UDP_ACTION_CONNECT) {
+            fprintf(stderr, "Tracker Error: Action is not %d (Connect)\n", UDP_ACTION_CONNECT);
+            fail_job(ae, job);
+            return;
+        }
+        memcpy(&job->connection_id, response + 8, 8);
+        job->connection_expires_ms = monotonic_ms() + UDP_CONNECTION_ID_MS;
+        remember_udp_connection(ae, job);
+        job->retransmits = 0;
+        send_udp_request(ae, job);
+        return;
+    }
+
+    if (job->scrape) {
+        if (action != UDP_ACTION_SCRAPE) {
+            fail_job(ae, job);
+            return;
+        }
+        finish_udp_scrape(ae, job, response, n);
+        return;
+    }
+
+    if (n < (ssize_t) sizeof(UdpAnnounceResponsePacket) || action != UDP_ACTION_ANNOUNCE) {
+        fail_job(ae, job);
+        return;
+    }
+
+    uint32_t interval, leechers, seeders;
+    memcpy(&interval, response + 8, 4);
+    memcpy(&leechers, response + 12, 4);
+    memcpy(&seeders, response + 16, 4);
+    AnnounceResult result = {
+        .url = job->url,
+        .ok = true,
+        .seeders = (int) be32toh(seeders),
+        .leechers = (int) be32toh(leechers),
+        .interval = (int) be32toh(interval),
+    };
+    // BEP 15: a tracker reached over IPv6 answers with 18 byte IPv6 peers
+    if (job->addr.ss_family == AF_INET6) {
+        result.peers6 = response + 20;
+        result.peers6_len = n - 20;
+    } else {
+        result.peers = response + 20;
+        result.peers_len = n - 20;
+    }
+    finish_job(ae, job, &result);
+}
+
+// caller holds ae->lock; queues the announces whose time has come and returns the ms until the next one, -1 if none
+static int queue_due_announces(AnnounceEngine *ae, const uint64_t now) {
+    int timeout = -1;
+    for (AnnounceTorrent *t = ae->torrents; t; t = t->next) {
+        if (!t->active) continue;
+        for (int i = 0; i < t->tracker_count; i++) {
+            AnnounceTracker *tr = &t->trackers[i];
+            if (tr->in_flight || tr->next_announce_ms == 0) continue;
+            if (now >= tr->next_announce_ms) {
+                tr->next_announce_ms = 0;
+                queue_job(ae, t, i, tr->started ? tr->pending : ANNOUNCE_STARTED);
+                continue;
+            }
+            const uint64_t left = tr->next_announce_ms - now;
+            if (timeout < 0 || left < (uint64_t) timeout) timeout = left > INT32_MAX ? INT32_MAX : (int) left;
+        }
+    }
+    return timeout;
+}
+
+// caller holds ae->lock; starts the scrapes that are due and returns the ms until the next one, -1 if none.
+// Each due tracker is asked about every torrent it would have to be scraped for within half an interval,
+// so a session sharing a few trackers scrapes them in a handful of requests.
+static int queue_scrapes(AnnounceEngine *ae, const uint64_t now) {
+    const uint64_t horizon = now + (uint64_t) AE_SCRAPE_INTERVAL * 1000 / 2;
+    int timeout = -1;
+    for (AnnounceTorrent *t = ae->torrents; t; t = t->next) {
+        for (int i = 0; i < t->tracker_count; i++) {
+            const AnnounceTracker *due = &t->trackers[i];
+            if (due->next_scrape_ms == 0) continue;
+            if (now < due->next_scrape_ms) {
+                const uint64_t left = due->next_scrape_ms - now;
+                if (timeout < 0 || left < (uint64_t) timeout) timeout = left > INT32_MAX ? INT32_MAX : (int) left;
+                continue;
+            }
+
+            AnnounceJob *job = calloc(1, sizeof *job);
+            ScrapeBatch *batch = calloc(1, sizeof *batch);
+            if (!job || !batch) {
+                free(job);
+                free(batch);
+                return timeout;
+            }
+            memcpy(job->url, due->url, sizeof job->url);
+            for (AnnounceTorrent *u = ae->torrents; u && batch->count < SCRAPE_BATCH_MAX; u = u->next) {
+                // a torrent lists each tracker at most once
+                for (int j = 0; j < u->tracker_count; j++) {
+                    AnnounceTracker *tr = &u->trackers[j];
+                    if (tr->next_scrape_ms == 0 || tr->next_scrape_ms > horizon || strcmp(tr->url, job->url) != 0) {
+                        continue;
+                    }
+                    tr->next_scrape_ms = 0;
+                    batch->owners[batch->count] = u->owner;
+                    memcpy(batch->info_hashes[batch->count++], u->params.info_hash, 20);
+                    break;
+                }
+            }
+            job->scrape = batch;
+            job->fd = -1;
+            http_response_init(&job->response);
+            job->next = ae->jobs;
+            ae->jobs = job;
+            ae->job_count++;
+        }
+    }
+    return timeout;
+}
+
+static void *engine_thread(void *arg) {
+    AnnounceEngine *ae = arg;
+    struct pollfd *pfds = NULL;
+    AnnounceJob **polled = NULL;
+    int polled_capacity = 0;
+
+    pthread_mutex_lock(&ae->lock);
+    for (;;) {
+        // when stopping only the stopped announces are still worth finishing
+        if (ae->stop) {
+            for (AnnounceJob *job = ae->jobs; job; job = job->next) {
+                if (job->torrent || job->scrape) job->cancelled = true;
+            }
+        }
+
+        // finished and cancelled jobs are unlinked here, nothing else frees them
+        AnnounceJob **link = &ae->jobs;
+        while (*link) {
+            AnnounceJob *job = *link;
+            if (job->state == JOB_DONE || job->cancelled) {
+                *link = job->next;
+                ae->job_count--;
+                free_job(job);
+            } else {
+                link = &job->next;
+            }
+        }
+
+        if (ae->stop && (!ae->jobs || monotonic_ms() >= ae->stop_deadline_ms)) break;
+
+        int timeout = -1;
+        if (!ae->stop) {
+            const uint64_t now = monotonic_ms();
+            timeout = queue_due_announces(ae, now);
+            const int timeouts[] = {queue_scrapes(ae, now), expire_idle_connections(ae, now)};
+            for (int i = 0; i < 2; i++) {
+                if (timeout < 0 || (timeouts[i] >= 0 && timeouts[i] < timeout)) timeout = timeouts[i];
+            }
+        }
+
+        // lookups run on the resolver threads, which wake the engine when one is done
+        for (AnnounceJob *job = ae->jobs; job; job = job->next) {
+            if (job->cancelled || (job->state != JOB_NEW && job->state != JOB_RESOLVING)) continue;
+            start_job(ae, job);
+        }
+
+        if (ae->job_count + 1 > polled_capacity) {
+            polled_capacity = ae->job_count + 16;
+            pfds = realloc(pfds, polled_capacity * sizeof *pfds);
+            polled = realloc(polled, polled_capacity * sizeof *polled);
+        }
+
+        const uint64_t now = monotonic_ms();
+        if (ae->stop) timeout = ae->stop_deadline_ms > now ? (int) (ae->stop_deadline_ms - now) : 0;
+        int n = 1;
+        pfds[0].fd = ae->wake_fd;
+        pfds[0].events = POLLIN;
+        for (AnnounceJob *job = ae->jobs; job; job = job->next) {
+            if (job->fd == -1 || job->state == JOB_DONE || job->cancelled) continue;
+            pfds[n].fd = job->fd;
+            pfds[n].events = job->state == JOB_HTTP_CONNECTING || job->state == JOB_HTTP_SENDING ? POLLOUT : POLLIN;
+            polled[n] = job;
+            n++;
+            const int left = job->deadline_ms > now ? (int) (job->deadline_ms - now) : 0;
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+
+        // jobs stay allocated until this thread unlinks them, so the polled pointers outlive the unlock
+        pthread_mutex_unlock(&ae->lock);
+        const int ready = poll(pfds, n, timeout);
+        pthread_mutex_lock(&ae->lock);
+        if (ready < 0 && errno != EINTR) break;
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t counter;
+            read(ae->wake_fd, &counter, sizeof counter);
+        }
+
+        const uint64_t after = monotonic_ms();
+        for (int i = 1; i < n; i++) {
+            AnnounceJob *job = polled[i];
+            if (job->state == JOB_DONE || job->cancelled) continue;
+
+            if (pfds[i].revents) {
+                if (job->udp) handle_udp(ae, job);
+                else handle_http(ae, job, pfds[i].revents);
+            }
+            // waiting for DNS again after a redirect or a stale pooled connection
+            if (job->state == JOB_DONE || job->state == JOB_RESOLVING || after < job->deadline_ms) continue;
+            if (job->udp && job->retransmits < UDP_MAX_RETRANSMITS) {
+                retransmit_udp(ae, job);
+            } else {
+                printf("[INFO] Tracker %s timed out. Skipping.\n", job->host);
+                fail_job(ae, job);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ae->lock);
+
+    free(pfds);
+    free(polled);
+    return NULL;
+}
@@ -0,0 +1,96 @@
+#ifndef ANNOUNCE_ENGINE_H
+#define ANNOUNCE_ENGINE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Runs the tracker requests of a whole session on one thread with non-blocking sockets.
+// Every active torrent is re-announced to each of its trackers on the tracker's interval,
+// and every answer is handed to the result callback as soon as it arrives. The swarm size of every
+// registered torrent, active or not, is kept fresh by scraping trackers that were not heard from for
+// AE_SCRAPE_INTERVAL, many torrents per request.
+typedef struct AnnounceEngine AnnounceEngine;
+
+#define AE_MAX_TRACKERS 30
+// used when a tracker does not say how often it wants to hear from us
+#define AE_DEFAULT_INTERVAL 1800
+#define AE_DEFAULT_MIN_INTERVAL 60
+// how long ae_destroy() keeps running to get the stopped announces out
+#define AE_STOP_GRACE_MS 1000
+// seconds a tracker goes without being asked about a torrent, by announce or scrape, before it is scraped
+#define AE_SCRAPE_INTERVAL 900
+// scrapes of torrents registered together are held back this long so they share requests
+#define AE_SCRAPE_DELAY_MS 2000
+
+// numbered as in BEP 15
+typedef enum {
+    ANNOUNCE_NONE = 0,
+    ANNOUNCE_COMPLETED = 1,
+    ANNOUNCE_STARTED = 2,
+    ANNOUNCE_STOPPED = 3,
+} AnnounceEvent;
+
+typedef struct {
+    uint8_t info_hash[20];
+    uint8_t peer_id[20];
+    // the port and the totals are filled through the totals callback right before each announce
+    int port;
+    uint64_t uploaded;
+    uint64_t downloaded;
+    uint64_t left;
+} AnnounceParams;
+
+typedef struct {
+    const char *url;
+    // false when the tracker could not be reached or sent nothing usable
+    bool ok;
+    // compact IPv4 peers, 6 bytes each
+    const unsigned char *peers;
+    size_t peers_len;
+    // compact IPv6 peers, 18 bytes each
+    const unsigned char *peers6;
+    size_t peers6_len;
+    int seeders;
+    int leechers;
+    // seconds until the next regular announce, and the least the tracker wants between two; 0 when not sent
+    int interval;
+    int min_interval;
+    // set once, on the answer that leaves every tracker of the torrent failed without any success;
+    // the engine stops announcing for the torrent then
+    bool all_failed;
+} AnnounceResult;
+
+// all of them run on the engine thread with the engine locked, they must not call back into the engine
+typedef struct {
+    void (*on_result)(void *owner, const AnnounceResult *result);
+    void (*fill_totals)(void *owner, AnnounceParams *params);
+    // the largest swarm any of the torrent's trackers reported, from announces and scrapes
+    void (*on_swarm_size)(void *owner, int seeders, int leechers);
+} AnnounceCallbacks;
+
+AnnounceEngine *ae_create(const AnnounceCallbacks *callbacks);
+
+// gives pending stopped announces up to AE_STOP_GRACE_MS, then drops whatever is still in flight
+void ae_destroy(AnnounceEngine *ae);
+
+// registers an inactive torrent, which is only scraped until it is activated
+bool ae_add_torrent(AnnounceEngine *ae, void *owner, const AnnounceParams *params,
+                    char urls[][256], int url_count);
+
+// activating a torrent announces started to each of its trackers right away; inactive torrents send stopped
+// to the trackers that were told started and are not re-announced
+void ae_set_active(AnnounceEngine *ae, const void *owner, bool active);
+
+void ae_announce_completed(AnnounceEngine *ae, const void *owner);
+
+// re-announces right away to the trackers that were given totals that changed outside the normal transfer,
+// e.g. when checking the files found data that was already on disk
+void ae_update_totals(AnnounceEngine *ae, const void *owner);
+
+// asks every tracker for peers as soon as its min interval allows
+void ae_request_peers(AnnounceEngine *ae, const void *owner);
+
+// sends stopped if the torrent is active and forgets it; once it returns no callback runs or is made for owner
+void ae_remove_torrent(AnnounceEngine *ae, const void *owner);
+
+#endif // ANNOUNCE_ENGINE_H
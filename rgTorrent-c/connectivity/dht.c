@@ -0,0 +1,1273 @@
+#include "dht.h"
+#include "dht_table.h"
+#include "bencode_parser.h"
+#include "dns_cache.h"
+#include "helpers.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <openssl/sha.h>
+
+// KRPC messages stay below the usual path MTU
+#define PACKET_MAX 1400
+#define TOKEN_LEN 8
+// longer tokens from other nodes are not kept
+#define MAX_TOKEN 64
+// closest nodes a lookup keeps track of
+#define LOOKUP_MAX_CANDIDATES (DHT_K * 4)
+// peers in one get_peers answer, 50 IPv6 values still fit in a datagram
+#define MAX_VALUES 50
+// datagrams read per pass, so timers are not starved by a flood
+#define RECV_BATCH 64
+// the routing tables are checked for stale buckets and the stored peers for expired ones this often
+#define HOUSEKEEPING_MS 60000
+
+#define KRPC_ERROR_PROTOCOL 203
+#define KRPC_ERROR_METHOD 204
+
+typedef enum {
+    QUERY_PING,
+    QUERY_FIND_NODE,
+    QUERY_GET_PEERS,
+    QUERY_ANNOUNCE_PEER,
+} QueryType;
+
+static const char *const query_names[] = {"ping", "find_node", "get_peers", "announce_peer"};
+
+typedef enum {
+    CANDIDATE_NEW,
+    CANDIDATE_QUERIED,
+    CANDIDATE_REPLIED,
+    CANDIDATE_FAILED,
+} CandidateState;
+
+typedef struct {
+    uint8_t id[20];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    CandidateState state;
+    // get_peers: what the node wants to see in our announce_peer
+    uint8_t token[MAX_TOKEN];
+    int token_len;
+} Candidate;
+
+typedef struct DhtTorrent DhtTorrent;
+
+// an iterative find_node or get_peers, closing in on target DHT_ALPHA queries at a time
+typedef struct Lookup {
+    QueryType type;
+    uint8_t target[20];
+    // the torrent a get_peers lookup is for, NULL for node lookups
+    DhtTorrent *torrent;
+    // sorted by distance to target
+    Candidate candidates[LOOKUP_MAX_CANDIDATES];
+    int count;
+    int in_flight;
+    struct Lookup *next;
+} Lookup;
+
+typedef struct Query {
+    uint16_t tid;
+    QueryType type;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    // unknown for bootstrap nodes and nodes from PORT messages
+    uint8_t id[20];
+    bool id_known;
+    uint64_t deadline_ms;
+    // NULL for pings and announces, and once the lookup was abandoned
+    Lookup *lookup;
+    struct Query *next;
+} Query;
+
+struct DhtTorrent {
+    void *owner;
+    uint8_t info_hash[20];
+    bool active;
+    // 0 while no lookup is scheduled
+    uint64_t next_lookup_ms;
+    uint64_t last_lookup_ms;
+    Lookup *lookup;
+    struct DhtTorrent *next;
+};
+
+// a peer that announced itself to us, address then port as in the compact format
+typedef struct {
+    unsigned char compact[18];
+    int len;
+    uint64_t expires_ms;
+} StoredPeer;
+
+typedef struct StoredTorrent {
+    uint8_t info_hash[20];
+    StoredPeer peers[DHT_MAX_STORED_PEERS];
+    int count;
+    struct StoredTorrent *next;
+} StoredTorrent;
+
+typedef struct {
+    char host[256];
+    char port[10];
+} BootstrapNode;
+
+typedef struct {
+    unsigned char data[PACKET_MAX];
+    size_t len;
+    bool overflow;
+} Packet;
+
+struct Dht {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // written when work is queued, and to stop the thread
+    int wake_fd;
+    bool stop;
+    int fd;
+    // AF_INET6 for a dual-stack socket, AF_INET where the host has no IPv6
+    int family;
+    int port;
+    DhtCallbacks callbacks;
+    DnsCache *dns;
+    uint8_t id[20];
+    // BEP 32: IPv4 and IPv6 nodes are kept apart
+    DhtTable tables[2];
+    Lookup *lookups;
+    // the one bootstrap or bucket refresh lookup running, NULL if none
+    Lookup *node_lookup;
+    Query *queries;
+    uint16_t next_tid;
+    DhtTorrent *torrents;
+    StoredTorrent *stored;
+    int stored_count;
+    BootstrapNode bootstrap[DHT_MAX_BOOTSTRAP_NODES];
+    int bootstrap_count;
+    uint64_t next_bootstrap_ms;
+    uint64_t next_housekeeping_ms;
+    uint8_t secret[16];
+    uint8_t previous_secret[16];
+    uint64_t secret_rotated_ms;
+    unsigned int seed;
+};
+
+static void *dht_thread(void *arg);
+
+static void wake_dht(const Dht *dht) {
+    const uint64_t one = 1;
+    write(dht->wake_fd, &one, sizeof one);
+}
+
+static void dns_ready(void *ctx) {
+    wake_dht(ctx);
+}
+
+static DhtTable *table_for(Dht *dht, const int family) {
+    return &dht->tables[family == AF_INET6];
+}
+
+// a dual-stack socket where the host has IPv6, IPv4 only otherwise
+static int bind_socket(const int port, int *out_family) {
+    int fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        const int off = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
+        struct sockaddr_in6 addr = {0};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons((uint16_t) port);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof addr) == 0) {
+            *out_family = AF_INET6;
+            return fd;
+        }
+        close(fd);
+        if (errno == EADDRINUSE) return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t) port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+        close(fd);
+        return -1;
+    }
+    *out_family = AF_INET;
+    return fd;
+}
+
+static void fill_random(uint8_t *out, const size_t len, unsigned int *seed) {
+    if (getrandom(out, len, 0) == (ssize_t) len) return;
+    for (size_t i = 0; i < len; i++) out[i] = (uint8_t) rand_r(seed);
+}
+
+Dht *dht_create(const DhtCallbacks *callbacks, const int port) {
+    Dht *dht = calloc(1, sizeof *dht);
+    if (!dht) return NULL;
+    dht->fd = bind_socket(port, &dht->family);
+    if (dht->fd < 0 && port != 0) dht->fd = bind_socket(0, &dht->family);
+    if (dht->fd < 0) {
+        free(dht);
+        return NULL;
+    }
+    struct sockaddr_storage bound;
+    socklen_t bound_len = sizeof bound;
+    getsockname(dht->fd, (struct sockaddr *) &bound, &bound_len);
+    dht->port = ntohs(bound.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &bound)->sin6_port
+                                                  : ((struct sockaddr_in *) &bound)->sin_port);
+
+    dht->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dht->dns = dht->wake_fd >= 0 ? dns_create(dns_ready, dht) : NULL;
+    if (!dht->dns) {
+        if (dht->wake_fd >= 0) close(dht->wake_fd);
+        close(dht->fd);
+        free(dht);
+        return NULL;
+    }
+    dht->callbacks = *callbacks;
+    dht->seed = (unsigned int) time(NULL) ^ (unsigned int) getpid() ^ (unsigned int) dht->port;
+    fill_random(dht->id, 20, &dht->seed);
+    fill_random(dht->secret, sizeof dht->secret, &dht->seed);
+    memcpy(dht->previous_secret, dht->secret, sizeof dht->secret);
+    dht->secret_rotated_ms = monotonic_ms();
+    dht->next_tid = (uint16_t) rand_r(&dht->seed);
+    dht_table_init(&dht->tables[0], dht->id);
+    dht_table_init(&dht->tables[1], dht->id);
+
+    pthread_mutex_init(&dht->lock, NULL);
+    if (pthread_create(&dht->thread, NULL, dht_thread, dht) != 0) {
+        pthread_mutex_destroy(&dht->lock);
+        dns_destroy(dht->dns);
+        close(dht->wake_fd);
+        close(dht->fd);
+        free(dht);
+        return NULL;
+    }
+    printf("[INFO] DHT node listening on UDP port %d\n", dht->port);
+    return dht;
+}
+
+void dht_destroy(Dht *dht) {
+    pthread_mutex_lock(&dht->lock);
+    dht->stop = true;
+    pthread_mutex_unlock(&dht->lock);
+    wake_dht(dht);
+    pthread_join(dht->thread, NULL);
+    // no lookup wakes the thread from here on
+    dns_destroy(dht->dns);
+
+    while (dht->queries) {
+        Query *next = dht->queries->next;
+        free(dht->queries);
+        dht->queries = next;
+    }
+    while (dht->lookups) {
+        Lookup *next = dht->lookups->next;
+        free(dht->lookups);
+        dht->lookups = next;
+    }
+    while (dht->torrents) {
+        DhtTorrent *next = dht->torrents->next;
+        free(dht->torrents);
+        dht->torrents = next;
+    }
+    while (dht->stored) {
+        StoredTorrent *next = dht->stored->next;
+        free(dht->stored);
+        dht->stored = next;
+    }
+    pthread_mutex_destroy(&dht->lock);
+    close(dht->wake_fd);
+    close(dht->fd);
+    free(dht);
+}
+
+int dht_port(const Dht *dht) {
+    return dht->port;
+}
+
+// copies addr into a zeroed out, unmapping IPv4-mapped IPv6 addresses; false for other families
+static bool normalize(const struct sockaddr *addr, const socklen_t addr_len, struct sockaddr_storage *out,
+                      socklen_t *out_len) {
+    memset(out, 0, sizeof *out);
+    if (addr->sa_family == AF_INET && addr_len >= sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        struct sockaddr_in *v4 = (struct sockaddr_in *) out;
+        v4->sin_family = AF_INET;
+        v4->sin_addr = in->sin_addr;
+        v4->sin_port = in->sin_port;
+        *out_len = sizeof *v4;
+        return true;
+    }
+    if (addr->sa_family != AF_INET6 || addr_len < sizeof(struct sockaddr_in6)) return false;
+
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+    if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *) out;
+        v4->sin_family = AF_INET;
+        memcpy(&v4->sin_addr, in6->sin6_addr.s6_addr + 12, 4);
+        v4->sin_port = in6->sin6_port;
+        *out_len = sizeof *v4;
+        return true;
+    }
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) out;
+    v6->sin6_family = AF_INET6;
+    v6->sin6_addr = in6->sin6_addr;
+    v6->sin6_port = in6->sin6_port;
+    v6->sin6_scope_id = in6->sin6_scope_id;
+    *out_len = sizeof *v6;
+    return true;
+}
+
+// address then port in network order, 6 bytes for IPv4 and 18 for IPv6; returns the length
+static size_t put_compact_addr(const struct sockaddr_storage *addr, unsigned char *out) {
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        memcpy(out, &in6->sin6_addr, 16);
+        memcpy(out + 16, &in6->sin6_port, 2);
+        return 18;
+    }
+    const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+    memcpy(out, &in->sin_addr, 4);
+    memcpy(out + 4, &in->sin_port, 2);
+    return 6;
+}
+
+// reads a 6 or 18 byte compact address; false for port 0
+static bool read_compact_addr(const unsigned char *in, const size_t len, struct sockaddr_storage *out,
+                              socklen_t *out_len) {
+    memset(out, 0, sizeof *out);
+    if (len == 18) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) out;
+        in6->sin6_family = AF_INET6;
+        memcpy(&in6->sin6_addr, in, 16);
+        memcpy(&in6->sin6_port, in + 16, 2);
+        *out_len = sizeof *in6;
+        return in6->sin6_port != 0;
+    }
+    struct sockaddr_in *in4 = (struct sockaddr_in *) out;
+    in4->sin_family = AF_INET;
+    memcpy(&in4->sin_addr, in, 4);
+    memcpy(&in4->sin_port, in + 4, 2);
+    *out_len = sizeof *in4;
+    return in4->sin_port != 0;
+}
+
+static bool same_addr(const struct sockaddr_storage *a, const socklen_t a_len, const struct sockaddr_storage *b,
+                      const socklen_t b_len) {
+    return a_len == b_len && memcmp(a, b, a_len) == 0;
+}
+
+static void put(Packet *p, const void *data, const size_t len) {
+    if (p->overflow || p->len + len > sizeof p->data) {
+        p->overflow = true;
+        return;
+    }
+    memcpy(p->data + p->len, data, len);
+    p->len += len;
+}
+
+static void put_raw(Packet *p, const char *s) {
+    put(p, s, strlen(s));
+}
+
+// a bencoded byte string
+static void put_bytes(Packet *p, const void *data, const size_t len) {
+    char prefix[24];
+    const int n = snprintf(prefix, sizeof prefix, "%zu:", len);
+    put(p, prefix, n);
+    put(p, data, len);
+}
+
+static void put_key(Packet *p, const char *key) {
+    put_bytes(p, key, strlen(key));
+}
+
+static void put_int(Packet *p, const long value) {
+    char text[32];
+    const int n = snprintf(text, sizeof text, "i%lde", value);
+    put(p, text, n);
+}
+
+static bool send_packet(const Dht *dht, const Packet *p, const struct sockaddr_storage *addr,
+                        const socklen_t addr_len) {
+    if (p->overflow) return false;
+    if (addr->ss_family == AF_INET6 && dht->family != AF_INET6) return false;
+
+    // a dual-stack socket reaches IPv4 nodes through their mapped address
+    struct sockaddr_in6 mapped;
+    const struct sockaddr *to = (const struct sockaddr *) addr;
+    socklen_t to_len = addr_len;
+    if (addr->ss_family == AF_INET && dht->family == AF_INET6) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        memset(&mapped, 0, sizeof mapped);
+        mapped.sin6_family = AF_INET6;
+        mapped.sin6_port = in->sin_port;
+        mapped.sin6_addr.s6_addr[10] = 0xff;
+        mapped.sin6_addr.s6_addr[11] = 0xff;
+        memcpy(mapped.sin6_addr.s6_addr + 12, &in->sin_addr, 4);
+        to = (const struct sockaddr *) &mapped;
+        to_len = sizeof mapped;
+    }
+    return sendto(dht->fd, p->data, p->len, 0, to, to_len) == (ssize_t) p->len;
+}
+
+// caller holds dht->lock; the query is tracked until it is answered or times out
+static bool send_query(Dht *dht, const QueryType type, const struct sockaddr_storage *addr, const socklen_t addr_len,
+                       const uint8_t *id, const uint8_t *target, const uint8_t *token, const int token_len,
+                       const int port, Lookup *lookup) {
+    Query *q = calloc(1, sizeof *q);
+    if (!q) return false;
+    q->tid = dht->next_tid++;
+    q->type = type;
+    memcpy(&q->addr, addr, addr_len);
+    q->addr_len = addr_len;
+    q->id_known = id != NULL;
+    if (id) memcpy(q->id, id, 20);
+    q->lookup = lookup;
+
+    // keys in sorted order, as bencoding wants them
+    Packet p = {0};
+    put_raw(&p, "d1:ad");
+    put_key(&p, "id");
+    put_bytes(&p, dht->id, 20);
+    if (type == QUERY_ANNOUNCE_PEER) {
+        put_key(&p, "implied_port");
+        put_int(&p, 0);
+    }
+    if (type == QUERY_GET_PEERS || type == QUERY_ANNOUNCE_PEER) {
+        put_key(&p, "info_hash");
+        put_bytes(&p, target, 20);
+    }
+    if (type == QUERY_ANNOUNCE_PEER) {
+        put_key(&p, "port");
+        put_int(&p, port);
+    }
+    if (type == QUERY_FIND_NODE) {
+        put_key(&p, "target");
+        put_bytes(&p, target, 20);
+    }
+    if (type == QUERY_ANNOUNCE_PEER) {
+        put_key(&p, "token");
+        put_bytes(&p, token, token_len);
+    }
+    // BEP 32: nodes of both families are wanted where we can reach both
+    if ((type == QUERY_FIND_NODE || type == QUERY_GET_PEERS) && dht->family == AF_INET6) {
+        put_key(&p, "want");
+        put_raw(&p, "l2:n42:n6e");
+    }
+    put_raw(&p, "e1:q");
+    put_key(&p, query_names[type]);
+    put_key(&p, "t");
+    const uint8_t tid[2] = {q->tid >> 8, q->tid & 0xff};
+    put_bytes(&p, tid, 2);
+    put_raw(&p, "1:y1:qe");
+
+    if (!send_packet(dht, &p, addr, addr_len)) {
+        free(q);
+        return false;
+    }
+    q->deadline_ms = monotonic_ms() + DHT_QUERY_TIMEOUT_MS;
+    q->next = dht->queries;
+    dht->queries = q;
+    return true;
+}
+
+static void send_error(const Dht *dht, const BencodeNode *tid, const int code, const char *message,
+                       const struct sockaddr_storage *addr, const socklen_t addr_len) {
+    Packet p = {0};
+    put_raw(&p, "d1:eli");
+    char text[16];
+    snprintf(text, sizeof text, "%d", code);
+    put_raw(&p, text);
+    put_raw(&p, "e");
+    put_key(&p, message);
+    put_raw(&p, "e1:t");
+    put_bytes(&p, tid->string.data, tid->string.length);
+    put_raw(&p, "1:y1:ee");
+    send_packet(dht, &p, addr, addr_len);
+}
+
+// BEP 5: a token is a hash of the querier's IP and a secret that changes every DHT_TOKEN_ROTATE_MS
+static void make_token(const uint8_t secret[16], const struct sockaddr_storage *addr, uint8_t out[TOKEN_LEN]) {
+    unsigned char input[16 + 16];
+    memcpy(input, secret, 16);
+    size_t len = 16;
+    if (addr->ss_family == AF_INET6) {
+        memcpy(input + len, &((const struct sockaddr_in6 *) addr)->sin6_addr, 16);
+        len += 16;
+    } else {
+        memcpy(input + len, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+        len += 4;
+    }
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(input, len, hash);
+    memcpy(out, hash, TOKEN_LEN);
+}
+
+static bool token_valid(const Dht *dht, const BencodeNode *token, const struct sockaddr_storage *addr) {
+    if (!token || token->type != BEN_STR || token->string.length != TOKEN_LEN) return false;
+    uint8_t expected[TOKEN_LEN];
+    make_token(dht->secret, addr, expected);
+    if (memcmp(expected, token->string.data, TOKEN_LEN) == 0) return true;
+    make_token(dht->previous_secret, addr, expected);
+    return memcmp(expected, token->string.data, TOKEN_LEN) == 0;
+}
+
+// caller holds dht->lock
+static StoredTorrent *find_stored(const Dht *dht, const uint8_t info_hash[20]) {
+    for (StoredTorrent *st = dht->stored; st; st = st->next) {
+        if (memcmp(st->info_hash, info_hash, 20) == 0) return st;
+    }
+    return NULL;
+}
+
+static void expire_stored(StoredTorrent *st, const uint64_t now) {
+    int kept = 0;
+    for (int i = 0; i < st->count; i++) {
+        if (st->peers[i].expires_ms > now) st->peers[kept++] = st->peers[i];
+    }
+    st->count = kept;
+}
+
+// caller holds dht->lock; a full torrent replaces the peer closest to expiring
+static void store_peer(Dht *dht, const uint8_t info_hash[20], const struct sockaddr_storage *addr,
+                       const uint64_t now) {
+    StoredTorrent *st = find_stored(dht, info_hash);
+    if (!st) {
+        if (dht->stored_count >= DHT_MAX_STORED_TORRENTS || !(st = calloc(1, sizeof *st))) return;
+        memcpy(st->info_hash, info_hash, 20);
+        st->next = dht->stored;
+        dht->stored = st;
+        dht->stored_count++;
+    }
+    expire_stored(st, now);
+
+    StoredPeer peer = {.expires_ms = now + DHT_PEER_TTL_MS};
+    peer.len = (int) put_compact_addr(addr, peer.compact);
+    int slot = st->count;
+    for (int i = 0; i < st->count; i++) {
+        if (st->peers[i].len == peer.len && memcmp(st->peers[i].compact, peer.compact, peer.len) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == DHT_MAX_STORED_PEERS) {
+        slot = 0;
+        for (int i = 1; i < st->count; i++) {
+            if (st->peers[i].expires_ms < st->peers[slot].expires_ms) slot = i;
+        }
+    }
+    st->peers[slot] = peer;
+    if (slot == st->count) st->count++;
+}
+
+// caller holds dht->lock
+static void expire_all_stored(Dht *dht, const uint64_t now) {
+    StoredTorrent **link = &dht->stored;
+    while (*link) {
+        StoredTorrent *st = *link;
+        expire_stored(st, now);
+        if (st->count == 0) {
+            *link = st->next;
+            dht->stored_count--;
+            free(st);
+        } else {
+            link = &st->next;
+        }
+    }
+}
+
+// the compact node info of family closest to target: 26 bytes per IPv4 node, 38 per IPv6 node
+static void put_nodes(Dht *dht, Packet *p, const uint8_t target[20], const int family) {
+    DhtNode closest[DHT_K];
+    const int count = dht_table_closest(table_for(dht, family), target, family, closest, DHT_K);
+    unsigned char compact[DHT_K * 38];
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(compact + len, closest[i].id, 20);
+        len += 20 + put_compact_addr(&closest[i].addr, compact + len + 20);
+    }
+    put_key(p, family == AF_INET6 ? "nodes6" : "nodes");
+    put_bytes(p, compact, len);
+}
+
+// BEP 32: the families listed in want, the querier's own family when there is none
+static void wanted_families(const BencodeNode *args, const struct sockaddr_storage *from, bool *v4, bool *v6) {
+    const BencodeNode *want = getDictValue(args, "want");
+    *v4 = *v6 = false;
+    if (want && want->type == BEN_LIST) {
+        for (size_t i = 0; i < want->list.length; i++) {
+            const BencodeNode *w = want->list.items[i];
+            if (w->type != BEN_STR || w->string.length != 2) continue;
+            if (memcmp(w->string.data, "n4", 2) == 0) *v4 = true;
+            if (memcmp(w->string.data, "n6", 2) == 0) *v6 = true;
+        }
+    }
+    if (!*v4 && !*v6) {
+        *v4 = from->ss_family == AF_INET;
+        *v6 = from->ss_family == AF_INET6;
+    }
+}
+
+static const uint8_t *id_arg(const BencodeNode *dict, const char *key) {
+    const BencodeNode *node = getDictValue(dict, key);
+    return node && node->type == BEN_STR && node->string.length == 20 ? node->string.data : NULL;
+}
+
+// caller holds dht->lock; asks a questionable node the table wants to hear from
+static void book_heard(Dht *dht, const uint8_t id[20], const struct sockaddr_storage *addr, const socklen_t addr_len,
+                       const uint64_t now) {
+    const DhtNode *stale = dht_table_heard(table_for(dht, addr->ss_family), id, (const struct sockaddr *) addr,
+                                           addr_len, now);
+    if (stale) {
+        const DhtNode ping = *stale;
+        send_query(dht, QUERY_PING, &ping.addr, ping.addr_len, ping.id, NULL, NULL, 0, 0, NULL);
+    }
+}
+
+// caller holds dht->lock
+static void handle_query(Dht *dht, const BencodeNode *root, const BencodeNode *tid,
+                         const struct sockaddr_storage *from, const socklen_t from_len, const uint64_t now) {
+    const BencodeNode *q = getDictValue(root, "q");
+    const BencodeNode *args = getDictValue(root, "a");
+    const uint8_t *id = id_arg(args, "id");
+    if (!q || q->type != BEN_STR || !id) {
+        send_error(dht, tid, KRPC_ERROR_PROTOCOL, "Protocol Error", from, from_len);
+        return;
+    }
+    book_heard(dht, id, from, from_len, now);
+
+    const size_t name_len = q->string.length;
+    const char *name = (const char *) q->string.data;
+    int type = -1;
+    for (int i = 0; i < 4 && type < 0; i++) {
+        if (strlen(query_names[i]) == name_len && memcmp(query_names[i], name, name_len) == 0) type = i;
+    }
+    if (type < 0) {
+        send_error(dht, tid, KRPC_ERROR_METHOD, "Method Unknown", from, from_len);
+        return;
+    }
+
+    const uint8_t *target = NULL;
+    if (type == QUERY_FIND_NODE) target = id_arg(args, "target");
+    if (type == QUERY_GET_PEERS || type == QUERY_ANNOUNCE_PEER) target = id_arg(args, "info_hash");
+    if (type != QUERY_PING && !target) {
+        send_error(dht, tid, KRPC_ERROR_PROTOCOL, "Protocol Error", from, from_len);
+        return;
+    }
+
+    if (type == QUERY_ANNOUNCE_PEER) {
+        if (!token_valid(dht, getDictValue(args, "token"), from)) {
+            send_error(dht, tid, KRPC_ERROR_PROTOCOL, "Bad Token", from, from_len);
+            return;
+        }
+        const BencodeNode *implied = getDictValue(args, "implied_port");
+        const BencodeNode *port = getDictValue(args, "port");
+        struct sockaddr_storage peer = *from;
+        if (!implied || implied->type != BEN_INT || implied->intValue == 0) {
+            if (!port || port->type != BEN_INT || port->intValue <= 0 || port->intValue > 65535) {
+                send_error(dht, tid, KRPC_ERROR_PROTOCOL, "Protocol Error", from, from_len);
+                return;
+            }
+            const uint16_t net_port = htons((uint16_t) port->intValue);
+            if (peer.ss_family == AF_INET6) ((struct sockaddr_in6 *) &peer)->sin6_port = net_port;
+            else ((struct sockaddr_in *) &peer)->sin_port = net_port;
+        }
+        store_peer(dht, target, &peer, now);
+    }
+
+    // keys in sorted order: id, nodes, nodes6, token, values
+    Packet p = {0};
+    put_raw(&p, "d1:rd");
+    put_key(&p, "id");
+    put_bytes(&p, dht->id, 20);
+    if (type == QUERY_FIND_NODE || type == QUERY_GET_PEERS) {
+        bool v4, v6;
+        wanted_families(args, from, &v4, &v6);
+        if (v4) put_nodes(dht, &p, target, AF_INET);
+        if (v6) put_nodes(dht, &p, target, AF_INET6);
+    }
+    if (type == QUERY_GET_PEERS) {
+        uint8_t token[TOKEN_LEN];
+        make_token(dht->secret, from, token);
+        put_key(&p, "token");
+        put_bytes(&p, token, TOKEN_LEN);
+
+        StoredTorrent *st = find_stored(dht, target);
+        if (st) expire_stored(st, now);
+        if (st && st->count > 0) {
+            // a random window of the stored peers, so every one of them gets handed out
+            const int count = st->count < MAX_VALUES ? st->count : MAX_VALUES;
+            const int start = rand_r(&dht->seed) % st->count;
+            put_key(&p, "values");
+            put_raw(&p, "l");
+            for (int i = 0; i < count; i++) {
+                const StoredPeer *peer = &st->peers[(start + i) % st->count];
+                put_bytes(&p, peer->compact, peer->len);
+            }
+            put_raw(&p, "e");
+        }
+    }
+    put_raw(&p, "e1:t");
+    put_bytes(&p, tid->string.data, tid->string.length);
+    put_raw(&p, "1:y1:re");
+    send_packet(dht, &p, from, from_len);
+}
+
+// caller holds dht->lock; keeps the candidates sorted and drops the farthest when full
+static Candidate *add_candidate(const Dht *dht, Lookup *l, const uint8_t id[20], const struct sockaddr_storage *addr,
+                                const socklen_t addr_len) {
+    if (memcmp(id, dht->id, 20) == 0) return NULL;
+    int at = l->count;
+    for (int i = 0; i < l->count; i++) {
+        const int cmp = dht_distance_cmp(l->target, id, l->candidates[i].id);
+        if (cmp == 0) return NULL;
+        if (cmp < 0) {
+            at = i;
+            break;
+        }
+    }
+    if (at == LOOKUP_MAX_CANDIDATES) return NULL;
+    // a candidate pushed off the end while a query to it is in flight is only forgotten by the lookup
+    const int moved = (l->count < LOOKUP_MAX_CANDIDATES ? l->count : LOOKUP_MAX_CANDIDATES - 1) - at;
+    memmove(&l->candidates[at + 1], &l->candidates[at], moved * sizeof(Candidate));
+    if (l->count < LOOKUP_MAX_CANDIDATES) l->count++;
+
+    Candidate *c = &l->candidates[at];
+    memset(c, 0, sizeof *c);
+    memcpy(c->id, id, 20);
+    memcpy(&c->addr, addr, addr_len);
+    c->addr_len = addr_len;
+    c->state = CANDIDATE_NEW;
+    return c;
+}
+
+static Candidate *find_candidate(Lookup *l, const struct sockaddr_storage *addr, const socklen_t addr_len) {
+    for (int i = 0; i < l->count; i++) {
+        if (same_addr(&l->candidates[i].addr, l->candidates[i].addr_len, addr, addr_len)) return &l->candidates[i];
+    }
+    return NULL;
+}
+
+// caller holds dht->lock; the lookup starts from the closest nodes of both tables
+static Lookup *new_lookup(Dht *dht, const QueryType type, const uint8_t target[20], DhtTorrent *torrent) {
+    Lookup *l = calloc(1, sizeof *l);
+    if (!l) return NULL;
+    l->type = type;
+    memcpy(l->target, target, 20);
+    l->torrent = torrent;
+    DhtNode closest[LOOKUP_MAX_CANDIDATES];
+    for (int t = 0; t < 2; t++) {
+        const int count = dht_table_closest(&dht->tables[t], target, AF_UNSPEC, closest, LOOKUP_MAX_CANDIDATES);
+        for (int i = 0; i < count; i++) add_candidate(dht, l, closest[i].id, &closest[i].addr, closest[i].addr_len);
+    }
+    l->next = dht->lookups;
+    dht->lookups = l;
+    return l;
+}
+
+// caller holds dht->lock; unlinks and frees the lookup, its queries still in flight report to nobody
+static void drop_lookup(Dht *dht, Lookup *l) {
+    for (Query *q = dht->queries; q; q = q->next) {
+        if (q->lookup == l) q->lookup = NULL;
+    }
+    Lookup **link = &dht->lookups;
+    while (*link && *link != l) link = &(*link)->next;
+    if (*link) *link = l->next;
+    if (dht->node_lookup == l) dht->node_lookup = NULL;
+    free(l);
+}
+
+// caller holds dht->lock; a finished get_peers is announced to the closest nodes that gave a token
+static void finish_lookup(Dht *dht, Lookup *l, const uint64_t now) {
+    int replied = 0;
+    for (int i = 0; i < l->count; i++) {
+        if (l->candidates[i].state == CANDIDATE_REPLIED) replied++;
+    }
+
+    DhtTorrent *t = l->torrent;
+    if (t) {
+        const int port = t->active ? dht->callbacks.announce_port(t->owner) : 0;
+        int announced = 0;
+        for (int i = 0; i < l->count && announced < DHT_K && port > 0; i++) {
+            const Candidate *c = &l->candidates[i];
+            if (c->state != CANDIDATE_REPLIED || c->token_len == 0) continue;
+            if (send_query(dht, QUERY_ANNOUNCE_PEER, &c->addr, c->addr_len, c->id, t->info_hash, c->token,
+                           c->token_len, port, NULL)) {
+                announced++;
+            }
+        }
+        printf("[INFO] DHT lookup finished, %d nodes answered, announced to %d\n", replied, announced);
+        t->lookup = NULL;
+        // a lookup that reached nobody is tried again once the table has filled up
+        const uint64_t delay = replied > 0 ? (uint64_t) DHT_ANNOUNCE_INTERVAL * 1000 : DHT_BOOTSTRAP_RETRY_MS;
+        t->next_lookup_ms = t->active ? now + delay : 0;
+    }
+    drop_lookup(dht, l);
+}
+
+// caller holds dht->lock; sends to the closest candidates not asked yet, DHT_ALPHA at a time. The lookup is over
+// once the DHT_K closest candidates that did not fail have all answered.
+static void step_lookup(Dht *dht, Lookup *l, const uint64_t now) {
+    int considered = 0;
+    for (int i = 0; i < l->count && considered < DHT_K && l->in_flight < DHT_ALPHA; i++) {
+        Candidate *c = &l->candidates[i];
+        if (c->state == CANDIDATE_FAILED) continue;
+        considered++;
+        if (c->state != CANDIDATE_NEW) continue;
+        if (send_query(dht, l->type, &c->addr, c->addr_len, c->id, l->target, NULL, 0, 0, l)) {
+            c->state = CANDIDATE_QUERIED;
+            l->in_flight++;
+        } else {
+            // unreachable, e.g. an IPv6 node on a host without IPv6
+            c->state = CANDIDATE_FAILED;
+            considered--;
+        }
+    }
+    if (l->in_flight == 0) finish_lookup(dht, l, now);
+}
+
+// caller holds dht->lock; new candidates from the compact node info of an answer
+static void merge_nodes(const Dht *dht, Lookup *l, const BencodeNode *nodes, const size_t entry_len) {
+    if (!nodes || nodes->type != BEN_STR) return;
+    for (size_t at = 0; at + entry_len <= nodes->string.length; at += entry_len) {
+        const unsigned char *entry = nodes->string.data + at;
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        if (!read_compact_addr(entry + 20, entry_len - 20, &addr, &addr_len)) continue;
+        if (addr.ss_family == AF_INET6 && dht->family != AF_INET6) continue;
+        add_candidate(dht, l, entry, &addr, addr_len);
+    }
+}
+
+// caller holds dht->lock; the values of a get_peers answer go to the torrent's owner
+static void deliver_values(const Dht *dht, const DhtTorrent *t, const BencodeNode *values) {
+    if (!values || values->type != BEN_LIST) return;
+    unsigned char peers[MAX_VALUES * 6], peers6[MAX_VALUES * 18];
+    size_t len = 0, len6 = 0;
+    for (size_t i = 0; i < values->list.length && i < MAX_VALUES * 2; i++) {
+        const BencodeNode *v = values->list.items[i];
+        if (v->type != BEN_STR) continue;
+        if (v->string.length == 6 && len < sizeof peers) {
+            memcpy(peers + len, v->string.data, 6);
+            len += 6;
+        } else if (v->string.length == 18 && len6 < sizeof peers6) {
+            memcpy(peers6 + len6, v->string.data, 18);
+            len6 += 18;
+        }
+    }
+    if (len) dht->callbacks.on_peers(t->owner, peers, len, AF_INET);
+    if (len6) dht->callbacks.on_peers(t->owner, peers6, len6, AF_INET6);
+}
+
+// caller holds dht->lock; takes q off the list of queries in flight
+static void unlink_query(Dht *dht, const Query *q) {
+    Query **link = &dht->queries;
+    while (*link && *link != q) link = &(*link)->next;
+    if (*link) *link = q->next;
+}
+
+// caller holds dht->lock; an unanswered query counts against the node and ends its part in the lookup
+static void fail_query(Dht *dht, Query *q, const uint64_t now) {
+    unlink_query(dht, q);
+    if (q->id_known) {
+        dht_table_failed(table_for(dht, q->addr.ss_family), q->id, (const struct sockaddr *) &q->addr, q->addr_len);
+    }
+    Lookup *l = q->lookup;
+    if (l) {
+        Candidate *c = find_candidate(l, &q->addr, q->addr_len);
+        if (c) c->state = CANDIDATE_FAILED;
+    }
+    free(q);
+    if (!l) return;
+    l->in_flight--;
+    step_lookup(dht, l, now);
+}
+
+// caller holds dht->lock
+static void handle_response(Dht *dht, const BencodeNode *root, const BencodeNode *tid,
+                            const struct sockaddr_storage *from, const socklen_t from_len, const bool error,
+                            const uint64_t now) {
+    if (tid->string.length != 2) return;
+    const uint16_t t = (uint16_t) (tid->string.data[0] << 8 | tid->string.data[1]);
+    Query *q = dht->queries;
+    while (q && !(q->tid == t && same_addr(&q->addr, q->addr_len, from, from_len))) q = q->next;
+    if (!q) return;
+
+    const BencodeNode *r = getDictValue(root, "r");
+    const uint8_t *id = id_arg(r, "id");
+    // a node that answers under another id than it was found with is not the node we asked
+    if (error || !id || (q->id_known && memcmp(id, q->id, 20) != 0)) {
+        fail_query(dht, q, now);
+        return;
+    }
+    unlink_query(dht, q);
+    book_heard(dht, id, from, from_len, now);
+
+    Lookup *l = q->lookup;
+    free(q);
+    if (!l) return;
+
+    // bootstrap nodes were asked before their id was known
+    Candidate *c = find_candidate(l, from, from_len);
+    if (!c) c = add_candidate(dht, l, id, from, from_len);
+    if (c) {
+        c->state = CANDIDATE_REPLIED;
+        const BencodeNode *token = getDictValue(r, "token");
+        if (token && token->type == BEN_STR && token->string.length <= MAX_TOKEN) {
+            memcpy(c->token, token->string.data, token->string.length);
+            c->token_len = (int) token->string.length;
+        }
+    }
+    merge_nodes(dht, l, getDictValue(r, "nodes"), 26);
+    merge_nodes(dht, l, getDictValue(r, "nodes6"), 38);
+    if (l->torrent) deliver_values(dht, l->torrent, getDictValue(r, "values"));
+    l->in_flight--;
+    step_lookup(dht, l, now);
+}
+
+// caller holds dht->lock
+static void handle_packet(Dht *dht, const unsigned char *data, const size_t len, const struct sockaddr *from_raw,
+                          const socklen_t from_raw_len, const uint64_t now) {
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    if (len == 0 || data[0] != 'd' || !normalize(from_raw, from_raw_len, &from, &from_len)) return;
+
+    FILE *mem_file = fmemopen((void *) data, len, "rb");
+    if (!mem_file) return;
+    BencodeContext ctx = {.file = mem_file};
+    BencodeNode *root = parseDict(&ctx);
+    fclose(mem_file);
+    if (!root) return;
+
+    const BencodeNode *y = getDictValue(root, "y");
+    const BencodeNode *tid = getDictValue(root, "t");
+    if (!ctx.hasError && y && y->type == BEN_STR && y->string.length == 1 && tid && tid->type == BEN_STR) {
+        switch (y->string.data[0]) {
+            case 'q':
+                handle_query(dht, root, tid, &from, from_len, now);
+                break;
+            case 'r':
+                handle_response(dht, root, tid, &from, from_len, false, now);
+                break;
+            case 'e':
+                handle_response(dht, root, tid, &from, from_len, true, now);
+                break;
+            default:
+                break;
+        }
+    }
+    freeBencodeNode(root);
+}
+
+void dht_add_bootstrap(Dht *dht, const char *host, const char *port) {
+    pthread_mutex_lock(&dht->lock);
+    if (dht->bootstrap_count < DHT_MAX_BOOTSTRAP_NODES) {
+        BootstrapNode *b = &dht->bootstrap[dht->bootstrap_count++];
+        snprintf(b->host, sizeof b->host, "%s", host);
+        snprintf(b->port, sizeof b->port, "%s", port);
+        // start resolving right away
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        dns_resolve(dht->dns, b->host, b->port, &addr, &addr_len);
+    }
+    dht->next_bootstrap_ms = 0;
+    pthread_mutex_unlock(&dht->lock);
+    wake_dht(dht);
+}
+
+void dht_add_node(Dht *dht, const struct sockaddr *addr, const socklen_t addr_len) {
+    struct sockaddr_storage node;
+    socklen_t node_len;
+    if (!normalize(addr, addr_len, &node, &node_len)) return;
+    pthread_mutex_lock(&dht->lock);
+    send_query(dht, QUERY_PING, &node, node_len, NULL, NULL, NULL, 0, 0, NULL);
+    pthread_mutex_unlock(&dht->lock);
+    wake_dht(dht);
+}
+
+// caller holds dht->lock
+static DhtTorrent *find_torrent(const Dht *dht, const void *owner) {
+    for (DhtTorrent *t = dht->torrents; t; t = t->next) {
+        if (t->owner == owner) return t;
+    }
+    return NULL;
+}
+
+bool dht_add_torrent(Dht *dht, void *owner, const uint8_t info_hash[20]) {
+    DhtTorrent *t = calloc(1, sizeof *t);
+    if (!t) return false;
+    t->owner = owner;
+    memcpy(t->info_hash, info_hash, 20);
+    pthread_mutex_lock(&dht->lock);
+    t->next = dht->torrents;
+    dht->torrents = t;
+    pthread_mutex_unlock(&dht->lock);
+    return true;
+}
+
+void dht_set_active(Dht *dht, const void *owner, const bool active) {
+    pthread_mutex_lock(&dht->lock);
+    DhtTorrent *t = find_torrent(dht, owner);
+    if (t && t->active != active) {
+        t->active = active;
+        // a lookup in flight runs to the end, it only skips the announce once inactive
+        t->next_lookup_ms = active ? monotonic_ms() : 0;
+    }
+    pthread_mutex_unlock(&dht->lock);
+    wake_dht(dht);
+}
+
+void dht_request_peers(Dht *dht, const void *owner) {
+    pthread_mutex_lock(&dht->lock);
+    DhtTorrent *t = find_torrent(dht, owner);
+    if (t && t->active && !t->lookup) {
+        const uint64_t allowed = t->last_lookup_ms + (uint64_t) DHT_MIN_LOOKUP_INTERVAL * 1000;
+        if (t->next_lookup_ms == 0 || allowed < t->next_lookup_ms) t->next_lookup_ms = allowed;
+    }
+    pthread_mutex_unlock(&dht->lock);
+    wake_dht(dht);
+}
+
+void dht_remove_torrent(Dht *dht, const void *owner) {
+    pthread_mutex_lock(&dht->lock);
+    DhtTorrent **link = &dht->torrents;
+    while (*link && (*link)->owner != owner) link = &(*link)->next;
+    DhtTorrent *t = *link;
+    if (t) {
+        *link = t->next;
+        if (t->lookup) drop_lookup(dht, t->lookup);
+        free(t);
+    }
+    pthread_mutex_unlock(&dht->lock);
+}
+
+void dht_node_counts(Dht *dht, int *nodes, int *good) {
+    pthread_mutex_lock(&dht->lock);
+    const uint64_t now = monotonic_ms();
+    *nodes = dht_table_count(&dht->tables[0]) + dht_table_count(&dht->tables[1]);
+    *good = dht_table_good_count(&dht->tables[0], now) + dht_table_good_count(&dht->tables[1], now);
+    pthread_mutex_unlock(&dht->lock);
+}
+
+// caller holds dht->lock; every node of the table that is not bad, in compact node info
+static unsigned char *table_nodes(const DhtTable *table, const int family, size_t *out_len) {
+    const size_t entry_len = family == AF_INET6 ? 38 : 26;
+    const int max = dht_table_count(table);
+    unsigned char *out = malloc(max * entry_len + 1);
+    *out_len = 0;
+    if (!out) return NULL;
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        const DhtBucket *b = &table->buckets[i];
+        for (int j = 0; j < b->count; j++) {
+            const DhtNode *n = &b->nodes[j];
+            if (n->fails >= DHT_NODE_MAX_FAILS) continue;
+            memcpy(out + *out_len, n->id, 20);
+            *out_len += 20 + put_compact_addr(&n->addr, out + *out_len + 20);
+        }
+    }
+    return out;
+}
+
+unsigned char *dht_save_state(Dht *dht, size_t *out_len) {
+    pthread_mutex_lock(&dht->lock);
+    size_t nodes_len, nodes6_len;
+    unsigned char *nodes = table_nodes(&dht->tables[0], AF_INET, &nodes_len);
+    unsigned char *nodes6 = table_nodes(&dht->tables[1], AF_INET6, &nodes6_len);
+    unsigned char *out = nodes && nodes6 ? malloc(nodes_len + nodes6_len + 96) : NULL;
+    *out_len = 0;
+    if (out) {
+        size_t n = (size_t) sprintf((char *) out, "d2:id20:");
+        memcpy(out + n, dht->id, 20);
+        n += 20;
+        n += (size_t) sprintf((char *) out + n, "5:nodes%zu:", nodes_len);
+        memcpy(out + n, nodes, nodes_len);
+        n += nodes_len;
+        n += (size_t) sprintf((char *) out + n, "6:nodes6%zu:", nodes6_len);
+        memcpy(out + n, nodes6, nodes6_len);
+        n += nodes6_len;
+        out[n++] = 'e';
+        *out_len = n;
+    }
+    pthread_mutex_unlock(&dht->lock);
+    free(nodes);
+    free(nodes6);
+    return out;
+}
+
+bool dht_load_state(Dht *dht, const unsigned char *data, const size_t len) {
+    if (len == 0) return false;
+    FILE *mem_file = fmemopen((void *) data, len, "rb");
+    if (!mem_file) return false;
+    BencodeContext ctx = {.file = mem_file};
+    BencodeNode *root = parseDict(&ctx);
+    fclose(mem_file);
+    const uint8_t *id = root && !ctx.hasError ? id_arg(root, "id") : NULL;
+    if (!id) {
+        freeBencodeNode(root);
+        return false;
+    }
+
+    pthread_mutex_lock(&dht->lock);
+    // keeping the id keeps our place in the other nodes' tables
+    memcpy(dht->id, id, 20);
+    dht_table_init(&dht->tables[0], dht->id);
+    dht_table_init(&dht->tables[1], dht->id);
+    const struct {
+        const char *key;
+        size_t entry_len;
+    } lists[] = {{"nodes", 26}, {"nodes6", 38}};
+    for (int l = 0; l < 2; l++) {
+        const BencodeNode *nodes = getDictValue(root, lists[l].key);
+        if (!nodes || nodes->type != BEN_STR) continue;
+        for (size_t at = 0; at + lists[l].entry_len <= nodes->string.length; at += lists[l].entry_len) {
+            const unsigned char *entry = nodes->string.data + at;
+            struct sockaddr_storage addr;
+            socklen_t addr_len;
+            if (!read_compact_addr(entry + 20, lists[l].entry_len - 20, &addr, &addr_len)) continue;
+            dht_table_heard(table_for(dht, addr.ss_family), entry, (const struct sockaddr *) &addr, addr_len, 0);
+        }
+    }
+    dht->next_bootstrap_ms = 0;
+    pthread_mutex_unlock(&dht->lock);
+    freeBencodeNode(root);
+    wake_dht(dht);
+    return true;
+}
+
+// caller holds dht->lock; looks our own id up from the table and the bootstrap nodes.
+// Returns false while a bootstrap host is still being resolved.
+static bool start_bootstrap(Dht *dht, const uint64_t now) {
+    bool resolving = false;
+    Lookup *l = new_lookup(dht, QUERY_FIND_NODE, dht->id, NULL);
+    if (!l) return true;
+    for (int i = 0; i < dht->bootstrap_count; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        const DnsStatus status = dns_resolve(dht->dns, dht->bootstrap[i].host, dht->bootstrap[i].port, &addr,
+                                             &addr_len);
+        if (status == DNS_PENDING) resolving = true;
+        if (status != DNS_OK) continue;
+        struct sockaddr_storage node;
+        socklen_t node_len;
+        if (normalize((struct sockaddr *) &addr, addr_len, &node, &node_len) &&
+            send_query(dht, QUERY_FIND_NODE, &node, node_len, NULL, dht->id, NULL, 0, 0, l)) {
+            l->in_flight++;
+        }
+    }
+    dht->node_lookup = l;
+    step_lookup(dht, l, now);
+    return !resolving;
+}
+
+// caller holds dht->lock; runs whatever is due and returns the ms until the next timer
+static int run_timers(Dht *dht, const uint64_t now) {
+    uint64_t next = now + HOUSEKEEPING_MS;
+
+    Query *q = dht->queries;
+    while (q) {
+        Query *following = q->next;
+        if (now >= q->deadline_ms) fail_query(dht, q, now);
+        q = following;
+    }
+    // failing a query may have started others, the list is read again for the earliest deadline
+    for (q = dht->queries; q; q = q->next) {
+        if (q->deadline_ms < next) next = q->deadline_ms;
+    }
+
+    if (now - dht->secret_rotated_ms >= DHT_TOKEN_ROTATE_MS) {
+        memcpy(dht->previous_secret, dht->secret, sizeof dht->secret);
+        fill_random(dht->secret, sizeof dht->secret, &dht->seed);
+        dht->secret_rotated_ms = now;
+    }
+    if (dht->secret_rotated_ms + DHT_TOKEN_ROTATE_MS < next) next = dht->secret_rotated_ms + DHT_TOKEN_ROTATE_MS;
+
+    const int good = dht_table_good_count(&dht->tables[0], now) + dht_table_good_count(&dht->tables[1], now);
+    if (!dht->node_lookup && good < DHT_MIN_GOOD_NODES) {
+        if (now >= dht->next_bootstrap_ms) {
+            // a bootstrap host that is still being resolved wakes the thread once it is
+            const bool resolved = start_bootstrap(dht, now);
+            dht->next_bootstrap_ms = now + (resolved ? DHT_BOOTSTRAP_RETRY_MS : 1000);
+        }
+        if (dht->next_bootstrap_ms < next) next = dht->next_bootstrap_ms;
+    }
+
+    if (now >= dht->next_housekeeping_ms) {
+        dht->next_housekeeping_ms = now + HOUSEKEEPING_MS;
+        expire_all_stored(dht, now);
+        // BEP 5: a bucket nothing was heard in for 15 minutes is refreshed by looking up a random id in it
+        for (int t = 0; t < 2 && !dht->node_lookup; t++) {
+            const int bucket = dht_table_take_stale_bucket(&dht->tables[t], now);
+            if (bucket < 0) continue;
+            uint8_t target[20];
+            dht_random_id_in_bucket(&dht->tables[t], bucket, &dht->seed, target);
+            Lookup *l = new_lookup(dht, QUERY_FIND_NODE, target, NULL);
+            if (!l) break;
+            dht->node_lookup = l;
+            step_lookup(dht, l, now);
+        }
+    }
+    if (dht->next_housekeeping_ms < next) next = dht->next_housekeeping_ms;
+
+    // torrents wait for nodes to ask; the first answer wakes the thread
+    const bool has_nodes = dht_table_count(&dht->tables[0]) + dht_table_count(&dht->tables[1]) > 0;
+    for (DhtTorrent *t = dht->torrents; t && has_nodes; t = t->next) {
+        if (!t->active || t->lookup || t->next_lookup_ms == 0) continue;
+        if (now < t->next_lookup_ms) {
+            if (t->next_lookup_ms < next) next = t->next_lookup_ms;
+            continue;
+        }
+        t->next_lookup_ms = 0;
+        t->last_lookup_ms = now;
+        t->lookup = new_lookup(dht, QUERY_GET_PEERS, t->info_hash, t);
+        if (t->lookup) step_lookup(dht, t->lookup, now);
+    }
+
+    const uint64_t left = next > now ? next - now : 0;
+    return left > INT32_MAX ? INT32_MAX : (int) left;
+}
+
+static void *dht_thread(void *arg) {
+    Dht *dht = arg;
+    unsigned char buf[2048];
+
+    pthread_mutex_lock(&dht->lock);
+    while (!dht->stop) {
+        const int timeout = run_timers(dht, monotonic_ms());
+        struct pollfd pfds[2] = {
+            {.fd = dht->wake_fd, .events = POLLIN},
+            {.fd = dht->fd, .events = POLLIN},
+        };
+        pthread_mutex_unlock(&dht->lock);
+        const int ready = poll(pfds, 2, timeout);
+        pthread_mutex_lock(&dht->lock);
+        if (ready < 0 && errno != EINTR) break;
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t counter;
+            read(dht->wake_fd, &counter, sizeof counter);
+        }
+        if (!(pfds[1].revents & POLLIN)) continue;
+        const uint64_t now = monotonic_ms();
+        for (int i = 0; i < RECV_BATCH && !dht->stop; i++) {
+            struct sockaddr_storage from;
+            socklen_t from_len = sizeof from;
+            const ssize_t n = recvfrom(dht->fd, buf, sizeof buf, 0, (struct sockaddr *) &from, &from_len);
+            if (n < 0) break;
+            handle_packet(dht, buf, (size_t) n, (struct sockaddr *) &from, from_len, now);
+        }
+    }
+    pthread_mutex_unlock(&dht->lock);
+    return NULL;
+}
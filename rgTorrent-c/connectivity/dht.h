@@ -0,0 +1,76 @@
+#ifndef DHT_H
+#define DHT_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Mainline DHT node (BEP 5) for a whole session: one dual-stack UDP socket, one routing table per address
+// family and one thread that runs every query. Each active torrent looks its info hash up every
+// DHT_ANNOUNCE_INTERVAL, hands the peers it finds to its owner and announces itself to the closest nodes.
+// Queries from other nodes are answered the whole time, including the peers announced to us.
+typedef struct Dht Dht;
+
+#define DHT_DEFAULT_PORT 6881
+// queries sent at once by one lookup
+#define DHT_ALPHA 3
+// unanswered queries count as failed after this long
+#define DHT_QUERY_TIMEOUT_MS 4000
+// seconds between two lookups of an active torrent, announce_peer included
+#define DHT_ANNOUNCE_INTERVAL 900
+// the least time between two lookups asked for through dht_request_peers()
+#define DHT_MIN_LOOKUP_INTERVAL 60
+// tokens are made from a secret that changes this often; the one before stays valid, so a token lasts 10 minutes
+#define DHT_TOKEN_ROTATE_MS 300000
+// peers announced to us are handed out for 30 minutes, as long as BEP 5 has them stored
+#define DHT_PEER_TTL_MS 1800000
+#define DHT_MAX_STORED_TORRENTS 1024
+#define DHT_MAX_STORED_PEERS 100
+// the table is bootstrapped again while it has fewer good nodes than this
+#define DHT_MIN_GOOD_NODES 8
+#define DHT_BOOTSTRAP_RETRY_MS 30000
+#define DHT_MAX_BOOTSTRAP_NODES 8
+
+// all of them run on the DHT thread with the DHT locked, they must not call back into the DHT
+typedef struct {
+    // compact peers, 6 bytes each for AF_INET and 18 bytes each for AF_INET6
+    void (*on_peers)(void *owner, const unsigned char *peers, size_t len, int family);
+    // the TCP port announced for the torrent, 0 while it does not listen and is not announced
+    int (*announce_port)(void *owner);
+} DhtCallbacks;
+
+// binds port, or any free port when it is taken; NULL if no socket could be bound
+Dht *dht_create(const DhtCallbacks *callbacks, int port);
+
+void dht_destroy(Dht *dht);
+
+int dht_port(const Dht *dht);
+
+// a well-known node to bootstrap from, resolved in the background and asked again whenever the table runs low
+void dht_add_bootstrap(Dht *dht, const char *host, const char *port);
+
+// pings the node and adds it to the table if it answers, e.g. from a peer's PORT message
+void dht_add_node(Dht *dht, const struct sockaddr *addr, socklen_t addr_len);
+
+// registers an inactive torrent, which is neither looked up nor announced until it is activated
+bool dht_add_torrent(Dht *dht, void *owner, const uint8_t info_hash[20]);
+
+// an activated torrent is looked up right away and then every DHT_ANNOUNCE_INTERVAL
+void dht_set_active(Dht *dht, const void *owner, bool active);
+
+// looks the torrent up again as soon as DHT_MIN_LOOKUP_INTERVAL allows
+void dht_request_peers(Dht *dht, const void *owner);
+
+// once it returns no callback runs or is made for owner
+void dht_remove_torrent(Dht *dht, const void *owner);
+
+// nodes in the routing tables and how many of them answered lately
+void dht_node_counts(Dht *dht, int *nodes, int *good);
+
+// the node id and the routing tables as a bencoded dictionary in a malloc'd buffer the caller frees
+unsigned char *dht_save_state(Dht *dht, size_t *out_len);
+
+// takes the node id and the nodes of a saved state; meant right after dht_create(), before any torrent is added.
+// The nodes are asked first when the table is bootstrapped.
+bool dht_load_state(Dht *dht, const unsigned char *data, size_t len);
+#endif // DHT_H
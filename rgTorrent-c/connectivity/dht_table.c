@@ -0,0 +1,167 @@
+#include "dht_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void dht_table_init(DhtTable *t, const uint8_t self[20]) {
+    memset(t, 0, sizeof *t);
+    memcpy(t->self, self, 20);
+}
+
+int dht_common_prefix(const uint8_t a[20], const uint8_t b[20]) {
+    for (int i = 0; i < 20; i++) {
+        const uint8_t x = a[i] ^ b[i];
+        if (x) return i * 8 + __builtin_clz(x) - 24;
+    }
+    return DHT_ID_BITS;
+}
+
+int dht_distance_cmp(const uint8_t target[20], const uint8_t a[20], const uint8_t b[20]) {
+    for (int i = 0; i < 20; i++) {
+        const uint8_t da = a[i] ^ target[i];
+        const uint8_t db = b[i] ^ target[i];
+        if (da != db) return da < db ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool is_bad(const DhtNode *n) {
+    return n->fails >= DHT_NODE_MAX_FAILS;
+}
+
+static bool is_good(const DhtNode *n, const uint64_t now) {
+    return !is_bad(n) && n->last_seen_ms != 0 && now - n->last_seen_ms < DHT_NODE_FRESH_MS;
+}
+
+static void fill_node(DhtNode *n, const uint8_t id[20], const struct sockaddr *addr, const socklen_t addr_len,
+                      const uint64_t seen_ms) {
+    memset(n, 0, sizeof *n);
+    memcpy(n->id, id, 20);
+    memcpy(&n->addr, addr, addr_len);
+    n->addr_len = addr_len;
+    n->last_seen_ms = seen_ms;
+}
+
+static DhtNode *find_node(DhtBucket *b, const uint8_t id[20]) {
+    for (int i = 0; i < b->count; i++) {
+        if (memcmp(b->nodes[i].id, id, 20) == 0) return &b->nodes[i];
+    }
+    return NULL;
+}
+
+DhtNode *dht_table_heard(DhtTable *t, const uint8_t id[20], const struct sockaddr *addr, const socklen_t addr_len,
+                         const uint64_t seen_ms) {
+    const int index = dht_common_prefix(t->self, id);
+    if (index == DHT_ID_BITS || addr_len > sizeof(struct sockaddr_storage)) return NULL;
+    DhtBucket *b = &t->buckets[index];
+
+    // a known id keeps the address it was first seen with, another node cannot take it over
+    DhtNode *known = find_node(b, id);
+    if (known) {
+        if (seen_ms && known->addr_len == addr_len && memcmp(&known->addr, addr, addr_len) == 0) {
+            known->last_seen_ms = seen_ms;
+            known->fails = 0;
+            known->pinged = false;
+            b->last_changed_ms = seen_ms;
+        }
+        return NULL;
+    }
+
+    if (b->count < DHT_K) {
+        fill_node(&b->nodes[b->count++], id, addr, addr_len, seen_ms);
+        if (seen_ms) b->last_changed_ms = seen_ms;
+        return NULL;
+    }
+    for (int i = 0; i < b->count; i++) {
+        if (!is_bad(&b->nodes[i])) continue;
+        fill_node(&b->nodes[i], id, addr, addr_len, seen_ms);
+        if (seen_ms) b->last_changed_ms = seen_ms;
+        return NULL;
+    }
+    // good nodes are never pushed out, the newcomer waits until one of the questionable ones fails a ping
+    if (!seen_ms) return NULL;
+    fill_node(&b->replacement, id, addr, addr_len, seen_ms);
+    b->has_replacement = true;
+
+    DhtNode *oldest = NULL;
+    for (int i = 0; i < b->count; i++) {
+        DhtNode *n = &b->nodes[i];
+        if (is_good(n, seen_ms)) continue;
+        if (!oldest || n->last_seen_ms < oldest->last_seen_ms) oldest = n;
+    }
+    if (!oldest || oldest->pinged) return NULL;
+    oldest->pinged = true;
+    return oldest;
+}
+
+void dht_table_failed(DhtTable *t, const uint8_t id[20], const struct sockaddr *addr, const socklen_t addr_len) {
+    const int index = dht_common_prefix(t->self, id);
+    if (index == DHT_ID_BITS) return;
+    DhtBucket *b = &t->buckets[index];
+    DhtNode *n = find_node(b, id);
+    if (!n || n->addr_len != addr_len || memcmp(&n->addr, addr, addr_len) != 0) return;
+
+    n->fails++;
+    n->pinged = false;
+    if (is_bad(n) && b->has_replacement) {
+        *n = b->replacement;
+        b->has_replacement = false;
+    }
+}
+
+int dht_table_closest(const DhtTable *t, const uint8_t target[20], const int family, DhtNode *out, const int max) {
+    int count = 0;
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        const DhtBucket *b = &t->buckets[i];
+        for (int j = 0; j < b->count; j++) {
+            const DhtNode *n = &b->nodes[j];
+            if (is_bad(n) || (family != AF_UNSPEC && n->addr.ss_family != family)) continue;
+            // insertion into the sorted prefix, whatever falls off the end is farther than all of out
+            int at = count < max ? count : max;
+            while (at > 0 && dht_distance_cmp(target, n->id, out[at - 1].id) < 0) at--;
+            if (at == max) continue;
+            const int moved = (count < max ? count : max - 1) - at;
+            memmove(&out[at + 1], &out[at], moved * sizeof *out);
+            out[at] = *n;
+            if (count < max) count++;
+        }
+    }
+    return count;
+}
+
+int dht_table_good_count(const DhtTable *t, const uint64_t now_ms) {
+    int count = 0;
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        for (int j = 0; j < t->buckets[i].count; j++) {
+            if (is_good(&t->buckets[i].nodes[j], now_ms)) count++;
+        }
+    }
+    return count;
+}
+
+int dht_table_count(const DhtTable *t) {
+    int count = 0;
+    for (int i = 0; i < DHT_ID_BITS; i++) count += t->buckets[i].count;
+    return count;
+}
+
+int dht_table_take_stale_bucket(DhtTable *t, const uint64_t now_ms) {
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        DhtBucket *b = &t->buckets[i];
+        if (b->count == 0 || now_ms - b->last_changed_ms < DHT_NODE_FRESH_MS) continue;
+        b->last_changed_ms = now_ms;
+        return i;
+    }
+    return -1;
+}
+
+void dht_random_id_in_bucket(const DhtTable *t, const int index, unsigned int *seed, uint8_t out[20]) {
+    for (int i = 0; i < 20; i++) out[i] = (uint8_t) rand_r(seed);
+    // the first index bits are ours, the next one differs and the rest is random
+    for (int bit = 0; bit <= index && bit < DHT_ID_BITS; bit++) {
+        const uint8_t mask = 0x80 >> bit % 8;
+        const bool ours = t->self[bit / 8] & mask;
+        const bool set = bit == index ? !ours : ours;
+        out[bit / 8] = set ? out[bit / 8] | mask : out[bit / 8] & ~mask;
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef DHT_TABLE_H
+#define DHT_TABLE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// BEP 5 routing table. Nodes are kept in one bucket per length of the prefix their id shares with ours,
+// which is the table Kademlia ends up with by only ever splitting the bucket our own id falls in:
+// half the id space shares no bit and goes in bucket 0, a quarter shares one and goes in bucket 1, and so on.
+// Not thread safe, owned by the DHT thread.
+#define DHT_K 8
+#define DHT_ID_BITS 160
+// a node not heard from for this long is questionable and gets pinged before it may be replaced
+#define DHT_NODE_FRESH_MS 900000
+// a node that left this many queries in a row unanswered is bad and replaced right away
+#define DHT_NODE_MAX_FAILS 2
+
+typedef struct {
+    uint8_t id[20];
+    // IPv4 or IPv6; IPv4-mapped addresses are stored as IPv4
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    // 0 for nodes restored from a saved table that were not heard from yet
+    uint64_t last_seen_ms;
+    int fails;
+    // a ping was sent to find out whether the questionable node is still there
+    bool pinged;
+} DhtNode;
+
+typedef struct {
+    DhtNode nodes[DHT_K];
+    int count;
+    // the last node that found the bucket full, it takes the place of the first node that goes bad
+    DhtNode replacement;
+    bool has_replacement;
+    // when a node was last added or heard from, buckets that go quiet for DHT_NODE_FRESH_MS are refreshed
+    uint64_t last_changed_ms;
+} DhtBucket;
+
+typedef struct {
+    uint8_t self[20];
+    DhtBucket buckets[DHT_ID_BITS];
+} DhtTable;
+
+void dht_table_init(DhtTable *t, const uint8_t self[20]);
+
+// number of leading bits a and b share, DHT_ID_BITS when they are equal
+int dht_common_prefix(const uint8_t a[20], const uint8_t b[20]);
+
+// < 0 when a is closer to target than b in the XOR metric, 0 when they are the same id
+int dht_distance_cmp(const uint8_t target[20], const uint8_t a[20], const uint8_t b[20]);
+
+// books a message from the node, adding it if its bucket has room or holds a bad node. A full bucket keeps
+// the node as its replacement and returns the questionable node that has to be pinged, NULL otherwise.
+// seen_ms 0 adds a node that is not known to be alive, as restored from a saved table.
+DhtNode *dht_table_heard(DhtTable *t, const uint8_t id[20], const struct sockaddr *addr, socklen_t addr_len,
+                         uint64_t seen_ms);
+
+// books a query the node left unanswered; a node that goes bad makes room for the bucket's replacement
+void dht_table_failed(DhtTable *t, const uint8_t id[20], const struct sockaddr *addr, socklen_t addr_len);
+
+// copies up to max nodes of family (AF_UNSPEC for both), closest to target first, into out; bad nodes are left out
+int dht_table_closest(const DhtTable *t, const uint8_t target[20], int family, DhtNode *out, int max);
+
+// nodes that answered within DHT_NODE_FRESH_MS
+int dht_table_good_count(const DhtTable *t, uint64_t now_ms);
+
+int dht_table_count(const DhtTable *t);
+
+// index of a non-empty bucket nothing was heard in for DHT_NODE_FRESH_MS, -1 if none; the bucket counts as
+// refreshed from now on
+int dht_table_take_stale_bucket(DhtTable *t, uint64_t now_ms);
+
+// a random id that falls in bucket index
+void dht_random_id_in_bucket(const DhtTable *t, int index, unsigned int *seed, uint8_t out[20]);
+#endif // DHT_TABLE_H
@@ -0,0 +1,182 @@
+#include "dns_cache.h"
+#include "helpers.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+typedef struct {
+    char host[256];
+    // DNS_PENDING until a resolver thread answered, then the answer until it expires
+    DnsStatus state;
+    // a resolver thread is looking the host up; such entries are never evicted
+    bool claimed;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t expires_ms;
+    uint64_t last_used_ms;
+} DnsEntry;
+
+struct DnsCache {
+    pthread_mutex_t lock;
+    // signalled when a lookup is queued, and to stop the resolver threads
+    pthread_cond_t work;
+    bool stop;
+    // the resolver threads and the owner; whoever drops the last reference frees the cache
+    int refs;
+    void (*notify)(void *ctx);
+    void *ctx;
+    int count;
+    DnsEntry entries[DNS_CACHE_MAX];
+};
+
+static void free_cache(DnsCache *c) {
+    pthread_cond_destroy(&c->work);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// caller holds c->lock
+static DnsEntry *next_unclaimed(DnsCache *c) {
+    for (int i = 0; i < c->count; i++) {
+        if (c->entries[i].state == DNS_PENDING && !c->entries[i].claimed) return &c->entries[i];
+    }
+    return NULL;
+}
+
+static void *resolver_thread(void *arg) {
+    DnsCache *c = arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop) {
+        DnsEntry *e = next_unclaimed(c);
+        if (!e) {
+            pthread_cond_wait(&c->work, &c->lock);
+            continue;
+        }
+        e->claimed = true;
+        char host[256];
+        memcpy(host, e->host, sizeof host);
+        pthread_mutex_unlock(&c->lock);
+
+        struct addrinfo hints = {0}, *info = NULL;
+        // the first answer is the one RFC 6724 ranks best, IPv6 only where this host has an IPv6 address
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_flags = AI_ADDRCONFIG;
+        hints.ai_socktype = SOCK_STREAM;
+        const int status = getaddrinfo(host, NULL, &hints, &info);
+        if (status != 0) fprintf(stderr, "DNS Lookup failed for %s: %s\n", host, gai_strerror(status));
+
+        pthread_mutex_lock(&c->lock);
+        // claimed entries stay where they are, e is still this host's
+        e->claimed = false;
+        if (status == 0 && info->ai_addrlen <= sizeof e->addr) {
+            memcpy(&e->addr, info->ai_addr, info->ai_addrlen);
+            e->addr_len = info->ai_addrlen;
+            e->state = DNS_OK;
+            e->expires_ms = monotonic_ms() + DNS_TTL_MS;
+        } else {
+            e->state = DNS_FAILED;
+            e->expires_ms = monotonic_ms() + DNS_NEGATIVE_TTL_MS;
+        }
+        if (info) freeaddrinfo(info);
+        if (c->notify) c->notify(c->ctx);
+    }
+    const bool last = --c->refs == 0;
+    pthread_mutex_unlock(&c->lock);
+
+    if (last) free_cache(c);
+    return NULL;
+}
+
+DnsCache *dns_create(void (*notify)(void *ctx), void *ctx) {
+    DnsCache *c = calloc(1, sizeof *c);
+    if (!c) return NULL;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, NULL);
+    c->notify = notify;
+    c->ctx = ctx;
+    c->refs = 1;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    // a thread stuck in getaddrinfo() must not hold up dns_destroy()
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < DNS_RESOLVER_THREADS; i++) {
+        pthread_t thread;
+        pthread_mutex_lock(&c->lock);
+        if (pthread_create(&thread, &attr, resolver_thread, c) == 0) c->refs++;
+        pthread_mutex_unlock(&c->lock);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (c->refs == 1) {
+        free_cache(c);
+        return NULL;
+    }
+    return c;
+}
+
+void dns_destroy(DnsCache *c) {
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    c->notify = NULL;
+    pthread_cond_broadcast(&c->work);
+    const bool last = --c->refs == 0;
+    pthread_mutex_unlock(&c->lock);
+
+    if (last) free_cache(c);
+}
+
+// caller holds c->lock; a free slot, or the least recently used answer; NULL while every host is being looked up
+static DnsEntry *take_entry(DnsCache *c) {
+    if (c->count < DNS_CACHE_MAX) return &c->entries[c->count++];
+
+    DnsEntry *oldest = NULL;
+    for (int i = 0; i < c->count; i++) {
+        DnsEntry *e = &c->entries[i];
+        if (e->state == DNS_PENDING) continue;
+        if (!oldest || e->last_used_ms < oldest->last_used_ms) oldest = e;
+    }
+    return oldest;
+}
+
+DnsStatus dns_resolve(DnsCache *c, const char *host, const char *port, struct sockaddr_storage *out,
+                      socklen_t *out_len) {
+    pthread_mutex_lock(&c->lock);
+    const uint64_t now = monotonic_ms();
+
+    DnsEntry *e = NULL;
+    for (int i = 0; i < c->count && !e; i++) {
+        if (strcmp(c->entries[i].host, host) == 0) e = &c->entries[i];
+    }
+    if (!e) {
+        e = take_entry(c);
+        if (!e) {
+            pthread_mutex_unlock(&c->lock);
+            return DNS_FAILED;
+        }
+        memset(e, 0, sizeof *e);
+        snprintf(e->host, sizeof e->host, "%s", host);
+        e->state = DNS_PENDING;
+        pthread_cond_signal(&c->work);
+    } else if (e->state != DNS_PENDING && now >= e->expires_ms) {
+        e->state = DNS_PENDING;
+        pthread_cond_signal(&c->work);
+    }
+    e->last_used_ms = now;
+
+    const DnsStatus status = e->state;
+    if (status == DNS_OK) {
+        memcpy(out, &e->addr, e->addr_len);
+        *out_len = e->addr_len;
+        const uint16_t net_port = htons((uint16_t) atoi(port));
+        if (out->ss_family == AF_INET) ((struct sockaddr_in *) out)->sin_port = net_port;
+        else if (out->ss_family == AF_INET6) ((struct sockaddr_in6 *) out)->sin6_port = net_port;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return status;
+}
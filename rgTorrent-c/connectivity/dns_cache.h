@@ -0,0 +1,33 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// Host lookups shared by the whole session. Each host is resolved once by a small pool of resolver
+// threads and the answer is kept for DNS_TTL_MS; hosts that failed to resolve are not asked again
+// for DNS_NEGATIVE_TTL_MS. Callers never block on DNS, they ask again once they are notified.
+typedef struct DnsCache DnsCache;
+
+#define DNS_RESOLVER_THREADS 4
+#define DNS_CACHE_MAX 512
+// getaddrinfo() does not tell the record's TTL, answers are trusted for this long instead
+#define DNS_TTL_MS 300000
+#define DNS_NEGATIVE_TTL_MS 60000
+
+typedef enum {
+    DNS_OK,
+    DNS_PENDING,
+    DNS_FAILED,
+} DnsStatus;
+
+// notify runs on a resolver thread after every finished lookup, with the cache locked
+DnsCache *dns_create(void (*notify)(void *ctx), void *ctx);
+
+// returns at once; lookups still running finish on their own and no notify is made after this
+void dns_destroy(DnsCache *c);
+
+// fills out with the host's address and the given port on DNS_OK. DNS_PENDING means a lookup was started
+// or is already running for the host, the caller asks again after the next notify.
+DnsStatus dns_resolve(DnsCache *c, const char *host, const char *port, struct sockaddr_storage *out,
+                      socklen_t *out_len);
+#endif // DNS_CACHE_H
@@ -49,7 +49,25 @@ int establish_handshake(const unsigned char* peers_list, const size_t peers_coun
 
 int handshake_by_address(const char* ip, const int port, const PeerHandshake *peer_handshake, const size_t total_pieces, bool **out_bitfield) {
     printf("Trying to establish a connection to %s:%d...\n", ip, port);
-    const int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    // IPv6 literals as well as dotted IPv4
+    struct sockaddr_storage peer_addr = {0};
+    socklen_t peer_addr_len;
+    struct sockaddr_in *v4 = (struct sockaddr_in *) &peer_addr;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) &peer_addr;
+    if (inet_pton(AF_INET, ip, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        peer_addr_len = sizeof *v4;
+    } else if (inet_pton(AF_INET6, ip, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        peer_addr_len = sizeof *v6;
+    } else {
+        fprintf(stderr, "Invalid IP address.\n");
+        return -1;
+    }
+
+    const int sockfd = socket(peer_addr.ss_family, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("Socket creation failed.");
         return -1;
@@ -61,17 +79,7 @@ int handshake_by_address(const char* ip, const int port, const PeerHandshake *pe
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-    struct sockaddr_in peer_addr = {0};
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_port = htons(port);
-
-    if (inet_pton(AF_INET, ip, &peer_addr.sin_addr) <= 0) {
-        perror("Invalid IP address.");
-        close(sockfd);
-        return -1;
-    }
-
-    if (connect(sockfd, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
+    if (connect(sockfd, (struct sockaddr *)&peer_addr, peer_addr_len) < 0) {
         printf("Connection failed or timed out.\n");
         close(sockfd);
         return -1;
@@ -0,0 +1,184 @@
+#include "http_response.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// a server that sends more header bytes than this is not a tracker we want to talk to
+#define HTTP_MAX_HEADER_BYTES 65536
+
+enum {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    // the CRLF that closes every chunk's data
+    CHUNK_DATA_END,
+    // optional trailer fields after the last chunk, up to an empty line
+    CHUNK_TRAILER,
+};
+
+void http_response_init(HttpResponse *r) {
+    memset(r, 0, sizeof *r);
+    r->content_length = -1;
+}
+
+void http_response_reset(HttpResponse *r) {
+    char *buf = r->buf;
+    const size_t capacity = r->capacity;
+    http_response_init(r);
+    r->buf = buf;
+    r->capacity = capacity;
+}
+
+void http_response_free(HttpResponse *r) {
+    free(r->buf);
+    http_response_init(r);
+}
+
+bool http_response_reserve(HttpResponse *r, const size_t want) {
+    // one byte more, the parsed body is kept NUL terminated
+    if (r->capacity - r->len > want) return true;
+    size_t capacity = r->capacity ? r->capacity : 4096;
+    while (capacity - r->len <= want) capacity *= 2;
+    char *grown = realloc(r->buf, capacity);
+    if (!grown) return false;
+    r->buf = grown;
+    r->capacity = capacity;
+    return true;
+}
+
+// offset right after the '\n' ending the line that starts at from, 0 while the line is incomplete
+static size_t line_end(const HttpResponse *r, const size_t from) {
+    const char *nl = memchr(r->buf + from, '\n', r->len - from);
+    return nl ? (size_t) (nl - r->buf) + 1 : 0;
+}
+
+// length of the line without its line break
+static size_t line_length(const HttpResponse *r, const size_t from, const size_t end) {
+    size_t n = end - from - 1;
+    if (n > 0 && r->buf[from + n - 1] == '\r') n--;
+    return n;
+}
+
+static bool header_is(const char *line, const size_t len, const char *name, const char **value) {
+    const size_t name_len = strlen(name);
+    if (len <= name_len || line[name_len] != ':' || strncasecmp(line, name, name_len) != 0) return false;
+    *value = line + name_len + 1;
+    while (*value < line + len && (**value == ' ' || **value == '\t')) (*value)++;
+    return true;
+}
+
+static bool parse_headers(HttpResponse *r) {
+    // nothing is parsed before the empty line that ends the headers is in
+    size_t pos = 0, end;
+    while ((end = line_end(r, pos)) != 0 && line_length(r, pos, end) != 0) pos = end;
+    if (end == 0) return r->len <= HTTP_MAX_HEADER_BYTES;
+
+    const size_t status_end = line_end(r, 0);
+    int minor;
+    if (sscanf(r->buf, "HTTP/1.%d %d", &minor, &r->status) != 2) {
+        fprintf(stderr, "Invalid HTTP response\n");
+        return false;
+    }
+    r->keep_alive = minor >= 1;
+
+    for (size_t from = status_end; from < pos; from = line_end(r, from)) {
+        const char *line = r->buf + from;
+        const size_t len = line_length(r, from, line_end(r, from));
+        const char *value;
+        if (header_is(line, len, "Content-Length", &value)) {
+            r->content_length = strtoll(value, NULL, 10);
+            if (r->content_length < 0) return false;
+        } else if (header_is(line, len, "Transfer-Encoding", &value)) {
+            // chunked is always the last of the codings listed
+            const size_t value_len = line + len - value;
+            r->chunked = value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0;
+        } else if (header_is(line, len, "Connection", &value)) {
+            if (strncasecmp(value, "close", 5) == 0) r->keep_alive = false;
+            else if (strncasecmp(value, "keep-alive", 10) == 0) r->keep_alive = true;
+        } else if (header_is(line, len, "Location", &value)) {
+            snprintf(r->location, sizeof r->location, "%.*s", (int) (line + len - value), value);
+        }
+    }
+
+    // these never carry a body
+    if (r->status == 204 || r->status == 304 || (r->status >= 100 && r->status < 200)) r->content_length = 0;
+    if (r->chunked) r->content_length = -1;
+    r->header_len = end;
+    r->parse_pos = end;
+    return true;
+}
+
+// decodes the chunks received so far over the consumed raw bytes
+static bool advance_chunked(HttpResponse *r) {
+    while (!r->complete) {
+        if (r->chunk_state == CHUNK_DATA) {
+            size_t take = r->len - r->parse_pos;
+            if (take == 0) return true;
+            if (take > r->chunk_left) take = r->chunk_left;
+            memmove(r->buf + r->header_len + r->body_len, r->buf + r->parse_pos, take);
+            r->body_len += take;
+            r->parse_pos += take;
+            r->chunk_left -= take;
+            if (r->chunk_left == 0) r->chunk_state = CHUNK_DATA_END;
+            continue;
+        }
+
+        const size_t end = line_end(r, r->parse_pos);
+        if (end == 0) return r->len - r->parse_pos <= HTTP_MAX_HEADER_BYTES;
+        const size_t len = line_length(r, r->parse_pos, end);
+        const char *line = r->buf + r->parse_pos;
+        r->parse_pos = end;
+
+        if (r->chunk_state == CHUNK_SIZE) {
+            char *after;
+            const unsigned long long size = strtoull(line, &after, 16);
+            if (after == line) return false;
+            r->chunk_left = size;
+            r->chunk_state = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        } else if (r->chunk_state == CHUNK_DATA_END) {
+            if (len != 0) return false;
+            r->chunk_state = CHUNK_SIZE;
+        } else if (len == 0) {
+            r->complete = true;
+        }
+    }
+    return true;
+}
+
+bool http_response_advance(HttpResponse *r) {
+    if (r->complete || r->len == 0) return true;
+    // reserve() always leaves room for it, the status line is read with sscanf()
+    r->buf[r->len] = '\0';
+    if (r->header_len == 0) {
+        if (!parse_headers(r)) return false;
+        if (r->header_len == 0) return true;
+    }
+
+    if (r->chunked) {
+        if (!advance_chunked(r)) return false;
+    } else {
+        r->body_len = r->len - r->header_len;
+        if (r->content_length >= 0 && r->body_len >= (uint64_t) r->content_length) {
+            r->body_len = r->content_length;
+            r->complete = true;
+        }
+        r->parse_pos = r->header_len + r->body_len;
+    }
+
+    if (r->complete) {
+        r->buf[r->header_len + r->body_len] = '\0';
+        // anything after the response means the connection is out of step with our requests
+        if (r->parse_pos != r->len) r->keep_alive = false;
+    }
+    return true;
+}
+
+bool http_response_finish(HttpResponse *r) {
+    if (r->complete) return true;
+    if (r->header_len == 0 || r->chunked || r->content_length >= 0) return false;
+    r->complete = true;
+    r->keep_alive = false;
+    r->buf[r->header_len + r->body_len] = '\0';
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental HTTP/1.x response reader. Bytes are appended to buf as they arrive and
+// http_response_advance() parses as far as it can: the headers once they are complete, then the body,
+// delimited by Content-Length, chunked transfer encoding or the end of the connection. Chunked bodies are
+// decoded in place, so the body is always contiguous right after the headers.
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+
+    // 0 until the headers are in
+    size_t header_len;
+    int status;
+    // the connection can carry another request once this response is complete
+    bool keep_alive;
+    bool chunked;
+    // -1 when the body is not delimited and runs until the server closes the connection
+    int64_t content_length;
+    // redirect target, empty when none was sent
+    char location[1024];
+
+    size_t body_len;
+    // raw bytes before this offset have been consumed
+    size_t parse_pos;
+    uint64_t chunk_left;
+    int chunk_state;
+    bool complete;
+} HttpResponse;
+
+void http_response_init(HttpResponse *r);
+
+// drops the bytes and parse state but keeps the buffer for the next response
+void http_response_reset(HttpResponse *r);
+
+void http_response_free(HttpResponse *r);
+
+// makes room for at least want more bytes at buf + len
+bool http_response_reserve(HttpResponse *r, size_t want);
+
+// parses the bytes appended since the last call; false when the response is malformed
+bool http_response_advance(HttpResponse *r);
+
+// the server closed the connection; false when the response was cut short
+bool http_response_finish(HttpResponse *r);
+
+static inline const char *http_response_body(const HttpResponse *r) {
+    return r->buf + r->header_len;
+}
+#endif // HTTP_RESPONSE_H
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 void create_parent_directories(const char *filepath) {
@@ -161,4 +163,53 @@ bool read_piece_from_disk(const uint32_t piece_index, const size_t nominal_piece
         if (bytes_read >= actual_piece_length) break;
     }
     return bytes_read > 0;
-}
\ No newline at end of file
+}
+
+void fhc_init(FileHandleCache *cache, const int num_files) {
+    cache->fds = malloc(num_files * sizeof(int));
+    cache->num_files = num_files;
+    for (int i = 0; i < num_files; i++) cache->fds[i] = -1;
+}
+
+int fhc_get(FileHandleCache *cache, const EndFile *end_files, const int file_index) {
+    if (file_index < 0 || file_index >= cache->num_files) return -1;
+
+    if (cache->fds[file_index] == -1) {
+        cache->fds[file_index] = open(end_files[file_index].filepath, O_RDONLY | O_CLOEXEC);
+    }
+    return cache->fds[file_index];
+}
+
+void fhc_close(FileHandleCache *cache) {
+    for (int i = 0; i < cache->num_files; i++) {
+        if (cache->fds[i] != -1) close(cache->fds[i]);
+    }
+    free(cache->fds);
+    cache->fds = NULL;
+    cache->num_files = 0;
+}
+
+// splits a range of the torrent's global byte space into per-file pieces, returns -1 if it is not fully covered
+int map_span_to_files(const size_t global_offset, const size_t length, const EndFile *end_files, const int num_files,
+                      FileSpan *out_spans, const int max_spans) {
+    const size_t global_end = global_offset + length;
+    size_t covered = 0;
+    int span_count = 0;
+
+    for (int i = 0; i < num_files && covered < length; i++) {
+        const EndFile *file = &end_files[i];
+
+        if (file->length == 0 || global_end <= file->global_start || global_offset >= file->global_end) continue;
+        if (span_count >= max_spans) return -1;
+
+        const size_t overlap_end = global_end < file->global_end ? global_end : file->global_end;
+        const size_t overlap_start = global_offset > file->global_start ? global_offset : file->global_start;
+
+        out_spans[span_count].file_index = i;
+        out_spans[span_count].file_offset = overlap_start - file->global_start;
+        out_spans[span_count].length = overlap_end - overlap_start;
+        covered += overlap_end - overlap_start;
+        span_count++;
+    }
+    return covered == length ? span_count : -1;
+}
@@ -13,6 +13,21 @@ typedef struct {
     size_t global_end;
 } EndFile;
 
+// Read-only descriptors of the torrent's files, opened on first use and kept for the lifetime of the swarm.
+typedef struct {
+    int *fds;
+    int num_files;
+} FileHandleCache;
+
+typedef struct {
+    int file_index;
+    size_t file_offset;
+    size_t length;
+} FileSpan;
+
+// creates the directories on the way to filepath, the ones that exist are left alone
+void create_parent_directories(const char *filepath);
+
 void write_piece_to_disk(uint32_t piece_index, size_t piece_length, const unsigned char *piece_buffer,
                          const EndFile *end_files, int num_files);
 
@@ -20,4 +35,13 @@ EndFile *fill_target_files(const BencodeNode *infoNode, size_t *num_files, const
 
 bool read_piece_from_disk(uint32_t piece_index, size_t nominal_piece_length, size_t actual_piece_length,
                           unsigned char *out_buffer, const EndFile *end_files, int num_files);
+
+void fhc_init(FileHandleCache *cache, int num_files);
+
+int fhc_get(FileHandleCache *cache, const EndFile *end_files, int file_index);
+
+void fhc_close(FileHandleCache *cache);
+
+int map_span_to_files(size_t global_offset, size_t length, const EndFile *end_files, int num_files,
+                      FileSpan *out_spans, int max_spans);
 #endif // FILE_SAVER_H
@@ -0,0 +1,97 @@
+#include "event_queue.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct EventCell {
+    size_t sequence;
+    EventRecord record;
+};
+
+bool eq_init(EventQueue *q, const size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    q->cells = malloc(size * sizeof(EventCell));
+    if (!q->cells) return false;
+
+    q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->efd < 0) {
+        free(q->cells);
+        q->cells = NULL;
+        return false;
+    }
+
+    // a cell whose sequence equals the enqueue position is free for that position
+    for (size_t i = 0; i < size; i++) q->cells[i].sequence = i;
+    q->mask = size - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+    q->signalled = false;
+    q->overflowed = false;
+    return true;
+}
+
+void eq_destroy(EventQueue *q) {
+    if (q->efd >= 0) close(q->efd);
+    q->efd = -1;
+    free(q->cells);
+    q->cells = NULL;
+}
+
+static void signal_consumer(EventQueue *q) {
+    if (__atomic_exchange_n(&q->signalled, true, __ATOMIC_ACQ_REL)) return;
+    const uint64_t one = 1;
+    write(q->efd, &one, sizeof one);
+}
+
+void eq_push(EventQueue *q, const EventRecord *ev) {
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    EventCell *cell;
+
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        const size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            // full, the consumer will rebuild its view from scratch
+            __atomic_store_n(&q->overflowed, true, __ATOMIC_RELEASE);
+            signal_consumer(q);
+            return;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->record = *ev;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    signal_consumer(q);
+}
+
+void eq_begin_drain(EventQueue *q) {
+    uint64_t counter;
+    read(q->efd, &counter, sizeof counter);
+    // anything pushed after this point signals again, anything before it is picked up by the following pops
+    (void) __atomic_exchange_n(&q->signalled, false, __ATOMIC_ACQ_REL);
+}
+
+bool eq_pop(EventQueue *q, EventRecord *out) {
+    const size_t pos = q->dequeue_pos;
+    EventCell *cell = &q->cells[pos & q->mask];
+    const size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    if ((intptr_t) seq - (intptr_t) (pos + 1) < 0) return false;
+
+    *out = cell->record;
+    __atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+    q->dequeue_pos = pos + 1;
+    return true;
+}
+
+bool eq_take_overflow(EventQueue *q) {
+    return __atomic_exchange_n(&q->overflowed, false, __ATOMIC_ACQ_REL);
+}
@@ -0,0 +1,44 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    int type;
+    int torrent_id;
+    int64_t value;
+} EventRecord;
+
+typedef struct EventCell EventCell;
+
+// Bounded lock-free queue with many producers and a single consumer. The consumer sleeps on an eventfd
+// that producers signal once per batch; when the ring is full new events are dropped and an overflow
+// flag tells the consumer it has to rescan instead.
+typedef struct {
+    EventCell *cells;
+    size_t mask;
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+    int efd;
+    bool signalled;
+    bool overflowed;
+} EventQueue;
+
+// capacity is rounded up to a power of two
+bool eq_init(EventQueue *q, size_t capacity);
+
+void eq_destroy(EventQueue *q);
+
+// safe from any thread, never blocks
+void eq_push(EventQueue *q, const EventRecord *ev);
+
+// consumer side: resets the eventfd, then call eq_pop until it returns false
+void eq_begin_drain(EventQueue *q);
+
+bool eq_pop(EventQueue *q, EventRecord *out);
+
+// true once after events were dropped
+bool eq_take_overflow(EventQueue *q);
+
+#endif
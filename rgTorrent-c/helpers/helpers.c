@@ -2,6 +2,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/random.h>
 
 bool isDigit(const int ch) {
     return ch >= 48 && ch <= 57;
@@ -15,14 +17,26 @@ int fpeek(FILE *const fp) {
     return c;
 }
 
+// not NUL terminated, peer ids are fixed 20 byte fields. Every session needs its own id, peers tell
+// connections to themselves and duplicate connections apart by it.
 void rand_str(unsigned char *dest, size_t length) {
     const static char charset[] = "0123456789"
                      "abcdefghijklmnopqrstuvwxyz"
                      "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
-    while (length-- > 0) {
-        const size_t index = (size_t) rand() / RAND_MAX * (sizeof charset - 1);
-        *dest++ = charset[index];
+    unsigned char noise[64];
+    while (length > 0) {
+        const size_t n = length < sizeof noise ? length : sizeof noise;
+        if (getrandom(noise, n, 0) != (ssize_t) n) {
+            for (size_t i = 0; i < n; i++) noise[i] = (unsigned char) rand();
+        }
+        for (size_t i = 0; i < n; i++) *dest++ = charset[noise[i] % (sizeof charset - 1)];
+        length -= n;
     }
-    *dest = '\0';
-}
\ No newline at end of file
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
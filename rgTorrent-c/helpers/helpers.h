@@ -1,6 +1,7 @@
 #ifndef HELPERS_H
 #define HELPERS_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 bool isDigit(int ch);
@@ -8,4 +9,6 @@ bool isDigit(int ch);
 int fpeek(FILE *fp);
 
 void rand_str(unsigned char *dest, size_t length);
+
+uint64_t monotonic_ms(void);
 #endif
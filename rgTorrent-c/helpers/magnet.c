@@ -0,0 +1,115 @@
+#include "magnet.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#define BTIH_PREFIX "urn:btih:"
+
+static int hex_value(const int ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+// percent-decodes src[0..len) into dst, with '+' standing for a space as in form encoding; false when it
+// does not fit
+static bool decode_component(const char *src, const size_t len, char *dst, const size_t dst_size) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char ch = src[i];
+        if (ch == '+') {
+            ch = ' ';
+        } else if (ch == '%' && i + 2 < len && hex_value(src[i + 1]) >= 0 && hex_value(src[i + 2]) >= 0) {
+            ch = (char) (hex_value(src[i + 1]) << 4 | hex_value(src[i + 2]));
+            i += 2;
+        }
+        if (n + 1 >= dst_size) return false;
+        dst[n++] = ch;
+    }
+    dst[n] = '\0';
+    return true;
+}
+
+static bool parse_hex_hash(const char *s, const size_t len, uint8_t out[20]) {
+    if (len != 40) return false;
+    for (size_t i = 0; i < 20; i++) {
+        const int hi = hex_value(s[2 * i]);
+        const int lo = hex_value(s[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = (uint8_t) (hi << 4 | lo);
+    }
+    return true;
+}
+
+// the 32 character base32 form some older links carry
+static bool parse_base32_hash(const char *s, const size_t len, uint8_t out[20]) {
+    if (len != 32) return false;
+    uint64_t bits = 0;
+    int bit_count = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        const int ch = toupper((unsigned char) s[i]);
+        int value;
+        if (ch >= 'A' && ch <= 'Z') value = ch - 'A';
+        else if (ch >= '2' && ch <= '7') value = ch - '2' + 26;
+        else return false;
+
+        bits = bits << 5 | (uint64_t) value;
+        bit_count += 5;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            out[n++] = (uint8_t) (bits >> bit_count);
+        }
+    }
+    return n == 20;
+}
+
+static bool key_is(const char *key, const size_t key_len, const char *name) {
+    const size_t name_len = strlen(name);
+    if (key_len == name_len) return strncmp(key, name, key_len) == 0;
+    // indexed forms like tr.1 or xt.2 name the same parameter
+    return key_len > name_len && strncmp(key, name, name_len) == 0 && key[name_len] == '.';
+}
+
+bool magnet_parse(const char *uri, MagnetLink *out) {
+    memset(out, 0, sizeof *out);
+    if (strncasecmp(uri, "magnet:?", 8) != 0) return false;
+
+    bool has_hash = false;
+    const char *p = uri + 8;
+    while (*p) {
+        const char *end = strchr(p, '&');
+        if (!end) end = p + strlen(p);
+        const char *eq = memchr(p, '=', end - p);
+
+        if (eq) {
+            const char *key = p;
+            const size_t key_len = eq - p;
+            const char *value = eq + 1;
+            const size_t value_len = end - value;
+
+            if (key_is(key, key_len, "xt")) {
+                char xt[128];
+                const size_t prefix_len = strlen(BTIH_PREFIX);
+                if (!has_hash && decode_component(value, value_len, xt, sizeof xt) &&
+                    strncasecmp(xt, BTIH_PREFIX, prefix_len) == 0) {
+                    const char *hash = xt + prefix_len;
+                    const size_t hash_len = strlen(hash);
+                    has_hash = parse_hex_hash(hash, hash_len, out->info_hash) ||
+                               parse_base32_hash(hash, hash_len, out->info_hash);
+                }
+            } else if (key_is(key, key_len, "dn")) {
+                if (!decode_component(value, value_len, out->name, sizeof out->name)) out->name[0] = '\0';
+            } else if (key_is(key, key_len, "tr") && value_len > 0 && out->tracker_count < MAGNET_MAX_TRACKERS) {
+                if (decode_component(value, value_len, out->trackers[out->tracker_count],
+                                     sizeof out->trackers[0])) {
+                    out->tracker_count++;
+                }
+            }
+        }
+        p = *end ? end + 1 : end;
+    }
+    return has_hash;
+}
@@ -0,0 +1,20 @@
+#ifndef MAGNET_H
+#define MAGNET_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// as many trackers as the announce engine takes for one torrent
+#define MAGNET_MAX_TRACKERS 30
+
+typedef struct {
+    uint8_t info_hash[20];
+    // the dn display name, empty when the link has none
+    char name[256];
+    char trackers[MAGNET_MAX_TRACKERS][256];
+    int tracker_count;
+} MagnetLink;
+
+// parses a magnet URI (BEP 9) with a BitTorrent info hash in hex or base32 form; false when it has none.
+// Trackers past MAGNET_MAX_TRACKERS and parameters we have no use for are skipped.
+bool magnet_parse(const char *uri, MagnetLink *out);
+#endif // MAGNET_H
@@ -0,0 +1,111 @@
+#include "choker.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// peers connected for less than this are three times as likely to get the optimistic slot
+#define CHOKER_NEW_PEER_MS 60000
+
+typedef struct {
+    int index;
+    uint64_t rate;
+} ChokeCandidate;
+
+static int compare_candidates(const void *a, const void *b) {
+    const uint64_t lhs = ((const ChokeCandidate *) a)->rate;
+    const uint64_t rhs = ((const ChokeCandidate *) b)->rate;
+    return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+static bool is_candidate(const PeerConnection *peer) {
+    return peer->peer_interested &&
+           (peer->state == PEER_STATE_WAITING_BITFIELD ||
+            peer->state == PEER_STATE_WAITING_UNCHOKE ||
+            peer->state == PEER_STATE_DOWNLOADING);
+}
+
+void choker_init(Choker *c, const uint64_t now_ms) {
+    c->last_rechoke_ms = now_ms;
+    c->last_optimistic_ms = 0;
+    c->optimistic_peer = -1;
+    c->pending = false;
+    // every swarm draws its own optimistic peers
+    c->seed = (unsigned int) time(NULL) ^ (unsigned int) getpid() ^ (unsigned int) (uintptr_t) c;
+}
+
+bool choker_due(const Choker *c, const uint64_t now_ms) {
+    return c->pending || now_ms - c->last_rechoke_ms >= CHOKER_INTERVAL_MS;
+}
+
+uint64_t choker_next_due(const Choker *c) {
+    return c->pending ? 0 : c->last_rechoke_ms + CHOKER_INTERVAL_MS;
+}
+
+static int pick_optimistic(Choker *c, const PeerConnection *peers, const int peer_count, const bool *out_unchoke,
+                           const uint64_t now_ms) {
+    int total_weight = 0;
+    for (int i = 0; i < peer_count; i++) {
+        if (!is_candidate(&peers[i]) || out_unchoke[i]) continue;
+        total_weight += now_ms - peers[i].connected_at_ms < CHOKER_NEW_PEER_MS ? 3 : 1;
+    }
+    if (total_weight == 0) return -1;
+
+    int ticket = rand_r(&c->seed) % total_weight;
+    for (int i = 0; i < peer_count; i++) {
+        if (!is_candidate(&peers[i]) || out_unchoke[i]) continue;
+        ticket -= now_ms - peers[i].connected_at_ms < CHOKER_NEW_PEER_MS ? 3 : 1;
+        if (ticket < 0) return i;
+    }
+    return -1;
+}
+
+void choker_rechoke(Choker *c, PeerConnection *peers, const int peer_count, const int upload_slots,
+                    const bool seeding, const uint64_t now_ms, bool *out_unchoke) {
+    const bool full_round = now_ms - c->last_rechoke_ms >= CHOKER_INTERVAL_MS;
+
+    for (int i = 0; i < peer_count; i++) out_unchoke[i] = false;
+    ChokeCandidate *candidates = malloc(peer_count * sizeof(ChokeCandidate));
+    if (!candidates) {
+        // everyone stays choked until the next round
+        if (full_round) c->last_rechoke_ms = now_ms;
+        c->pending = false;
+        return;
+    }
+    int candidate_count = 0;
+
+    for (int i = 0; i < peer_count; i++) {
+        if (!is_candidate(&peers[i])) continue;
+        // a peer that stopped sending to us only gets the optimistic slot while we download
+        if (!seeding && peers[i].snubbed) continue;
+
+        candidates[candidate_count].index = i;
+        candidates[candidate_count].rate = seeding ? rw_rate(&peers[i].upload_rate, now_ms)
+                                                   : rw_rate(&peers[i].download_rate, now_ms);
+        candidate_count++;
+    }
+
+    qsort(candidates, candidate_count, sizeof(ChokeCandidate), compare_candidates);
+
+    const int regular_slots = upload_slots > 1 ? upload_slots - 1 : 0;
+    for (int k = 0; k < candidate_count && k < regular_slots; k++) {
+        out_unchoke[candidates[k].index] = true;
+    }
+    free(candidates);
+
+    if (upload_slots > 0) {
+        const int current = c->optimistic_peer;
+        const bool current_valid = current >= 0 && current < peer_count &&
+                                   is_candidate(&peers[current]) && !out_unchoke[current];
+
+        if (!current_valid || now_ms - c->last_optimistic_ms >= CHOKER_OPTIMISTIC_INTERVAL_MS) {
+            c->optimistic_peer = pick_optimistic(c, peers, peer_count, out_unchoke, now_ms);
+            c->last_optimistic_ms = now_ms;
+        }
+        if (c->optimistic_peer != -1) out_unchoke[c->optimistic_peer] = true;
+    }
+
+    if (full_round) c->last_rechoke_ms = now_ms;
+    c->pending = false;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "swarm.h"
+
+#define CHOKER_INTERVAL_MS 10000
+#define CHOKER_OPTIMISTIC_INTERVAL_MS 30000
+
+// Tit-for-tat upload slot manager. Every CHOKER_INTERVAL_MS the interested peers that gave us the most
+// (or, while seeding, took the most from us) get all but one of the upload slots; the last one rotates every
+// CHOKER_OPTIMISTIC_INTERVAL_MS to give unknown peers a chance to prove themselves.
+typedef struct {
+    uint64_t last_rechoke_ms;
+    uint64_t last_optimistic_ms;
+    int optimistic_peer;
+    bool pending;
+    // rand_r state of the optimistic draw
+    unsigned int seed;
+} Choker;
+
+void choker_init(Choker *c, uint64_t now_ms);
+
+bool choker_due(const Choker *c, uint64_t now_ms);
+
+// when choker_due turns true without anything else happening
+uint64_t choker_next_due(const Choker *c);
+
+// fills out_unchoke[i] with the desired state of peers[i]; the caller sends the choke/unchoke messages
+void choker_rechoke(Choker *c, PeerConnection *peers, int peer_count, int upload_slots, bool seeding,
+                    uint64_t now_ms, bool *out_unchoke);
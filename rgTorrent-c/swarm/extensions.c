@@ -0,0 +1,244 @@
+#include "extensions.h"
+#include "bencode_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define CLIENT_VERSION "rgTorrent"
+// room for the six keys of a ut_pex message with PEX_MAX_PEERS IPv6 peers added and as many dropped
+#define PEX_MESSAGE_MAX 4096
+
+// length prefix, extension message id and the id of the extension, then the bencoded payload
+static void queue_message(SendQueue *out, const uint8_t extension_id, const void *payload, const size_t len) {
+    unsigned char header[6];
+    const uint32_t net_len = htonl(2 + len);
+    memcpy(header, &net_len, 4);
+    header[4] = EXT_MESSAGE_ID;
+    header[5] = extension_id;
+    sq_push(out, header, 6);
+    sq_push(out, payload, len);
+}
+
+// the bencoded dictionary at the start of payload; dict_len is set to its length, ut_metadata sends data after it
+static BencodeNode *parse_payload(const unsigned char *payload, const size_t len, size_t *dict_len) {
+    if (len == 0) return NULL;
+    FILE *mem_file = fmemopen((void *) payload, len, "rb");
+    if (!mem_file) return NULL;
+
+    BencodeContext ctx = {.file = mem_file};
+    BencodeNode *root = parseCollectionValue(&ctx);
+    fclose(mem_file);
+    if (root && (ctx.hasError || root->type != BEN_DICT)) {
+        freeBencodeNode(root);
+        return NULL;
+    }
+    if (root && dict_len) *dict_len = root->endOffset;
+    return root;
+}
+
+void ext_queue_handshake(SendQueue *out, const int listen_port, const size_t metadata_size, const bool pex) {
+    // keys in sorted order, as bencoding wants them
+    char payload[160];
+    int n = snprintf(payload, sizeof payload, "d1:md11:ut_metadatai%de", EXT_UT_METADATA_ID);
+    if (pex) n += snprintf(payload + n, sizeof payload - n, "6:ut_pexi%de", EXT_UT_PEX_ID);
+    n += snprintf(payload + n, sizeof payload - n, "e");
+    if (metadata_size > 0) n += snprintf(payload + n, sizeof payload - n, "13:metadata_sizei%zue", metadata_size);
+    if (listen_port > 0) n += snprintf(payload + n, sizeof payload - n, "1:pi%de", listen_port);
+    n += snprintf(payload + n, sizeof payload - n, "1:v%zu:%se", strlen(CLIENT_VERSION), CLIENT_VERSION);
+    queue_message(out, EXT_HANDSHAKE_ID, payload, n);
+}
+
+bool ext_parse_handshake(const unsigned char *payload, const size_t len, ExtHandshake *out) {
+    memset(out, 0, sizeof *out);
+    BencodeNode *root = parse_payload(payload, len, NULL);
+    if (!root) return false;
+
+    // an id of 0 switches the extension off
+    const BencodeNode *m = getDictValue(root, "m");
+    const BencodeNode *ut_pex = getDictValue(m, "ut_pex");
+    if (ut_pex && ut_pex->type == BEN_INT && ut_pex->intValue > 0 && ut_pex->intValue < 256) {
+        out->ut_pex = (uint8_t) ut_pex->intValue;
+    }
+    const BencodeNode *ut_metadata = getDictValue(m, "ut_metadata");
+    if (ut_metadata && ut_metadata->type == BEN_INT && ut_metadata->intValue > 0 && ut_metadata->intValue < 256) {
+        out->ut_metadata = (uint8_t) ut_metadata->intValue;
+    }
+    const BencodeNode *size = getDictValue(root, "metadata_size");
+    if (size && size->type == BEN_INT && size->intValue > 0 && size->intValue <= METADATA_MAX_SIZE) {
+        out->metadata_size = (size_t) size->intValue;
+    }
+    const BencodeNode *port = getDictValue(root, "p");
+    if (port && port->type == BEN_INT && port->intValue > 0 && port->intValue < 65536) {
+        out->listen_port = (uint16_t) port->intValue;
+    }
+
+    freeBencodeNode(root);
+    return true;
+}
+
+bool ext_parse_metadata(const unsigned char *payload, const size_t len, MetadataMessage *out) {
+    memset(out, 0, sizeof *out);
+    size_t dict_len = 0;
+    BencodeNode *root = parse_payload(payload, len, &dict_len);
+    if (!root) return false;
+
+    const BencodeNode *type = getDictValue(root, "msg_type");
+    const BencodeNode *piece = getDictValue(root, "piece");
+    const BencodeNode *total_size = getDictValue(root, "total_size");
+    const bool ok = type && type->type == BEN_INT && type->intValue >= METADATA_REQUEST &&
+                    type->intValue <= METADATA_REJECT && piece && piece->type == BEN_INT && piece->intValue >= 0 &&
+                    piece->intValue <= METADATA_MAX_SIZE / METADATA_PIECE_SIZE;
+    if (ok) {
+        out->type = (int) type->intValue;
+        out->piece = (uint32_t) piece->intValue;
+        if (total_size && total_size->type == BEN_INT && total_size->intValue > 0 &&
+            total_size->intValue <= METADATA_MAX_SIZE) {
+            out->total_size = (size_t) total_size->intValue;
+        }
+        out->data = payload + dict_len;
+        out->data_len = len - dict_len;
+    }
+    freeBencodeNode(root);
+    return ok;
+}
+
+void ext_queue_metadata_request(SendQueue *out, const uint8_t ut_metadata_id, const uint32_t piece) {
+    char payload[64];
+    const int n = snprintf(payload, sizeof payload, "d8:msg_typei%de5:piecei%uee", METADATA_REQUEST, piece);
+    queue_message(out, ut_metadata_id, payload, n);
+}
+
+void ext_queue_metadata_reject(SendQueue *out, const uint8_t ut_metadata_id, const uint32_t piece) {
+    char payload[64];
+    const int n = snprintf(payload, sizeof payload, "d8:msg_typei%de5:piecei%uee", METADATA_REJECT, piece);
+    queue_message(out, ut_metadata_id, payload, n);
+}
+
+void ext_queue_metadata_data(SendQueue *out, const uint8_t ut_metadata_id, const uint32_t piece,
+                             const unsigned char *metadata, const size_t metadata_size) {
+    const size_t begin = (size_t) piece * METADATA_PIECE_SIZE;
+    if (!metadata || begin >= metadata_size) {
+        ext_queue_metadata_reject(out, ut_metadata_id, piece);
+        return;
+    }
+    const size_t piece_len = metadata_size - begin < METADATA_PIECE_SIZE ? metadata_size - begin : METADATA_PIECE_SIZE;
+
+    // the dictionary and the piece after it make up one extension message
+    char dict[96];
+    const int n = snprintf(dict, sizeof dict, "d8:msg_typei%de5:piecei%ue10:total_sizei%zuee", METADATA_DATA, piece,
+                           metadata_size);
+    unsigned char header[6];
+    const uint32_t net_len = htonl(2 + n + piece_len);
+    memcpy(header, &net_len, 4);
+    header[4] = EXT_MESSAGE_ID;
+    header[5] = ut_metadata_id;
+    sq_push(out, header, 6);
+    sq_push(out, dict, n);
+    sq_push(out, metadata + begin, piece_len);
+}
+
+static bool contains(const PexSet *set, const PexPeer *peer) {
+    for (int i = 0; i < set->count; i++) {
+        const PexPeer *p = &set->peers[i];
+        if (p->addr_len == peer->addr_len && memcmp(&p->addr, &peer->addr, p->addr_len) == 0) return true;
+    }
+    return false;
+}
+
+// appends the compact form of the peer, address then port in network order, to the list of its family
+static void put_compact(const PexPeer *peer, unsigned char *v4, size_t *v4_len, unsigned char *v6, size_t *v6_len) {
+    if (peer->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) &peer->addr;
+        memcpy(v6 + *v6_len, &in6->sin6_addr, 16);
+        memcpy(v6 + *v6_len + 16, &in6->sin6_port, 2);
+        *v6_len += 18;
+    } else {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) &peer->addr;
+        memcpy(v4 + *v4_len, &in->sin_addr, 4);
+        memcpy(v4 + *v4_len + 4, &in->sin_port, 2);
+        *v4_len += 6;
+    }
+}
+
+static size_t put_bytes(unsigned char *buf, size_t at, const char *key, const unsigned char *data, const size_t len) {
+    at += sprintf((char *) buf + at, "%zu:%s%zu:", strlen(key), key, len);
+    memcpy(buf + at, data, len);
+    return at + len;
+}
+
+bool pex_queue_update(SendQueue *out, const uint8_t ut_pex_id, PexState *state, const PexSet *live) {
+    unsigned char added[PEX_MAX_PEERS * 6], added6[PEX_MAX_PEERS * 18];
+    unsigned char added_flags[PEX_MAX_PEERS], added6_flags[PEX_MAX_PEERS];
+    unsigned char dropped[PEX_MAX_PEERS * 6], dropped6[PEX_MAX_PEERS * 18];
+    size_t added_len = 0, added6_len = 0, dropped_len = 0, dropped6_len = 0;
+
+    PexSet next = {0};
+    for (int i = 0; i < state->sent.count; i++) {
+        const PexPeer *p = &state->sent.peers[i];
+        if (contains(live, p)) next.peers[next.count++] = *p;
+        else put_compact(p, dropped, &dropped_len, dropped6, &dropped6_len);
+    }
+    for (int i = 0; i < live->count && next.count < PEX_MAX_PEERS; i++) {
+        const PexPeer *p = &live->peers[i];
+        if (contains(&state->sent, p)) continue;
+        if (p->addr.ss_family == AF_INET6) added6_flags[added6_len / 18] = p->flags;
+        else added_flags[added_len / 6] = p->flags;
+        put_compact(p, added, &added_len, added6, &added6_len);
+        next.peers[next.count++] = *p;
+    }
+    if (added_len + added6_len + dropped_len + dropped6_len == 0) return false;
+
+    // keys in sorted order: "added.f" sorts before "added6"
+    unsigned char payload[PEX_MESSAGE_MAX];
+    size_t n = 0;
+    payload[n++] = 'd';
+    n = put_bytes(payload, n, "added", added, added_len);
+    n = put_bytes(payload, n, "added.f", added_flags, added_len / 6);
+    n = put_bytes(payload, n, "added6", added6, added6_len);
+    n = put_bytes(payload, n, "added6.f", added6_flags, added6_len / 18);
+    n = put_bytes(payload, n, "dropped", dropped, dropped_len);
+    n = put_bytes(payload, n, "dropped6", dropped6, dropped6_len);
+    payload[n++] = 'e';
+
+    queue_message(out, ut_pex_id, payload, n);
+    state->sent = next;
+    return true;
+}
+
+size_t pex_merge(PeerStore *store, const unsigned char *payload, const size_t len, const bool skip_seeds) {
+    BencodeNode *root = parse_payload(payload, len, NULL);
+    if (!root) return 0;
+
+    const struct {
+        const char *key;
+        const char *flags_key;
+        int family;
+        size_t entry_len;
+    } lists[] = {
+        {"added", "added.f", AF_INET, 6},
+        {"added6", "added6.f", AF_INET6, 18},
+    };
+
+    size_t merged = 0;
+    for (size_t l = 0; l < sizeof lists / sizeof lists[0]; l++) {
+        const BencodeNode *peers = getDictValue(root, lists[l].key);
+        if (!peers || peers->type != BEN_STR) continue;
+        const BencodeNode *flags = getDictValue(root, lists[l].flags_key);
+        const size_t flag_count = flags && flags->type == BEN_STR ? flags->string.length : 0;
+
+        // a message over the limit is not rejected, only what is past it is ignored
+        size_t count = peers->string.length / lists[l].entry_len;
+        if (count > PEX_MAX_PEERS) count = PEX_MAX_PEERS;
+        for (size_t i = 0; i < count; i++) {
+            if (skip_seeds && i < flag_count && flags->string.data[i] & PEX_FLAG_SEED) continue;
+            merged += ps_merge(store, peers->string.data + i * lists[l].entry_len, lists[l].entry_len,
+                               lists[l].family, PEER_SOURCE_PEX);
+        }
+    }
+
+    freeBencodeNode(root);
+    return merged;
+}
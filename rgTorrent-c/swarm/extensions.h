@@ -0,0 +1,100 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "peer_store.h"
+#include "send_queue.h"
+
+// BEP 10: bit 20 of the reserved handshake bytes announces the extension protocol
+#define EXT_RESERVED_BYTE 5
+#define EXT_RESERVED_BIT 0x10
+// every extension message goes under this message id, the first payload byte tells the extension
+#define EXT_MESSAGE_ID 20
+#define EXT_HANDSHAKE_ID 0
+// the ids peers are asked to use for the extensions we take
+#define EXT_UT_PEX_ID 1
+#define EXT_UT_METADATA_ID 2
+// longer extension messages drop the peer
+#define EXT_MAX_MESSAGE 262144
+
+// BEP 11: a peer is told about changes to our connection set at most once a minute, 50 peers each way
+#define PEX_INTERVAL_MS 60000
+#define PEX_MAX_PEERS 50
+// messages that come faster than this from one peer are ignored, the slack covers timer jitter
+#define PEX_MIN_RECEIVE_MS 45000
+#define PEX_FLAG_SEED 0x02
+#define PEX_FLAG_REACHABLE 0x10
+
+// BEP 9: the info dictionary is sent in pieces of 16 KiB, only the last one is shorter
+#define METADATA_PIECE_SIZE 16384
+// larger sizes told by a peer are not believed, the buffer for the whole dictionary is allocated up front
+#define METADATA_MAX_SIZE 16777216
+#define METADATA_REQUEST 0
+#define METADATA_DATA 1
+#define METADATA_REJECT 2
+
+typedef struct {
+    // the peer's id for ut_pex, 0 when it does not take PEX
+    uint8_t ut_pex;
+    // the peer's id for ut_metadata, 0 when it does not take it
+    uint8_t ut_metadata;
+    // the size of the info dictionary the peer has, 0 when it did not tell
+    size_t metadata_size;
+    // the port the peer accepts connections on, 0 when it did not tell
+    uint16_t listen_port;
+} ExtHandshake;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint8_t flags;
+} PexPeer;
+
+typedef struct {
+    PexPeer peers[PEX_MAX_PEERS];
+    int count;
+} PexSet;
+
+// PEX state of one connection, allocated once the peer's extension handshake offers ut_pex
+typedef struct {
+    // what the peer was told so far
+    PexSet sent;
+    uint64_t next_send_ms;
+    uint64_t last_received_ms;
+} PexState;
+
+typedef struct {
+    int type;
+    uint32_t piece;
+    // the size of the whole info dictionary, told with every METADATA_DATA message
+    size_t total_size;
+    // the piece of a METADATA_DATA message, it follows the dictionary in the payload
+    const unsigned char *data;
+    size_t data_len;
+} MetadataMessage;
+
+// metadata_size is the size of the info dictionary we can serve, 0 while we do not have it; pex offers ut_pex
+void ext_queue_handshake(SendQueue *out, int listen_port, size_t metadata_size, bool pex);
+
+// reads the peer's extension handshake; false when the payload is not a bencoded dictionary
+bool ext_parse_handshake(const unsigned char *payload, size_t len, ExtHandshake *out);
+
+// reads a ut_metadata message; false when it is malformed
+bool ext_parse_metadata(const unsigned char *payload, size_t len, MetadataMessage *out);
+
+void ext_queue_metadata_request(SendQueue *out, uint8_t ut_metadata_id, uint32_t piece);
+
+void ext_queue_metadata_reject(SendQueue *out, uint8_t ut_metadata_id, uint32_t piece);
+
+// queues piece of metadata, or a reject when metadata has no such piece
+void ext_queue_metadata_data(SendQueue *out, uint8_t ut_metadata_id, uint32_t piece, const unsigned char *metadata,
+                             size_t metadata_size);
+
+// queues a ut_pex message with what changed between live and what the peer was told; false when nothing did
+bool pex_queue_update(SendQueue *out, uint8_t ut_pex_id, PexState *state, const PexSet *live);
+
+// merges the added peers of a ut_pex message into the store as PEX peers and returns how many were new.
+// Seeds are left out when skip_seeds is set, a seeding torrent has no use for them.
+size_t pex_merge(PeerStore *store, const unsigned char *payload, size_t len, bool skip_seeds);
@@ -0,0 +1,96 @@
+#include "fast_extension.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+
+static bool ipv4_of(const struct sockaddr_storage *addr, uint8_t out[4]) {
+    if (addr->ss_family == AF_INET) {
+        memcpy(out, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+        return true;
+    }
+    const struct in6_addr *v6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    if (addr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(v6)) {
+        memcpy(out, v6->s6_addr + 12, 4);
+        return true;
+    }
+    return false;
+}
+
+int fast_allowed_set(const struct sockaddr_storage *addr, const uint8_t info_hash[20], const uint32_t num_pieces,
+                     int count, uint32_t *out) {
+    uint8_t x[SHA_DIGEST_LENGTH + 4];
+    if (num_pieces == 0 || !ipv4_of(addr, x)) return 0;
+    if ((uint32_t) count > num_pieces) count = (int) num_pieces;
+
+    // the network of the peer, followed by the info hash, is hashed over and over and each digest read as
+    // five piece indices until enough distinct ones came up
+    x[3] = 0;
+    memcpy(x + 4, info_hash, 20);
+    size_t x_len = 24;
+    int n = 0;
+    while (n < count) {
+        SHA1(x, x_len, x);
+        x_len = SHA_DIGEST_LENGTH;
+        for (int i = 0; i < 5 && n < count; i++) {
+            uint32_t y;
+            memcpy(&y, x + 4 * i, 4);
+            const uint32_t index = ntohl(y) % num_pieces;
+            if (!fast_list_contains(out, n, index)) out[n++] = index;
+        }
+    }
+    return n;
+}
+
+void fast_queue_message(SendQueue *out, const uint8_t msg_id) {
+    const unsigned char msg[5] = {0, 0, 0, 1, msg_id};
+    sq_push(out, msg, 5);
+}
+
+void fast_queue_piece_message(SendQueue *out, const uint8_t msg_id, const uint32_t piece) {
+    unsigned char msg[9];
+    const uint32_t net_len = htonl(5);
+    const uint32_t net_piece = htonl(piece);
+    memcpy(msg, &net_len, 4);
+    msg[4] = msg_id;
+    memcpy(msg + 5, &net_piece, 4);
+    sq_push(out, msg, 9);
+}
+
+void fast_queue_reject(SendQueue *out, const uint32_t piece, const uint32_t begin, const uint32_t length) {
+    unsigned char msg[17];
+    const uint32_t net_len = htonl(13);
+    const uint32_t net_piece = htonl(piece);
+    const uint32_t net_begin = htonl(begin);
+    const uint32_t net_length = htonl(length);
+    memcpy(msg, &net_len, 4);
+    msg[4] = REJECT_REQUEST;
+    memcpy(msg + 5, &net_piece, 4);
+    memcpy(msg + 9, &net_begin, 4);
+    memcpy(msg + 13, &net_length, 4);
+    sq_push(out, msg, 17);
+}
+
+bool fast_list_add(uint32_t *pieces, int *count, const uint32_t piece) {
+    if (fast_list_contains(pieces, *count, piece)) return true;
+    if (*count >= FAST_MAX_PIECES) return false;
+    pieces[(*count)++] = piece;
+    return true;
+}
+
+bool fast_list_contains(const uint32_t *pieces, const int count, const uint32_t piece) {
+    for (int i = 0; i < count; i++) {
+        if (pieces[i] == piece) return true;
+    }
+    return false;
+}
+
+void fast_list_remove(uint32_t *pieces, int *count, const uint32_t piece) {
+    for (int i = 0; i < *count; i++) {
+        if (pieces[i] == piece) {
+            pieces[i] = pieces[--*count];
+            return;
+        }
+    }
+}
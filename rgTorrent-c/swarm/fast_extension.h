@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "send_queue.h"
+
+// BEP 6: the third bit from the end of the reserved handshake bytes announces the fast extension
+#define FAST_RESERVED_BYTE 7
+#define FAST_RESERVED_BIT 0x04
+#define SUGGEST_PIECE 13
+#define HAVE_ALL 14
+#define HAVE_NONE 15
+#define REJECT_REQUEST 16
+#define ALLOWED_FAST 17
+// pieces a choked peer may still request from us
+#define ALLOWED_FAST_COUNT 10
+// allowed fast and suggested pieces kept per peer, further ones are ignored
+#define FAST_MAX_PIECES 32
+
+// The allowed fast set of BEP 6 for the peer at addr: up to count distinct pieces derived from its /24 network
+// and the info hash, so every peer of a torrent behind the same NAT gets the same set. Only defined for IPv4,
+// IPv4-mapped addresses included; returns how many pieces were written to out, 0 for IPv6 peers.
+int fast_allowed_set(const struct sockaddr_storage *addr, const uint8_t info_hash[20], uint32_t num_pieces,
+                     int count, uint32_t *out);
+
+// have_all, have_none or any other message without a payload
+void fast_queue_message(SendQueue *out, uint8_t msg_id);
+
+// suggest_piece, allowed_fast or any other message carrying just a piece index
+void fast_queue_piece_message(SendQueue *out, uint8_t msg_id, uint32_t piece);
+
+void fast_queue_reject(SendQueue *out, uint32_t piece, uint32_t begin, uint32_t length);
+
+// adds piece to a list of at most FAST_MAX_PIECES, keeping it free of duplicates; false when it is full
+bool fast_list_add(uint32_t *pieces, int *count, uint32_t piece);
+
+bool fast_list_contains(const uint32_t *pieces, int count, uint32_t piece);
+
+void fast_list_remove(uint32_t *pieces, int *count, uint32_t piece);
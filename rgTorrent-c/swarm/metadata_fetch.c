@@ -0,0 +1,109 @@
+#include "metadata_fetch.h"
+#include "extensions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#define PIECE_MISSING 0
+#define PIECE_REQUESTED 1
+#define PIECE_DONE 2
+
+void mf_init(MetadataFetch *mf) {
+    memset(mf, 0, sizeof *mf);
+}
+
+void mf_free(MetadataFetch *mf) {
+    free(mf->buffer);
+    free(mf->piece_state);
+    free(mf->requested_from);
+    free(mf->requested_at);
+    mf_init(mf);
+}
+
+bool mf_offer_size(MetadataFetch *mf, const size_t size) {
+    if (mf->size) return size == mf->size;
+    if (size == 0 || size > METADATA_MAX_SIZE) return false;
+
+    const int piece_count = (int) ((size + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE);
+    mf->buffer = malloc(size);
+    mf->piece_state = calloc(piece_count, sizeof *mf->piece_state);
+    mf->requested_from = calloc(piece_count, sizeof *mf->requested_from);
+    mf->requested_at = calloc(piece_count, sizeof *mf->requested_at);
+    if (!mf->buffer || !mf->piece_state || !mf->requested_from || !mf->requested_at) {
+        mf_free(mf);
+        return false;
+    }
+    mf->size = size;
+    mf->piece_count = piece_count;
+    return true;
+}
+
+int mf_next_piece(MetadataFetch *mf, const int peer, const uint64_t now_ms) {
+    int outstanding = 0;
+    for (int i = 0; i < mf->piece_count; i++) {
+        if (mf->piece_state[i] == PIECE_REQUESTED && mf->requested_from[i] == peer) outstanding++;
+    }
+    if (outstanding >= METADATA_REQUESTS_PER_PEER) return -1;
+
+    // missing pieces first, a timed out request only goes to another peer once nothing else is left
+    int chosen = -1;
+    for (int i = 0; i < mf->piece_count; i++) {
+        if (mf->piece_state[i] == PIECE_MISSING) {
+            chosen = i;
+            break;
+        }
+        if (chosen == -1 && mf->piece_state[i] == PIECE_REQUESTED && mf->requested_from[i] != peer &&
+            now_ms - mf->requested_at[i] >= METADATA_REQUEST_TIMEOUT_MS) {
+            chosen = i;
+        }
+    }
+    if (chosen == -1) return -1;
+
+    mf->piece_state[chosen] = PIECE_REQUESTED;
+    mf->requested_from[chosen] = peer;
+    mf->requested_at[chosen] = now_ms;
+    return chosen;
+}
+
+bool mf_store(MetadataFetch *mf, const uint32_t piece, const unsigned char *data, const size_t len) {
+    if (piece >= (uint32_t) mf->piece_count) return false;
+    const size_t begin = (size_t) piece * METADATA_PIECE_SIZE;
+    const size_t expected = mf->size - begin < METADATA_PIECE_SIZE ? mf->size - begin : METADATA_PIECE_SIZE;
+    if (len != expected) return false;
+    // a late answer to a request that was handed to another peer meanwhile
+    if (mf->piece_state[piece] == PIECE_DONE) return true;
+
+    memcpy(mf->buffer + begin, data, len);
+    mf->piece_state[piece] = PIECE_DONE;
+    mf->pieces_done++;
+    return true;
+}
+
+void mf_release(MetadataFetch *mf, const int peer) {
+    for (int i = 0; i < mf->piece_count; i++) {
+        if (mf->piece_state[i] == PIECE_REQUESTED && mf->requested_from[i] == peer) mf->piece_state[i] = PIECE_MISSING;
+    }
+}
+
+bool mf_complete(const MetadataFetch *mf) {
+    return mf->size > 0 && mf->pieces_done == mf->piece_count;
+}
+
+unsigned char *mf_take_verified(MetadataFetch *mf, const uint8_t info_hash[20], size_t *out_len) {
+    *out_len = 0;
+    if (!mf_complete(mf)) return NULL;
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(mf->buffer, mf->size, hash);
+    if (memcmp(hash, info_hash, SHA_DIGEST_LENGTH) != 0) {
+        mf_free(mf);
+        return NULL;
+    }
+
+    unsigned char *metadata = mf->buffer;
+    *out_len = mf->size;
+    mf->buffer = NULL;
+    mf_free(mf);
+    return metadata;
+}
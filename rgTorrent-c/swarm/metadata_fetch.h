@@ -0,0 +1,47 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a piece asked for and not delivered in this long is asked for again from another peer
+#define METADATA_REQUEST_TIMEOUT_MS 10000
+// pieces asked from one peer at once, so several peers share the work
+#define METADATA_REQUESTS_PER_PEER 2
+
+// Puts a magnet link's info dictionary together from the 16 KiB pieces of BEP 9, fetched from several peers
+// in parallel. Peers are told apart by their connection slot. Owned by the torrent's network thread.
+typedef struct {
+    // 0 until the first peer tells it
+    size_t size;
+    unsigned char *buffer;
+    int piece_count;
+    int pieces_done;
+    uint8_t *piece_state;
+    // the slot each requested piece was asked from and when
+    int *requested_from;
+    uint64_t *requested_at;
+} MetadataFetch;
+
+void mf_init(MetadataFetch *mf);
+
+void mf_free(MetadataFetch *mf);
+
+// takes the size a peer told as the size of the dictionary if none is known yet. False when the peer's size
+// is not the one taken, its pieces would not fit.
+bool mf_offer_size(MetadataFetch *mf, size_t size);
+
+// the next piece to ask peer for, booked as asked from it; -1 when none is left or the peer has
+// METADATA_REQUESTS_PER_PEER pieces outstanding. Pieces whose request timed out are handed out again.
+int mf_next_piece(MetadataFetch *mf, int peer, uint64_t now_ms);
+
+// stores a piece that came in; false when it is not a piece of the dictionary or has the wrong length
+bool mf_store(MetadataFetch *mf, uint32_t piece, const unsigned char *data, size_t len);
+
+// the peer went away or rejected us, the pieces it still owes are asked from others
+void mf_release(MetadataFetch *mf, int peer);
+
+bool mf_complete(const MetadataFetch *mf);
+
+// checks the complete dictionary against the info hash. On a match it is moved into a malloc'd buffer for the
+// caller; otherwise everything is fetched again from scratch, including the size, which may have been a lie.
+unsigned char *mf_take_verified(MetadataFetch *mf, const uint8_t info_hash[20], size_t *out_len);
@@ -0,0 +1,194 @@
+#include "peer_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+void ps_init(PeerStore *ps) {
+    memset(ps, 0, sizeof *ps);
+}
+
+void ps_free(PeerStore *ps) {
+    free(ps->records);
+    ps_init(ps);
+}
+
+// copies addr into a zeroed out, unmapping IPv4-mapped IPv6 addresses; false for other families
+static bool normalize(const struct sockaddr *addr, const socklen_t addr_len, struct sockaddr_storage *out,
+                      socklen_t *out_len) {
+    memset(out, 0, sizeof *out);
+    if (addr->sa_family == AF_INET && addr_len >= sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        struct sockaddr_in *v4 = (struct sockaddr_in *) out;
+        v4->sin_family = AF_INET;
+        v4->sin_addr = in->sin_addr;
+        v4->sin_port = in->sin_port;
+        *out_len = sizeof *v4;
+        return true;
+    }
+    if (addr->sa_family != AF_INET6 || addr_len < sizeof(struct sockaddr_in6)) return false;
+
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+    if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *) out;
+        v4->sin_family = AF_INET;
+        memcpy(&v4->sin_addr, in6->sin6_addr.s6_addr + 12, 4);
+        v4->sin_port = in6->sin6_port;
+        *out_len = sizeof *v4;
+        return true;
+    }
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) out;
+    v6->sin6_family = AF_INET6;
+    v6->sin6_addr = in6->sin6_addr;
+    v6->sin6_port = in6->sin6_port;
+    // link-local peers are only reachable through the interface they were seen on
+    v6->sin6_scope_id = in6->sin6_scope_id;
+    *out_len = sizeof *v6;
+    return true;
+}
+
+// both sides normalized, so the unused bytes are zero and compare equal
+static int find(const PeerStore *ps, const struct sockaddr_storage *addr, const socklen_t addr_len) {
+    for (size_t i = 0; i < ps->count; i++) {
+        const PeerRecord *r = &ps->records[i];
+        if (r->addr_len == addr_len && memcmp(&r->addr, addr, addr_len) == 0) return (int) i;
+    }
+    return -1;
+}
+
+// a full store makes room by replacing a peer that is not connected and has given up on
+static int reclaim(const PeerStore *ps) {
+    for (size_t i = 0; i < ps->count; i++) {
+        const PeerRecord *r = &ps->records[i];
+        if (!r->connected && (r->failures >= PEER_MAX_FAILURES || !r->dialable)) return (int) i;
+    }
+    return -1;
+}
+
+static int add_normalized(PeerStore *ps, const struct sockaddr_storage *addr, const socklen_t addr_len,
+                          const PeerSource source) {
+    const int existing = find(ps, addr, addr_len);
+    if (existing != -1) return existing;
+
+    int index;
+    if (ps->count == ps->capacity && ps->capacity < PEER_STORE_CAPACITY) {
+        const size_t capacity = ps->capacity ? ps->capacity * 2 : 64;
+        PeerRecord *grown = realloc(ps->records, capacity * sizeof(PeerRecord));
+        if (grown) {
+            ps->records = grown;
+            ps->capacity = capacity;
+        }
+    }
+    if (ps->count < ps->capacity) {
+        index = (int) ps->count++;
+    } else if ((index = reclaim(ps)) == -1) {
+        return -1;
+    }
+
+    PeerRecord *r = &ps->records[index];
+    memset(r, 0, sizeof *r);
+    r->addr = *addr;
+    r->addr_len = addr_len;
+    r->source = source;
+    r->dialable = source != PEER_SOURCE_INCOMING;
+    return index;
+}
+
+int ps_add(PeerStore *ps, const struct sockaddr *addr, const socklen_t addr_len, const PeerSource source) {
+    struct sockaddr_storage normalized;
+    socklen_t normalized_len;
+    if (!normalize(addr, addr_len, &normalized, &normalized_len)) return -1;
+    return add_normalized(ps, &normalized, normalized_len, source);
+}
+
+size_t ps_merge(PeerStore *ps, const unsigned char *compact, const size_t len, const int family,
+                const PeerSource source) {
+    // address bytes followed by the port, both in network order
+    const size_t entry_len = family == AF_INET6 ? 18 : 6;
+    size_t added = 0;
+    for (size_t off = 0; off + entry_len <= len; off += entry_len) {
+        struct sockaddr_storage raw = {0};
+        if (family == AF_INET6) {
+            struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) &raw;
+            v6->sin6_family = AF_INET6;
+            memcpy(&v6->sin6_addr, compact + off, 16);
+            memcpy(&v6->sin6_port, compact + off + 16, 2);
+        } else {
+            struct sockaddr_in *v4 = (struct sockaddr_in *) &raw;
+            v4->sin_family = AF_INET;
+            memcpy(&v4->sin_addr, compact + off, 4);
+            memcpy(&v4->sin_port, compact + off + 4, 2);
+        }
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        normalize((const struct sockaddr *) &raw, sizeof raw, &addr, &addr_len);
+        if (find(ps, &addr, addr_len) == -1 && add_normalized(ps, &addr, addr_len, source) != -1) added++;
+    }
+    return added;
+}
+
+int ps_set_listen_port(PeerStore *ps, const int index, const uint16_t port) {
+    PeerRecord *r = &ps->records[index];
+    if (r->dialable || port == 0) return index;
+
+    struct sockaddr_storage addr = r->addr;
+    if (addr.ss_family == AF_INET6) ((struct sockaddr_in6 *) &addr)->sin6_port = htons(port);
+    else ((struct sockaddr_in *) &addr)->sin_port = htons(port);
+
+    const int existing = find(ps, &addr, r->addr_len);
+    if (existing == -1) {
+        r->addr = addr;
+        r->dialable = true;
+        return index;
+    }
+    // a connection already runs to that endpoint, the records stay apart rather than share it
+    if (ps->records[existing].connected) return index;
+    // the ephemeral record is not dialable and not connected any more, so it is the first one reclaimed
+    r->connected = false;
+    ps->records[existing].connected = true;
+    return existing;
+}
+
+void ps_connection_closed(PeerStore *ps, const int index, const bool established, const uint64_t downloaded,
+                          const uint64_t uploaded, const uint64_t now_ms) {
+    PeerRecord *r = &ps->records[index];
+    r->connected = false;
+    r->downloaded += downloaded;
+    r->uploaded += uploaded;
+
+    if (established) {
+        r->failures = 0;
+        r->next_attempt_ms = now_ms + PEER_RECONNECT_MS;
+        return;
+    }
+
+    const int shift = r->failures < 16 ? r->failures : 16;
+    r->failures++;
+    uint64_t backoff = (uint64_t) PEER_RETRY_BASE_MS << shift;
+    if (backoff > PEER_RETRY_MAX_MS) backoff = PEER_RETRY_MAX_MS;
+    r->next_attempt_ms = now_ms + backoff;
+}
+
+static bool ranks_higher(const PeerRecord *a, const PeerRecord *b) {
+    const uint64_t a_bytes = a->downloaded + a->uploaded;
+    const uint64_t b_bytes = b->downloaded + b->uploaded;
+    if (a_bytes != b_bytes) return a_bytes > b_bytes;
+    if ((a->last_attempt_ms == 0) != (b->last_attempt_ms == 0)) return a->last_attempt_ms == 0;
+    if (a->failures != b->failures) return a->failures < b->failures;
+    return a->last_attempt_ms < b->last_attempt_ms;
+}
+
+int ps_next_candidate(const PeerStore *ps, const uint64_t now_ms) {
+    int best = -1;
+    for (size_t i = 0; i < ps->count; i++) {
+        const PeerRecord *r = &ps->records[i];
+        if (r->connected || !r->dialable || r->failures >= PEER_MAX_FAILURES) continue;
+        if (now_ms < r->next_attempt_ms) continue;
+        if (best == -1 || ranks_higher(r, &ps->records[best])) best = (int) i;
+    }
+    return best;
+}
+
+void ps_reset_attempts(PeerStore *ps) {
+    for (size_t i = 0; i < ps->count; i++) ps->records[i].next_attempt_ms = 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// a peer we had a working connection with is dialed again after this long
+#define PEER_RECONNECT_MS 60000
+// a failed dial is retried after PEER_RETRY_BASE_MS, doubling with every further failure up to PEER_RETRY_MAX_MS
+#define PEER_RETRY_BASE_MS 10000
+#define PEER_RETRY_MAX_MS 1800000
+// peers that failed this often in a row are no longer dialed
+#define PEER_MAX_FAILURES 8
+#define PEER_STORE_CAPACITY 4096
+
+typedef enum {
+    PEER_SOURCE_TRACKER,
+    PEER_SOURCE_INCOMING,
+    PEER_SOURCE_PEX,
+} PeerSource;
+
+typedef struct {
+    // IPv4 or IPv6 endpoint; IPv4-mapped IPv6 addresses are stored as IPv4 so both forms dedupe
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    PeerSource source;
+    // incoming peers connect from an ephemeral port and cannot be dialed back
+    bool dialable;
+    bool connected;
+    int failures;
+    // 0 until the peer is dialed for the first time
+    uint64_t last_attempt_ms;
+    // the peer is not dialed before this
+    uint64_t next_attempt_ms;
+    // payload exchanged over all past connections, candidates are ranked by it
+    uint64_t downloaded;
+    uint64_t uploaded;
+} PeerRecord;
+
+// Every endpoint the torrent has heard of, deduplicated. Owned by the torrent's network thread.
+typedef struct {
+    PeerRecord *records;
+    size_t count;
+    size_t capacity;
+} PeerStore;
+
+void ps_init(PeerStore *ps);
+
+void ps_free(PeerStore *ps);
+
+// index of the record for addr, created if needed; -1 when the store is full of peers worth keeping or
+// addr is neither IPv4 nor IPv6
+int ps_add(PeerStore *ps, const struct sockaddr *addr, socklen_t addr_len, PeerSource source);
+
+// adds the compact peers not known yet and returns how many were new. family tells the format:
+// AF_INET for 6 byte IPv4 entries, AF_INET6 for the 18 byte entries of BEP 7
+size_t ps_merge(PeerStore *ps, const unsigned char *compact, size_t len, int family, PeerSource source);
+
+// an incoming peer told its listening port (BEP 10): the peer is from now on known by that endpoint and can
+// be dialed. Returns the index of the record that stands for the peer, which is an older one when the endpoint
+// was already known; the connection then moves over to it.
+int ps_set_listen_port(PeerStore *ps, int index, uint16_t port);
+
+// books a finished connection: failures back off, working peers keep what they transferred for the ranking
+void ps_connection_closed(PeerStore *ps, int index, bool established, uint64_t downloaded, uint64_t uploaded,
+                          uint64_t now_ms);
+
+// index of the best peer to dial now, -1 when none is due. Peers that transferred the most come first,
+// then the ones never tried, then those with fewer failures and the oldest attempt.
+int ps_next_candidate(const PeerStore *ps, uint64_t now_ms);
+
+// makes every peer due again, used when the swarm comes back from a pause
+void ps_reset_attempts(PeerStore *ps);
@@ -0,0 +1,58 @@
+#include "rate_limiter.h"
+
+void tb_init(TokenBucket *b) {
+    pthread_mutex_init(&b->lock, NULL);
+    b->rate = 0;
+    b->tokens = 0;
+    b->last_refill_ms = 0;
+}
+
+void tb_destroy(TokenBucket *b) {
+    pthread_mutex_destroy(&b->lock);
+}
+
+void tb_set_rate(TokenBucket *b, const uint64_t bytes_per_sec) {
+    pthread_mutex_lock(&b->lock);
+    b->rate = bytes_per_sec;
+    b->tokens = 0;
+    b->last_refill_ms = 0;
+    pthread_mutex_unlock(&b->lock);
+}
+
+uint64_t tb_rate(TokenBucket *b) {
+    pthread_mutex_lock(&b->lock);
+    const uint64_t rate = b->rate;
+    pthread_mutex_unlock(&b->lock);
+    return rate;
+}
+
+static void refill(TokenBucket *b, const uint64_t now_ms) {
+    if (b->last_refill_ms == 0) {
+        b->tokens = (double) b->rate;
+    } else if (now_ms > b->last_refill_ms) {
+        b->tokens += (double) b->rate * (double) (now_ms - b->last_refill_ms) / 1000.0;
+        if (b->tokens > (double) b->rate) b->tokens = (double) b->rate;
+    }
+    b->last_refill_ms = now_ms;
+}
+
+bool tb_consume_chain(TokenBucket *const *chain, const int chain_length, const uint64_t amount,
+                      const uint64_t now_ms) {
+    for (int i = 0; i < chain_length; i++) pthread_mutex_lock(&chain[i]->lock);
+
+    bool allowed = true;
+    for (int i = 0; i < chain_length; i++) {
+        if (chain[i]->rate == 0) continue;
+        refill(chain[i], now_ms);
+        if (chain[i]->tokens <= 0) allowed = false;
+    }
+
+    if (allowed) {
+        for (int i = 0; i < chain_length; i++) {
+            if (chain[i]->rate != 0) chain[i]->tokens -= (double) amount;
+        }
+    }
+
+    for (int i = chain_length - 1; i >= 0; i--) pthread_mutex_unlock(&chain[i]->lock);
+    return allowed;
+}
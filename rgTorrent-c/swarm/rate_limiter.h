@@ -0,0 +1,26 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Token bucket refilled at `rate` bytes per second and capped at one second worth of tokens.
+// Consumers may overdraw it by up to one request, later ones wait until the deficit is paid back,
+// so blocks bigger than the configured rate still get through at the right average speed.
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t rate; // 0 = unlimited
+    double tokens;
+    uint64_t last_refill_ms;
+} TokenBucket;
+
+void tb_init(TokenBucket *b);
+
+void tb_destroy(TokenBucket *b);
+
+void tb_set_rate(TokenBucket *b, uint64_t bytes_per_sec);
+
+uint64_t tb_rate(TokenBucket *b);
+
+// Takes `amount` from every bucket of the chain or from none of them. Buckets are locked in chain
+// order, so callers must always pass them child first (torrent, then session).
+bool tb_consume_chain(TokenBucket *const *chain, int chain_length, uint64_t amount, uint64_t now_ms);
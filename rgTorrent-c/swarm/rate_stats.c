@@ -0,0 +1,45 @@
+#include "rate_stats.h"
+
+#include <string.h>
+
+void rw_init(RateWindow *w) {
+    memset(w, 0, sizeof *w);
+}
+
+static void advance(RateWindow *w, const uint64_t now_ms) {
+    const uint64_t slot = now_ms / RATE_SLOT_MS;
+    if (slot <= w->last_slot) return;
+
+    const uint64_t elapsed = slot - w->last_slot;
+    if (elapsed >= RATE_WINDOW_SLOTS) {
+        memset(w->slots, 0, sizeof w->slots);
+        w->window_total = 0;
+    } else {
+        for (uint64_t s = w->last_slot + 1; s <= slot; s++) {
+            w->window_total -= w->slots[s % RATE_WINDOW_SLOTS];
+            w->slots[s % RATE_WINDOW_SLOTS] = 0;
+        }
+    }
+    w->last_slot = slot;
+}
+
+void rw_add(RateWindow *w, const uint64_t now_ms, const uint64_t bytes) {
+    if (w->first_sample_ms == 0) {
+        w->first_sample_ms = now_ms;
+        w->last_slot = now_ms / RATE_SLOT_MS;
+    }
+    advance(w, now_ms);
+    w->slots[w->last_slot % RATE_WINDOW_SLOTS] += bytes;
+    w->window_total += bytes;
+}
+
+uint64_t rw_rate(RateWindow *w, const uint64_t now_ms) {
+    if (w->first_sample_ms == 0) return 0;
+    advance(w, now_ms);
+
+    uint64_t span_ms = (uint64_t) RATE_WINDOW_SLOTS * RATE_SLOT_MS;
+    const uint64_t since_first = now_ms - w->first_sample_ms;
+    if (since_first < span_ms) span_ms = since_first < RATE_SLOT_MS ? RATE_SLOT_MS : since_first;
+
+    return w->window_total * 1000 / span_ms;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+#define RATE_SLOT_MS 500
+#define RATE_WINDOW_SLOTS 20
+
+// Sliding-window byte counter: the last RATE_WINDOW_SLOTS * RATE_SLOT_MS milliseconds in fixed slots.
+// Not thread-safe, every window belongs to the network thread of its torrent.
+typedef struct {
+    uint64_t slots[RATE_WINDOW_SLOTS];
+    uint64_t window_total;
+    uint64_t last_slot;
+    uint64_t first_sample_ms;
+} RateWindow;
+
+void rw_init(RateWindow *w);
+
+void rw_add(RateWindow *w, uint64_t now_ms, uint64_t bytes);
+
+// average bytes per second over the window, or over the time since the first sample if that is shorter
+uint64_t rw_rate(RateWindow *w, uint64_t now_ms);
+
+// Counters shared between a torrent's network thread (the only writer) and any reader thread.
+static inline void stat_add(uint64_t *counter, const uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline void stat_store(uint64_t *counter, const uint64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,149 @@
+#include "send_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// messages up to this size are appended to the tail chunk instead of getting their own
+#define SQ_COALESCE_LIMIT 1024
+#define SQ_CHUNK_SIZE 4096
+#define SQ_MAX_IOV 64
+
+struct SendChunk {
+    SendChunk *next;
+    size_t len;
+    size_t sent;
+    size_t capacity;
+    // -1 for in-memory chunks, otherwise the payload is len bytes of file_fd starting at file_offset
+    int file_fd;
+    off_t file_offset;
+    unsigned char data[];
+};
+
+static void append_chunk(SendQueue *q, SendChunk *c) {
+    if (q->tail) q->tail->next = c;
+    else q->head = c;
+    q->tail = c;
+    q->queued_bytes += c->len;
+}
+
+void sq_init(SendQueue *q) {
+    q->head = NULL;
+    q->tail = NULL;
+    q->queued_bytes = 0;
+}
+
+void sq_free(SendQueue *q) {
+    SendChunk *c = q->head;
+    while (c) {
+        SendChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    sq_init(q);
+}
+
+bool sq_push(SendQueue *q, const void *data, const size_t len) {
+    if (len == 0) return true;
+
+    if (len <= SQ_COALESCE_LIMIT && q->tail && q->tail->file_fd == -1 && q->tail->capacity - q->tail->len >= len) {
+        memcpy(q->tail->data + q->tail->len, data, len);
+        q->tail->len += len;
+        q->queued_bytes += len;
+        return true;
+    }
+
+    const size_t capacity = len <= SQ_COALESCE_LIMIT ? SQ_CHUNK_SIZE : len;
+    SendChunk *c = malloc(sizeof(SendChunk) + capacity);
+    if (!c) return false;
+
+    c->next = NULL;
+    c->len = len;
+    c->sent = 0;
+    c->capacity = capacity;
+    c->file_fd = -1;
+    c->file_offset = 0;
+    memcpy(c->data, data, len);
+
+    append_chunk(q, c);
+    return true;
+}
+
+bool sq_push_file(SendQueue *q, const int file_fd, const off_t offset, const size_t len) {
+    if (len == 0) return true;
+
+    SendChunk *c = malloc(sizeof(SendChunk));
+    if (!c) return false;
+
+    c->next = NULL;
+    c->len = len;
+    c->sent = 0;
+    c->capacity = 0;
+    c->file_fd = file_fd;
+    c->file_offset = offset;
+
+    append_chunk(q, c);
+    return true;
+}
+
+static void consume(SendQueue *q, size_t written) {
+    q->queued_bytes -= written;
+    while (written > 0) {
+        SendChunk *c = q->head;
+        const size_t remaining = c->len - c->sent;
+        if (written < remaining) {
+            c->sent += written;
+            break;
+        }
+        written -= remaining;
+        q->head = c->next;
+        if (!q->head) q->tail = NULL;
+        free(c);
+    }
+}
+
+bool sq_empty(const SendQueue *q) {
+    return q->head == NULL;
+}
+
+bool sq_flush(SendQueue *q, const int sockfd) {
+    while (q->head) {
+        ssize_t written;
+
+        if (q->head->file_fd != -1) {
+            SendChunk *c = q->head;
+            off_t offset = c->file_offset + (off_t) c->sent;
+            written = sendfile(sockfd, c->file_fd, &offset, c->len - c->sent);
+            // the file shrank underneath us, the peer would wait forever for the rest of the block
+            if (written == 0) return false;
+        } else {
+            struct iovec iov[SQ_MAX_IOV];
+            int iov_count = 0;
+            for (const SendChunk *c = q->head; c && c->file_fd == -1 && iov_count < SQ_MAX_IOV; c = c->next) {
+                iov[iov_count].iov_base = (void *) (c->data + c->sent);
+                iov[iov_count].iov_len = c->len - c->sent;
+                iov_count++;
+            }
+
+            // a piece header followed by a file segment should leave in the same TCP segment as its payload
+            const SendChunk *after = q->head;
+            for (int k = 0; k < iov_count; k++) after = after->next;
+            const int more = after && after->file_fd != -1 ? MSG_MORE : 0;
+
+            struct msghdr msg = {0};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            written = sendmsg(sockfd, &msg, MSG_NOSIGNAL | more);
+        }
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        consume(q, (size_t) written);
+    }
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct SendChunk SendChunk;
+
+// Outgoing byte stream of a single peer. Small control messages are coalesced into shared chunks,
+// everything is flushed with one sendmsg() per writable event and partial writes resume where they stopped.
+// File-backed segments are sent with sendfile() straight from the page cache; the queue does not own their fds.
+typedef struct {
+    SendChunk *head;
+    SendChunk *tail;
+    size_t queued_bytes;
+} SendQueue;
+
+void sq_init(SendQueue *q);
+
+void sq_free(SendQueue *q);
+
+bool sq_push(SendQueue *q, const void *data, size_t len);
+
+bool sq_push_file(SendQueue *q, int file_fd, off_t offset, size_t len);
+
+bool sq_empty(const SendQueue *q);
+
+// returns false when the socket failed and the peer should be dropped.
+// Callers must keep SIGPIPE blocked in the calling thread, sendfile() has no MSG_NOSIGNAL equivalent.
+bool sq_flush(SendQueue *q, int sockfd);
@@ -6,24 +6,78 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include "handshake.h"
 #include "file_saver.h"
+#include "choker.h"
+#include "rate_limiter.h"
+#include "helpers.h"
+#include "peer_store.h"
+#include "extensions.h"
+#include "fast_extension.h"
+#include "metadata_fetch.h"
 #include <openssl/sha.h>
 
 #define MAX_PEERS 30
+#define CHOKE 0
 #define UNCHOKE 1
+#define INTERESTED 2
+#define NOT_INTERESTED 3
+#define HAVE 4
+// BEP 5: the last bit of the reserved handshake bytes announces a DHT node, whose UDP port follows in a PORT message
+#define PORT_MSG 9
+#define DHT_RESERVED_BYTE 7
+#define DHT_RESERVED_BIT 0x01
 #define BITTORENT_PROTOCOL "BitTorrent protocol"
 #define MAX_SEED_BLOCK_LENGTH 131072
+#define MAX_BLOCK_SPANS 64
+// stop pulling queued upload requests while this much is still waiting in the peer's send queue
+#define UPLOAD_HIGH_WATER 262144
+// pieces read for uploads lately, suggested to peers we unchoke since their data is likely still cached
+#define RECENT_UPLOADS 4
+// how often a swarm that ran out of peers to dial asks the trackers for more
+#define PEER_REQUEST_INTERVAL_MS 30000
+// outgoing connects that take longer are given up and count as failed
+#define PEER_CONNECT_TIMEOUT_MS 10000
+// a block not delivered in this long is asked for from another peer
+#define REQUEST_TIMEOUT_MS 20000
+// requests in a row a peer lets time out before it counts as snubbing us, and before it is dropped
+#define SNUB_TIMEOUTS 2
+#define SNUB_DROP_TIMEOUTS 4
+// a snubbed peer is given another piece after this long
+#define SNUB_RETRY_MS 30000
+// peers close connections that stay silent for two minutes, a keep-alive goes out well before that
+#define KEEPALIVE_INTERVAL_MS 90000
+#define IDLE_TIMEOUT_MS 180000
+// the loop sleeps until the next timer, but looks at what is not on the wheel (peers due for a dial, half-open
+// slots freed by other torrents, the statistics) at least this often
+#define SWARM_MAX_WAIT_MS 1000
+// work held back by the rate limiters is retried this often, tokens refill in between
+#define THROTTLE_RETRY_MS 100
+
+typedef enum {
+    TIMER_REQUEST,
+    TIMER_KEEPALIVE,
+    TIMER_IDLE,
+    TIMER_CONNECT
+} PeerTimerKind;
 
 static void set_nonblocking(const int sockfd) {
     const int flags = fcntl(sockfd, F_GETFL, 0);
     fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
 }
 
+// outgoing messages are already batched by the send queue, Nagle would only add delayed-ACK stalls on top
+static void set_nodelay(const int sockfd) {
+    const int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 static bool read_exactly(const int fd, void *buf, const size_t count) {
     size_t bytes_read = 0;
     while (bytes_read < count) {
@@ -44,7 +98,18 @@ static bool read_exactly(const int fd, void *buf, const size_t count) {
     return true;
 }
 
-void request_block(const int sockfd, const uint32_t piece_index, const uint32_t block_offset,
+// reads past the payload of a message we have no use for
+static bool skip_bytes(const int fd, uint32_t count) {
+    unsigned char skipped[4096];
+    while (count > 0) {
+        const uint32_t chunk = count < sizeof skipped ? count : sizeof skipped;
+        if (!read_exactly(fd, skipped, chunk)) return false;
+        count -= chunk;
+    }
+    return true;
+}
+
+void request_block(SendQueue *out, const uint32_t piece_index, const uint32_t block_offset,
                    const uint32_t block_length) {
     unsigned char req_msg[17];
     const uint32_t net_len = htonl(13);
@@ -58,24 +123,205 @@ void request_block(const int sockfd, const uint32_t piece_index, const uint32_t
     memcpy(req_msg + 5, &net_index, 4);
     memcpy(req_msg + 9, &net_begin, 4);
     memcpy(req_msg + 13, &net_length, 4);
-    send(sockfd, req_msg, 17, 0);
+    sq_push(out, req_msg, 17);
+}
+
+static void request_or_defer(TorrentEntry *e, PeerConnection *peer, const uint32_t piece_index,
+                             const uint32_t block_offset, const uint32_t block_length) {
+    TokenBucket *const chain[2] = {&e->download_limit, &e->session->download_limit};
+
+    const uint64_t now = monotonic_ms();
+    if (tb_consume_chain(chain, 2, block_length, now)) {
+        request_block(&peer->out, piece_index, block_offset, block_length);
+        peer->request_sent_ms = now;
+        peer->request_deferred = false;
+    } else {
+        peer->deferred_request.index = piece_index;
+        peer->deferred_request.begin = block_offset;
+        peer->deferred_request.length = block_length;
+        peer->request_deferred = true;
+    }
+}
+
+typedef struct {
+    uint32_t pieces[RECENT_UPLOADS];
+    int count;
+    int next;
+} RecentPieces;
+
+static void note_recent(RecentPieces *recent, const uint32_t piece) {
+    if (fast_list_contains(recent->pieces, recent->count, piece)) return;
+    recent->pieces[recent->next] = piece;
+    recent->next = (recent->next + 1) % RECENT_UPLOADS;
+    if (recent->count < RECENT_UPLOADS) recent->count++;
+}
+
+// BEP 6: a peer with the fast extension may request its allowed fast pieces while we choke it
+static void queue_allowed_fast(const TorrentEntry *e, PeerConnection *peer, const PeerStore *store) {
+    if (!peer->fast || peer->record == -1) return;
+    peer->granted_fast_count = fast_allowed_set(&store->records[peer->record].addr, e->info_hash, e->total_pieces,
+                                                ALLOWED_FAST_COUNT, peer->granted_fast);
+    for (int i = 0; i < peer->granted_fast_count; i++) {
+        fast_queue_piece_message(&peer->out, ALLOWED_FAST, peer->granted_fast[i]);
+    }
 }
 
+static void queue_bitfield(TorrentEntry *e, PeerConnection *peer, const PeerStore *store) {
+    SendQueue *out = &peer->out;
+    // a magnet link has no pieces to tell about before its metadata is known
+    if (e->total_pieces == 0) {
+        if (peer->fast) fast_queue_message(out, HAVE_NONE);
+        return;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    const size_t completed = e->pieces_completed;
+    pthread_mutex_unlock(&e->lock);
+    // both ends of a fast connection skip the bitfield when it is all ones or all zeros
+    if (peer->fast && (completed == 0 || completed == e->total_pieces)) {
+        fast_queue_message(out, completed == 0 ? HAVE_NONE : HAVE_ALL);
+        queue_allowed_fast(e, peer, store);
+        return;
+    }
+
+    const uint32_t bitfield_len = (e->total_pieces + 7) / 8;
+    const uint32_t bitfield_msg_len = htonl(1 + bitfield_len);
+    const uint8_t msg_id_bitfield = 5;
+    unsigned char *bitfield_msg = calloc(1, 5 + bitfield_len);
+
+    memcpy(bitfield_msg, &bitfield_msg_len, 4);
+    bitfield_msg[4] = msg_id_bitfield;
+
+    pthread_mutex_lock(&e->lock);
+    for (size_t p = 0; p < e->total_pieces; p++) {
+        if (e->piece_states[p] == PIECE_DONE) {
+            bitfield_msg[5 + (p / 8)] |= (1 << (7 - (p % 8)));
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    sq_push(out, bitfield_msg, 5 + bitfield_len);
+    free(bitfield_msg);
+    queue_allowed_fast(e, peer, store);
+}
+
+// tells a peer that runs a DHT node where ours listens
+static void queue_dht_port(const TorrentEntry *e, PeerConnection *peer) {
+    const int port = ts_dht_port(e->session);
+    if (!peer->dht || port <= 0) return;
+    unsigned char port_msg[7];
+    const uint32_t net_len = htonl(3);
+    const uint16_t net_port = htons((uint16_t) port);
+    memcpy(port_msg, &net_len, 4);
+    port_msg[4] = PORT_MSG;
+    memcpy(port_msg + 5, &net_port, 2);
+    sq_push(&peer->out, port_msg, 7);
+}
+
+// rarest first among the pieces we miss and the peer has, the lowest index among equally rare ones
 int get_next_piece_to_download(TorrentEntry *e, const bool *peer_inventory) {
     int selected_piece = -1;
     pthread_mutex_lock(&e->lock);
     for (size_t i = 0; i < e->total_pieces; i++) {
-        if (e->piece_states[i] == PIECE_MISSING && peer_inventory[i] == true) {
-            e->piece_states[i] = PIECE_PENDING;
+        if (e->piece_states[i] == PIECE_MISSING && peer_inventory[i] == true &&
+            (selected_piece == -1 || e->availability[i] < e->availability[selected_piece])) {
             selected_piece = (int) i;
-            break;
+            // the peer itself has it, nothing is rarer
+            if (e->availability[i] <= 1) break;
         }
     }
+    if (selected_piece != -1) e->piece_states[selected_piece] = PIECE_PENDING;
     pthread_mutex_unlock(&e->lock);
     return selected_piece;
 }
 
-static void drop_peer(TorrentEntry *e, struct pollfd *pfd, PeerConnection *peer) {
+// books a piece the peer announced in its bitfield or a have message; called with e->lock held
+static void add_to_inventory(TorrentEntry *e, PeerConnection *peer, const size_t piece) {
+    if (peer->inventory[piece]) return;
+    peer->inventory[piece] = true;
+    peer->pieces_have++;
+    e->availability[piece]++;
+    if (e->piece_states[piece] != PIECE_DONE) peer->pieces_wanted++;
+}
+
+// tells the peer whether it has pieces we miss, once that changed
+static void update_interest(PeerConnection *peer) {
+    const bool interested = peer->pieces_wanted > 0;
+    if (interested == peer->am_interested) return;
+    const uint8_t msg[5] = {0, 0, 0, 1, interested ? INTERESTED : NOT_INTERESTED};
+    sq_push(&peer->out, msg, 5);
+    peer->am_interested = interested;
+}
+
+// claims the first listed piece we miss and the peer has; pieces done meanwhile are taken off the list, a
+// claimed one too when take is set
+static int claim_listed_piece(TorrentEntry *e, const PeerConnection *peer, uint32_t *pieces, int *count,
+                              const bool take) {
+    int selected_piece = -1;
+    pthread_mutex_lock(&e->lock);
+    for (int i = 0; i < *count && selected_piece == -1;) {
+        const uint32_t p = pieces[i];
+        if (e->piece_states[p] == PIECE_DONE) {
+            pieces[i] = pieces[--*count];
+            continue;
+        }
+        if (e->piece_states[p] == PIECE_MISSING && peer->inventory[p]) {
+            e->piece_states[p] = PIECE_PENDING;
+            selected_piece = (int) p;
+            if (take) pieces[i] = pieces[--*count];
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&e->lock);
+    return selected_piece;
+}
+
+static size_t piece_size(const TorrentEntry *e, const uint32_t piece_index) {
+    if (piece_index == e->total_pieces - 1) {
+        const size_t rem = e->size_bytes % e->piece_length;
+        if (rem != 0) return rem;
+    }
+    return e->piece_length;
+}
+
+// asks the peer for the first block of the next piece it can give us: suggested pieces first, then any we miss
+// while it unchokes us; only its allowed fast pieces while it chokes us
+static void request_next_piece(TorrentEntry *e, PeerConnection *peer) {
+    if (peer->snubbed) {
+        peer->current_piece_assigned = -1;
+        return;
+    }
+    int next_piece;
+    if (peer->state == PEER_STATE_DOWNLOADING) {
+        next_piece = claim_listed_piece(e, peer, peer->suggested, &peer->suggested_count, true);
+        if (next_piece == -1) next_piece = get_next_piece_to_download(e, peer->inventory);
+    } else {
+        next_piece = claim_listed_piece(e, peer, peer->allowed_fast, &peer->allowed_fast_count, false);
+    }
+    peer->current_piece_assigned = next_piece;
+    if (next_piece == -1) return;
+
+    peer->current_block_offset = 0;
+    peer->piece_buffer = malloc(e->piece_length);
+    uint32_t block_size = DEFAULT_BLOCK_SIZE;
+    const size_t current_piece_size = piece_size(e, next_piece);
+    if (block_size > current_piece_size) block_size = current_piece_size;
+    request_or_defer(e, peer, next_piece, 0, block_size);
+}
+
+// peers that unchoke us and sit idle take the pieces handed back to the picker, except the one at skip
+static void reassign_idle(TorrentEntry *e, PeerConnection *peers, const int skip) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        PeerConnection *peer = &peers[i];
+        if (i != skip && peer->state == PEER_STATE_DOWNLOADING && peer->current_piece_assigned == -1 &&
+            peer->pieces_wanted > 0) {
+            request_next_piece(e, peer);
+        }
+    }
+}
+
+// hands the peer's piece back to the picker, the blocks that came in for it are thrown away
+static void release_piece(TorrentEntry *e, PeerConnection *peer) {
     if (peer->current_piece_assigned != -1) {
         pthread_mutex_lock(&e->lock);
         e->piece_states[peer->current_piece_assigned] = PIECE_MISSING;
@@ -86,10 +332,41 @@ static void drop_peer(TorrentEntry *e, struct pollfd *pfd, PeerConnection *peer)
         free(peer->piece_buffer);
         peer->piece_buffer = NULL;
     }
+    peer->request_deferred = false;
+}
+
+static void drop_peer(TorrentEntry *e, struct pollfd *pfd, PeerConnection *peer) {
+    if (peer->state == PEER_STATE_CONNECTING) ts_half_open_release(e->session);
+    release_piece(e, peer);
     if (peer->inventory) {
+        pthread_mutex_lock(&e->lock);
+        for (size_t p = 0; p < e->total_pieces; p++) {
+            if (peer->inventory[p]) e->availability[p]--;
+        }
+        pthread_mutex_unlock(&e->lock);
         free(peer->inventory);
         peer->inventory = NULL;
     }
+    peer->pieces_have = 0;
+    peer->pieces_wanted = 0;
+    peer->am_interested = false;
+    sq_free(&peer->out);
+    free(peer->pex);
+    peer->pex = NULL;
+    peer->extensions = false;
+    peer->dht = false;
+    peer->fast = false;
+    peer->allowed_fast_count = 0;
+    peer->suggested_count = 0;
+    peer->granted_fast_count = 0;
+    peer->ut_pex_id = 0;
+    peer->ut_metadata_id = 0;
+    peer->metadata_size = 0;
+    peer->am_choking = true;
+    peer->peer_interested = false;
+    peer->upload_queue_count = 0;
+    rw_init(&peer->download_rate);
+    rw_init(&peer->upload_rate);
     if (pfd->fd != -1) {
         close(pfd->fd);
         pfd->fd = -1;
@@ -97,59 +374,161 @@ static void drop_peer(TorrentEntry *e, struct pollfd *pfd, PeerConnection *peer)
     peer->state = PEER_STATE_DEAD;
 }
 
-static bool handle_handshake(const TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer) {
+// Checks the peer id of a handshake that matched our info hash. PEX hands out our own endpoint and the
+// endpoints of peers we are already connected to, so those connections are refused here.
+static bool accept_handshake(const TorrentEntry *e, PeerConnection *peers, const int index,
+                             const PeerHandshake *reply, PeerStore *store) {
+    PeerConnection *peer = &peers[index];
+    if (memcmp(reply->peer_id, e->peer_id, 20) == 0) {
+        if (peer->record != -1) store->records[peer->record].dialable = false;
+        return false;
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (i == index || peers[i].state == PEER_STATE_DEAD || !peers[i].established) continue;
+        if (memcmp(peers[i].peer_id, reply->peer_id, 20) == 0) return false;
+    }
+
+    memcpy(peer->peer_id, reply->peer_id, 20);
+    peer->extensions = reply->reserved[EXT_RESERVED_BYTE] & EXT_RESERVED_BIT;
+    peer->dht = reply->reserved[DHT_RESERVED_BYTE] & DHT_RESERVED_BIT;
+    peer->fast = reply->reserved[FAST_RESERVED_BYTE] & FAST_RESERVED_BIT;
+    peer->established = true;
+    peer->state = PEER_STATE_WAITING_BITFIELD;
+    return true;
+}
+
+// our handshake went out when the connect finished; the bitfield waits for the peer's, it depends on whether the
+// peer takes the fast extension
+static bool handle_handshake(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peers, const int index,
+                             PeerStore *store, const int listen_port) {
     PeerHandshake peer_reply;
     const ssize_t received = recv(pfd->fd, &peer_reply, sizeof(PeerHandshake), 0);
 
     if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
     if (received != sizeof(PeerHandshake) || memcmp(peer_reply.info_hash, e->info_hash, 20) != 0) return false;
 
-    peer->state = PEER_STATE_WAITING_BITFIELD;
+    if (!accept_handshake(e, peers, index, &peer_reply, store)) return false;
+    queue_bitfield(e, &peers[index], store);
+    // the extension handshake goes out as soon as both sides are known to take it
+    if (peers[index].extensions) ext_queue_handshake(&peers[index].out, listen_port, e->info_len, !e->private_torrent);
+    queue_dht_port(e, &peers[index]);
     return true;
 }
 
-static bool handle_bitfield(const TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer) {
-    uint32_t msg_len_net = 0;
-    const ssize_t recvd = recv(pfd->fd, &msg_len_net, 4, 0);
-
+// a peer that connected to us: answered with our handshake once its own matches
+static bool handle_incoming_handshake(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peers,
+                                      const int index, PeerStore *store, const int listen_port,
+                                      const PeerHandshake *ours) {
+    PeerHandshake incoming;
+    const ssize_t recvd = recv(pfd->fd, &incoming, sizeof(PeerHandshake), 0);
     if (recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
-    if (recvd <= 0) return false;
-    if (recvd < 4 && !read_exactly(pfd->fd, (char *) &msg_len_net + recvd, 4 - recvd)) return false;
+    if (recvd != sizeof(PeerHandshake) || memcmp(incoming.info_hash, e->info_hash, 20) != 0 ||
+        !accept_handshake(e, peers, index, &incoming, store)) {
+        return false;
+    }
 
-    const uint32_t msg_len = ntohl(msg_len_net);
-    peer->inventory = calloc(e->total_pieces, sizeof(bool));
+    PeerConnection *peer = &peers[index];
+    sq_push(&peer->out, ours, sizeof(PeerHandshake));
+    queue_bitfield(e, peer, store);
+    if (peer->extensions) ext_queue_handshake(&peer->out, listen_port, e->info_len, !e->private_torrent);
+    queue_dht_port(e, peer);
+    return true;
+}
 
-    if (msg_len > 0) {
-        uint8_t msg_id;
-        if (!read_exactly(pfd->fd, &msg_id, 1)) return false;
-
-        const uint32_t payload_len = msg_len - 1;
-        if (msg_id == 5 && payload_len > 0) {
-            unsigned char *payload = malloc(payload_len);
-            if (read_exactly(pfd->fd, payload, payload_len)) {
-                for (size_t p = 0; p < e->total_pieces; p++) {
-                    const size_t byte_index = p / 8;
-                    const size_t bit_index = 7 - (p % 8);
-                    if (byte_index < payload_len && payload[byte_index] >> bit_index & 1) {
-                        peer->inventory[p] = true;
-                    }
-                }
+// an outgoing connect finished: our handshake goes out, or the connection failed
+static bool handle_connected(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer,
+                             const PeerHandshake *ours) {
+    int socket_error = 0;
+    socklen_t len = sizeof(socket_error);
+    getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &socket_error, &len);
+    if (socket_error != 0) return false;
+
+    sq_push(&peer->out, ours, sizeof(PeerHandshake));
+
+    ts_half_open_release(e->session);
+    peer->state = PEER_STATE_HANDSHAKING;
+    return true;
+}
+
+// the peer's DHT node is at its address with the port of the message; reads the payload whose id byte is read
+static bool handle_port(TorrentEntry *e, const struct pollfd *pfd, const PeerConnection *peer,
+                        const PeerStore *store, const uint32_t payload_len) {
+    uint16_t net_port;
+    if (payload_len != 2 || !read_exactly(pfd->fd, &net_port, 2)) return false;
+    if (!peer->dht || peer->record == -1 || net_port == 0) return true;
+
+    struct sockaddr_storage node = store->records[peer->record].addr;
+    if (node.ss_family == AF_INET6) ((struct sockaddr_in6 *) &node)->sin6_port = net_port;
+    else ((struct sockaddr_in *) &node)->sin_port = net_port;
+    ts_dht_add_node(e->session, (struct sockaddr *) &node, store->records[peer->record].addr_len);
+    return true;
+}
+
+// BEP 10, BEP 11 and BEP 9 messages; reads the payload of an extension message whose id byte is still unread.
+// While a magnet link's metadata is fetched, mf collects what the peer in slot sends; NULL once it is known.
+static bool handle_extended(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer, PeerStore *store,
+                            const uint32_t payload_len, MetadataFetch *mf, const int slot) {
+    if (!peer->extensions || payload_len == 0 || payload_len > EXT_MAX_MESSAGE) return false;
+    unsigned char *payload = malloc(payload_len);
+    if (!payload || !read_exactly(pfd->fd, payload, payload_len)) {
+        free(payload);
+        return false;
+    }
+
+    bool keep = true;
+    const uint64_t now = monotonic_ms();
+    if (payload[0] == EXT_HANDSHAKE_ID) {
+        ExtHandshake handshake;
+        if (ext_parse_handshake(payload + 1, payload_len - 1, &handshake)) {
+            // an incoming peer becomes dialable once it tells where it listens
+            if (handshake.listen_port && peer->record != -1 && !peer->outgoing) {
+                peer->record = ps_set_listen_port(store, peer->record, handshake.listen_port);
             }
-            free(payload);
-        } else if (payload_len > 0) {
-            unsigned char *temp = malloc(payload_len);
-            read_exactly(pfd->fd, temp, payload_len);
-            free(temp);
+            peer->ut_metadata_id = handshake.ut_metadata;
+            peer->metadata_size = handshake.metadata_size;
+            // no PEX either way for a private torrent, so nothing is merged or sent
+            peer->ut_pex_id = e->private_torrent ? 0 : handshake.ut_pex;
+            if (!peer->ut_pex_id) {
+                free(peer->pex);
+                peer->pex = NULL;
+            } else if (!peer->pex && (peer->pex = calloc(1, sizeof *peer->pex))) {
+                // the first message carries the connection set as it is, later ones only the changes
+                peer->pex->next_send_ms = now;
+            }
+        }
+    } else if (payload[0] == EXT_UT_PEX_ID && peer->pex &&
+               (peer->pex->last_received_ms == 0 || now - peer->pex->last_received_ms >= PEX_MIN_RECEIVE_MS)) {
+        peer->pex->last_received_ms = now;
+        pthread_mutex_lock(&e->lock);
+        const bool seeding = !mf && e->pieces_completed == e->total_pieces;
+        pthread_mutex_unlock(&e->lock);
+        pex_merge(store, payload + 1, payload_len - 1, seeding);
+    } else if (payload[0] == EXT_UT_METADATA_ID) {
+        MetadataMessage msg;
+        if (!ext_parse_metadata(payload + 1, payload_len - 1, &msg)) {
+            keep = false;
+        } else if (msg.type == METADATA_REQUEST && peer->ut_metadata_id) {
+            // without the metadata yet every request is rejected
+            ext_queue_metadata_data(&peer->out, peer->ut_metadata_id, msg.piece, e->info_bytes, e->info_len);
+        } else if (msg.type == METADATA_DATA && mf) {
+            keep = mf_store(mf, msg.piece, msg.data, msg.data_len);
+        } else if (msg.type == METADATA_REJECT && mf) {
+            // the peer does not serve the metadata after all, its pieces go to the others
+            peer->metadata_size = 0;
+            mf_release(mf, slot);
         }
     }
+    free(payload);
+    return keep;
+}
 
-    const uint8_t interested_msg[5] = {0, 0, 0, 1, 2};
-    send(pfd->fd, interested_msg, 5, 0);
-    peer->state = PEER_STATE_WAITING_UNCHOKE;
-    return true;
+static void start_downloading(TorrentEntry *e, PeerConnection *peer) {
+    peer->state = PEER_STATE_DOWNLOADING;
+    // an allowed fast piece begun while the peer choked us goes on where it was
+    if (peer->current_piece_assigned == -1) request_next_piece(e, peer);
 }
 
-static bool handle_unchoke(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer) {
+static bool handle_bitfield(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer, PeerStore *store) {
     uint32_t msg_len_net = 0;
     const ssize_t recvd = recv(pfd->fd, &msg_len_net, 4, 0);
 
@@ -158,47 +537,171 @@ static bool handle_unchoke(TorrentEntry *e, const struct pollfd *pfd, PeerConnec
     if (recvd < 4 && !read_exactly(pfd->fd, (char *) &msg_len_net + recvd, 4 - recvd)) return false;
 
     const uint32_t msg_len = ntohl(msg_len_net);
+    uint8_t msg_id = 0;
+    if (msg_len > 0 && !read_exactly(pfd->fd, &msg_id, 1)) return false;
+    // some clients send their extension handshake or their DHT port before the bitfield
+    if (msg_len > 0 && msg_id == EXT_MESSAGE_ID) return handle_extended(e, pfd, peer, store, msg_len - 1, NULL, -1);
+    if (msg_len > 0 && msg_id == PORT_MSG) return handle_port(e, pfd, peer, store, msg_len - 1);
+    // have_all and have_none stand in for the bitfield, and only on fast connections
+    if ((msg_id == HAVE_ALL || msg_id == HAVE_NONE) && (!peer->fast || msg_len != 1)) return false;
+
+    const uint32_t payload_len = msg_len > 0 ? msg_len - 1 : 0;
+    if (msg_id == 5 && payload_len != (e->total_pieces + 7) / 8) return false;
+    unsigned char *payload = NULL;
+    if (msg_id == 5 || (msg_id == HAVE && payload_len == 4)) {
+        payload = malloc(payload_len);
+        if (!payload || !read_exactly(pfd->fd, payload, payload_len)) {
+            free(payload);
+            return false;
+        }
+    } else if (!skip_bytes(pfd->fd, payload_len)) {
+        return false;
+    }
 
-    // keep-alive
-    if (msg_len == 0) return true;
+    peer->inventory = calloc(e->total_pieces, sizeof(bool));
+    pthread_mutex_lock(&e->lock);
+    if (msg_id == 5 || msg_id == HAVE_ALL) {
+        for (size_t p = 0; p < e->total_pieces; p++) {
+            if (msg_id == HAVE_ALL || payload[p / 8] >> (7 - p % 8) & 1) add_to_inventory(e, peer, p);
+        }
+    } else if (payload) {
+        // peers with few pieces may announce them one by one instead
+        uint32_t net_index;
+        memcpy(&net_index, payload, 4);
+        if (ntohl(net_index) < e->total_pieces) add_to_inventory(e, peer, ntohl(net_index));
+    }
+    pthread_mutex_unlock(&e->lock);
+    free(payload);
+    // peers without any pieces may skip the bitfield
+    if (msg_id == INTERESTED && msg_len == 1) peer->peer_interested = true;
 
-    uint8_t msg_id;
-    if (!read_exactly(pfd->fd, &msg_id, 1)) return false;
+    update_interest(peer);
+    peer->state = PEER_STATE_WAITING_UNCHOKE;
+    if (msg_id == UNCHOKE && msg_len == 1) start_downloading(e, peer);
+    return true;
+}
 
-    const uint32_t payload_len = msg_len - 1;
-    if (payload_len > 0) {
-        unsigned char *temp = malloc(payload_len);
-        read_exactly(pfd->fd, temp, payload_len);
-        free(temp);
+// The peer stopped serving us. Without the fast extension the request we have out is void and the piece goes
+// back to the picker for the other peers. A fast peer still answers it, with the block or a reject; we only wait
+// for that on its allowed fast pieces and otherwise give the piece up right away.
+static void handle_choke(TorrentEntry *e, PeerConnection *peer, PeerConnection *all_peers) {
+    peer->state = PEER_STATE_WAITING_UNCHOKE;
+    const int piece = peer->current_piece_assigned;
+    if (piece != -1 && peer->fast && fast_list_contains(peer->allowed_fast, peer->allowed_fast_count, piece)) return;
+    release_piece(e, peer);
+    reassign_idle(e, all_peers, -1);
+    request_next_piece(e, peer);
+}
+
+// BEP 6 messages past the bitfield, whose id byte is read. Peers that did not announce the extension must not
+// send them, have_all and have_none are only valid in place of the bitfield.
+static bool handle_fast(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer, const uint8_t msg_id,
+                        const uint32_t payload_len) {
+    if (!peer->fast || msg_id == HAVE_ALL || msg_id == HAVE_NONE) return false;
+
+    if (msg_id == REJECT_REQUEST) {
+        uint32_t net_request[3];
+        if (payload_len != 12 || !read_exactly(pfd->fd, net_request, 12)) return false;
+        const uint32_t index = ntohl(net_request[0]);
+        const uint32_t begin = ntohl(net_request[1]);
+        // only the one request we have out matters, the piece goes back to the picker
+        if ((int) index != peer->current_piece_assigned || begin != peer->current_block_offset) return true;
+        release_piece(e, peer);
+        fast_list_remove(peer->allowed_fast, &peer->allowed_fast_count, index);
+        // an unchoked peer that rejects is left alone until it unchokes us again
+        if (peer->state == PEER_STATE_WAITING_UNCHOKE) request_next_piece(e, peer);
+        return true;
     }
 
-    if (msg_id == UNCHOKE) {
-        const int next_piece = get_next_piece_to_download(e, peer->inventory);
-        if (next_piece == -1) return false;
+    uint32_t net_index;
+    if (payload_len != 4 || !read_exactly(pfd->fd, &net_index, 4)) return false;
+    const uint32_t index = ntohl(net_index);
+    if (index >= e->total_pieces) return true;
+
+    if (msg_id == SUGGEST_PIECE) {
+        fast_list_add(peer->suggested, &peer->suggested_count, index);
+    } else if (msg_id == ALLOWED_FAST) {
+        fast_list_add(peer->allowed_fast, &peer->allowed_fast_count, index);
+        if (peer->state == PEER_STATE_WAITING_UNCHOKE && peer->current_piece_assigned == -1) {
+            request_next_piece(e, peer);
+        }
+    }
+    return true;
+}
 
-        peer->current_piece_assigned = next_piece;
-        peer->current_block_offset = 0;
-        peer->piece_buffer = malloc(e->piece_length);
+// queues a piece message for a block the caller checked lies within its piece; false when the block cannot be read
+static bool queue_block_upload(const TorrentEntry *e, SendQueue *out, FileHandleCache *files, const EndFile *end_files,
+                               const int num_files, const size_t current_piece_size, const uint32_t block_index,
+                               const uint32_t block_begin, const uint32_t block_length) {
+    unsigned char header[13];
+    const uint32_t out_msg_len = htonl(9 + block_length);
+    const uint32_t net_index = htonl(block_index);
+    const uint32_t net_begin = htonl(block_begin);
+    memcpy(header, &out_msg_len, 4);
+    header[4] = 7;
+    memcpy(header + 5, &net_index, 4);
+    memcpy(header + 9, &net_begin, 4);
+
+    FileSpan spans[MAX_BLOCK_SPANS];
+    const int span_count = map_span_to_files((size_t) block_index * e->piece_length + block_begin, block_length,
+                                             end_files, num_files, spans, MAX_BLOCK_SPANS);
+    // not covered by the files, or spread over more of them than we track spans for
+    if (span_count <= 0) return false;
+
+    int fds[MAX_BLOCK_SPANS];
+    bool zero_copy = true;
+    for (int s = 0; s < span_count && zero_copy; s++) {
+        fds[s] = fhc_get(files, end_files, spans[s].file_index);
+        if (fds[s] < 0) zero_copy = false;
+    }
 
-        uint32_t block_size = DEFAULT_BLOCK_SIZE;
-        size_t current_piece_size = e->piece_length;
-        if (next_piece == (int) e->total_pieces - 1) {
-            const size_t remainder = e->size_bytes % e->piece_length;
-            if (remainder != 0) current_piece_size = remainder;
+    if (zero_copy) {
+        sq_push(out, header, 13);
+        for (int s = 0; s < span_count; s++) {
+            sq_push_file(out, fds[s], (off_t) spans[s].file_offset, spans[s].length);
         }
-        if (peer->current_block_offset + block_size > current_piece_size) {
-            block_size = current_piece_size - peer->current_block_offset;
+        return true;
+    }
+
+    // a file that could not be opened for sendfile is read through a bounce buffer
+    unsigned char *piece_buf = malloc(current_piece_size);
+    const bool loaded = piece_buf && read_piece_from_disk(block_index, e->piece_length, current_piece_size, piece_buf,
+                                                          end_files, num_files);
+    if (loaded) {
+        sq_push(out, header, 13);
+        sq_push(out, piece_buf + block_begin, block_length);
+    }
+    free(piece_buf);
+    return loaded;
+}
+
+static void serve_uploads(TorrentEntry *e, PeerConnection *peer, FileHandleCache *files, const EndFile *end_files,
+                          const int num_files, RecentPieces *recent) {
+    TokenBucket *const chain[2] = {&e->upload_limit, &e->session->upload_limit};
+
+    while (peer->upload_queue_count > 0 && peer->out.queued_bytes < UPLOAD_HIGH_WATER) {
+        const BlockRequest *r = &peer->upload_queue[peer->upload_queue_head];
+        if (!tb_consume_chain(chain, 2, r->length, monotonic_ms())) break;
+
+        if (queue_block_upload(e, &peer->out, files, end_files, num_files, piece_size(e, r->index), r->index,
+                               r->begin, r->length)) {
+            note_recent(recent, r->index);
+            rw_add(&peer->upload_rate, monotonic_ms(), r->length);
+            peer->uploaded += r->length;
+            stat_add(&e->stats.uploaded, r->length);
+        } else if (peer->fast) {
+            fast_queue_reject(&peer->out, r->index, r->begin, r->length);
         }
 
-        request_block(pfd->fd, next_piece, 0, block_size);
-        peer->state = PEER_STATE_DOWNLOADING;
+        peer->upload_queue_head = (peer->upload_queue_head + 1) % MAX_QUEUED_UPLOADS;
+        peer->upload_queue_count--;
     }
-    return true;
 }
 
-static bool handle_downloading(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer,
-                               const unsigned char *pieces_hashes, const EndFile *end_files, const int num_files,
-                               const struct pollfd *all_poll_fds, const PeerConnection *all_peers) {
+static bool handle_message(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer,
+                           const unsigned char *pieces_hashes, const EndFile *end_files, const int num_files,
+                           Choker *choker, PeerStore *store, const struct pollfd *all_poll_fds,
+                           PeerConnection *all_peers) {
     uint32_t msg_len_net;
     const ssize_t res = recv(pfd->fd, &msg_len_net, 4, 0);
 
@@ -208,12 +711,49 @@ static bool handle_downloading(TorrentEntry *e, const struct pollfd *pfd, PeerCo
 
     const uint32_t msg_len = ntohl(msg_len_net);
     if (msg_len == 0) return true; // keep-alive
+    // nothing past the bitfield comes close, a larger length is garbage on the wire
+    if (msg_len > EXT_MAX_MESSAGE + 1) return false;
 
     uint8_t msg_id;
     if (!read_exactly(pfd->fd, &msg_id, 1)) return false;
 
     const uint32_t payload_len = msg_len - 1;
+    if (msg_id <= NOT_INTERESTED) {
+        if (!skip_bytes(pfd->fd, payload_len)) return false;
+
+        if (msg_id == CHOKE) {
+            if (peer->state == PEER_STATE_DOWNLOADING) handle_choke(e, peer, all_peers);
+        } else if (msg_id == UNCHOKE) {
+            if (peer->state == PEER_STATE_WAITING_UNCHOKE) start_downloading(e, peer);
+            else if (peer->current_piece_assigned == -1) request_next_piece(e, peer);
+        } else {
+            const bool interested = msg_id == INTERESTED;
+            // a newly interested peer may take a free slot right away, a leaving one frees its slot
+            if (interested != peer->peer_interested && (interested ? peer->am_choking : !peer->am_choking)) {
+                choker->pending = true;
+            }
+            peer->peer_interested = interested;
+        }
+        return true;
+    }
+
+    if (msg_id == HAVE) {
+        uint32_t net_index;
+        if (payload_len != 4 || !read_exactly(pfd->fd, &net_index, 4)) return false;
+        const uint32_t index = ntohl(net_index);
+        if (index >= e->total_pieces) return false;
+
+        pthread_mutex_lock(&e->lock);
+        add_to_inventory(e, peer, index);
+        pthread_mutex_unlock(&e->lock);
+        update_interest(peer);
+        // a peer that unchokes us but had nothing left for us may have just got something
+        if (peer->state == PEER_STATE_DOWNLOADING && peer->current_piece_assigned == -1) request_next_piece(e, peer);
+        return true;
+    }
+
     if (msg_id == 6) {
+        if (payload_len != 12) return false;
         uint32_t net_index, net_begin, net_length;
         if (!read_exactly(pfd->fd, &net_index, 4)) return false;
         if (!read_exactly(pfd->fd, &net_begin, 4)) return false;
@@ -223,48 +763,38 @@ static bool handle_downloading(TorrentEntry *e, const struct pollfd *pfd, PeerCo
         const uint32_t block_begin = ntohl(net_begin);
         const uint32_t block_length = ntohl(net_length);
 
+        if (block_index >= e->total_pieces) return false;
+
         pthread_mutex_lock(&e->lock);
         const bool has_piece = (e->piece_states[block_index] == PIECE_DONE);
         pthread_mutex_unlock(&e->lock);
 
-        if (has_piece && block_length <= MAX_SEED_BLOCK_LENGTH) {
-            size_t current_piece_size = e->piece_length;
-            if (block_index == e->total_pieces - 1) {
-                const size_t rem = e->size_bytes % e->piece_length;
-                if (rem != 0) current_piece_size = rem;
-            }
-
-            unsigned char *piece_buf = malloc(current_piece_size);
-
-            if (read_piece_from_disk(block_index, e->piece_length, current_piece_size, piece_buf, end_files,
-                                     num_files)) {
-                if (block_begin + block_length <= current_piece_size) {
-                    const uint32_t out_msg_len = htonl(9 + block_length);
-                    const uint8_t out_id = 7;
-                    unsigned char header[13];
-
-                    memcpy(header, &out_msg_len, 4);
-                    header[4] = out_id;
-                    memcpy(header + 5, &net_index, 4);
-                    memcpy(header + 9, &net_begin, 4);
-
-                    send(pfd->fd, header, 13, 0);
-                    send(pfd->fd, piece_buf + block_begin, block_length, 0);
-                }
-            }
-            free(piece_buf);
+        const bool allowed =
+            !peer->am_choking || fast_list_contains(peer->granted_fast, peer->granted_fast_count, block_index);
+        // begin + length is not summed, it could wrap around past the end of the piece
+        const size_t size = piece_size(e, block_index);
+        if (has_piece && allowed && block_length <= MAX_SEED_BLOCK_LENGTH && block_begin <= size &&
+            block_length <= size - block_begin &&
+            peer->upload_queue_count < MAX_QUEUED_UPLOADS) {
+            const int tail = (peer->upload_queue_head + peer->upload_queue_count) % MAX_QUEUED_UPLOADS;
+            peer->upload_queue[tail].index = block_index;
+            peer->upload_queue[tail].begin = block_begin;
+            peer->upload_queue[tail].length = block_length;
+            peer->upload_queue_count++;
+        } else if (peer->fast) {
+            // a fast peer is told right away instead of waiting on a block that never comes
+            fast_queue_reject(&peer->out, block_index, block_begin, block_length);
         }
         return true;
     }
 
-    if (msg_id != 7) {
-        if (payload_len > 0) {
-            unsigned char *temp = malloc(payload_len);
-            read_exactly(pfd->fd, temp, payload_len);
-            free(temp);
-        }
-        return true;
-    }
+    if (msg_id == EXT_MESSAGE_ID) return handle_extended(e, pfd, peer, store, payload_len, NULL, -1);
+    if (msg_id == PORT_MSG) return handle_port(e, pfd, peer, store, payload_len);
+    if (msg_id >= SUGGEST_PIECE && msg_id <= ALLOWED_FAST) return handle_fast(e, pfd, peer, msg_id, payload_len);
+
+    // cancel and whatever else we do not take
+    if (msg_id != 7) return skip_bytes(pfd->fd, payload_len);
+    if (payload_len <= 8) return false;
 
     uint32_t net_index, net_begin;
     if (!read_exactly(pfd->fd, &net_index, 4)) return false;
@@ -274,23 +804,21 @@ static bool handle_downloading(TorrentEntry *e, const struct pollfd *pfd, PeerCo
     const uint32_t block_begin = ntohl(net_begin);
     const uint32_t block_data_len = payload_len - 8;
 
-    if (block_index != peer->current_piece_assigned) return false;
-
-    unsigned char *block_data = malloc(block_data_len);
-    if (!read_exactly(pfd->fd, block_data, block_data_len)) {
-        free(block_data);
-        return false;
+    // a block we gave up on when the peer choked us, or one we never asked for
+    if ((int) block_index != peer->current_piece_assigned || block_begin != peer->current_block_offset ||
+        block_begin + block_data_len > piece_size(e, block_index)) {
+        stat_add(&e->stats.wasted, block_data_len);
+        return skip_bytes(pfd->fd, block_data_len);
     }
 
-    memcpy(peer->piece_buffer + block_begin, block_data, block_data_len);
-    free(block_data);
+    if (!read_exactly(pfd->fd, peer->piece_buffer + block_begin, block_data_len)) return false;
+    peer->request_timeouts = 0;
     peer->current_block_offset += block_data_len;
+    rw_add(&peer->download_rate, monotonic_ms(), block_data_len);
+    peer->downloaded += block_data_len;
+    stat_add(&e->stats.downloaded, block_data_len);
 
-    size_t current_piece_size = e->piece_length;
-    if (block_index == (int) e->total_pieces - 1) {
-        const size_t remainder = e->size_bytes % e->piece_length;
-        if (remainder != 0) current_piece_size = remainder;
-    }
+    const size_t current_piece_size = piece_size(e, block_index);
 
     if (peer->current_block_offset >= current_piece_size) {
         unsigned char hash[SHA_DIGEST_LENGTH];
@@ -298,15 +826,31 @@ static bool handle_downloading(TorrentEntry *e, const struct pollfd *pfd, PeerCo
         const unsigned char *expected_hash = pieces_hashes + block_index * SHA_DIGEST_LENGTH;
 
         // corrupt piece
-        if (memcmp(hash, expected_hash, SHA_DIGEST_LENGTH) != 0) return false;
+        if (memcmp(hash, expected_hash, SHA_DIGEST_LENGTH) != 0) {
+            stat_add(&e->stats.wasted, current_piece_size);
+            return false;
+        }
 
         write_piece_to_disk(block_index, e->piece_length, peer->piece_buffer, end_files, num_files);
 
-        pthread_mutex_lock(&e->lock);
+        ts_entry_begin_update(e);
         e->piece_states[block_index] = PIECE_DONE;
         e->pieces_completed++;
         e->progress = (double) e->pieces_completed / (double) e->total_pieces;
-        pthread_mutex_unlock(&e->lock);
+        const bool finished = e->pieces_completed == e->total_pieces && e->status == TS_STATUS_DOWNLOADING;
+        if (finished) {
+            e->status = TS_STATUS_SEEDING;
+            e->seeding = true;
+        }
+        ts_entry_end_update(e);
+
+        ts_post_event(e->session, TS_EVENT_PIECE_COMPLETED, e->id, block_index);
+        if (finished) {
+            ts_post_event(e->session, TS_EVENT_STATUS_CHANGED, e->id, 0);
+            // the torrent moves from a download slot to a seed slot
+            ts_request_schedule(e->session);
+            ts_entry_announce_completed(e);
+        }
 
         const uint32_t have_msg_len = htonl(5);
         const uint8_t have_msg_id = 4;
@@ -318,194 +862,610 @@ static bool handle_downloading(TorrentEntry *e, const struct pollfd *pfd, PeerCo
         memcpy(have_msg + 5, &net_piece_index, 4);
 
         for (int j = 0; j < MAX_PEERS; j++) {
-            if (all_poll_fds[j].fd != -1 && all_peers[j].state >= PEER_STATE_HANDSHAKING) {
-                if (all_poll_fds[j].fd != pfd->fd) {
-                    send(all_poll_fds[j].fd, have_msg, 9, 0);
-                }
+            // peers still handshaking get the piece in their bitfield, a have must not come before it
+            if (all_poll_fds[j].fd != -1 && all_peers[j].established && all_poll_fds[j].fd != pfd->fd) {
+                sq_push(&all_peers[j].out, have_msg, 9);
+            }
+            // peers whose last piece we missed was this one are of no more interest
+            if (all_peers[j].inventory && all_peers[j].inventory[block_index]) {
+                all_peers[j].pieces_wanted--;
+                update_interest(&all_peers[j]);
             }
         }
 
         free(peer->piece_buffer);
         peer->piece_buffer = NULL;
-
-        const int next_piece = get_next_piece_to_download(e, peer->inventory);
-        if (next_piece != -1) {
-            peer->current_piece_assigned = next_piece;
-            peer->current_block_offset = 0;
-            peer->piece_buffer = malloc(e->piece_length);
-
-            uint32_t next_block_size = DEFAULT_BLOCK_SIZE;
-            size_t next_piece_size = e->piece_length;
-            if (next_piece == (int) e->total_pieces - 1) {
-                const size_t rem = e->size_bytes % e->piece_length;
-                if (rem != 0) next_piece_size = rem;
-            }
-            if (next_block_size > next_piece_size) next_block_size = next_piece_size;
-
-            request_block(pfd->fd, next_piece, 0, next_block_size);
-        } else {
-            peer->current_piece_assigned = -1;
-            return true;
-        }
+        request_next_piece(e, peer);
     } else {
         uint32_t next_block_size = DEFAULT_BLOCK_SIZE;
         if (peer->current_block_offset + next_block_size > current_piece_size) {
             next_block_size = current_piece_size - peer->current_block_offset;
         }
-        request_block(pfd->fd, block_index, peer->current_block_offset, next_block_size);
+        request_or_defer(e, peer, block_index, peer->current_block_offset, next_block_size);
     }
     return true;
 }
 
-static void initiate_connections(struct pollfd *poll_fds, PeerConnection *peers, const unsigned char *peers_list,
-                                 size_t peers_count) {
-    const int spawn_count = peers_count < MAX_PEERS ? peers_count : MAX_PEERS;
+static bool peer_is_seed(const TorrentEntry *e, const PeerConnection *peer) {
+    return peer->inventory && peer->pieces_have == e->total_pieces;
+}
 
-    for (int i = 0; i < spawn_count; i++) {
-        const unsigned char *p = peers_list + i * 6;
-        const int port = p[4] << 8 | p[5];
-        char ip_str[16];
-        snprintf(ip_str, sizeof(ip_str), "%d.%d.%d.%d", p[0], p[1], p[2], p[3]);
+// BEP 11: tells peers[to] which of our other peers accept connections, at most once every PEX_INTERVAL_MS
+static void send_pex(const TorrentEntry *e, PeerConnection *peers, const int to, const PeerStore *store,
+                     const uint64_t now) {
+    PeerConnection *peer = &peers[to];
+    if (!peer->pex || now < peer->pex->next_send_ms) return;
+
+    PexSet live = {0};
+    for (int i = 0; i < MAX_PEERS && live.count < PEX_MAX_PEERS; i++) {
+        const PeerConnection *other = &peers[i];
+        if (i == to || other->record == -1 || !other->established || other->state == PEER_STATE_DEAD) continue;
+        const PeerRecord *r = &store->records[other->record];
+        if (!r->dialable) continue;
+
+        PexPeer *p = &live.peers[live.count++];
+        p->addr = r->addr;
+        p->addr_len = r->addr_len;
+        p->flags = (other->outgoing ? PEX_FLAG_REACHABLE : 0) | (peer_is_seed(e, other) ? PEX_FLAG_SEED : 0);
+    }
+    // nothing to tell yet leaves the peer due, it hears about the first change right away
+    if (pex_queue_update(&peer->out, peer->ut_pex_id, peer->pex, &live)) peer->pex->next_send_ms = now + PEX_INTERVAL_MS;
+}
 
-        const int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0) continue;
+static void drain_wake_fd(const TorrentEntry *e) {
+    uint64_t counter;
+    read(e->wake_fd, &counter, sizeof counter);
+}
 
-        set_nonblocking(sockfd);
+static int effective_limit(const int connection_limit) {
+    return connection_limit < 0 || connection_limit > MAX_PEERS ? MAX_PEERS : connection_limit;
+}
+
+static void collect_peers(TorrentEntry *e, PeerStore *store) {
+    const int families[] = {AF_INET, AF_INET6};
+    for (int i = 0; i < 2; i++) {
+        size_t len;
+        unsigned char *fresh = ts_entry_take_peers(e, families[i], &len);
+        if (!fresh) continue;
+        ps_merge(store, fresh, len, families[i], PEER_SOURCE_TRACKER);
+        free(fresh);
+    }
+}
+
+static void book_closed(PeerStore *store, PeerConnection *peer, const uint64_t now) {
+    if (peer->record == -1) return;
+    ps_connection_closed(store, peer->record, peer->established, peer->downloaded, peer->uploaded, now);
+    peer->record = -1;
+}
+
+static void reset_connection(PeerConnection *peer, const int record, const uint64_t now) {
+    peer->record = record;
+    peer->established = false;
+    peer->downloaded = 0;
+    peer->uploaded = 0;
+    peer->connected_at_ms = now;
+    peer->request_timeouts = 0;
+    peer->snubbed = false;
+    peer->last_sent_ms = now;
+    peer->last_received_ms = now;
+}
+
+// Keeps the torrent's connections topped up to its limit with the best ranked peers from the store,
+// within the session's half-open cap. Returns the new connection count.
+static int initiate_connections(TorrentEntry *e, struct pollfd *poll_fds, PeerConnection *peers, PeerStore *store,
+                                int connections, const int connection_limit) {
+    const uint64_t now = monotonic_ms();
+
+    // slots emptied since the last call book the connection on their peer's record
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].state == PEER_STATE_DEAD) book_closed(store, &peers[i], now);
+    }
 
-        struct sockaddr_in peer_addr = {0};
-        peer_addr.sin_family = AF_INET;
-        peer_addr.sin_port = htons(port);
-        inet_pton(AF_INET, ip_str, &peer_addr.sin_addr);
+    const int limit = effective_limit(connection_limit);
+    int slot = 0;
 
-        connect(sockfd, (struct sockaddr *) &peer_addr, sizeof(peer_addr));
+    while (connections < limit) {
+        while (slot < MAX_PEERS && peers[slot].state != PEER_STATE_DEAD) slot++;
+        if (slot == MAX_PEERS) break;
 
-        poll_fds[i].fd = sockfd;
-        poll_fds[i].events = POLLIN | POLLOUT;
-        peers[i].sockfd = sockfd;
-        peers[i].state = PEER_STATE_CONNECTING;
+        const int candidate = ps_next_candidate(store, now);
+        if (candidate == -1) break;
+        if (!ts_half_open_acquire(e->session)) break;
+        PeerRecord *r = &store->records[candidate];
+        r->last_attempt_ms = now;
+
+        const int sockfd = socket(r->addr.ss_family, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            ts_half_open_release(e->session);
+            ps_connection_closed(store, candidate, false, 0, 0, now);
+            continue;
+        }
+
+        set_nonblocking(sockfd);
+        set_nodelay(sockfd);
+
+        connect(sockfd, (struct sockaddr *) &r->addr, r->addr_len);
+
+        r->connected = true;
+        poll_fds[slot].fd = sockfd;
+        poll_fds[slot].events = POLLIN | POLLOUT;
+        peers[slot].sockfd = sockfd;
+        peers[slot].state = PEER_STATE_CONNECTING;
+        peers[slot].outgoing = true;
+        reset_connection(&peers[slot], candidate, now);
+        connections++;
     }
+    return connections;
 }
 
-void start_swarm(TorrentEntry *e, const unsigned char *peers_list, const size_t peers_count,
-                 const unsigned char *pieces_hashes, const EndFile *end_files, const int num_files) {
-    // +1 is to hold server socket
-    struct pollfd poll_fds[MAX_PEERS + 1];
-    PeerConnection peers[MAX_PEERS];
+// a dual-stack socket takes IPv4 peers as IPv4-mapped addresses; IPv4 only where the host has no IPv6
+static int listen_socket(struct sockaddr_storage *addr, socklen_t *addr_len) {
+    memset(addr, 0, sizeof *addr);
+    int server_fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd >= 0) {
+        const int v6only = 0;
+        if (setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == 0) {
+            struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) addr;
+            v6->sin6_family = AF_INET6;
+            v6->sin6_addr = in6addr_any;
+            *addr_len = sizeof *v6;
+            return server_fd;
+        }
+        close(server_fd);
+    }
+
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in *v4 = (struct sockaddr_in *) addr;
+    v4->sin_family = AF_INET;
+    v4->sin_addr.s_addr = INADDR_ANY;
+    *addr_len = sizeof *v4;
+    return server_fd;
+}
+
+static void set_port(struct sockaddr_storage *addr, const int port) {
+    if (addr->ss_family == AF_INET6) ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+    else ((struct sockaddr_in *) addr)->sin_port = htons(port);
+}
+
+int swarm_listen(int *out_port) {
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
+    const int server_fd = listen_socket(&server_addr, &addr_len);
+    if (server_fd < 0) return -1;
+    const int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    set_nonblocking(server_fd);
+
+    int bound_port = 6881;
+    set_port(&server_addr, bound_port);
+    while (bind(server_fd, (struct sockaddr *) &server_addr, addr_len) < 0 && bound_port < 6890) {
+        bound_port++;
+        set_port(&server_addr, bound_port);
+    }
+
+    // past 6890 listen() binds an ephemeral port, which is what the trackers have to be told
+    if (listen(server_fd, 10) < 0) {
+        close(server_fd);
+        return -1;
+    }
+    socklen_t len = sizeof(server_addr);
+    getsockname(server_fd, (struct sockaddr *) &server_addr, &len);
+    *out_port = ntohs(server_addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &server_addr)->sin6_port
+                                                        : ((struct sockaddr_in *) &server_addr)->sin_port);
 
+    printf("[INFO] Listening for incoming connections on port %d\n", *out_port);
+    return server_fd;
+}
+
+static void init_peers(struct pollfd *poll_fds, PeerConnection *peers) {
     for (int i = 0; i < MAX_PEERS; i++) {
         poll_fds[i].fd = -1;
         peers[i].state = PEER_STATE_DEAD;
         peers[i].inventory = NULL;
+        peers[i].pieces_have = 0;
+        peers[i].pieces_wanted = 0;
+        peers[i].am_interested = false;
         peers[i].current_piece_assigned = -1;
         peers[i].piece_buffer = NULL;
+        peers[i].record = -1;
+        peers[i].extensions = false;
+        peers[i].fast = false;
+        peers[i].allowed_fast_count = 0;
+        peers[i].suggested_count = 0;
+        peers[i].granted_fast_count = 0;
+        peers[i].ut_pex_id = 0;
+        peers[i].pex = NULL;
+        peers[i].ut_metadata_id = 0;
+        peers[i].metadata_size = 0;
+        sq_init(&peers[i].out);
+        peers[i].am_choking = true;
+        peers[i].peer_interested = false;
+        rw_init(&peers[i].download_rate);
+        rw_init(&peers[i].upload_rate);
+        peers[i].request_deferred = false;
+        peers[i].request_timeouts = 0;
+        peers[i].snubbed = false;
+        tw_timer_init(&peers[i].request_timer, TIMER_REQUEST, i);
+        tw_timer_init(&peers[i].keepalive_timer, TIMER_KEEPALIVE, i);
+        tw_timer_init(&peers[i].idle_timer, TIMER_IDLE, i);
+        tw_timer_init(&peers[i].connect_timer, TIMER_CONNECT, i);
+        peers[i].upload_queue_head = 0;
+        peers[i].upload_queue_count = 0;
     }
+}
 
-    initiate_connections(poll_fds, peers, peers_list, peers_count);
+static void build_handshake(const TorrentEntry *e, PeerHandshake *out) {
+    out->pstrlen = 19;
+    memcpy(out->pstr, BITTORENT_PROTOCOL, 19);
+    memset(out->reserved, 0, 8);
+    out->reserved[EXT_RESERVED_BYTE] |= EXT_RESERVED_BIT;
+    out->reserved[FAST_RESERVED_BYTE] |= FAST_RESERVED_BIT;
+    if (ts_dht_port(e->session) > 0) out->reserved[DHT_RESERVED_BYTE] |= DHT_RESERVED_BIT;
+    memcpy(out->info_hash, e->info_hash, 20);
+    memcpy(out->peer_id, e->peer_id, 20);
+}
 
-    const int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    const int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    set_nonblocking(server_fd);
+// sleeps until the session writes the wake fd for a status change or a stop request; returns the status the
+// torrent left the pause or the queue with
+static TsStatus wait_while_parked(TorrentEntry *e, int *connection_limit) {
+    TsStatus status = TS_STATUS_PAUSED;
+    while (!ts_entry_stopping(e)) {
+        struct pollfd wake = {.fd = e->wake_fd, .events = POLLIN};
+        if (poll(&wake, 1, -1) > 0) drain_wake_fd(e);
+        pthread_mutex_lock(&e->lock);
+        status = e->status;
+        *connection_limit = e->connection_limit;
+        pthread_mutex_unlock(&e->lock);
+        if (status != TS_STATUS_PAUSED && status != TS_STATUS_QUEUED) break;
+    }
+    return status;
+}
 
-    struct sockaddr_in server_addr = {0};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+// takes the waiting connection into a free slot, within limit; returns the new connection count
+static int accept_incoming(const int server_fd, struct pollfd *poll_fds, PeerConnection *peers, PeerStore *store,
+                           int connections, const int limit, const uint64_t now) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    const int new_fd = accept(server_fd, (struct sockaddr *) &client_addr, &client_len);
+    if (new_fd < 0) return connections;
+
+    set_nonblocking(new_fd);
+    set_nodelay(new_fd);
+    bool slot_found = false;
+    for (int i = 0; i < MAX_PEERS && connections < limit; i++) {
+        if (peers[i].state == PEER_STATE_DEAD) {
+            book_closed(store, &peers[i], now);
+            const int record = ps_add(store, (struct sockaddr *) &client_addr, client_len, PEER_SOURCE_INCOMING);
+            if (record != -1) store->records[record].connected = true;
+
+            poll_fds[i].fd = new_fd;
+            poll_fds[i].events = POLLIN | POLLOUT;
+            peers[i].sockfd = new_fd;
+            peers[i].state = PEER_STATE_INCOMING_HANDSHAKE;
+            peers[i].outgoing = false;
+            reset_connection(&peers[i], record, now);
+            slot_found = true;
+            connections++;
+            printf("[Swarm] Accepted incoming peer connection!\n");
+            break;
+        }
+    }
+    if (!slot_found) close(new_fd);
+    return connections;
+}
 
-    int bound_port = 6881;
-    while (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 && bound_port < 6890) {
-        bound_port++;
-        server_addr.sin_port = htons(bound_port);
+// choking discards whatever the peer still had queued, it re-requests after the next unchoke. A fast peer is told
+// about every discarded request and keeps those for its allowed fast pieces.
+static void discard_queued_uploads(PeerConnection *peer) {
+    int kept = 0;
+    for (int n = 0; n < peer->upload_queue_count && peer->fast; n++) {
+        const BlockRequest r = peer->upload_queue[(peer->upload_queue_head + n) % MAX_QUEUED_UPLOADS];
+        if (fast_list_contains(peer->granted_fast, peer->granted_fast_count, r.index)) {
+            peer->upload_queue[(peer->upload_queue_head + kept++) % MAX_QUEUED_UPLOADS] = r;
+        } else {
+            fast_queue_reject(&peer->out, r.index, r.begin, r.length);
+        }
     }
+    peer->upload_queue_count = kept;
+}
+
+// a fast peer we unchoke is pointed at the pieces we read last and it misses, they come from the page cache
+static void suggest_recent(PeerConnection *peer, const RecentPieces *recent) {
+    if (!peer->fast || !peer->inventory) return;
+    for (int i = 0; i < recent->count; i++) {
+        const uint32_t piece = recent->pieces[i];
+        if (!peer->inventory[piece]) fast_queue_piece_message(&peer->out, SUGGEST_PIECE, piece);
+    }
+}
+
+static void apply_rechoke(TorrentEntry *e, Choker *choker, struct pollfd *poll_fds, PeerConnection *peers,
+                          const RecentPieces *recent) {
+    pthread_mutex_lock(&e->lock);
+    const bool seeding = e->pieces_completed == e->total_pieces;
+    const int upload_slots = e->upload_slots;
+    pthread_mutex_unlock(&e->lock);
+
+    bool unchoke[MAX_PEERS];
+    choker_rechoke(choker, peers, MAX_PEERS, upload_slots, seeding, monotonic_ms(), unchoke);
+
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (poll_fds[i].fd == -1 || unchoke[i] == !peers[i].am_choking) continue;
+
+        const uint8_t msg[5] = {0, 0, 0, 1, unchoke[i] ? UNCHOKE : CHOKE};
+        sq_push(&peers[i].out, msg, 5);
+        peers[i].am_choking = !unchoke[i];
+        if (unchoke[i]) suggest_recent(&peers[i], recent);
+        else discard_queued_uploads(&peers[i]);
+
+        if (!sq_flush(&peers[i].out, poll_fds[i].fd)) {
+            drop_peer(e, &poll_fds[i], &peers[i]);
+            continue;
+        }
+        if (!sq_empty(&peers[i].out)) poll_fds[i].events = POLLIN | POLLOUT;
+    }
+}
+
+// arms the timers an established connection needs and does not have running yet
+static void arm_timers(TimerWheel *timers, PeerConnection *peer) {
+    // a dead host never answers the SYN, its half-open slot is needed for the next candidate
+    if (peer->state == PEER_STATE_CONNECTING && !peer->connect_timer.armed) {
+        tw_schedule(timers, &peer->connect_timer, peer->connected_at_ms + PEER_CONNECT_TIMEOUT_MS);
+    }
+    if (!peer->established) return;
+    if (!peer->keepalive_timer.armed) {
+        tw_schedule(timers, &peer->keepalive_timer, peer->last_sent_ms + KEEPALIVE_INTERVAL_MS);
+    }
+    if (!peer->idle_timer.armed) tw_schedule(timers, &peer->idle_timer, peer->last_received_ms + IDLE_TIMEOUT_MS);
+    if (peer->current_piece_assigned != -1 && !peer->request_deferred && !peer->request_timer.armed) {
+        tw_schedule(timers, &peer->request_timer, peer->request_sent_ms + REQUEST_TIMEOUT_MS);
+    }
+}
+
+// The block we asked the peer for did not come. Its piece goes to the idle peers and the peer gets another one,
+// unless it let requests time out repeatedly: it is snubbed and tried again after SNUB_RETRY_MS, then dropped.
+static void handle_request_timeout(TorrentEntry *e, TimerWheel *timers, struct pollfd *pfd, PeerConnection *peers,
+                                   const int index, const uint64_t now) {
+    PeerConnection *peer = &peers[index];
+    if (peer->current_piece_assigned == -1 || peer->request_deferred) {
+        // the retry of a snubbed peer
+        if (peer->snubbed && peer->pieces_wanted > 0) {
+            peer->snubbed = false;
+            request_next_piece(e, peer);
+        }
+        return;
+    }
+    // the timed-out block came in and another request went out since
+    if (now - peer->request_sent_ms < REQUEST_TIMEOUT_MS) {
+        tw_schedule(timers, &peer->request_timer, peer->request_sent_ms + REQUEST_TIMEOUT_MS);
+        return;
+    }
+
+    release_piece(e, peer);
+    peer->request_timeouts++;
+    reassign_idle(e, peers, index);
+    if (peer->request_timeouts >= SNUB_DROP_TIMEOUTS) {
+        printf("[INFO] Dropping a peer that let %d requests in a row time out\n", peer->request_timeouts);
+        drop_peer(e, pfd, peer);
+    } else if (peer->request_timeouts >= SNUB_TIMEOUTS) {
+        peer->snubbed = true;
+        tw_schedule(timers, &peer->request_timer, now + SNUB_RETRY_MS);
+    } else {
+        request_next_piece(e, peer);
+    }
+}
+
+// Timers are not cancelled when a connection closes; each one checks the connection in its slot when it fires
+// and only acts on what is still due.
+static void handle_timer(TorrentEntry *e, TimerWheel *timers, const Timer *t, struct pollfd *poll_fds,
+                         PeerConnection *peers, const uint64_t now) {
+    PeerConnection *peer = &peers[t->owner];
+    if (peer->state == PEER_STATE_DEAD) return;
+    if (t->kind == TIMER_CONNECT) {
+        if (peer->state != PEER_STATE_CONNECTING) return;
+        if (now - peer->connected_at_ms >= PEER_CONNECT_TIMEOUT_MS) {
+            drop_peer(e, &poll_fds[t->owner], peer);
+        } else {
+            tw_schedule(timers, &peer->connect_timer, peer->connected_at_ms + PEER_CONNECT_TIMEOUT_MS);
+        }
+        return;
+    }
+    if (!peer->established) return;
+
+    switch (t->kind) {
+        case TIMER_REQUEST:
+            handle_request_timeout(e, timers, &poll_fds[t->owner], peers, t->owner, now);
+            break;
+        case TIMER_KEEPALIVE:
+            if (now - peer->last_sent_ms >= KEEPALIVE_INTERVAL_MS) {
+                const uint8_t keep_alive[4] = {0};
+                sq_push(&peer->out, keep_alive, 4);
+                peer->last_sent_ms = now;
+            }
+            tw_schedule(timers, &peer->keepalive_timer, peer->last_sent_ms + KEEPALIVE_INTERVAL_MS);
+            break;
+        case TIMER_IDLE:
+            if (now - peer->last_received_ms >= IDLE_TIMEOUT_MS) {
+                drop_peer(e, &poll_fds[t->owner], peer);
+            } else {
+                tw_schedule(timers, &peer->idle_timer, peer->last_received_ms + IDLE_TIMEOUT_MS);
+            }
+            break;
+    }
+}
+
+// how long the loop may sleep: until the next timer or rechoke, only briefly while the rate limiters hold work back
+static int poll_timeout(const TimerWheel *timers, const Choker *choker, const bool throttled, const uint64_t now) {
+    uint64_t deadline = now + (throttled ? THROTTLE_RETRY_MS : SWARM_MAX_WAIT_MS);
+    const uint64_t next_timer = tw_next_deadline(timers);
+    if (next_timer < deadline) deadline = next_timer;
+    const uint64_t next_rechoke = choker_next_due(choker);
+    if (next_rechoke < deadline) deadline = next_rechoke;
+    return deadline > now ? (int) (deadline - now) : 0;
+}
+
+void start_swarm(TorrentEntry *e, const int server_fd, PeerStore *store, const unsigned char *pieces_hashes,
+                 const EndFile *end_files, const int num_files) {
+    // uploads are written with sendfile(), which raises SIGPIPE on a reset connection instead of returning EPIPE
+    sigset_t sigpipe_mask;
+    sigemptyset(&sigpipe_mask);
+    sigaddset(&sigpipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe_mask, NULL);
+
+    FileHandleCache files;
+    fhc_init(&files, num_files);
+
+    // the two extra slots hold the server socket and the torrent's wake eventfd
+    struct pollfd poll_fds[MAX_PEERS + 2];
+    PeerConnection peers[MAX_PEERS];
+    init_peers(poll_fds, peers);
+
+    Choker choker;
+    choker_init(&choker, monotonic_ms());
+    RecentPieces recent = {0};
+    // request deadlines, keep-alives and idle disconnects of every connection
+    TimerWheel timers;
+    tw_init(&timers, monotonic_ms());
+    bool throttled = false;
+
+    // torrent-wide rates are sampled from the byte counters once per round and published for readers
+    RateWindow torrent_download_rate, torrent_upload_rate;
+    rw_init(&torrent_download_rate);
+    rw_init(&torrent_upload_rate);
+    uint64_t sampled_downloaded = stat_load(&e->stats.downloaded);
+    uint64_t sampled_uploaded = stat_load(&e->stats.uploaded);
+    uint64_t last_stats_event_ms = 0;
+    bool stats_active = false;
+
+    pthread_mutex_lock(&e->lock);
+    int connection_limit = e->connection_limit;
+    // told to peers in the extension handshake, so those that connected to us can be dialed back
+    const int listen_port = e->listen_port;
+    pthread_mutex_unlock(&e->lock);
+
+    collect_peers(e, store);
+    initiate_connections(e, poll_fds, peers, store, 0, connection_limit);
+    uint64_t last_peer_request_ms = monotonic_ms();
 
-    listen(server_fd, 10);
     poll_fds[MAX_PEERS].fd = server_fd;
     poll_fds[MAX_PEERS].events = POLLIN;
-
-    printf("[INFO] Listening for incoming connections on port %d\n", bound_port);
+    poll_fds[MAX_PEERS + 1].fd = e->wake_fd;
+    poll_fds[MAX_PEERS + 1].events = POLLIN;
 
     PeerHandshake established_handshake;
-    established_handshake.pstrlen = 19;
-    memcpy(established_handshake.pstr, BITTORENT_PROTOCOL, 19);
-    memset(established_handshake.reserved, 0, 8);
-    memcpy(established_handshake.info_hash, e->info_hash, 20);
-    memcpy(established_handshake.peer_id, e->peer_id, 20);
+    build_handshake(e, &established_handshake);
 
-    while (true) {
+    while (!ts_entry_stopping(e)) {
         pthread_mutex_lock(&e->lock);
         TsStatus current_status = e->status;
+        connection_limit = e->connection_limit;
         pthread_mutex_unlock(&e->lock);
 
         if (current_status == TS_STATUS_ERROR) break;
 
-        if (current_status == TS_STATUS_PAUSED) {
+        // paused by the user or sent back to the queue by the scheduler
+        if (current_status == TS_STATUS_PAUSED || current_status == TS_STATUS_QUEUED) {
+            const uint64_t parked_at = monotonic_ms();
             for (int i = 0; i < MAX_PEERS; i++) {
                 drop_peer(e, &poll_fds[i], &peers[i]);
+                book_closed(store, &peers[i], parked_at);
             }
-
-            // TODO: probably only temp solution
-            while (true) {
-                usleep(100000);
-                pthread_mutex_lock(&e->lock);
-                current_status = e->status;
-                pthread_mutex_unlock(&e->lock);
-                if (current_status != TS_STATUS_PAUSED) break;
-            }
-
+            ts_entry_begin_update(e);
+            e->seeds = 0;
+            e->peers_count = 0;
+            ts_entry_end_update(e);
+            ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+            rw_init(&torrent_download_rate);
+            rw_init(&torrent_upload_rate);
+            stat_store(&e->stats.download_rate, 0);
+            stat_store(&e->stats.upload_rate, 0);
+            if (stats_active) ts_post_event(e->session, TS_EVENT_STATS_UPDATED, e->id, 0);
+            stats_active = false;
+            ts_entry_set_announcing(e, false);
+
+            current_status = wait_while_parked(e, &connection_limit);
             if (current_status == TS_STATUS_DOWNLOADING || current_status == TS_STATUS_SEEDING) {
-                initiate_connections(poll_fds, peers, peers_list, peers_count);
+                ts_entry_set_announcing(e, true);
+                collect_peers(e, store);
+                ps_reset_attempts(store);
+                initiate_connections(e, poll_fds, peers, store, 0, connection_limit);
             }
             continue;
         }
 
-        const int activity = poll(poll_fds, MAX_PEERS + 1, 100);
-        if (activity < 0) break;
+        const int activity = poll(poll_fds, MAX_PEERS + 2, poll_timeout(&timers, &choker, throttled, monotonic_ms()));
+        if (activity < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // the session wakes the thread for status changes and for newly announced peers
+        if (poll_fds[MAX_PEERS + 1].revents & POLLIN) {
+            drain_wake_fd(e);
+            collect_peers(e, store);
+        }
 
         int live_seeds = 0;
         int live_peers = 0;
+        int connections = 0;
 
+        // the scheduler shrinks the budget when more torrents become active, shed whatever is over it
+        const int limit = effective_limit(connection_limit);
         for (int i = 0; i < MAX_PEERS; i++) {
-            if (peers[i].state >= PEER_STATE_WAITING_UNCHOKE && peers[i].inventory != NULL) {
-                bool is_seed = true;
-
-                for (size_t p = 0; p < e->total_pieces; p++) {
-                    if (!peers[i].inventory[p]) {
-                        is_seed = false;
-                        break;
-                    }
-                }
+            if (peers[i].state == PEER_STATE_DEAD) continue;
+            if (++connections > limit) {
+                drop_peer(e, &poll_fds[i], &peers[i]);
+                connections--;
+            }
+        }
 
-                if (is_seed) live_seeds++;
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (peers[i].state >= PEER_STATE_WAITING_UNCHOKE && peers[i].inventory != NULL) {
+                if (peer_is_seed(e, &peers[i])) live_seeds++;
                 else live_peers++;
             }
         }
 
-        pthread_mutex_lock(&e->lock);
-        e->seeds = live_seeds;
-        e->peers_count = live_peers;
-        pthread_mutex_unlock(&e->lock);
+        // this thread is the only writer of the counts, so they can be compared without the lock
+        if (e->seeds != live_seeds || e->peers_count != live_peers) {
+            ts_entry_begin_update(e);
+            e->seeds = live_seeds;
+            e->peers_count = live_peers;
+            ts_entry_end_update(e);
+            ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+        }
+
+        const uint64_t now = monotonic_ms();
+        const uint64_t downloaded = stat_load(&e->stats.downloaded);
+        const uint64_t uploaded = stat_load(&e->stats.uploaded);
+        rw_add(&torrent_download_rate, now, downloaded - sampled_downloaded);
+        rw_add(&torrent_upload_rate, now, uploaded - sampled_uploaded);
+        sampled_downloaded = downloaded;
+        sampled_uploaded = uploaded;
+        const uint64_t download_rate = rw_rate(&torrent_download_rate, now);
+        const uint64_t upload_rate = rw_rate(&torrent_upload_rate, now);
+        stat_store(&e->stats.download_rate, download_rate);
+        stat_store(&e->stats.upload_rate, upload_rate);
+
+        // one update per second while the rates are non-zero, plus a last one once they reach zero
+        if (now - last_stats_event_ms >= 1000) {
+            const bool active = download_rate > 0 || upload_rate > 0;
+            if (active || stats_active) ts_post_event(e->session, TS_EVENT_STATS_UPDATED, e->id, 0);
+            stats_active = active;
+            last_stats_event_ms = now;
+        }
+
+        if (choker_due(&choker, monotonic_ms())) {
+            apply_rechoke(e, &choker, poll_fds, peers, &recent);
+        }
 
-        if (activity == 0) continue;
         if (poll_fds[MAX_PEERS].revents & POLLIN) {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            const int new_fd = accept(server_fd, (struct sockaddr *) &client_addr, &client_len);
-
-            if (new_fd >= 0) {
-                set_nonblocking(new_fd);
-                bool slot_found = false;
-                for (int i = 0; i < MAX_PEERS; i++) {
-                    if (peers[i].state == PEER_STATE_DEAD) {
-                        poll_fds[i].fd = new_fd;
-                        poll_fds[i].events = POLLIN | POLLOUT;
-                        peers[i].sockfd = new_fd;
-                        peers[i].state = PEER_STATE_INCOMING_HANDSHAKE;
-                        slot_found = true;
-                        printf("[Swarm] Accepted incoming peer connection!\n");
-                        break;
-                    }
-                }
-                if (!slot_found) close(new_fd);
-            }
+            connections = accept_incoming(server_fd, poll_fds, peers, store, connections, limit, now);
+        }
+
+        // slots left by dropped peers go to the peers that waited longest
+        connections = initiate_connections(e, poll_fds, peers, store, connections, connection_limit);
+        if (connections < limit && now - last_peer_request_ms >= PEER_REQUEST_INTERVAL_MS) {
+            ts_entry_request_peers(e);
+            last_peer_request_ms = now;
         }
 
         for (int i = 0; i < MAX_PEERS; i++) {
@@ -513,54 +1473,24 @@ void start_swarm(TorrentEntry *e, const unsigned char *peers_list, const size_t
 
             if (poll_fds[i].revents & POLLIN) {
                 bool keep_alive = true;
+                peers[i].last_received_ms = now;
 
                 switch (peers[i].state) {
                     case PEER_STATE_HANDSHAKING:
-                        keep_alive = handle_handshake(e, &poll_fds[i], &peers[i]);
+                        keep_alive = handle_handshake(e, &poll_fds[i], peers, i, store, listen_port);
                         break;
                     case PEER_STATE_WAITING_BITFIELD:
-                        keep_alive = handle_bitfield(e, &poll_fds[i], &peers[i]);
+                        keep_alive = handle_bitfield(e, &poll_fds[i], &peers[i], store);
                         break;
                     case PEER_STATE_WAITING_UNCHOKE:
-                        keep_alive = handle_unchoke(e, &poll_fds[i], &peers[i]);
-                        break;
                     case PEER_STATE_DOWNLOADING:
-                        keep_alive = handle_downloading(e, &poll_fds[i], &peers[i], pieces_hashes, end_files, num_files,
-                                                        poll_fds, peers);
+                        keep_alive = handle_message(e, &poll_fds[i], &peers[i], pieces_hashes, end_files, num_files,
+                                                    &choker, store, poll_fds, peers);
                         break;
-                    case PEER_STATE_INCOMING_HANDSHAKE: {
-                        PeerHandshake incoming;
-                        const ssize_t recvd = recv(poll_fds[i].fd, &incoming, sizeof(PeerHandshake), 0);
-                        if (recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                            keep_alive = true;
-                            break;
-                        }
-                        if (recvd != sizeof(PeerHandshake) || memcmp(incoming.info_hash, e->info_hash, 20) != 0) {
-                            keep_alive = false;
-                        } else {
-                            send(poll_fds[i].fd, &established_handshake, sizeof(PeerHandshake), 0);
-
-                            const uint32_t bitfield_len = (e->total_pieces + 7) / 8;
-                            uint32_t bitfield_msg_len = htonl(1 + bitfield_len);
-                            const uint8_t msg_id_bitfield = 5;
-                            unsigned char *bitfield_msg = calloc(1, 5 + bitfield_len);
-                            memcpy(bitfield_msg, &bitfield_msg_len, 4);
-                            bitfield_msg[4] = msg_id_bitfield;
-                            pthread_mutex_lock(&e->lock);
-                            for (size_t p = 0; p < e->total_pieces; p++) {
-                                if (e->piece_states[p] == PIECE_DONE) bitfield_msg[5 + (p / 8)] |= (1 << (7 - (p % 8)));
-                            }
-                            pthread_mutex_unlock(&e->lock);
-                            send(poll_fds[i].fd, bitfield_msg, 5 + bitfield_len, 0);
-                            free(bitfield_msg);
-
-                            const uint8_t unchoke_msg[5] = {0, 0, 0, 1, 1};
-                            send(poll_fds[i].fd, unchoke_msg, 5, 0);
-
-                            peers[i].state = PEER_STATE_WAITING_BITFIELD;
-                        }
+                    case PEER_STATE_INCOMING_HANDSHAKE:
+                        keep_alive = handle_incoming_handshake(e, &poll_fds[i], peers, i, store, listen_port,
+                                                               &established_handshake);
                         break;
-                    }
                     default:
                         break;
                 }
@@ -572,46 +1502,59 @@ void start_swarm(TorrentEntry *e, const unsigned char *peers_list, const size_t
 
             if (poll_fds[i].revents & POLLOUT) {
                 if (peers[i].state == PEER_STATE_CONNECTING) {
-                    int socket_error = 0;
-                    socklen_t len = sizeof(socket_error);
-                    getsockopt(poll_fds[i].fd, SOL_SOCKET, SO_ERROR, &socket_error, &len);
-
-                    if (socket_error != 0) {
+                    if (!handle_connected(e, &poll_fds[i], &peers[i], &established_handshake)) {
                         drop_peer(e, &poll_fds[i], &peers[i]);
                         continue;
                     }
+                } else if (!sq_flush(&peers[i].out, poll_fds[i].fd)) {
+                    drop_peer(e, &poll_fds[i], &peers[i]);
+                    continue;
+                }
+            }
+        }
 
-                    send(poll_fds[i].fd, &established_handshake, sizeof(PeerHandshake), 0);
-
-                    const uint32_t bitfield_len = (e->total_pieces + 7) / 8;
-                    uint32_t bitfield_msg_len = htonl(1 + bitfield_len);
-                    const uint8_t msg_id_bitfield = 5;
-                    unsigned char *bitfield_msg = calloc(1, 5 + bitfield_len);
-
-                    memcpy(bitfield_msg, &bitfield_msg_len, 4);
-                    bitfield_msg[4] = msg_id_bitfield;
+        const uint64_t timers_now = monotonic_ms();
+        for (const Timer *t; (t = tw_pop_expired(&timers, timers_now));) {
+            handle_timer(e, &timers, t, poll_fds, peers, timers_now);
+        }
+        throttled = false;
 
-                    pthread_mutex_lock(&e->lock);
-                    for (size_t p = 0; p < e->total_pieces; p++) {
-                        if (e->piece_states[p] == PIECE_DONE) {
-                            bitfield_msg[5 + (p / 8)] |= (1 << (7 - (p % 8)));
-                        }
-                    }
-                    pthread_mutex_unlock(&e->lock);
+        // everything queued during this round goes out in one batch per peer, whatever the socket
+        // cannot take right now waits for POLLOUT
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (poll_fds[i].fd == -1) continue;
+            if (peers[i].state == PEER_STATE_CONNECTING) {
+                arm_timers(&timers, &peers[i]);
+                continue;
+            }
 
-                    send(poll_fds[i].fd, bitfield_msg, 5 + bitfield_len, 0);
-                    free(bitfield_msg);
-                    const uint8_t unchoke_msg[5] = {0, 0, 0, 1, 1}; // Len=1, ID=1
-                    send(poll_fds[i].fd, unchoke_msg, 5, 0);
+            // work held back by the rate limiters is retried every round, tokens refill in between
+            if (peers[i].request_deferred) {
+                const BlockRequest r = peers[i].deferred_request;
+                request_or_defer(e, &peers[i], r.index, r.begin, r.length);
+            }
+            serve_uploads(e, &peers[i], &files, end_files, num_files, &recent);
+            send_pex(e, peers, i, store, now);
+            arm_timers(&timers, &peers[i]);
+            if (peers[i].request_deferred ||
+                (peers[i].upload_queue_count > 0 && peers[i].out.queued_bytes < UPLOAD_HIGH_WATER)) {
+                throttled = true;
+            }
 
-                    peers[i].state = PEER_STATE_HANDSHAKING;
-                    poll_fds[i].events = POLLIN;
+            if (!sq_empty(&peers[i].out)) {
+                if (!sq_flush(&peers[i].out, poll_fds[i].fd)) {
+                    drop_peer(e, &poll_fds[i], &peers[i]);
+                    continue;
                 }
+                peers[i].last_sent_ms = now;
             }
+            poll_fds[i].events = sq_empty(&peers[i].out) ? POLLIN : POLLIN | POLLOUT;
         }
     }
 
     printf("[INFO] Shutting down network threads for info hash...\n");
+    stat_store(&e->stats.download_rate, 0);
+    stat_store(&e->stats.upload_rate, 0);
 
     if (poll_fds[MAX_PEERS].fd != -1) {
         close(poll_fds[MAX_PEERS].fd);
@@ -623,4 +1566,213 @@ void start_swarm(TorrentEntry *e, const unsigned char *peers_list, const size_t
             drop_peer(e, &poll_fds[i], &peers[i]);
         }
     }
+
+    fhc_close(&files);
+}
+
+static void drop_fetch_peer(TorrentEntry *e, struct pollfd *pfd, PeerConnection *peer, MetadataFetch *mf,
+                            const int slot) {
+    mf_release(mf, slot);
+    drop_peer(e, pfd, peer);
+}
+
+// reads one message of a peer while the metadata is fetched; only extension and PORT messages are of use then
+static bool handle_fetch_message(TorrentEntry *e, const struct pollfd *pfd, PeerConnection *peer, PeerStore *store,
+                                 MetadataFetch *mf, const int slot) {
+    uint32_t msg_len_net;
+    const ssize_t res = recv(pfd->fd, &msg_len_net, 4, 0);
+
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (res <= 0) return false;
+    if (res < 4 && !read_exactly(pfd->fd, (char *) &msg_len_net + res, 4 - res)) return false;
+
+    const uint32_t msg_len = ntohl(msg_len_net);
+    if (msg_len == 0) return true; // keep-alive
+    if (msg_len > EXT_MAX_MESSAGE + 1) return false;
+
+    uint8_t msg_id;
+    if (!read_exactly(pfd->fd, &msg_id, 1)) return false;
+    const uint32_t payload_len = msg_len - 1;
+    if (msg_id == EXT_MESSAGE_ID) return handle_extended(e, pfd, peer, store, payload_len, mf, slot);
+    if (msg_id == PORT_MSG) return handle_port(e, pfd, peer, store, payload_len);
+    return skip_bytes(pfd->fd, payload_len);
+}
+
+// asks the peer for the pieces it is due, as long as it serves a dictionary of the size being fetched
+static void request_metadata(MetadataFetch *mf, PeerConnection *peer, const int slot, const uint64_t now) {
+    if (!peer->ut_metadata_id || !peer->metadata_size || !mf_offer_size(mf, peer->metadata_size)) return;
+    int piece;
+    while ((piece = mf_next_piece(mf, slot, now)) != -1) {
+        ext_queue_metadata_request(&peer->out, peer->ut_metadata_id, (uint32_t) piece);
+    }
+}
+
+unsigned char *swarm_fetch_metadata(TorrentEntry *e, const int server_fd, PeerStore *store, size_t *out_len) {
+    struct pollfd poll_fds[MAX_PEERS + 2];
+    PeerConnection peers[MAX_PEERS];
+    init_peers(poll_fds, peers);
+
+    MetadataFetch mf;
+    mf_init(&mf);
+
+    pthread_mutex_lock(&e->lock);
+    int connection_limit = e->connection_limit;
+    const int listen_port = e->listen_port;
+    pthread_mutex_unlock(&e->lock);
+
+    collect_peers(e, store);
+    initiate_connections(e, poll_fds, peers, store, 0, connection_limit);
+    uint64_t last_peer_request_ms = monotonic_ms();
+
+    poll_fds[MAX_PEERS].fd = server_fd;
+    poll_fds[MAX_PEERS].events = POLLIN;
+    poll_fds[MAX_PEERS + 1].fd = e->wake_fd;
+    poll_fds[MAX_PEERS + 1].events = POLLIN;
+
+    PeerHandshake handshake;
+    build_handshake(e, &handshake);
+
+    printf("[INFO] Fetching the metadata of %s from the swarm...\n", e->name);
+    unsigned char *metadata = NULL;
+    *out_len = 0;
+    while (!metadata && !ts_entry_stopping(e)) {
+        pthread_mutex_lock(&e->lock);
+        TsStatus current_status = e->status;
+        connection_limit = e->connection_limit;
+        pthread_mutex_unlock(&e->lock);
+
+        if (current_status == TS_STATUS_ERROR) break;
+
+        if (current_status == TS_STATUS_PAUSED || current_status == TS_STATUS_QUEUED) {
+            const uint64_t parked_at = monotonic_ms();
+            for (int i = 0; i < MAX_PEERS; i++) {
+                drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                book_closed(store, &peers[i], parked_at);
+            }
+            ts_entry_begin_update(e);
+            e->peers_count = 0;
+            ts_entry_end_update(e);
+            ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+            ts_entry_set_announcing(e, false);
+
+            if (wait_while_parked(e, &connection_limit) == TS_STATUS_FETCHING_METADATA) {
+                ts_entry_set_announcing(e, true);
+                collect_peers(e, store);
+                ps_reset_attempts(store);
+                initiate_connections(e, poll_fds, peers, store, 0, connection_limit);
+            }
+            continue;
+        }
+
+        // the fetch keeps no timer wheel, its connect and request timeouts are looked at every round
+        const int activity = poll(poll_fds, MAX_PEERS + 2, SWARM_MAX_WAIT_MS);
+        if (activity < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (poll_fds[MAX_PEERS + 1].revents & POLLIN) {
+            drain_wake_fd(e);
+            collect_peers(e, store);
+        }
+
+        const int limit = effective_limit(connection_limit);
+        const uint64_t now = monotonic_ms();
+        int connections = 0;
+        int live_peers = 0;
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (peers[i].state == PEER_STATE_DEAD) continue;
+            if (peers[i].state == PEER_STATE_CONNECTING && now - peers[i].connected_at_ms >= PEER_CONNECT_TIMEOUT_MS) {
+                drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                continue;
+            }
+            if (++connections > limit) {
+                drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                connections--;
+                continue;
+            }
+            if (peers[i].established) live_peers++;
+        }
+        if (e->peers_count != live_peers) {
+            ts_entry_begin_update(e);
+            e->peers_count = live_peers;
+            ts_entry_end_update(e);
+            ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+        }
+
+        if (poll_fds[MAX_PEERS].revents & POLLIN) {
+            connections = accept_incoming(server_fd, poll_fds, peers, store, connections, limit, now);
+        }
+        connections = initiate_connections(e, poll_fds, peers, store, connections, connection_limit);
+        if (connections < limit && now - last_peer_request_ms >= PEER_REQUEST_INTERVAL_MS) {
+            ts_entry_request_peers(e);
+            last_peer_request_ms = now;
+        }
+
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (poll_fds[i].fd == -1) continue;
+
+            if (poll_fds[i].revents & POLLIN) {
+                bool keep_alive = true;
+                switch (peers[i].state) {
+                    case PEER_STATE_HANDSHAKING:
+                        keep_alive = handle_handshake(e, &poll_fds[i], peers, i, store, listen_port);
+                        break;
+                    case PEER_STATE_INCOMING_HANDSHAKE:
+                        keep_alive = handle_incoming_handshake(e, &poll_fds[i], peers, i, store, listen_port,
+                                                               &handshake);
+                        break;
+                    case PEER_STATE_CONNECTING:
+                    case PEER_STATE_DEAD:
+                        break;
+                    default:
+                        keep_alive = handle_fetch_message(e, &poll_fds[i], &peers[i], store, &mf, i);
+                        break;
+                }
+                // the metadata only comes over the extension protocol
+                if (peers[i].established && !peers[i].extensions) keep_alive = false;
+                if (!keep_alive) {
+                    drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                    continue;
+                }
+            }
+
+            if (poll_fds[i].revents & POLLOUT) {
+                if (peers[i].state == PEER_STATE_CONNECTING) {
+                    if (!handle_connected(e, &poll_fds[i], &peers[i], &handshake)) {
+                        drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                        continue;
+                    }
+                } else if (!sq_flush(&peers[i].out, poll_fds[i].fd)) {
+                    drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                    continue;
+                }
+            }
+        }
+
+        if (mf_complete(&mf)) {
+            metadata = mf_take_verified(&mf, e->info_hash, out_len);
+            if (!metadata) printf("[INFO] The metadata of %s failed the hash check, fetching it again\n", e->name);
+        }
+
+        for (int i = 0; i < MAX_PEERS && !metadata; i++) {
+            if (poll_fds[i].fd == -1 || peers[i].state == PEER_STATE_CONNECTING) continue;
+
+            request_metadata(&mf, &peers[i], i, now);
+            if (!sq_empty(&peers[i].out) && !sq_flush(&peers[i].out, poll_fds[i].fd)) {
+                drop_fetch_peer(e, &poll_fds[i], &peers[i], &mf, i);
+                continue;
+            }
+            poll_fds[i].events = sq_empty(&peers[i].out) ? POLLIN : POLLIN | POLLOUT;
+        }
+    }
+
+    // the swarm dials the same peers again right away, now able to download from them
+    const uint64_t now = monotonic_ms();
+    for (int i = 0; i < MAX_PEERS; i++) {
+        drop_peer(e, &poll_fds[i], &peers[i]);
+        book_closed(store, &peers[i], now);
+    }
+    if (metadata) ps_reset_attempts(store);
+    mf_free(&mf);
+    return metadata;
 }
@@ -3,7 +3,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "extensions.h"
+#include "fast_extension.h"
 #include "file_saver.h"
+#include "peer_store.h"
+#include "rate_stats.h"
+#include "send_queue.h"
+#include "timer_wheel.h"
 
 typedef struct TorrentEntry TorrentEntry;
 
@@ -11,19 +17,93 @@ typedef enum {
     PEER_STATE_CONNECTING = 0,
     PEER_STATE_HANDSHAKING,
     PEER_STATE_WAITING_BITFIELD,
+    // past the bitfield while the peer chokes us
     PEER_STATE_WAITING_UNCHOKE,
+    // past the bitfield while the peer unchokes us
     PEER_STATE_DOWNLOADING,
     PEER_STATE_DEAD,
     PEER_STATE_INCOMING_HANDSHAKE
 } PeerConnectionState;
 
+#define MAX_QUEUED_UPLOADS 64
+
+typedef struct {
+    uint32_t index;
+    uint32_t begin;
+    uint32_t length;
+} BlockRequest;
+
 typedef struct {
     int sockfd;
     PeerConnectionState state;
     bool *inventory;
+    // pieces in the inventory, and how many of them we miss; we are interested in the peer while any are
+    size_t pieces_have;
+    size_t pieces_wanted;
+    bool am_interested;
     int current_piece_assigned;
     uint32_t current_block_offset;
     unsigned char *piece_buffer;
+    SendQueue out;
+
+    // index in the torrent's peer store, -1 when the connection has none
+    int record;
+    // the BitTorrent handshake went through, a connection closed before that counts as a failed dial
+    bool established;
+    // we dialed the peer, so it is known to accept connections
+    bool outgoing;
+    // from the peer's handshake, set once established
+    uint8_t peer_id[20];
+    // the peer set the extension protocol bit in its handshake (BEP 10)
+    bool extensions;
+    // the peer runs a DHT node (BEP 5) and is sent our DHT port
+    bool dht;
+    // the peer set the fast extension bit in its handshake (BEP 6)
+    bool fast;
+    // pieces the peer lets us fetch while it chokes us, and the ones it suggested to us
+    uint32_t allowed_fast[FAST_MAX_PIECES];
+    int allowed_fast_count;
+    uint32_t suggested[FAST_MAX_PIECES];
+    int suggested_count;
+    // pieces we serve the peer while we choke it
+    uint32_t granted_fast[ALLOWED_FAST_COUNT];
+    int granted_fast_count;
+    // the peer's id for ut_pex; pex is allocated once its extension handshake offers it
+    uint8_t ut_pex_id;
+    PexState *pex;
+    // the peer's id for ut_metadata and the size of the info dictionary it offers, 0 when it has none to give
+    uint8_t ut_metadata_id;
+    size_t metadata_size;
+    // payload moved over this connection, booked on the peer's record when it closes
+    uint64_t downloaded;
+    uint64_t uploaded;
+
+    bool am_choking;
+    bool peer_interested;
+    uint64_t connected_at_ms;
+    // payload bytes in each direction, the choker ranks peers by these
+    RateWindow download_rate;
+    RateWindow upload_rate;
+
+    // a block request held back by the download rate limit
+    bool request_deferred;
+    BlockRequest deferred_request;
+    // when the block request we have out was sent, and how many requests in a row the peer let time out. A
+    // snubbed peer is not asked for pieces until its request timer gives it another try.
+    uint64_t request_sent_ms;
+    int request_timeouts;
+    bool snubbed;
+    // traffic in either direction, for keep-alives and idle disconnects
+    uint64_t last_sent_ms;
+    uint64_t last_received_ms;
+    Timer request_timer;
+    Timer keepalive_timer;
+    Timer idle_timer;
+    Timer connect_timer;
+    // requests the peer made that wait for upload bandwidth, served in order
+    BlockRequest upload_queue[MAX_QUEUED_UPLOADS];
+    int upload_queue_head;
+    int upload_queue_count;
 } PeerConnection;
 
 typedef enum {
@@ -32,4 +112,15 @@ typedef enum {
     PIECE_DONE = 2
 } PieceState;
 
-void start_swarm(TorrentEntry *e, const unsigned char *peers_list, size_t peers_count, const unsigned char *pieces_hashes, const EndFile *end_files, int num_files);
\ No newline at end of file
+// opens the torrent's listening socket on the first free port from 6881, -1 on failure
+int swarm_listen(int *out_port);
+
+// runs the torrent's peer connections on server_fd until it is stopped or fails; peers are taken from store and
+// from the entry's announce inbox as they arrive. Closes server_fd. The store stays the caller's.
+void start_swarm(TorrentEntry *e, int server_fd, PeerStore *store, const unsigned char *pieces_hashes,
+                 const EndFile *end_files, int num_files);
+
+// fetches the info dictionary of a magnet link over ut_metadata (BEP 9), from several peers at once, and checks
+// it against the info hash. Returns it in a malloc'd buffer, NULL when the torrent was stopped or failed first.
+// The peers met on the way stay in store for the swarm.
+unsigned char *swarm_fetch_metadata(TorrentEntry *e, int server_fd, PeerStore *store, size_t *out_len);
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include "timer_wheel.h"
+
+#include <stddef.h>
+
+#define TW_SLOT_MASK (TW_LEVEL_SLOTS - 1)
+// the overflow list is sorted out again every time the top level comes round
+#define TW_WHEEL_BITS (TW_LEVEL_BITS * TW_LEVELS)
+
+static void init_list(Timer *head) {
+    head->next = head->prev = head;
+}
+
+static void link_timer(TimerWheel *w, Timer *t) {
+    // a deadline behind the cursor goes in the slot that is looked at next
+    const uint64_t tick = t->deadline_ms > w->current_tick ? t->deadline_ms : w->current_tick;
+    const uint64_t delta = tick - w->current_tick;
+    int level = 0;
+    while (level < TW_LEVELS && delta >> (TW_LEVEL_BITS * (level + 1))) level++;
+
+    Timer *head = &w->overflow;
+    t->slot = 0;
+    if (level < TW_LEVELS) {
+        t->slot = (tick >> (TW_LEVEL_BITS * level)) & TW_SLOT_MASK;
+        head = &w->slots[level][t->slot];
+        w->occupied[level] |= 1ULL << t->slot;
+    }
+    t->level = level;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_timer(TimerWheel *w, Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if (t->level < TW_LEVELS) {
+        const Timer *head = &w->slots[t->level][t->slot];
+        if (head->next == head) w->occupied[t->level] &= ~(1ULL << t->slot);
+    }
+    t->next = t->prev = NULL;
+    t->armed = false;
+}
+
+// The slot of the level the cursor reaches first. The current slot of level 0 still counts; that of a higher
+// level was emptied when the cursor entered it and only holds timers for its next turn.
+static int first_slot(const TimerWheel *w, const int level) {
+    const uint64_t bits = w->occupied[level];
+    if (!bits) return -1;
+    const int index = (int) ((w->current_tick >> (TW_LEVEL_BITS * level)) & TW_SLOT_MASK);
+    const int from = level == 0 ? index : index + 1;
+    const uint64_t ahead = from == TW_LEVEL_SLOTS ? 0 : bits & (~0ULL << from);
+    return __builtin_ctzll(ahead ? ahead : bits);
+}
+
+// the tick the cursor reaches the slot at, for level 0 the deadline of its timers
+static uint64_t slot_start(const TimerWheel *w, const int level, const int slot) {
+    const int shift = TW_LEVEL_BITS * level;
+    const uint64_t block = w->current_tick >> shift;
+    const int index = (int) (block & TW_SLOT_MASK);
+    const int from = level == 0 ? index : index + 1;
+    return (block - index + slot + (slot < from ? TW_LEVEL_SLOTS : 0)) << shift;
+}
+
+// the first tick from the cursor on at which a timer is due or an occupied slot moves down a level
+static uint64_t next_event_tick(const TimerWheel *w) {
+    uint64_t next = TW_NO_DEADLINE;
+    for (int level = 0; level < TW_LEVELS; level++) {
+        const int slot = first_slot(w, level);
+        if (slot == -1) continue;
+        const uint64_t start = slot_start(w, level, slot);
+        if (start < next) next = start;
+    }
+    if (w->overflow.next != &w->overflow) {
+        const uint64_t turn = ((w->current_tick >> TW_WHEEL_BITS) + 1) << TW_WHEEL_BITS;
+        if (turn < next) next = turn;
+    }
+    return next;
+}
+
+static void relink_list(TimerWheel *w, Timer *head) {
+    Timer *t = head->next;
+    init_list(head);
+    while (t != head) {
+        Timer *next = t->next;
+        link_timer(w, t);
+        t = next;
+    }
+}
+
+// moves the cursor to tick; the slots whose turn starts there are spread over the levels below
+static void advance(TimerWheel *w, const uint64_t tick) {
+    w->current_tick = tick;
+    for (int level = 1; level < TW_LEVELS; level++) {
+        const int shift = TW_LEVEL_BITS * level;
+        if (tick & ((1ULL << shift) - 1)) return;
+        const int slot = (int) ((tick >> shift) & TW_SLOT_MASK);
+        w->occupied[level] &= ~(1ULL << slot);
+        relink_list(w, &w->slots[level][slot]);
+    }
+    if (!(tick & ((1ULL << TW_WHEEL_BITS) - 1))) relink_list(w, &w->overflow);
+}
+
+void tw_init(TimerWheel *w, const uint64_t now_ms) {
+    for (int level = 0; level < TW_LEVELS; level++) {
+        for (int slot = 0; slot < TW_LEVEL_SLOTS; slot++) init_list(&w->slots[level][slot]);
+        w->occupied[level] = 0;
+    }
+    init_list(&w->overflow);
+    w->current_tick = now_ms;
+    w->count = 0;
+}
+
+void tw_timer_init(Timer *t, const int kind, const int owner) {
+    t->next = t->prev = NULL;
+    t->deadline_ms = 0;
+    t->kind = kind;
+    t->owner = owner;
+    t->level = 0;
+    t->slot = 0;
+    t->armed = false;
+}
+
+void tw_schedule(TimerWheel *w, Timer *t, const uint64_t deadline_ms) {
+    tw_cancel(w, t);
+    t->deadline_ms = deadline_ms;
+    link_timer(w, t);
+    t->armed = true;
+    w->count++;
+}
+
+void tw_cancel(TimerWheel *w, Timer *t) {
+    if (!t->armed) return;
+    unlink_timer(w, t);
+    w->count--;
+}
+
+Timer *tw_pop_expired(TimerWheel *w, const uint64_t now_ms) {
+    while (w->current_tick <= now_ms) {
+        Timer *head = &w->slots[0][w->current_tick & TW_SLOT_MASK];
+        if (head->next != head) {
+            Timer *t = head->next;
+            unlink_timer(w, t);
+            w->count--;
+            return t;
+        }
+        // stretches without timers are skipped in one step
+        const uint64_t next = next_event_tick(w);
+        if (next > now_ms) {
+            if (now_ms > w->current_tick) advance(w, now_ms);
+            break;
+        }
+        advance(w, next);
+    }
+    return NULL;
+}
+
+uint64_t tw_next_deadline(const TimerWheel *w) {
+    return next_event_tick(w);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// deadlines are kept to the millisecond, one tick of the wheel is one of them
+#define TW_LEVELS 4
+#define TW_LEVEL_BITS 6
+#define TW_LEVEL_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_NO_DEADLINE UINT64_MAX
+
+// A timer embedded in whatever it times. kind and owner tell the wheel's owner what fired.
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t deadline_ms;
+    int kind;
+    int owner;
+    // where the timer sits on the wheel, level TW_LEVELS being the overflow list
+    uint8_t level;
+    uint8_t slot;
+    bool armed;
+} Timer;
+
+// Hierarchical timer wheel. Level 0 has a slot per tick for the next 64 ms, every further level has slots 64 times
+// as wide, up to about 4.6 hours; later deadlines wait in an overflow list. Timers move down a level whenever
+// the wheel reaches the start of their slot, so each one is touched at most once per level. Scheduling and
+// cancelling are O(1), expiry skips empty stretches through the occupancy bitmaps. Not thread safe, owned by
+// the loop that expires it.
+typedef struct {
+    Timer slots[TW_LEVELS][TW_LEVEL_SLOTS];
+    // bit s is set while slot s of the level holds timers
+    uint64_t occupied[TW_LEVELS];
+    Timer overflow;
+    // the tick expiry has got to; everything before it has fired
+    uint64_t current_tick;
+    int count;
+} TimerWheel;
+
+void tw_init(TimerWheel *w, uint64_t now_ms);
+
+void tw_timer_init(Timer *t, int kind, int owner);
+
+// arms t for deadline_ms, moving it if it is armed already; a deadline in the past fires on the next expiry
+void tw_schedule(TimerWheel *w, Timer *t, uint64_t deadline_ms);
+
+void tw_cancel(TimerWheel *w, Timer *t);
+
+// takes the next timer due by now_ms off the wheel, NULL when none is. Handlers may schedule and cancel any
+// timer, the popped one included, between calls.
+Timer *tw_pop_expired(TimerWheel *w, uint64_t now_ms);
+
+// when tw_pop_expired next has work: the earliest deadline, or before it the tick that deadline's timer moves
+// down a level at, which costs at most one early wake-up per level. TW_NO_DEADLINE when the wheel is empty.
+uint64_t tw_next_deadline(const TimerWheel *w);
@@ -0,0 +1,161 @@
+// Offline check of the DHT: a swarm of DHT nodes on loopback bootstraps from one of them, a torrent announced
+// by one node is found by another, and a node started from a saved state finds it without any bootstrap host.
+// Exits non-zero when a step fails.
+#include "dht.h"
+#include "dht_table.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_NODES 40
+#define SIM_WAIT_MS 10000
+#define SIM_ANNOUNCER 5
+#define SIM_SEEKER 30
+// owner of the node started from a saved state
+#define SIM_RESTORED SIM_NODES
+#define SIM_PORT_BASE 10000
+
+static pthread_mutex_t found_lock = PTHREAD_MUTEX_INITIALIZER;
+// set once the node was handed the announcer's peer
+static bool found_announcer[SIM_NODES + 1];
+
+static void on_peers(void *owner, const unsigned char *peers, const size_t len, const int family) {
+    const int index = (int) (intptr_t) owner;
+    if (family != AF_INET) return;
+    pthread_mutex_lock(&found_lock);
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t port;
+        memcpy(&port, peers + i + 4, 2);
+        if (ntohs(port) == SIM_PORT_BASE + SIM_ANNOUNCER) found_announcer[index] = true;
+    }
+    pthread_mutex_unlock(&found_lock);
+}
+
+static int announce_port(void *owner) {
+    return SIM_PORT_BASE + (int) (intptr_t) owner;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool found(const int index) {
+    pthread_mutex_lock(&found_lock);
+    const bool result = found_announcer[index];
+    pthread_mutex_unlock(&found_lock);
+    return result;
+}
+
+// waits up to SIM_WAIT_MS for node index to hear of the announcer
+static bool wait_found(const int index) {
+    const uint64_t deadline = now_ms() + SIM_WAIT_MS;
+    while (now_ms() < deadline) {
+        if (found(index)) return true;
+        usleep(50000);
+    }
+    return false;
+}
+
+static bool wait_good_nodes(Dht *const *nodes, const int count, const int min_good) {
+    const uint64_t deadline = now_ms() + SIM_WAIT_MS;
+    while (now_ms() < deadline) {
+        bool all = true;
+        for (int i = 0; i < count && all; i++) {
+            int total, good;
+            dht_node_counts(nodes[i], &total, &good);
+            all = good >= min_good;
+        }
+        if (all) return true;
+        usleep(50000);
+    }
+    return false;
+}
+
+static bool check(const bool ok, const char *what) {
+    printf("[%s] %s\n", ok ? "PASS" : "FAIL", what);
+    return ok;
+}
+
+// the XOR metric and bucket placement of the routing table
+static bool check_table(void) {
+    uint8_t self[20] = {0};
+    DhtTable table;
+    dht_table_init(&table, self);
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < 64; i++) {
+        uint8_t id[20] = {0};
+        id[0] = (uint8_t) (0x80 >> (i % 8));
+        id[19] = (uint8_t) i;
+        addr.sin_port = htons((uint16_t) (20000 + i));
+        dht_table_heard(&table, id, (struct sockaddr *) &addr, sizeof addr, 1);
+    }
+
+    DhtNode closest[DHT_K];
+    const int n = dht_table_closest(&table, self, AF_INET, closest, DHT_K);
+    bool sorted = n == DHT_K;
+    for (int i = 1; i < n && sorted; i++) sorted = dht_distance_cmp(self, closest[i - 1].id, closest[i].id) < 0;
+
+    uint8_t far[20] = {0x80};
+    return check(dht_common_prefix(self, far) == 0 && dht_common_prefix(self, self) == DHT_ID_BITS,
+                 "common prefix lengths") &
+           check(dht_table_count(&table) == 8 * DHT_K, "one full bucket per prefix length") &
+           check(sorted, "closest nodes come in XOR order");
+}
+
+int main(void) {
+    bool ok = check_table();
+
+    const DhtCallbacks callbacks = {.on_peers = on_peers, .announce_port = announce_port};
+    Dht *nodes[SIM_NODES];
+    for (int i = 0; i < SIM_NODES; i++) {
+        nodes[i] = dht_create(&callbacks, 0);
+        if (!nodes[i]) {
+            printf("[FAIL] no UDP socket for node %d\n", i);
+            return 1;
+        }
+    }
+    char bootstrap_port[16];
+    snprintf(bootstrap_port, sizeof bootstrap_port, "%d", dht_port(nodes[0]));
+    for (int i = 1; i < SIM_NODES; i++) dht_add_bootstrap(nodes[i], "127.0.0.1", bootstrap_port);
+    ok &= check(wait_good_nodes(nodes, SIM_NODES, DHT_K), "every node bootstraps to a full bucket of good nodes");
+
+    uint8_t info_hash[20];
+    for (int i = 0; i < 20; i++) info_hash[i] = (uint8_t) (i * 37 + 11);
+    dht_add_torrent(nodes[SIM_ANNOUNCER], (void *) (intptr_t) SIM_ANNOUNCER, info_hash);
+    dht_set_active(nodes[SIM_ANNOUNCER], (void *) (intptr_t) SIM_ANNOUNCER, true);
+    // the announcer's lookup ends with announce_peer to the closest nodes
+    usleep(2000000);
+    dht_add_torrent(nodes[SIM_SEEKER], (void *) (intptr_t) SIM_SEEKER, info_hash);
+    dht_set_active(nodes[SIM_SEEKER], (void *) (intptr_t) SIM_SEEKER, true);
+    ok &= check(wait_found(SIM_SEEKER), "get_peers finds the peer of announce_peer");
+
+    size_t state_len;
+    unsigned char *state = dht_save_state(nodes[SIM_SEEKER], &state_len);
+    Dht *restored = dht_create(&callbacks, 0);
+    const bool loaded = restored && state && dht_load_state(restored, state, state_len);
+    free(state);
+    ok &= check(loaded, "a saved state loads into a fresh node");
+    if (loaded) {
+        dht_add_torrent(restored, (void *) (intptr_t) SIM_RESTORED, info_hash);
+        dht_set_active(restored, (void *) (intptr_t) SIM_RESTORED, true);
+        ok &= check(wait_found(SIM_RESTORED), "a node bootstrapped from its saved state finds the peer");
+        dht_remove_torrent(restored, (void *) (intptr_t) SIM_RESTORED);
+    }
+    if (restored) dht_destroy(restored);
+
+    for (int i = 0; i < SIM_NODES; i++) {
+        dht_remove_torrent(nodes[i], (void *) (intptr_t) i);
+        dht_destroy(nodes[i]);
+    }
+    return ok ? 0 : 1;
+}
@@ -1,212 +1,492 @@
 #include "torrent_session.h"
 #include "bencode_parser.h"
 #include "bencoder.h"
-#include "announce_connector.h"
+#include "announce_engine.h"
+#include "dht.h"
 #include "handshake.h"
 #include "helpers.h"
+#include "magnet.h"
 #include "swarm.h"
 #include "file_saver.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <openssl/sha.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+static void *scheduler_thread(void *arg);
+
+static void on_announce(void *owner, const AnnounceResult *r);
+
+static void fill_announce_totals(void *owner, AnnounceParams *params);
+
+static void on_swarm_size(void *owner, int seeders, int leechers);
+
+static void on_dht_peers(void *owner, const unsigned char *peers, size_t len, int family);
+
+static int dht_announce_port(void *owner);
+
+// $XDG_CACHE_HOME/rgTorrent/metadata, falling back to ~/.cache; empty when neither is set
+static void default_metadata_cache_dir(char *out, const size_t size) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache_home && cache_home[0] == '/') snprintf(out, size, "%s/rgTorrent/metadata", cache_home);
+    else if (home && home[0]) snprintf(out, size, "%s/.cache/rgTorrent/metadata", home);
+    else out[0] = '\0';
+}
+
+// well-known nodes a DHT without a saved routing table starts from
+static const char *const dht_routers[][2] = {
+    {"router.bittorrent.com", "6881"},
+    {"dht.transmissionbt.com", "6881"},
+    {"router.utorrent.com", "6881"},
+};
 
 TorrentSession *ts_create(void) {
     TorrentSession *s = calloc(1, sizeof(TorrentSession));
     pthread_mutex_init(&s->lock, NULL);
-    s->next_id = 1;
+    tb_init(&s->upload_limit);
+    tb_init(&s->download_limit);
+    if (!eq_init(&s->events, TS_EVENT_QUEUE_SIZE)) {
+        fprintf(stderr, "[ERROR] Could not create the session event queue\n");
+        tb_destroy(&s->upload_limit);
+        tb_destroy(&s->download_limit);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return NULL;
+    }
+    const AnnounceCallbacks callbacks = {
+        .on_result = on_announce,
+        .fill_totals = fill_announce_totals,
+        .on_swarm_size = on_swarm_size,
+    };
+    s->announcer = ae_create(&callbacks);
+    if (!s->announcer) {
+        fprintf(stderr, "[ERROR] Could not start the announce engine\n");
+        eq_destroy(&s->events);
+        tb_destroy(&s->upload_limit);
+        tb_destroy(&s->download_limit);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return NULL;
+    }
+    const DhtCallbacks dht_callbacks = {
+        .on_peers = on_dht_peers,
+        .announce_port = dht_announce_port,
+    };
+    // without a DHT the session still runs off its trackers
+    s->dht = dht_create(&dht_callbacks, DHT_DEFAULT_PORT);
+    if (s->dht) {
+        for (size_t i = 0; i < sizeof dht_routers / sizeof dht_routers[0]; i++) {
+            dht_add_bootstrap(s->dht, dht_routers[i][0], dht_routers[i][1]);
+        }
+    } else {
+        fprintf(stderr, "[ERROR] Could not start the DHT node\n");
+    }
+    default_metadata_cache_dir(s->metadata_cache_dir, sizeof s->metadata_cache_dir);
+    s->free_slot = -1;
+
+    s->max_active_downloads = TS_DEFAULT_ACTIVE_DOWNLOADS;
+    s->max_active_seeds = TS_DEFAULT_ACTIVE_SEEDS;
+    s->max_connections = TS_DEFAULT_MAX_CONNECTIONS;
+    s->max_half_open = TS_DEFAULT_MAX_HALF_OPEN;
+    s->skip_inactive = true;
+    pthread_mutex_init(&s->scheduler_lock, NULL);
+    pthread_cond_init(&s->scheduler_cond, NULL);
+    pthread_create(&s->scheduler, NULL, scheduler_thread, s);
     return s;
 }
 
-#define MAX_TRACKERS 30
+// caller holds s->lock
+static TorrentEntry *find_entry(const TorrentSession *s, const int id) {
+    if (id <= 0) return NULL;
+    const int slot = id & ((1 << TS_SLOT_BITS) - 1);
+    const int generation = id >> TS_SLOT_BITS;
+    if (slot >= s->slot_count || s->slots[slot].generation != generation) return NULL;
+    return s->slots[slot].entry;
+}
 
-typedef struct {
-    char url[256];
-    UdpAnnounceRequest req;
-    char *result_peers;
-    size_t result_len;
-    int seeders;
-    int leechers;
-    pthread_t thread;
-} TrackerJob;
-
-static void *tracker_worker_thread(void *arg) {
-    TrackerJob *job = arg;
-    job->req.announce_address = job->url;
-    job->result_peers = get_peers_list(&job->req, &job->result_len, &job->seeders, &job->leechers);
-    return NULL;
+// caller holds s->lock; returns the new id or -1
+static int claim_slot(TorrentSession *s, TorrentEntry *e) {
+    int slot = s->free_slot;
+    if (slot != -1) {
+        s->free_slot = s->slots[slot].next_free;
+    } else {
+        if (s->slot_count == 1 << TS_SLOT_BITS) return -1;
+        if (s->slot_count == s->slot_capacity) {
+            const int capacity = s->slot_capacity ? s->slot_capacity * 2 : 16;
+            TsSlot *grown = realloc(s->slots, capacity * sizeof(TsSlot));
+            if (!grown) return -1;
+            s->slots = grown;
+            s->slot_capacity = capacity;
+        }
+        slot = s->slot_count++;
+        s->slots[slot].generation = 0;
+    }
+
+    s->slots[slot].generation = s->slots[slot].generation % TS_MAX_GENERATION + 1;
+    s->slots[slot].entry = e;
+    s->slots[slot].next_free = -1;
+    return s->slots[slot].generation << TS_SLOT_BITS | slot;
+}
+
+static void release_slot(TorrentSession *s, const int id) {
+    const int slot = id & ((1 << TS_SLOT_BITS) - 1);
+    s->slots[slot].entry = NULL;
+    s->slots[slot].next_free = s->free_slot;
+    s->free_slot = slot;
+}
+
+bool ts_entry_stopping(const TorrentEntry *e) {
+    return __atomic_load_n(&e->stop_requested, __ATOMIC_ACQUIRE);
+}
+
+static void wake_entry(const TorrentEntry *e) {
+    const uint64_t one = 1;
+    write(e->wake_fd, &one, sizeof one);
+}
+
+static void free_entry(TorrentEntry *e) {
+    if (e->metadata) freeBencodeNode(e->metadata);
+    close(e->wake_fd);
+    pthread_mutex_destroy(&e->lock);
+    tb_destroy(&e->upload_limit);
+    tb_destroy(&e->download_limit);
+    free(e->piece_states);
+    free(e->availability);
+    free(e->info_bytes);
+    free(e->peer_inbox);
+    free(e->peer6_inbox);
+    free(e);
 }
 
 void ts_destroy(TorrentSession *s) {
-    // TODO: signal threads to stop, then join them
+    pthread_mutex_lock(&s->scheduler_lock);
+    s->scheduler_stop = true;
+    pthread_cond_signal(&s->scheduler_cond);
+    pthread_mutex_unlock(&s->scheduler_lock);
+    pthread_join(s->scheduler, NULL);
+
+    // every torrent is told to stop first so they all wind down in parallel
+    for (int i = 0; i < s->count; i++) {
+        __atomic_store_n(&s->order[i]->stop_requested, true, __ATOMIC_RELEASE);
+        wake_entry(s->order[i]);
+    }
+    for (int i = 0; i < s->count; i++) {
+        if (s->order[i]->thread_running) pthread_join(s->order[i]->thread, NULL);
+        ae_remove_torrent(s->announcer, s->order[i]);
+        if (s->dht) dht_remove_torrent(s->dht, s->order[i]);
+    }
+    // no announce callback can reach an entry once the engine is gone
+    ae_destroy(s->announcer);
+    if (s->dht) dht_destroy(s->dht);
+    // torrent, announce and DHT threads ask for a schedule until they are gone, which is a no-op after the stop
+    pthread_cond_destroy(&s->scheduler_cond);
+    pthread_mutex_destroy(&s->scheduler_lock);
+    for (int i = 0; i < s->count; i++) free_entry(s->order[i]);
+    free(s->order);
+    free(s->slots);
+    tb_destroy(&s->upload_limit);
+    tb_destroy(&s->download_limit);
+    eq_destroy(&s->events);
     pthread_mutex_destroy(&s->lock);
     free(s);
 }
 
 typedef struct {
-    TorrentSession *session;
-    int entry_index;
+    TorrentEntry *entry;
     BencodeNode *root;
 } ThreadArgs;
 
-static void *download_thread(void *arg) {
-    ThreadArgs *targs = arg;
-    TorrentSession *s = targs->session;
-    const int idx = targs->entry_index;
-    BencodeNode *root = targs->root;
-    free(targs);
-
-    TorrentEntry *e = &s->entries[idx];
-
-    if (!root) {
-        pthread_mutex_lock(&e->lock);
-        e->status = TS_STATUS_ERROR;
-        pthread_mutex_unlock(&e->lock);
-        return NULL;
-    }
+static void set_error(TorrentEntry *e) {
+    ts_entry_begin_update(e);
+    e->status = TS_STATUS_ERROR;
+    ts_entry_end_update(e);
+    ts_post_event(e->session, TS_EVENT_ERROR, e->id, 0);
+    ts_request_schedule(e->session);
+    wake_entry(e);
+}
 
-    BencodeNode *infoNode = getDictValue(root, "info");
-    if (!infoNode) {
-        pthread_mutex_lock(&e->lock);
-        e->status = TS_STATUS_ERROR;
-        pthread_mutex_unlock(&e->lock);
-        freeBencodeNode(root);
-        return NULL;
+// caller holds e->lock; a trailing partial entry is dropped
+static void append_peers(unsigned char **inbox, size_t *inbox_len, const unsigned char *peers, const size_t len,
+                         const size_t entry_len) {
+    const size_t usable = len - len % entry_len;
+    unsigned char *grown = usable ? realloc(*inbox, *inbox_len + usable) : NULL;
+    if (grown) {
+        memcpy(grown + *inbox_len, peers, usable);
+        *inbox = grown;
+        *inbox_len += usable;
     }
+}
 
-    BencodeNode *pieces_node = getDictValue(infoNode, "pieces");
-    BencodeNode *piece_length_node = getDictValue(infoNode, "piece length");
+// runs on the announce engine thread
+static void on_announce(void *owner, const AnnounceResult *r) {
+    TorrentEntry *e = owner;
 
-    if (!pieces_node || pieces_node->type != BEN_STR ||
-        pieces_node->string.length == 0 ||
-        !piece_length_node || piece_length_node->type != BEN_INT) {
-        pthread_mutex_lock(&e->lock);
-        e->status = TS_STATUS_ERROR;
-        pthread_mutex_unlock(&e->lock);
-        freeBencodeNode(root);
-        return NULL;
+    ts_entry_begin_update(e);
+    if (r->ok) {
+        append_peers(&e->peer_inbox, &e->peer_inbox_len, r->peers, r->peers_len, 6);
+        append_peers(&e->peer6_inbox, &e->peer6_inbox_len, r->peers6, r->peers6_len, 18);
+    }
+    ts_entry_end_update(e);
+
+    if (r->ok) {
+        ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+        wake_entry(e);
+    } else if (r->all_failed && __atomic_load_n(&e->use_dht, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "[INFO] ALL trackers failed for %s, looking for peers on the DHT only\n", e->name);
+    } else if (r->all_failed) {
+        fprintf(stderr, "[INFO] ALL trackers failed for %s\n", e->name);
+        set_error(e);
     }
+}
 
-    const size_t total_pieces = pieces_node->string.length / SHA_DIGEST_LENGTH;
-    const size_t piece_length = piece_length_node->intValue;
+// runs on the DHT thread
+static void on_dht_peers(void *owner, const unsigned char *peers, const size_t len, const int family) {
+    TorrentEntry *e = owner;
 
     pthread_mutex_lock(&e->lock);
-    e->total_pieces = total_pieces;
-    e->piece_length = piece_length;
+    if (family == AF_INET6) append_peers(&e->peer6_inbox, &e->peer6_inbox_len, peers, len, 18);
+    else append_peers(&e->peer_inbox, &e->peer_inbox_len, peers, len, 6);
+    pthread_mutex_unlock(&e->lock);
 
-    e->piece_states = calloc(total_pieces, sizeof(uint8_t));
-    e->pieces_completed = 0;
+    ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+    wake_entry(e);
+}
+
+// runs on the DHT thread
+static int dht_announce_port(void *owner) {
+    TorrentEntry *e = owner;
+    pthread_mutex_lock(&e->lock);
+    const int port = e->listen_port;
     pthread_mutex_unlock(&e->lock);
+    return port;
+}
 
-    {
-        FILE *f = fopen(e->torrent_path, "rb");
-        if (!f) {
-            pthread_mutex_lock(&e->lock);
-            e->status = TS_STATUS_ERROR;
-            pthread_mutex_unlock(&e->lock);
-            freeBencodeNode(root);
-            return NULL;
-        }
-        const long info_len = infoNode->endOffset - infoNode->startOffset;
-        char *info_buf = malloc(info_len);
-        fseek(f, infoNode->startOffset, SEEK_SET);
-        fread(info_buf, info_len, 1, f);
-        fclose(f);
-        SHA1((unsigned char *) info_buf, info_len, e->info_hash);
-        free(info_buf);
-    }
+// runs on the announce engine thread
+static void on_swarm_size(void *owner, const int seeders, const int leechers) {
+    TorrentEntry *e = owner;
 
-    const BencodeNode *announceNode = getDictValue(root, "announce");
+    ts_entry_begin_update(e);
+    const bool changed = seeders != e->total_seeds || leechers != e->total_peers;
+    e->total_seeds = seeders;
+    e->total_peers = leechers;
+    ts_entry_end_update(e);
 
-    UdpAnnounceRequest req = {
-        .announce_address = announceNode ? announceNode->string.data : NULL,
-        .info_hash = e->info_hash,
-        .peer_id = e->peer_id,
-        .port = 6881,
-        .uploaded = 0,
-        .downloaded = 0,
-        .left = (long) e->size_bytes,
-    };
+    if (changed) ts_post_event(e->session, TS_EVENT_PEERS_CHANGED, e->id, 0);
+}
 
-    TrackerJob jobs[MAX_TRACKERS];
-    int job_count = 0;
+// runs on the announce engine thread, right before each announce
+static void fill_announce_totals(void *owner, AnnounceParams *params) {
+    TorrentEntry *e = owner;
+    params->downloaded = stat_load(&e->stats.downloaded);
+    params->uploaded = stat_load(&e->stats.uploaded);
 
-    if (announceNode && announceNode->type == BEN_STR) {
-        snprintf(jobs[job_count].url, sizeof(jobs[0].url), "%.*s",
-                 (int) announceNode->string.length, announceNode->string.data);
-        jobs[job_count].req = req;
-        jobs[job_count].result_peers = NULL;
-        job_count++;
-    }
+    pthread_mutex_lock(&e->lock);
+    params->port = e->listen_port;
+    const uint64_t have = (uint64_t) e->pieces_completed * e->piece_length;
+    const bool complete = e->verified && e->pieces_completed == e->total_pieces;
+    const bool needs_metadata = e->needs_metadata;
+    const uint64_t size = e->size_bytes;
+    pthread_mutex_unlock(&e->lock);
+    // only the last piece can be short, so this is exact once the torrent is complete
+    params->left = complete || have >= size ? 0 : size - have;
+    // a magnet link does not know its size yet, anything but 0 keeps the trackers from taking it for a seed
+    if (needs_metadata) params->left = 1;
+}
 
-    const BencodeNode *ann_list = getDictValue(root, "announce-list");
-    if (ann_list && ann_list->type == BEN_LIST) {
-        for (size_t i = 0; i < ann_list->list.length && job_count < MAX_TRACKERS; i++) {
-            const BencodeNode *tier = ann_list->list.items[i];
-            if (!tier || tier->type != BEN_LIST) continue;
-            for (size_t j = 0; j < tier->list.length && job_count < MAX_TRACKERS; j++) {
-                const BencodeNode *url_node = tier->list.items[j];
-                if (!url_node || url_node->type != BEN_STR) continue;
+void ts_entry_set_announcing(TorrentEntry *e, const bool active) {
+    ae_set_active(e->session->announcer, e, active);
+    if (e->use_dht) dht_set_active(e->session->dht, e, active);
+}
 
-                snprintf(jobs[job_count].url, sizeof(jobs[0].url), "%.*s",
-                         (int) url_node->string.length, url_node->string.data);
-                jobs[job_count].req = req;
-                jobs[job_count].result_peers = NULL;
-                job_count++;
+void ts_entry_announce_completed(TorrentEntry *e) {
+    ae_announce_completed(e->session->announcer, e);
+}
+
+void ts_entry_request_peers(TorrentEntry *e) {
+    ae_request_peers(e->session->announcer, e);
+    if (e->use_dht) dht_request_peers(e->session->dht, e);
+}
+
+unsigned char *ts_entry_take_peers(TorrentEntry *e, const int family, size_t *out_len) {
+    unsigned char **inbox = family == AF_INET6 ? &e->peer6_inbox : &e->peer_inbox;
+    size_t *inbox_len = family == AF_INET6 ? &e->peer6_inbox_len : &e->peer_inbox_len;
+    pthread_mutex_lock(&e->lock);
+    unsigned char *peers = *inbox;
+    *out_len = *inbox_len;
+    *inbox = NULL;
+    *inbox_len = 0;
+    pthread_mutex_unlock(&e->lock);
+    return peers;
+}
+
+// name and total size from the info dictionary
+static void describe_torrent(TorrentEntry *e, const BencodeNode *info) {
+    const BencodeNode *nameNode = getDictValue(info, "name");
+    if (nameNode && nameNode->type == BEN_STR)
+        snprintf(e->name, sizeof e->name, "%.*s",
+                 (int) nameNode->string.length,
+                 nameNode->string.data);
+
+    const BencodeNode *lenNode = getDictValue(info, "length");
+    if (lenNode && lenNode->type == BEN_INT) {
+        e->size_bytes = (uint64_t) lenNode->intValue;
+    } else {
+        const BencodeNode *files_list = getDictValue(info, "files");
+        if (files_list && files_list->type == BEN_LIST) {
+            uint64_t total_size = 0;
+            for (size_t i = 0; i < files_list->list.length; i++) {
+                const BencodeNode *file_dict = files_list->list.items[i];
+                const BencodeNode *flen = getDictValue(file_dict, "length");
+                if (flen && flen->type == BEN_INT) {
+                    total_size += flen->intValue;
+                }
             }
+            e->size_bytes = total_size;
         }
     }
+}
 
-    printf("[INFO] Spawning %d concurrent tracker requests...\n", job_count);
+// BEP 27: private torrents only get their peers from their trackers
+static bool is_private(const BencodeNode *info) {
+    const BencodeNode *private_node = getDictValue(info, "private");
+    return private_node && private_node->type == BEN_INT && private_node->intValue == 1;
+}
 
-    for (int i = 0; i < job_count; i++) {
-        pthread_create(&jobs[i].thread, NULL, tracker_worker_thread, &jobs[i]);
+// <cache dir>/<hex info hash>.torrent, false when the cache is off
+static bool metadata_cache_path(TorrentSession *s, const uint8_t info_hash[20], char *out, const size_t size) {
+    char hex[41];
+    for (int i = 0; i < 20; i++) sprintf(hex + 2 * i, "%02x", info_hash[i]);
+    pthread_mutex_lock(&s->lock);
+    const bool enabled = s->metadata_cache_dir[0] != '\0';
+    if (enabled) snprintf(out, size, "%s/%s.torrent", s->metadata_cache_dir, hex);
+    pthread_mutex_unlock(&s->lock);
+    return enabled;
+}
+
+// written under a temporary name first, a session that dies halfway leaves no torn file to be read back
+static void save_cached_metadata(TorrentSession *s, const uint8_t info_hash[20], const unsigned char *torrent,
+                                 const size_t len) {
+    char path[600], tmp_path[610];
+    if (!metadata_cache_path(s, info_hash, path, sizeof path)) return;
+    snprintf(tmp_path, sizeof tmp_path, "%s.part", path);
+    create_parent_directories(path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    bool ok = f && fwrite(torrent, 1, len, f) == len;
+    if (f && fclose(f) != 0) ok = false;
+    if (ok && rename(tmp_path, path) == 0) return;
+    fprintf(stderr, "[INFO] Could not cache the metadata in %s\n", path);
+    remove(tmp_path);
+}
+
+// fetches a magnet link's info dictionary from the swarm and caches it for the next time the link is added.
+// Returns it as the root of a .torrent, NULL when the torrent was stopped or failed first.
+static BencodeNode *fetch_metadata(TorrentEntry *e, const int server_fd, PeerStore *store) {
+    size_t info_len;
+    unsigned char *info = swarm_fetch_metadata(e, server_fd, store, &info_len);
+    if (!info) return NULL;
+
+    // wrapped into the smallest .torrent there is, which the cache keeps and the parser reads like any other
+    const size_t torrent_len = info_len + 8;
+    unsigned char *torrent = malloc(torrent_len);
+    if (!torrent) {
+        free(info);
+        return NULL;
     }
+    memcpy(torrent, "d4:info", 7);
+    memcpy(torrent + 7, info, info_len);
+    torrent[torrent_len - 1] = 'e';
 
-    char *peers = NULL;
-    size_t peers_len = 0;
+    BencodeContext ctx = {0};
+    ctx.file = fmemopen(torrent, torrent_len, "rb");
+    BencodeNode *root = ctx.file ? parseCollectionValue(&ctx) : NULL;
+    if (ctx.file) fclose(ctx.file);
+    if (root && ctx.hasError) {
+        freeBencodeNode(root);
+        root = NULL;
+    }
+    const BencodeNode *info_node = getDictValue(root, "info");
+    if (!info_node || info_node->type != BEN_DICT) {
+        fprintf(stderr, "[INFO] The metadata of %s is not a dictionary\n", e->name);
+        if (root) freeBencodeNode(root);
+        free(torrent);
+        free(info);
+        return NULL;
+    }
+    save_cached_metadata(e->session, e->info_hash, torrent, torrent_len);
+    free(torrent);
+
+    // served to the peers of the swarm from now on
+    e->info_bytes = info;
+    e->info_len = info_len;
+
+    ts_entry_begin_update(e);
+    describe_torrent(e, info_node);
+    e->needs_metadata = false;
+    if (e->status == TS_STATUS_FETCHING_METADATA) e->status = TS_STATUS_VERIFYING;
+    ts_entry_end_update(e);
+    ts_post_event(e->session, TS_EVENT_STATUS_CHANGED, e->id, 0);
+
+    // a private torrent leaves the DHT as soon as it is known to be one
+    e->private_torrent = is_private(info_node);
+    if (e->private_torrent && e->use_dht) {
+        dht_remove_torrent(e->session->dht, e);
+        __atomic_store_n(&e->use_dht, false, __ATOMIC_RELAXED);
+    }
+    printf("[INFO] Fetched the metadata of %s, %zu bytes\n", e->name, info_len);
+    return root;
+}
 
-    for (int i = 0; i < job_count; i++) {
-        pthread_join(jobs[i].thread, NULL);
-        if (jobs[i].result_peers) {
-            if (!peers) {
-                peers = jobs[i].result_peers;
-                peers_len = jobs[i].result_len;
+// checks the files against the piece hashes of root and then runs the swarm; takes over root and server_fd
+static void run_torrent(TorrentEntry *e, BencodeNode *root, const int server_fd, PeerStore *store) {
+    TorrentSession *s = e->session;
 
-                pthread_mutex_lock(&e->lock);
-                e->total_seeds = jobs[i].seeders;
-                e->total_peers = jobs[i].leechers;
-                pthread_mutex_unlock(&e->lock);
-            } else {
-                free(jobs[i].result_peers);
-            }
-        }
+    BencodeNode *infoNode = getDictValue(root, "info");
+    if (!infoNode) {
+        set_error(e);
+        close(server_fd);
+        freeBencodeNode(root);
+        return;
     }
 
-    if (!peers) {
-        fprintf(stderr, "[INFO] ALL trackers failed for %s\n", e->name);
-        pthread_mutex_lock(&e->lock);
-        e->status = TS_STATUS_ERROR;
-        pthread_mutex_unlock(&e->lock);
+    BencodeNode *pieces_node = getDictValue(infoNode, "pieces");
+    BencodeNode *piece_length_node = getDictValue(infoNode, "piece length");
+
+    if (!pieces_node || pieces_node->type != BEN_STR ||
+        pieces_node->string.length == 0 ||
+        !piece_length_node || piece_length_node->type != BEN_INT) {
+        set_error(e);
+        close(server_fd);
         freeBencodeNode(root);
-        return NULL;
+        return;
     }
 
-    printf("[INFO] Swarm located. Trying to establish connections.\n");
+    const size_t total_pieces = pieces_node->string.length / SHA_DIGEST_LENGTH;
+    const size_t piece_length = piece_length_node->intValue;
+
+    ts_entry_begin_update(e);
+    e->total_pieces = total_pieces;
+    e->piece_length = piece_length;
 
-    const size_t peers_count = peers_len / 6;
+    e->piece_states = calloc(total_pieces, sizeof(uint8_t));
+    e->availability = calloc(total_pieces, sizeof(uint16_t));
+    e->pieces_completed = 0;
+    ts_entry_end_update(e);
 
     size_t num_files = 0;
     EndFile *end_files = fill_target_files(infoNode, &num_files, e->save_path);
     if (!end_files) {
-        pthread_mutex_lock(&e->lock);
-        e->status = TS_STATUS_ERROR;
-        pthread_mutex_unlock(&e->lock);
-        free(peers);
+        set_error(e);
+        close(server_fd);
         freeBencodeNode(root);
-        return NULL;
+        return;
     }
 
     printf("[INFO] Verifying existing files for %s...\n", e->name);
@@ -215,7 +495,7 @@ static void *download_thread(void *arg) {
     unsigned char *verify_buffer = malloc(e->piece_length);
     int recovered_pieces = 0;
 
-    for (size_t p = 0; p < e->total_pieces; p++) {
+    for (size_t p = 0; p < e->total_pieces && !ts_entry_stopping(e); p++) {
         size_t current_piece_size = e->piece_length;
         if (p == e->total_pieces - 1) {
             const size_t rem = e->size_bytes % e->piece_length;
@@ -235,11 +515,20 @@ static void *download_thread(void *arg) {
     }
     free(verify_buffer);
 
-    pthread_mutex_lock(&e->lock);
+    if (ts_entry_stopping(e)) {
+        close(server_fd);
+        free(end_files);
+        freeBencodeNode(root);
+        return;
+    }
+
+    ts_entry_begin_update(e);
     e->pieces_completed = recovered_pieces;
     e->progress = (double) e->pieces_completed / (double) e->total_pieces;
+    e->verified = true;
 
-    if (e->status != TS_STATUS_PAUSED) {
+    // the torrent may have been paused or sent back to the queue meanwhile
+    if (e->status == TS_STATUS_VERIFYING) {
         if (e->pieces_completed == e->total_pieces) {
             e->status = TS_STATUS_SEEDING;
             e->seeding = true;
@@ -248,172 +537,672 @@ static void *download_thread(void *arg) {
         }
     }
 
-    pthread_mutex_unlock(&e->lock);
+    ts_entry_end_update(e);
+    ts_post_event(s, TS_EVENT_STATUS_CHANGED, e->id, 0);
+    // a complete torrent now needs a seed slot instead of a download slot
+    ts_request_schedule(s);
+    // the first announces went out before the check and reported everything as left
+    if (recovered_pieces > 0) ae_update_totals(s->announcer, e);
 
     printf("[INFO] Verification complete. Recovered %d / %ld pieces.\n", recovered_pieces, e->total_pieces);
 
-    start_swarm(e, (unsigned char *) peers, peers_count, pieces_hashes, end_files, (int) num_files);
+    start_swarm(e, server_fd, store, pieces_hashes, end_files, (int) num_files);
 
-    pthread_mutex_lock(&e->lock);
-    if (e->pieces_completed == e->total_pieces && e->status != TS_STATUS_PAUSED) {
+    if (ts_entry_stopping(e)) {
+        free(end_files);
+        freeBencodeNode(root);
+        return;
+    }
+
+    // the swarm only returns early on an error, which a complete torrent keeps showing
+    ts_entry_begin_update(e);
+    if (e->pieces_completed == e->total_pieces && e->status != TS_STATUS_PAUSED && e->status != TS_STATUS_QUEUED &&
+        e->status != TS_STATUS_ERROR) {
         e->status = TS_STATUS_SEEDING;
         e->seeding = true;
         e->progress = 1.0;
     }
-    pthread_mutex_unlock(&e->lock);
+    ts_entry_end_update(e);
+    ts_post_event(s, TS_EVENT_STATUS_CHANGED, e->id, 0);
 
     free(end_files);
-    free(peers);
+
+    freeBencodeNode(root);
+}
+
+static void *download_thread(void *arg) {
+    ThreadArgs *targs = arg;
+    TorrentEntry *e = targs->entry;
+    BencodeNode *root = targs->root;
+    free(targs);
 
     pthread_mutex_lock(&e->lock);
-    if (e->pieces_completed == e->total_pieces) {
-        e->status = TS_STATUS_SEEDING;
-        e->seeding = true;
-        e->progress = 1.0;
+    const bool needs_metadata = e->needs_metadata;
+    pthread_mutex_unlock(&e->lock);
+
+    if (!root && !needs_metadata) {
+        set_error(e);
+        return NULL;
+    }
+
+    // a trackerless torrent finds its peers through the DHT alone
+    if (e->tracker_count == 0 && !e->use_dht) {
+        fprintf(stderr, "[INFO] No trackers for %s\n", e->name);
+        set_error(e);
+        if (root) freeBencodeNode(root);
+        return NULL;
+    }
+
+    // bound before announcing so the trackers are given the port we really listen on
+    int listen_port = 0;
+    const int server_fd = swarm_listen(&listen_port);
+    if (server_fd < 0) {
+        set_error(e);
+        if (root) freeBencodeNode(root);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    e->listen_port = listen_port;
+    pthread_mutex_unlock(&e->lock);
+    printf("[INFO] Announcing to %d trackers...\n", e->tracker_count);
+    // answers are pushed into the entry's inbox while the files are verified, the swarm picks them up as they come
+    ts_entry_set_announcing(e, true);
+
+    // the peers that gave us the metadata are the first ones the swarm dials
+    PeerStore store;
+    ps_init(&store);
+    if (needs_metadata) root = fetch_metadata(e, server_fd, &store);
+
+    if (root) {
+        run_torrent(e, root, server_fd, &store);
+    } else {
+        close(server_fd);
+        if (!ts_entry_stopping(e)) set_error(e);
     }
+    // short of a stop request only an error ends the torrent, the trackers stop expecting us
+    if (!ts_entry_stopping(e)) ts_entry_set_announcing(e, false);
+    ps_free(&store);
+    return NULL;
+}
+
+static bool is_complete(const TorrentEntry *e) {
+    return e->verified && e->pieces_completed == e->total_pieces;
+}
+
+static void set_status(TorrentEntry *e, const TsStatus status) {
+    ts_entry_begin_update(e);
+    e->status = status;
+    ts_entry_end_update(e);
+    ts_post_event(e->session, TS_EVENT_STATUS_CHANGED, e->id, 0);
+    // a parked swarm sleeps until it is woken
+    wake_entry(e);
+}
+
+static void start_entry(TorrentEntry *e, const bool complete) {
+    pthread_mutex_lock(&e->lock);
+    const TsStatus unverified = e->needs_metadata ? TS_STATUS_FETCHING_METADATA : TS_STATUS_VERIFYING;
     pthread_mutex_unlock(&e->lock);
 
-    freeBencodeNode(root);
+    if (e->thread_running) {
+        // the network thread is parked in its swarm loop, or still fetching the metadata or verifying
+        set_status(e, !e->verified ? unverified : complete ? TS_STATUS_SEEDING : TS_STATUS_DOWNLOADING);
+        return;
+    }
+
+    set_status(e, unverified);
+    ThreadArgs *args = malloc(sizeof *args);
+    args->entry = e;
+    args->root = e->metadata;
+    e->metadata = NULL;
+    pthread_create(&e->thread, NULL, download_thread, args);
+    e->thread_running = true;
+}
+
+// Walks the torrents in queue order and gives the active slots to the first ones that want them.
+// Queued torrents are started, running ones past the limits go back to the queue and park their swarm.
+// Caller holds s->lock.
+static void schedule(TorrentSession *s) {
+    const uint64_t now = monotonic_ms();
+    int downloads = 0;
+    int seeds = 0;
+    int running = 0;
+
+    for (int i = 0; i < s->count; i++) {
+        TorrentEntry *e = s->order[i];
+        pthread_mutex_lock(&e->lock);
+        const TsStatus status = e->status;
+        const bool complete = is_complete(e);
+        pthread_mutex_unlock(&e->lock);
+
+        if (status == TS_STATUS_PAUSED || status == TS_STATUS_ERROR) continue;
+
+        const bool transferring = status == TS_STATUS_DOWNLOADING || status == TS_STATUS_SEEDING;
+        const uint64_t rate = stat_load(complete ? &e->stats.upload_rate : &e->stats.download_rate);
+        if (!transferring || rate > 0) e->last_active_ms = now;
+
+        bool run;
+        if (transferring && s->skip_inactive && now - e->last_active_ms >= TS_INACTIVE_MS) {
+            run = true;
+        } else {
+            int *used = complete ? &seeds : &downloads;
+            const int limit = complete ? s->max_active_seeds : s->max_active_downloads;
+            run = limit < 0 || *used < limit;
+            if (run) (*used)++;
+        }
+
+        if (run && status == TS_STATUS_QUEUED) start_entry(e, complete);
+        else if (!run && status != TS_STATUS_QUEUED) set_status(e, TS_STATUS_QUEUED);
+        if (run) running++;
+    }
+
+    int per_torrent = -1;
+    if (s->max_connections >= 0 && running > 0) {
+        per_torrent = s->max_connections / running;
+        if (per_torrent < 1) per_torrent = 1;
+    }
+    for (int i = 0; i < s->count; i++) {
+        TorrentEntry *e = s->order[i];
+        pthread_mutex_lock(&e->lock);
+        e->connection_limit = per_torrent;
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+static void *scheduler_thread(void *arg) {
+    TorrentSession *s = arg;
+
+    pthread_mutex_lock(&s->scheduler_lock);
+    while (!s->scheduler_stop) {
+        if (!s->schedule_pending) {
+            if (s->skip_inactive) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+                pthread_cond_timedwait(&s->scheduler_cond, &s->scheduler_lock, &deadline);
+            } else {
+                pthread_cond_wait(&s->scheduler_cond, &s->scheduler_lock);
+            }
+        }
+        if (s->scheduler_stop) break;
+        s->schedule_pending = false;
+        pthread_mutex_unlock(&s->scheduler_lock);
+
+        pthread_mutex_lock(&s->lock);
+        schedule(s);
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_mutex_lock(&s->scheduler_lock);
+    }
+    pthread_mutex_unlock(&s->scheduler_lock);
     return NULL;
 }
 
-int ts_add_torrent(TorrentSession *s,
-                   const char *torrent_path,
-                   const char *save_path) {
+void ts_request_schedule(TorrentSession *s) {
+    pthread_mutex_lock(&s->scheduler_lock);
+    // nobody waits on it once the scheduler thread stopped
+    if (!s->scheduler_stop) {
+        s->schedule_pending = true;
+        pthread_cond_signal(&s->scheduler_cond);
+    }
+    pthread_mutex_unlock(&s->scheduler_lock);
+}
+
+void ts_set_queue_limits(TorrentSession *s, const int max_downloads, const int max_seeds, const int max_connections) {
+    pthread_mutex_lock(&s->lock);
+    s->max_active_downloads = max_downloads;
+    s->max_active_seeds = max_seeds;
+    s->max_connections = max_connections;
+    schedule(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void ts_queue_limits(TorrentSession *s, int *max_downloads, int *max_seeds, int *max_connections) {
+    pthread_mutex_lock(&s->lock);
+    *max_downloads = s->max_active_downloads;
+    *max_seeds = s->max_active_seeds;
+    *max_connections = s->max_connections;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void ts_set_skip_inactive(TorrentSession *s, const bool skip) {
+    pthread_mutex_lock(&s->lock);
+    s->skip_inactive = skip;
+    schedule(s);
+    pthread_mutex_unlock(&s->lock);
+    // wakes the scheduler so it picks up the new wait mode
+    ts_request_schedule(s);
+}
+
+void ts_set_half_open_limit(TorrentSession *s, const int max_half_open) {
+    __atomic_store_n(&s->max_half_open, max_half_open, __ATOMIC_RELAXED);
+}
+
+bool ts_half_open_acquire(TorrentSession *s) {
+    const int limit = __atomic_load_n(&s->max_half_open, __ATOMIC_RELAXED);
+    int current = __atomic_load_n(&s->half_open, __ATOMIC_RELAXED);
+    do {
+        if (limit >= 0 && current >= limit) return false;
+    } while (!__atomic_compare_exchange_n(&s->half_open, &current, current + 1, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
+void ts_half_open_release(TorrentSession *s) {
+    __atomic_sub_fetch(&s->half_open, 1, __ATOMIC_RELAXED);
+}
+
+int ts_dht_port(const TorrentSession *s) {
+    return s->dht ? dht_port(s->dht) : 0;
+}
+
+void ts_dht_add_node(TorrentSession *s, const struct sockaddr *addr, const socklen_t addr_len) {
+    if (s->dht) dht_add_node(s->dht, addr, addr_len);
+}
+
+unsigned char *ts_dht_state(TorrentSession *s, size_t *out_len) {
+    *out_len = 0;
+    return s->dht ? dht_save_state(s->dht, out_len) : NULL;
+}
+
+void ts_restore_dht_state(TorrentSession *s, const unsigned char *data, const size_t len) {
+    if (s->dht && !dht_load_state(s->dht, data, len)) fprintf(stderr, "[INFO] Saved DHT state is unusable\n");
+}
+
+// the info dictionary exactly as it is stored in the file, which is what the info hash is taken over; a malloc'd
+// buffer the caller frees, NULL when it cannot be read
+static unsigned char *read_info(FILE *f, const BencodeNode *info, size_t *out_len) {
+    const long info_len = info->endOffset - info->startOffset;
+    unsigned char *info_buf = info_len > 0 ? malloc(info_len) : NULL;
+    if (!info_buf) return NULL;
+    if (fseek(f, info->startOffset, SEEK_SET) != 0 || fread(info_buf, info_len, 1, f) != 1) {
+        free(info_buf);
+        return NULL;
+    }
+    *out_len = (size_t) info_len;
+    return info_buf;
+}
+
+// the announce key first, then every tier of the announce-list
+static int collect_tracker_urls(const BencodeNode *root, char urls[][256]) {
+    int url_count = 0;
+
+    const BencodeNode *announceNode = getDictValue(root, "announce");
+    if (announceNode && announceNode->type == BEN_STR) {
+        snprintf(urls[url_count++], 256, "%.*s",
+                 (int) announceNode->string.length, announceNode->string.data);
+    }
+
+    const BencodeNode *ann_list = getDictValue(root, "announce-list");
+    if (ann_list && ann_list->type == BEN_LIST) {
+        for (size_t i = 0; i < ann_list->list.length && url_count < AE_MAX_TRACKERS; i++) {
+            const BencodeNode *tier = ann_list->list.items[i];
+            if (!tier || tier->type != BEN_LIST) continue;
+            for (size_t j = 0; j < tier->list.length && url_count < AE_MAX_TRACKERS; j++) {
+                const BencodeNode *url_node = tier->list.items[j];
+                if (!url_node || url_node->type != BEN_STR) continue;
+
+                snprintf(urls[url_count++], 256, "%.*s",
+                         (int) url_node->string.length, url_node->string.data);
+            }
+        }
+    }
+    return url_count;
+}
+
+// appends the link's trackers that are not in urls yet
+static int merge_magnet_trackers(const MagnetLink *link, char urls[][256], int url_count) {
+    for (int i = 0; i < link->tracker_count && url_count < AE_MAX_TRACKERS; i++) {
+        bool known = false;
+        for (int j = 0; j < url_count && !known; j++) known = strcmp(urls[j], link->trackers[i]) == 0;
+        if (!known) snprintf(urls[url_count++], 256, "%s", link->trackers[i]);
+    }
+    return url_count;
+}
+
+// Adds a torrent from the .torrent in f, from a magnet link or from both: a cached .torrent of the link is used
+// as long as its info hash is the link's, the link adds its trackers. Without a usable .torrent the link's
+// metadata is fetched by the network thread. Returns the new id or -1.
+static int add_entry(TorrentSession *s, const char *torrent_path, const char *save_path, FILE *f,
+                     const MagnetLink *link) {
+    TorrentEntry *e = calloc(1, sizeof *e);
+    if (!e) return -1;
+    e->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (e->wake_fd < 0) {
+        free(e);
+        return -1;
+    }
+
     pthread_mutex_lock(&s->lock);
-    if (s->count >= TS_MAX_TORRENTS) {
+    if (s->count == s->order_capacity) {
+        const int capacity = s->order_capacity ? s->order_capacity * 2 : 16;
+        TorrentEntry **grown = realloc(s->order, capacity * sizeof(TorrentEntry *));
+        if (!grown) {
+            pthread_mutex_unlock(&s->lock);
+            close(e->wake_fd);
+            free(e);
+            return -1;
+        }
+        s->order = grown;
+        s->order_capacity = capacity;
+    }
+
+    e->id = claim_slot(s, e);
+    if (e->id < 0) {
         pthread_mutex_unlock(&s->lock);
+        close(e->wake_fd);
+        free(e);
         return -1;
     }
+    e->order_index = s->count;
+    s->order[s->count++] = e;
 
-    const int idx = s->count++;
-    TorrentEntry *e = &s->entries[idx];
-    memset(e, 0, sizeof *e);
     pthread_mutex_init(&e->lock, NULL);
+    tb_init(&e->upload_limit);
+    tb_init(&e->download_limit);
+    e->session = s;
 
-    e->id = s->next_id++;
     strncpy(e->torrent_path, torrent_path, sizeof e->torrent_path - 1);
     strncpy(e->save_path, save_path, sizeof e->save_path - 1);
 
-    e->status = TS_STATUS_VERIFYING;
+    e->status = TS_STATUS_QUEUED;
+    e->upload_slots = TS_DEFAULT_UPLOAD_SLOTS;
+    e->connection_limit = -1;
 
     rand_str(e->peer_id, 20);
 
-    BencodeContext ctx = {0};
-    ctx.file = fopen(torrent_path, "rb");
     BencodeNode *root = NULL;
-    if (ctx.file) {
+    const BencodeNode *info = NULL;
+    if (f) {
+        BencodeContext ctx = {0};
+        ctx.file = f;
         root = parseCollectionValue(&ctx);
-        if (root) {
-            const BencodeNode *info = getDictValue(root, "info");
-            if (info) {
-                const BencodeNode *nameNode = getDictValue(info, "name");
-                if (nameNode && nameNode->type == BEN_STR)
-                    snprintf(e->name, sizeof e->name, "%.*s",
-                             (int) nameNode->string.length,
-                             nameNode->string.data);
-
-                const BencodeNode *lenNode = getDictValue(info, "length");
-                if (lenNode && lenNode->type == BEN_INT) {
-                    e->size_bytes = (uint64_t) lenNode->intValue;
-                } else {
-                    const BencodeNode *files_list = getDictValue(info, "files");
-                    if (files_list && files_list->type == BEN_LIST) {
-                        uint64_t total_size = 0;
-                        for (size_t i = 0; i < files_list->list.length; i++) {
-                            const BencodeNode *file_dict = files_list->list.items[i];
-                            const BencodeNode *flen = getDictValue(file_dict, "length");
-                            if (flen && flen->type == BEN_INT) {
-                                total_size += flen->intValue;
-                            }
-                        }
-                        e->size_bytes = total_size;
-                    }
-                }
-            }
+        info = getDictValue(root, "info");
+        if (info) e->info_bytes = read_info(f, info, &e->info_len);
+        if (e->info_bytes) SHA1(e->info_bytes, e->info_len, e->info_hash);
+    }
+    if (link && (!e->info_bytes || memcmp(e->info_hash, link->info_hash, 20) != 0)) {
+        // a cached .torrent that does not belong to the link is ignored, the metadata is fetched again
+        if (root) freeBencodeNode(root);
+        root = NULL;
+        info = NULL;
+        free(e->info_bytes);
+        e->info_bytes = NULL;
+        e->info_len = 0;
+        memcpy(e->info_hash, link->info_hash, 20);
+        e->needs_metadata = true;
+        if (link->name[0]) {
+            snprintf(e->name, sizeof e->name, "%s", link->name);
+        } else {
+            for (int i = 0; i < 20; i++) sprintf(e->name + 2 * i, "%02x", link->info_hash[i]);
         }
-        fclose(ctx.file);
     }
 
-    ThreadArgs *args = malloc(sizeof *args);
-    args->session = s;
-    args->entry_index = idx;
-    args->root = root;
-    pthread_create(&e->thread, NULL, download_thread, args);
-    e->thread_running = true;
+    const bool hashed = e->info_bytes || e->needs_metadata;
+    if (info) {
+        describe_torrent(e, info);
+        e->private_torrent = is_private(info);
+    }
+    if (hashed) {
+        // registered right away so the swarm size is known before the torrent gets a slot
+        char urls[AE_MAX_TRACKERS][256];
+        int url_count = root ? collect_tracker_urls(root, urls) : 0;
+        if (link) url_count = merge_magnet_trackers(link, urls, url_count);
+        if (url_count > 0) {
+            AnnounceParams announce = {0};
+            memcpy(announce.info_hash, e->info_hash, 20);
+            memcpy(announce.peer_id, e->peer_id, 20);
+            if (ae_add_torrent(s->announcer, e, &announce, urls, url_count)) e->tracker_count = url_count;
+        }
+        // a magnet link cannot tell whether it is private before its metadata is here
+        if (!e->private_torrent && s->dht) e->use_dht = dht_add_torrent(s->dht, e, e->info_hash);
+    }
+
+    e->metadata = root;
 
     const int id = e->id;
+    ts_post_event(s, TS_EVENT_ADDED, id, 0);
+    schedule(s);
     pthread_mutex_unlock(&s->lock);
     return id;
 }
 
-void ts_remove_torrent(TorrentSession *s, int id) {
-    pthread_mutex_lock(&s->lock);
-    for (int i = 0; i < s->count; i++) {
-        if (s->entries[i].id == id) {
-            if (s->entries[i].thread_running)
-                pthread_join(s->entries[i].thread, NULL);
-            pthread_mutex_destroy(&s->entries[i].lock);
+int ts_add_torrent(TorrentSession *s,
+                   const char *torrent_path,
+                   const char *save_path) {
+    FILE *f = fopen(torrent_path, "rb");
+    const int id = add_entry(s, torrent_path, save_path, f, NULL);
+    if (f) fclose(f);
+    return id;
+}
 
-            if (s->entries[i].piece_states) {
-                free(s->entries[i].piece_states);
-            }
+int ts_add_magnet(TorrentSession *s, const char *magnet_uri, const char *save_path) {
+    MagnetLink link;
+    if (!magnet_parse(magnet_uri, &link)) return -1;
+
+    char cache_path[600];
+    FILE *cached = metadata_cache_path(s, link.info_hash, cache_path, sizeof cache_path)
+                       ? fopen(cache_path, "rb")
+                       : NULL;
+    if (cached) printf("[INFO] Using the cached metadata of %s\n", cache_path);
+    const int id = add_entry(s, magnet_uri, save_path, cached, &link);
+    if (cached) fclose(cached);
+    return id;
+}
 
-            memmove(&s->entries[i], &s->entries[i + 1],
-                    (s->count - i - 1) * sizeof(TorrentEntry));
-            s->count--;
-            break;
-        }
-    }
+void ts_set_metadata_cache_dir(TorrentSession *s, const char *dir) {
+    pthread_mutex_lock(&s->lock);
+    snprintf(s->metadata_cache_dir, sizeof s->metadata_cache_dir, "%s", dir ? dir : "");
     pthread_mutex_unlock(&s->lock);
 }
 
-void ts_pause_torrent(TorrentSession *s, const int id) {
+void ts_remove_torrent(TorrentSession *s, int id) {
     pthread_mutex_lock(&s->lock);
-    for (int i = 0; i < s->count; i++) {
-        if (s->entries[i].id == id) {
-            pthread_mutex_lock(&s->entries[i].lock);
+    TorrentEntry *e = find_entry(s, id);
+    if (!e) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
 
-            if (s->entries[i].status == TS_STATUS_DOWNLOADING ||
-                s->entries[i].status == TS_STATUS_SEEDING ||
-                s->entries[i].status == TS_STATUS_VERIFYING) {
+    // unlinked first, the scheduler and the accessors never see it again
+    release_slot(s, id);
+    memmove(&s->order[e->order_index], &s->order[e->order_index + 1],
+            (s->count - e->order_index - 1) * sizeof(TorrentEntry *));
+    s->count--;
+    for (int i = e->order_index; i < s->count; i++) s->order[i]->order_index = i;
 
-                s->entries[i].status = TS_STATUS_PAUSED;
-                }
+    ts_post_event(s, TS_EVENT_REMOVED, id, 0);
+    schedule(s);
+    pthread_mutex_unlock(&s->lock);
+
+    __atomic_store_n(&e->stop_requested, true, __ATOMIC_RELEASE);
+    wake_entry(e);
+    if (e->thread_running)
+        pthread_join(e->thread, NULL);
+    ae_remove_torrent(s->announcer, e);
+    if (e->use_dht) dht_remove_torrent(s->dht, e);
+    free_entry(e);
+}
 
-            pthread_mutex_unlock(&s->entries[i].lock);
-            break;
+void ts_pause_torrent(TorrentSession *s, const int id) {
+    pthread_mutex_lock(&s->lock);
+    TorrentEntry *e = find_entry(s, id);
+    if (e) {
+        ts_entry_begin_update(e);
+
+        const bool pausable = e->status == TS_STATUS_DOWNLOADING ||
+                              e->status == TS_STATUS_SEEDING ||
+                              e->status == TS_STATUS_VERIFYING ||
+                              e->status == TS_STATUS_FETCHING_METADATA ||
+                              e->status == TS_STATUS_QUEUED;
+        if (pausable) {
+            e->status = TS_STATUS_PAUSED;
+            ts_post_event(s, TS_EVENT_STATUS_CHANGED, id, 0);
+            wake_entry(e);
         }
+
+        ts_entry_end_update(e);
+        // the freed slot goes to the next queued torrent
+        if (pausable) schedule(s);
     }
     pthread_mutex_unlock(&s->lock);
 }
 
 void ts_resume_torrent(TorrentSession *s, int id) {
     pthread_mutex_lock(&s->lock);
-    for (int i = 0; i < s->count; i++) {
-        if (s->entries[i].id == id) {
-            pthread_mutex_lock(&s->entries[i].lock);
-            if (s->entries[i].status == TS_STATUS_PAUSED) {
-                if (s->entries[i].pieces_completed == s->entries[i].total_pieces) {
-                    s->entries[i].status = TS_STATUS_SEEDING;
-                } else {
-                    s->entries[i].status = TS_STATUS_DOWNLOADING;
-                }
-            }
-            pthread_mutex_unlock(&s->entries[i].lock);
-            break;
+    TorrentEntry *e = find_entry(s, id);
+    if (e) {
+        ts_entry_begin_update(e);
+        const bool paused = e->status == TS_STATUS_PAUSED;
+        // resumed torrents rejoin the queue, schedule() starts them if a slot is free
+        if (paused) e->status = TS_STATUS_QUEUED;
+        ts_entry_end_update(e);
+
+        if (paused) {
+            ts_post_event(s, TS_EVENT_STATUS_CHANGED, id, 0);
+            schedule(s);
         }
     }
     pthread_mutex_unlock(&s->lock);
 }
 
+void ts_set_upload_slots(TorrentSession *s, const int id, const int slots) {
+    pthread_mutex_lock(&s->lock);
+    TorrentEntry *e = find_entry(s, id);
+    if (e) {
+        pthread_mutex_lock(&e->lock);
+        e->upload_slots = slots < 0 ? 0 : slots;
+        pthread_mutex_unlock(&e->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void ts_set_upload_limit(TorrentSession *s, const uint64_t bytes_per_sec) {
+    tb_set_rate(&s->upload_limit, bytes_per_sec);
+}
+
+void ts_set_download_limit(TorrentSession *s, const uint64_t bytes_per_sec) {
+    tb_set_rate(&s->download_limit, bytes_per_sec);
+}
+
+uint64_t ts_upload_limit(TorrentSession *s) {
+    return tb_rate(&s->upload_limit);
+}
+
+uint64_t ts_download_limit(TorrentSession *s) {
+    return tb_rate(&s->download_limit);
+}
+
+void ts_set_torrent_upload_limit(TorrentSession *s, const int id, const uint64_t bytes_per_sec) {
+    pthread_mutex_lock(&s->lock);
+    TorrentEntry *e = find_entry(s, id);
+    if (e) tb_set_rate(&e->upload_limit, bytes_per_sec);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void ts_set_torrent_download_limit(TorrentSession *s, const int id, const uint64_t bytes_per_sec) {
+    pthread_mutex_lock(&s->lock);
+    TorrentEntry *e = find_entry(s, id);
+    if (e) tb_set_rate(&e->download_limit, bytes_per_sec);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void ts_entry_begin_update(TorrentEntry *e) {
+    pthread_mutex_lock(&e->lock);
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void ts_entry_end_update(TorrentEntry *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&e->lock);
+}
+
+int ts_event_fd(const TorrentSession *s) {
+    return s->events.efd;
+}
+
+int ts_poll_events(TorrentSession *s, TsEvent *out, const int max) {
+    eq_begin_drain(&s->events);
+
+    int n = 0;
+    if (max > 0 && eq_take_overflow(&s->events)) {
+        out[n].type = TS_EVENT_OVERFLOW;
+        out[n].torrent_id = -1;
+        out[n].value = 0;
+        n++;
+    }
+    while (n < max && eq_pop(&s->events, &out[n])) n++;
+    return n;
+}
+
+void ts_post_event(TorrentSession *s, const TsEventType type, const int torrent_id, const int64_t value) {
+    const TsEvent ev = {.type = type, .torrent_id = torrent_id, .value = value};
+    eq_push(&s->events, &ev);
+}
+
+static int64_t eta_seconds(const TorrentEntry *e, const size_t pieces_completed, const uint64_t rate) {
+    if (e->total_pieces > 0 && pieces_completed == e->total_pieces) return 0;
+    if (rate == 0) return -1;
+
+    const uint64_t have = (uint64_t) pieces_completed * e->piece_length;
+    const uint64_t left = have < e->size_bytes ? e->size_bytes - have : 0;
+    return (int64_t) ((left + rate - 1) / rate);
+}
+
+int ts_snapshot(TorrentSession *s, TsTorrentStatus *out, const int max) {
+    pthread_mutex_lock(&s->lock);
+    const int n = s->count < max ? s->count : max;
+
+    for (int i = 0; i < n; i++) {
+        const TorrentEntry *e = s->order[i];
+        TsTorrentStatus *st = &out[i];
+
+        // fixed once the torrent is added
+        st->id = e->id;
+        memcpy(st->save_path, e->save_path, sizeof st->save_path);
+        memcpy(st->torrent_path, e->torrent_path, sizeof st->torrent_path);
+
+        size_t pieces_completed;
+        unsigned int start;
+        do {
+            start = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+            if (start & 1) continue;
+
+            // a magnet link learns them with its metadata
+            memcpy(st->name, e->name, sizeof st->name);
+            st->size_bytes = e->size_bytes;
+            st->status = e->status;
+            st->progress = e->progress;
+            st->seeds = e->seeds;
+            st->total_seeds = e->total_seeds;
+            st->peers = e->peers_count;
+            st->total_peers = e->total_peers;
+            st->seeding = e->seeding;
+            pieces_completed = e->pieces_completed;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((start & 1) || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != start);
+
+        st->download_rate = stat_load(&e->stats.download_rate);
+        st->upload_rate = stat_load(&e->stats.upload_rate);
+        st->downloaded = stat_load(&e->stats.downloaded);
+        st->uploaded = stat_load(&e->stats.uploaded);
+        st->wasted = stat_load(&e->stats.wasted);
+        st->eta = eta_seconds(e, pieces_completed, st->download_rate);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
 int ts_torrent_count(const TorrentSession *s) { return s->count; }
-int ts_torrent_id(const TorrentSession *s, const int index) { return s->entries[index].id; }
-const char *ts_torrent_name(const TorrentSession *s, const int index) { return s->entries[index].name; }
-uint64_t ts_torrent_size(const TorrentSession *s, const int index) { return s->entries[index].size_bytes; }
+int ts_torrent_id(const TorrentSession *s, const int index) { return s->order[index]->id; }
+const char *ts_torrent_name(const TorrentSession *s, const int index) { return s->order[index]->name; }
+uint64_t ts_torrent_size(const TorrentSession *s, const int index) { return s->order[index]->size_bytes; }
 
 double ts_torrent_progress(const TorrentSession *s, const int index) {
-    TorrentEntry *e = (TorrentEntry *) &s->entries[index];
+    TorrentEntry *e = s->order[index];
     pthread_mutex_lock(&e->lock);
     const double p = e->progress;
     pthread_mutex_unlock(&e->lock);
@@ -421,31 +1210,61 @@ double ts_torrent_progress(const TorrentSession *s, const int index) {
 }
 
 TsStatus ts_torrent_status(const TorrentSession *s, const int index) {
-    return s->entries[index].status;
+    return s->order[index]->status;
 }
 
 const char *ts_torrent_status_str(const TorrentSession *s, int i) {
-    switch (s->entries[i].status) {
+    switch (s->order[i]->status) {
         case TS_STATUS_VERIFYING: return "Verifying";
         case TS_STATUS_DOWNLOADING: return "Downloading";
         case TS_STATUS_SEEDING: return "Seeding";
         case TS_STATUS_PAUSED: return "Paused";
         case TS_STATUS_ERROR: return "Error";
         case TS_STATUS_QUEUED: return "Queued";
+        case TS_STATUS_FETCHING_METADATA: return "Fetching metadata";
         default: return "Unknown";
     }
 }
 
-int ts_torrent_seeds(const TorrentSession *s, const int index) { return s->entries[index].seeds; }
-int ts_torrent_peers(const TorrentSession *s, const int index) { return s->entries[index].peers_count; }
-bool ts_torrent_is_seeding(const TorrentSession *s, const int index) { return s->entries[index].seeding; }
-const char *ts_torrent_save_path(const TorrentSession *s, const int index) { return s->entries[index].save_path; }
-const char *ts_torrent_file_path(const TorrentSession *s, const int index) { return s->entries[index].torrent_path; }
+int ts_torrent_seeds(const TorrentSession *s, const int index) { return s->order[index]->seeds; }
+int ts_torrent_peers(const TorrentSession *s, const int index) { return s->order[index]->peers_count; }
+bool ts_torrent_is_seeding(const TorrentSession *s, const int index) { return s->order[index]->seeding; }
+const char *ts_torrent_save_path(const TorrentSession *s, const int index) { return s->order[index]->save_path; }
+const char *ts_torrent_file_path(const TorrentSession *s, const int index) { return s->order[index]->torrent_path; }
 
 int ts_torrent_total_seeds(const TorrentSession *s, const int index) {
-    return s->entries[index].total_seeds;
+    return s->order[index]->total_seeds;
 }
 
 int ts_torrent_total_peers(const TorrentSession *s, const int index) {
-    return s->entries[index].total_peers;
+    return s->order[index]->total_peers;
+}
+
+uint64_t ts_torrent_download_rate(const TorrentSession *s, const int index) {
+    return stat_load(&s->order[index]->stats.download_rate);
 }
+
+uint64_t ts_torrent_upload_rate(const TorrentSession *s, const int index) {
+    return stat_load(&s->order[index]->stats.upload_rate);
+}
+
+uint64_t ts_torrent_downloaded(const TorrentSession *s, const int index) {
+    return stat_load(&s->order[index]->stats.downloaded);
+}
+
+uint64_t ts_torrent_uploaded(const TorrentSession *s, const int index) {
+    return stat_load(&s->order[index]->stats.uploaded);
+}
+
+uint64_t ts_torrent_wasted(const TorrentSession *s, const int index) {
+    return stat_load(&s->order[index]->stats.wasted);
+}
+
+int64_t ts_torrent_eta(const TorrentSession *s, const int index) {
+    TorrentEntry *e = s->order[index];
+    pthread_mutex_lock(&e->lock);
+    const size_t pieces_completed = e->pieces_completed;
+    pthread_mutex_unlock(&e->lock);
+
+    return eta_seconds(e, pieces_completed, stat_load(&e->stats.download_rate));
+}
\ No newline at end of file
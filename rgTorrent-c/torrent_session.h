@@ -5,6 +5,11 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <bits/pthreadtypes.h>
+#include <sys/socket.h>
+
+#include "event_queue.h"
+#include "rate_limiter.h"
+#include "rate_stats.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,8 +17,16 @@ extern "C" {
 
 #endif
 
-#define TS_MAX_TORRENTS 256
 #define DEFAULT_BLOCK_SIZE 16384
+#define TS_DEFAULT_UPLOAD_SLOTS 4
+#define TS_EVENT_QUEUE_SIZE 4096
+#define TS_DEFAULT_ACTIVE_DOWNLOADS 3
+#define TS_DEFAULT_ACTIVE_SEEDS 5
+#define TS_DEFAULT_MAX_CONNECTIONS 200
+// outgoing connections still waiting for the TCP handshake, across all torrents
+#define TS_DEFAULT_MAX_HALF_OPEN 20
+// an active torrent that moved no data for this long stops counting against the active limits
+#define TS_INACTIVE_MS 60000
 
 typedef enum {
     TS_STATUS_VERIFYING,
@@ -22,12 +35,51 @@ typedef enum {
     TS_STATUS_PAUSED,
     TS_STATUS_ERROR,
     TS_STATUS_QUEUED,
+    // a magnet link waiting for its info dictionary from the swarm
+    TS_STATUS_FETCHING_METADATA,
 } TsStatus;
 
+typedef enum {
+    TS_EVENT_ADDED,
+    TS_EVENT_REMOVED,
+    TS_EVENT_STATUS_CHANGED,
+    // value is the piece index
+    TS_EVENT_PIECE_COMPLETED,
+    TS_EVENT_PEERS_CHANGED,
+    // rates or transfer totals moved, posted at most once a second per torrent
+    TS_EVENT_STATS_UPDATED,
+    TS_EVENT_ERROR,
+    // events were dropped, everything has to be re-read with ts_snapshot()
+    TS_EVENT_OVERFLOW,
+} TsEventType;
+
+// type holds a TsEventType
+typedef EventRecord TsEvent;
+
+struct TorrentSession;
+struct BencodeNode;
+struct AnnounceEngine;
+struct Dht;
+
+// written only by the torrent's network thread through stat_add/stat_store, read lock-free through stat_load
+typedef struct {
+    uint64_t downloaded;
+    uint64_t uploaded;
+    // payload of pieces that failed the hash check
+    uint64_t wasted;
+    uint64_t download_rate;
+    uint64_t upload_rate;
+} TsTransferStats;
+
 typedef struct TorrentEntry {
+    struct TorrentSession *session;
     int id;
+    // position in the session's order array
+    int order_index;
+    // the .torrent file, or the magnet URI the torrent was added with
     char torrent_path[512];
     char save_path[512];
+    // name and size of a magnet link are only known once its metadata is fetched
     char name[256];
     uint64_t size_bytes;
     double progress;
@@ -36,28 +88,133 @@ typedef struct TorrentEntry {
     int peers_count;
     int total_peers;
     bool seeding;
+    int upload_slots;
     TsStatus status;
     pthread_t thread;
     bool thread_running;
+    // set once when the torrent is removed or the session destroyed, the network thread then winds down
+    bool stop_requested;
+    // eventfd in the network thread's poll set, written whenever status or stop_requested change
+    int wake_fd;
+    // parsed .torrent held until the scheduler starts the torrent, then owned by its thread
+    struct BencodeNode *metadata;
+    // the bencoded info dictionary, served to peers that fetch it over ut_metadata. Set when the torrent is added,
+    // or by the network thread once a magnet link's metadata is fetched; read by the network thread alone.
+    unsigned char *info_bytes;
+    size_t info_len;
+    // a magnet link whose metadata has not been fetched yet, guarded by lock
+    bool needs_metadata;
+    bool verified;
+    // peer connections this torrent may hold, assigned by the scheduler from the session budget
+    int connection_limit;
+    uint64_t last_active_ms;
+    // compact peers delivered by the announce engine and the DHT since the network thread last took them,
+    // guarded by lock
+    unsigned char *peer_inbox;
+    size_t peer_inbox_len;
+    // the same for IPv6 peers, 18 bytes each
+    unsigned char *peer6_inbox;
+    size_t peer6_inbox_len;
     pthread_mutex_t lock; // protects progress/status/seeds/peers
+    // seqlock over the fields read by ts_snapshot(), odd while a writer holding lock is updating them
+    unsigned int seq;
+    TokenBucket upload_limit;
+    TokenBucket download_limit;
+    TsTransferStats stats;
 
     uint8_t info_hash[20];
     uint8_t peer_id[20];
+    // the port the swarm accepts peers on, 0 until it listens; announced to the trackers, guarded by lock
+    int listen_port;
+    // registered with the announce engine when the torrent is added, so even queued torrents are scraped
+    int tracker_count;
+    // registered with the session's DHT; never set for private torrents
+    bool use_dht;
+    // BEP 27: the info dictionary says private, so no DHT and no PEX. Set before the swarm runs, for a magnet link
+    // once its metadata is here
+    bool private_torrent;
     size_t total_pieces;
     size_t piece_length;
     uint8_t *piece_states;
     size_t pieces_completed;
+    // how many connected peers have each piece, kept by the network thread for rarest-first picking
+    uint16_t *availability;
 } TorrentEntry;
 
+// an id is generation << TS_SLOT_BITS | slot, so the id of a removed torrent stops resolving
+// even after its slot is reused
+#define TS_SLOT_BITS 20
+#define TS_MAX_GENERATION 2047
+
+typedef struct {
+    TorrentEntry *entry;
+    int generation;
+    int next_free;
+} TsSlot;
+
 struct TorrentSession {
-    TorrentEntry entries[TS_MAX_TORRENTS];
+    // entries are heap-allocated and never move; order keeps them in insertion order for the index accessors
+    TorrentEntry **order;
     int count;
-    int next_id;
+    int order_capacity;
+    TsSlot *slots;
+    int slot_count;
+    int slot_capacity;
+    int free_slot;
     pthread_mutex_t lock;
+    // shared by all torrents, consulted after the torrent's own buckets
+    TokenBucket upload_limit;
+    TokenBucket download_limit;
+    EventQueue events;
+    // one thread running the tracker requests of every torrent
+    struct AnnounceEngine *announcer;
+    // one DHT node and UDP socket for every torrent, NULL when it could not be started
+    struct Dht *dht;
+    // where the metadata fetched for magnet links is kept, empty for no cache; guarded by lock
+    char metadata_cache_dir[512];
+
+    // queueing limits, -1 means unlimited
+    int max_active_downloads;
+    int max_active_seeds;
+    int max_connections;
+    // outgoing connects in progress, counted with ts_half_open_acquire/release
+    int half_open;
+    int max_half_open;
+    // torrents idle for TS_INACTIVE_MS do not take an active slot
+    bool skip_inactive;
+
+    // background scheduler, woken by ts_request_schedule() and once a second for the inactivity check
+    pthread_t scheduler;
+    pthread_mutex_t scheduler_lock;
+    pthread_cond_t scheduler_cond;
+    bool schedule_pending;
+    bool scheduler_stop;
 };
 
 typedef struct TorrentSession TorrentSession;
 
+// consistent copy of one torrent's status, filled by ts_snapshot()
+typedef struct {
+    int id;
+    char name[256];
+    char save_path[512];
+    char torrent_path[512];
+    uint64_t size_bytes;
+    TsStatus status;
+    double progress;
+    int seeds;
+    int total_seeds;
+    int peers;
+    int total_peers;
+    bool seeding;
+    uint64_t download_rate;
+    uint64_t upload_rate;
+    uint64_t downloaded;
+    uint64_t uploaded;
+    uint64_t wasted;
+    int64_t eta;
+} TsTorrentStatus;
+
 TorrentSession *ts_create(void);
 
 void ts_destroy(TorrentSession *s);
@@ -66,12 +223,101 @@ int ts_add_torrent(TorrentSession *s,
                    const char *torrent_path,
                    const char *save_path);
 
+// adds a magnet link (BEP 9). Its info dictionary is fetched from the peers the trackers of the link and the DHT
+// find, in TS_STATUS_FETCHING_METADATA, and then downloaded like any torrent. Fetched dictionaries are cached,
+// so a link added again starts right away. Returns -1 when the URI has no BitTorrent info hash.
+int ts_add_magnet(TorrentSession *s, const char *magnet_uri, const char *save_path);
+
+// the directory metadata fetched for magnet links is cached in, created when needed; NULL or "" turns the cache
+// off. Defaults to $XDG_CACHE_HOME/rgTorrent/metadata, or ~/.cache/rgTorrent/metadata.
+void ts_set_metadata_cache_dir(TorrentSession *s, const char *dir);
+
 void ts_remove_torrent(TorrentSession *s, int id);
 
+// copies the status of up to max torrents into out and returns how many were written.
+// Never waits on the torrents' network threads, a reader that races an update simply retries.
+int ts_snapshot(TorrentSession *s, TsTorrentStatus *out, int max);
+
+// readable whenever ts_poll_events() has something to return; owned by the session
+int ts_event_fd(const TorrentSession *s);
+
+// moves up to max pending events into out and returns how many were written.
+// Single consumer only; call it again while it returns max, the fd is not signalled for leftovers.
+int ts_poll_events(TorrentSession *s, TsEvent *out, int max);
+
+void ts_post_event(TorrentSession *s, TsEventType type, int torrent_id, int64_t value);
+
+// queue limits for the whole session, -1 removes a limit. Torrents beyond the active limits wait
+// in TS_STATUS_QUEUED and are started in the order they were added as slots free up.
+void ts_set_queue_limits(TorrentSession *s, int max_downloads, int max_seeds, int max_connections);
+
+void ts_queue_limits(TorrentSession *s, int *max_downloads, int *max_seeds, int *max_connections);
+
+void ts_set_skip_inactive(TorrentSession *s, bool skip);
+
+// caps the outgoing connects in progress at once, -1 removes the cap
+void ts_set_half_open_limit(TorrentSession *s, int max_half_open);
+
+// takes one half-open slot, false when the cap is reached; safe from any thread
+bool ts_half_open_acquire(TorrentSession *s);
+
+void ts_half_open_release(TorrentSession *s);
+
+// the UDP port of the session's DHT node, 0 without a DHT
+int ts_dht_port(const TorrentSession *s);
+
+// a DHT node learned from a peer's PORT message; safe from any thread
+void ts_dht_add_node(TorrentSession *s, const struct sockaddr *addr, socklen_t addr_len);
+
+// the DHT's node id and routing table, to be handed back to ts_restore_dht_state() by the next session so it
+// does not have to bootstrap from scratch. Returns a malloc'd buffer the caller frees, NULL without a DHT.
+unsigned char *ts_dht_state(TorrentSession *s, size_t *out_len);
+
+// meant right after ts_create(), before any torrent is added
+void ts_restore_dht_state(TorrentSession *s, const unsigned char *data, size_t len);
+
+// asks the scheduler to re-evaluate the queue soon, safe from any thread
+void ts_request_schedule(TorrentSession *s);
+
+bool ts_entry_stopping(const TorrentEntry *e);
+
+// moves the compact peers of family (AF_INET or AF_INET6) announced so far into a malloc'd buffer the caller
+// frees, NULL when there are none
+unsigned char *ts_entry_take_peers(TorrentEntry *e, int family, size_t *out_len);
+
+// the network thread parks (false) and resumes (true) the torrent's tracker announces; parking sends stopped
+void ts_entry_set_announcing(TorrentEntry *e, bool active);
+
+void ts_entry_announce_completed(TorrentEntry *e);
+
+// re-announces early, as far as each tracker's min interval allows; must be called without e->lock
+void ts_entry_request_peers(TorrentEntry *e);
+
+// brackets every change to the fields published through ts_snapshot(); takes and releases e->lock
+void ts_entry_begin_update(TorrentEntry *e);
+
+void ts_entry_end_update(TorrentEntry *e);
+
 void ts_pause_torrent(TorrentSession *s, int id);
 
 void ts_resume_torrent(TorrentSession *s, int id);
 
+// number of peers we upload to at once, one of them is the rotating optimistic unchoke
+void ts_set_upload_slots(TorrentSession *s, int id, int slots);
+
+// bandwidth limits in bytes per second, 0 removes the limit
+void ts_set_upload_limit(TorrentSession *s, uint64_t bytes_per_sec);
+
+void ts_set_download_limit(TorrentSession *s, uint64_t bytes_per_sec);
+
+uint64_t ts_upload_limit(TorrentSession *s);
+
+uint64_t ts_download_limit(TorrentSession *s);
+
+void ts_set_torrent_upload_limit(TorrentSession *s, int id, uint64_t bytes_per_sec);
+
+void ts_set_torrent_download_limit(TorrentSession *s, int id, uint64_t bytes_per_sec);
+
 int ts_torrent_count(const TorrentSession *s);
 
 int ts_torrent_id(const TorrentSession *s, int index);
@@ -100,6 +346,21 @@ int ts_torrent_total_seeds(const TorrentSession *s, int index);
 
 int ts_torrent_total_peers(const TorrentSession *s, int index);
 
+// bytes per second averaged over the last few seconds
+uint64_t ts_torrent_download_rate(const TorrentSession *s, int index);
+
+uint64_t ts_torrent_upload_rate(const TorrentSession *s, int index);
+
+// payload bytes transferred since the torrent was added
+uint64_t ts_torrent_downloaded(const TorrentSession *s, int index);
+
+uint64_t ts_torrent_uploaded(const TorrentSession *s, int index);
+
+uint64_t ts_torrent_wasted(const TorrentSession *s, int index);
+
+// seconds until the download completes at the current rate, -1 when there is no rate to estimate from
+int64_t ts_torrent_eta(const TorrentSession *s, int index);
+
 #ifdef __cplusplus
 }
 #endif
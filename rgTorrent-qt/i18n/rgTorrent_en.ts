@@ -54,6 +54,21 @@
         <message><source>Yes</source><translation>Yes</translation></message>
         <message><source>No</source><translation>No</translation></message>
         <message><source>%1 bytes</source><translation>%1 bytes</translation></message>
+        <message><source>Download Speed</source><translation>Download Speed</translation></message>
+        <message><source>Upload Speed</source><translation>Upload Speed</translation></message>
+        <message><source>Downloaded</source><translation>Downloaded</translation></message>
+        <message><source>Uploaded</source><translation>Uploaded</translation></message>
+        <message><source>Wasted</source><translation>Wasted</translation></message>
+        <message><source>ETA</source><translation>ETA</translation></message>
+        <message><source>%1/s</source><translation>%1/s</translation></message>
+        <message><source>%1 GB</source><translation>%1 GB</translation></message>
+        <message><source>%1 MB</source><translation>%1 MB</translation></message>
+        <message><source>%1 KB</source><translation>%1 KB</translation></message>
+        <message><source>%1 B</source><translation>%1 B</translation></message>
+        <message><source>%1d %2h</source><translation>%1d %2h</translation></message>
+        <message><source>%1h %2m</source><translation>%1h %2m</translation></message>
+        <message><source>%1m %2s</source><translation>%1m %2s</translation></message>
+        <message><source>%1s</source><translation>%1s</translation></message>
     </context>
     <context>
         <name>CreateTorrentDialog</name>
@@ -81,6 +96,7 @@
         <message><source>Paused</source><translation>Paused</translation></message>
         <message><source>Error</source><translation>Error</translation></message>
         <message><source>Queued</source><translation>Queued</translation></message>
+        <message><source>Fetching metadata</source><translation>Fetching metadata</translation></message>
         <message><source>Unknown</source><translation>Unknown</translation></message>
         <message><source>Name:</source><translation>Name:</translation></message>
         <message><source>Total Size:</source><translation>Total Size:</translation></message>
@@ -54,6 +54,21 @@
         <message><source>Yes</source><translation>Так</translation></message>
         <message><source>No</source><translation>Ні</translation></message>
         <message><source>%1 bytes</source><translation>%1 байт</translation></message>
+        <message><source>Download Speed</source><translation>Швидкість завантаження</translation></message>
+        <message><source>Upload Speed</source><translation>Швидкість віддачі</translation></message>
+        <message><source>Downloaded</source><translation>Завантажено</translation></message>
+        <message><source>Uploaded</source><translation>Віддано</translation></message>
+        <message><source>Wasted</source><translation>Втрачено</translation></message>
+        <message><source>ETA</source><translation>Залишилось</translation></message>
+        <message><source>%1/s</source><translation>%1/с</translation></message>
+        <message><source>%1 GB</source><translation>%1 ГБ</translation></message>
+        <message><source>%1 MB</source><translation>%1 МБ</translation></message>
+        <message><source>%1 KB</source><translation>%1 КБ</translation></message>
+        <message><source>%1 B</source><translation>%1 Б</translation></message>
+        <message><source>%1d %2h</source><translation>%1д %2г</translation></message>
+        <message><source>%1h %2m</source><translation>%1г %2хв</translation></message>
+        <message><source>%1m %2s</source><translation>%1хв %2с</translation></message>
+        <message><source>%1s</source><translation>%1с</translation></message>
     </context>
     <context>
         <name>CreateTorrentDialog</name>
@@ -81,6 +96,7 @@
         <message><source>Paused</source><translation>Призупинено</translation></message>
         <message><source>Error</source><translation>Помилка</translation></message>
         <message><source>Queued</source><translation>В черзі</translation></message>
+        <message><source>Fetching metadata</source><translation>Отримання метаданих</translation></message>
         <message><source>Unknown</source><translation>Невідомо</translation></message>
         <message><source>Name:</source><translation>Назва:</translation></message>
         <message><source>Total Size:</source><translation>Загальний розмір:</translation></message>
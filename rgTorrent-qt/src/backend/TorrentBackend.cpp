@@ -2,6 +2,7 @@
 #include <QFileInfo>
 #include <QSettings>
 #include <QDateTime>
+#include <cstdlib>
 
 extern "C" {
 #include "torrent_session.h"
@@ -27,6 +28,7 @@ static QString statusToString(const TsStatus s) {
         case TS_STATUS_PAUSED: return TorrentBackend::tr("Paused");
         case TS_STATUS_ERROR: return TorrentBackend::tr("Error");
         case TS_STATUS_QUEUED: return TorrentBackend::tr("Queued");
+        case TS_STATUS_FETCHING_METADATA: return TorrentBackend::tr("Fetching metadata");
         default: return TorrentBackend::tr("Unknown");
     }
 }
@@ -35,76 +37,86 @@ TorrentBackend::TorrentBackend(QObject *parent)
     : QObject(parent) {
     m_session = ts_create();
 
-    m_pollTimer = new QTimer(this);
-    m_pollTimer->setInterval(1000);
-    connect(m_pollTimer, &QTimer::timeout, this, &TorrentBackend::poll);
-    m_pollTimer->start();
+    // the core signals this fd whenever a torrent changes, nothing is polled while the session is idle
+    m_eventNotifier = new QSocketNotifier(ts_event_fd(m_session), QSocketNotifier::Read, this);
+    connect(m_eventNotifier, &QSocketNotifier::activated, this, &TorrentBackend::drainEvents);
 }
 
 TorrentBackend::~TorrentBackend() {
     ts_destroy(m_session);
 }
 
-void TorrentBackend::poll() {
-    QList<TorrentItem> fresh;
-    const int count = ts_torrent_count(m_session);
+static QList<TorrentItem> snapshotItems(TorrentSession *session) {
+    QList<TsTorrentStatus> statuses(ts_torrent_count(session));
+    const int count = ts_snapshot(session, statuses.data(), static_cast<int>(statuses.size()));
 
+    QList<TorrentItem> items;
+    items.reserve(count);
     for (int i = 0; i < count; ++i) {
+        const TsTorrentStatus &st = statuses[i];
         TorrentItem t;
-        t.id = ts_torrent_id(m_session, i);
-        t.name = QString::fromUtf8(ts_torrent_name(m_session, i));
-        t.sizeBytes = ts_torrent_size(m_session, i);
-        t.status = statusToString(ts_torrent_status(m_session, i));
-        t.seeds = ts_torrent_seeds(m_session, i);
-        t.totalSeeds = ts_torrent_total_seeds(m_session, i);
-        t.peers = ts_torrent_peers(m_session, i);
-        t.totalPeers = ts_torrent_total_peers(m_session, i);
-        t.progress = ts_torrent_progress(m_session, i);
-        t.seeding = ts_torrent_is_seeding(m_session, i);
-        t.savePath = QString::fromUtf8(ts_torrent_save_path(m_session, i));
-        t.torrentPath = QString::fromUtf8(ts_torrent_file_path(m_session, i));
-        fresh.append(t);
+        t.id = st.id;
+        t.name = QString::fromUtf8(st.name);
+        t.sizeBytes = st.size_bytes;
+        t.status = statusToString(st.status);
+        t.seeds = st.seeds;
+        t.totalSeeds = st.total_seeds;
+        t.peers = st.peers;
+        t.totalPeers = st.total_peers;
+        t.progress = st.progress;
+        t.downloadRate = st.download_rate;
+        t.uploadRate = st.upload_rate;
+        t.downloaded = st.downloaded;
+        t.uploaded = st.uploaded;
+        t.wasted = st.wasted;
+        t.etaSeconds = st.eta;
+        t.seeding = st.seeding;
+        t.savePath = QString::fromUtf8(st.save_path);
+        t.torrentPath = QString::fromUtf8(st.torrent_path);
+        items.append(t);
     }
+    return items;
+}
 
-    emit torrentsChanged(fresh);
+void TorrentBackend::poll() {
+    emit torrentsChanged(snapshotItems(m_session));
+}
+
+void TorrentBackend::drainEvents() {
+    TsEvent events[256];
+    int total = 0;
+    int n;
+    do {
+        n = ts_poll_events(m_session, events, 256);
+        total += n;
+    } while (n == 256);
+
+    // every event kind, including an overflow, is answered with one fresh snapshot of all torrents
+    if (total > 0) poll();
 }
 
 QList<TorrentItem> TorrentBackend::torrents() const {
-    QList<TorrentItem> result;
-    const int count = ts_torrent_count(m_session);
-    for (int i = 0; i < count; ++i) {
-        TorrentItem t;
-        t.id = ts_torrent_id(m_session, i);
-        t.name = QString::fromUtf8(ts_torrent_name(m_session, i));
-        t.sizeBytes = ts_torrent_size(m_session, i);
-        t.status = statusToString(ts_torrent_status(m_session, i));
-        t.seeds = ts_torrent_seeds(m_session, i);
-        t.peers = ts_torrent_peers(m_session, i);
-        t.progress = ts_torrent_progress(m_session, i);
-        t.seeding = ts_torrent_is_seeding(m_session, i);
-        t.savePath = QString::fromUtf8(ts_torrent_save_path(m_session, i));
-        t.torrentPath = QString::fromUtf8(ts_torrent_file_path(m_session, i));
-        result.append(t);
-    }
-    return result;
+    return snapshotItems(m_session);
+}
+
+// magnet links are kept in the session under the same key as .torrent paths
+static int addToSession(TorrentSession *session, const QString &torrentPath, const QString &savePath) {
+    if (torrentPath.startsWith(QStringLiteral("magnet:"), Qt::CaseInsensitive))
+        return ts_add_magnet(session, torrentPath.toUtf8().constData(), savePath.toUtf8().constData());
+    return ts_add_torrent(session, torrentPath.toUtf8().constData(), savePath.toUtf8().constData());
 }
 
 void TorrentBackend::addTorrent(const QString &torrentPath, const QString &savePath) {
-    const int id = ts_add_torrent(m_session,
-                                  torrentPath.toUtf8().constData(),
-                                  savePath.toUtf8().constData());
+    const int id = addToSession(m_session, torrentPath, savePath);
     if (id < 0) {
         emit errorOccurred(tr("Failed to add torrent: %1").arg(torrentPath));
         return;
     }
-    // poll() will pick up the new entry on its next tick (within 1 second).
-    // Trigger an immediate refresh so the UI responds instantly.
-    poll();
+    // the core posts TS_EVENT_ADDED, drainEvents() refreshes the list
 }
 
 void TorrentBackend::removeTorrent(const int id) {
     ts_remove_torrent(m_session, id);
-    poll();
 }
 
 void TorrentBackend::createTorrent(const QString &sourceDir, const QString &outputPath, const QString &trackerUrl,
@@ -230,17 +242,42 @@ void TorrentBackend::saveSession() const {
     }
 
     settings.setValue("session/torrents", activeTorrents);
+    settings.setValue("limits/upload", static_cast<quint64>(ts_upload_limit(m_session)));
+    settings.setValue("limits/download", static_cast<quint64>(ts_download_limit(m_session)));
+
+    int maxDownloads, maxSeeds, maxConnections;
+    ts_queue_limits(m_session, &maxDownloads, &maxSeeds, &maxConnections);
+    settings.setValue("queue/downloads", maxDownloads);
+    settings.setValue("queue/seeds", maxSeeds);
+    settings.setValue("queue/connections", maxConnections);
+
+    // the next session starts from the nodes we know instead of bootstrapping from scratch
+    size_t dhtLength = 0;
+    if (unsigned char *dhtState = ts_dht_state(m_session, &dhtLength)) {
+        settings.setValue("dht/state", QByteArray(reinterpret_cast<const char *>(dhtState),
+                                                  static_cast<qsizetype>(dhtLength)));
+        free(dhtState);
+    }
 }
 
 void TorrentBackend::loadSession() const {
     const QSettings settings("rgTorrent", "rgTorrent");
     QStringList activeTorrents = settings.value("session/torrents").toStringList();
 
+    ts_set_upload_limit(m_session, settings.value("limits/upload", 0).toULongLong());
+    ts_set_download_limit(m_session, settings.value("limits/download", 0).toULongLong());
+    ts_set_queue_limits(m_session,
+                        settings.value("queue/downloads", TS_DEFAULT_ACTIVE_DOWNLOADS).toInt(),
+                        settings.value("queue/seeds", TS_DEFAULT_ACTIVE_SEEDS).toInt(),
+                        settings.value("queue/connections", TS_DEFAULT_MAX_CONNECTIONS).toInt());
+    if (const QByteArray dhtState = settings.value("dht/state").toByteArray(); !dhtState.isEmpty()) {
+        ts_restore_dht_state(m_session, reinterpret_cast<const unsigned char *>(dhtState.constData()),
+                             static_cast<size_t>(dhtState.size()));
+    }
+
     for (const QString &entry: activeTorrents) {
         if (QStringList parts = entry.split("|"); parts.size() >= 2) {
-            const int id = ts_add_torrent(m_session,
-                                    parts[0].toUtf8().constData(),
-                                    parts[1].toUtf8().constData());
+            const int id = addToSession(m_session, parts[0], parts[1]);
 
             if (parts.size() >= 3 && parts[2] == "1") {
                 ts_pause_torrent(m_session, id);
@@ -251,10 +288,28 @@ void TorrentBackend::loadSession() const {
 
 void TorrentBackend::pauseTorrent(const int id) {
     ts_pause_torrent(m_session, id);
-    poll();
 }
 
 void TorrentBackend::resumeTorrent(const int id) {
     ts_resume_torrent(m_session, id);
-    poll();
-}
\ No newline at end of file
+}
+
+void TorrentBackend::setUploadLimit(const quint64 bytesPerSec) {
+    ts_set_upload_limit(m_session, bytesPerSec);
+}
+
+void TorrentBackend::setDownloadLimit(const quint64 bytesPerSec) {
+    ts_set_download_limit(m_session, bytesPerSec);
+}
+
+void TorrentBackend::setQueueLimits(const int maxDownloads, const int maxSeeds, const int maxConnections) {
+    ts_set_queue_limits(m_session, maxDownloads, maxSeeds, maxConnections);
+}
+
+void TorrentBackend::setTorrentUploadLimit(const int id, const quint64 bytesPerSec) {
+    ts_set_torrent_upload_limit(m_session, id, bytesPerSec);
+}
+
+void TorrentBackend::setTorrentDownloadLimit(const int id, const quint64 bytesPerSec) {
+    ts_set_torrent_download_limit(m_session, id, bytesPerSec);
+}
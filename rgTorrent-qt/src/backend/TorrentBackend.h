@@ -1,6 +1,6 @@
 #pragma once
 #include <QObject>
-#include <QTimer>
+#include <QSocketNotifier>
 #include <QList>
 #include <QString>
 #include "TorrentItem.h"
@@ -28,6 +28,13 @@ public slots:
     void createTorrent(const QString &sourceDir, const QString &outputPath,const QString &trackerUrl, int pieceLength);
     void pauseTorrent(int id);
     void resumeTorrent(int id);
+    // limits are in bytes per second, 0 means unlimited
+    void setUploadLimit(quint64 bytesPerSec);
+    void setDownloadLimit(quint64 bytesPerSec);
+    void setTorrentUploadLimit(int id, quint64 bytesPerSec);
+    void setTorrentDownloadLimit(int id, quint64 bytesPerSec);
+    // active torrent and connection caps for the queue, -1 means unlimited
+    void setQueueLimits(int maxDownloads, int maxSeeds, int maxConnections);
 
     signals:
         void torrentsChanged(const QList<TorrentItem> &items);
@@ -35,8 +42,9 @@ public slots:
 
 private slots:
     void poll();
+    void drainEvents();
 
 private:
-    QTimer             *m_pollTimer = nullptr;
+    QSocketNotifier    *m_eventNotifier = nullptr;
     TorrentSession     *m_session   = nullptr;
 };
\ No newline at end of file
@@ -11,6 +11,12 @@ struct TorrentItem {
     int peers = 0;
     int totalPeers = 0;
     double  progress    = 0.0;
+    quint64 downloadRate = 0;
+    quint64 uploadRate = 0;
+    quint64 downloaded = 0;
+    quint64 uploaded = 0;
+    quint64 wasted = 0;
+    qint64 etaSeconds = -1;
     bool    seeding     = false;
     QString savePath;
     QString torrentPath;
@@ -59,6 +59,12 @@ TorrentDetailsPanel::TorrentDetailsPanel(QWidget *parent)
     addRow(m_card, row++, tr("Status"),   &m_lStatus);
     addRow(m_card, row++, tr("Seeds"),    &m_lSeeds);
     addRow(m_card, row++, tr("Peers"),    &m_lPeers);
+    addRow(m_card, row++, tr("Download Speed"), &m_lDownRate);
+    addRow(m_card, row++, tr("Upload Speed"),   &m_lUpRate);
+    addRow(m_card, row++, tr("Downloaded"), &m_lDownloaded);
+    addRow(m_card, row++, tr("Uploaded"),   &m_lUploaded);
+    addRow(m_card, row++, tr("Wasted"),     &m_lWasted);
+    addRow(m_card, row++, tr("ETA"),        &m_lEta);
     addRow(m_card, row++, tr("Seeding"),  &m_lSeeding);
     addRow(m_card, row++, tr("File"),     &m_lPath);
 
@@ -105,6 +111,23 @@ void TorrentDetailsPanel::addRow(QWidget *parent, const int row,
     grid->addWidget(*valueOut,  row, 1);
 }
 
+QString TorrentDetailsPanel::formatBytes(const quint64 bytes) {
+    const double kb = 1024, mb = kb * 1024;
+
+    if (const double gb = mb * 1024; bytes >= gb) return tr("%1 GB").arg(bytes / gb, 0, 'f', 2);
+    if (bytes >= mb) return tr("%1 MB").arg(bytes / mb, 0, 'f', 1);
+    if (bytes >= kb) return tr("%1 KB").arg(bytes / kb, 0, 'f', 0);
+    return tr("%1 B").arg(bytes);
+}
+
+QString TorrentDetailsPanel::formatEta(const qint64 seconds) {
+    if (seconds < 0) return QStringLiteral("∞");
+    if (seconds >= 86400) return tr("%1d %2h").arg(seconds / 86400).arg(seconds % 86400 / 3600);
+    if (seconds >= 3600) return tr("%1h %2m").arg(seconds / 3600).arg(seconds % 3600 / 60);
+    if (seconds >= 60) return tr("%1m %2s").arg(seconds / 60).arg(seconds % 60);
+    return tr("%1s").arg(seconds);
+}
+
 void TorrentDetailsPanel::setTorrent(const TorrentItem &item) const {
     m_lName->setText(item.name.isEmpty() ? QStringLiteral("—") : item.name);
 
@@ -115,6 +138,12 @@ void TorrentDetailsPanel::setTorrent(const TorrentItem &item) const {
     m_lStatus->setText(item.status);
     m_lSeeds->setText(QString("%1 (%2)").arg(item.seeds).arg(item.totalSeeds));
     m_lPeers->setText(QString("%1 (%2)").arg(item.peers).arg(item.totalPeers));
+    m_lDownRate->setText(tr("%1/s").arg(formatBytes(item.downloadRate)));
+    m_lUpRate->setText(tr("%1/s").arg(formatBytes(item.uploadRate)));
+    m_lDownloaded->setText(formatBytes(item.downloaded));
+    m_lUploaded->setText(formatBytes(item.uploaded));
+    m_lWasted->setText(formatBytes(item.wasted));
+    m_lEta->setText(formatEta(item.etaSeconds));
     m_lSeeding->setText(item.seeding ? tr("Yes") : tr("No"));
     m_lPath->setText(item.torrentPath.isEmpty()
         ? QStringLiteral("—") : item.torrentPath);
@@ -127,7 +156,8 @@ void TorrentDetailsPanel::setTorrent(const TorrentItem &item) const {
 void TorrentDetailsPanel::clear()
 {
     for (auto *l : {m_lName, m_lSize, m_lStatus, m_lSeeds,
-                     m_lPeers, m_lSeeding, m_lPath})
+                     m_lPeers, m_lDownRate, m_lUpRate, m_lDownloaded,
+                     m_lUploaded, m_lWasted, m_lEta, m_lSeeding, m_lPath})
         l->setText(QStringLiteral("—"));
     m_progressBar->setValue(0);
     m_lProgress->setText("0%");
@@ -140,8 +170,14 @@ void TorrentDetailsPanel::retranslateUi() const {
     if (const auto k2 = findChild<QLabel*>("key_2")) k2->setText(tr("Status"));
     if (const auto k3 = findChild<QLabel*>("key_3")) k3->setText(tr("Seeds"));
     if (const auto k4 = findChild<QLabel*>("key_4")) k4->setText(tr("Peers"));
-    if (const auto k5 = findChild<QLabel*>("key_5")) k5->setText(tr("Seeding"));
-    if (const auto k6 = findChild<QLabel*>("key_6")) k6->setText(tr("File"));
+    if (const auto k5 = findChild<QLabel*>("key_5")) k5->setText(tr("Download Speed"));
+    if (const auto k6 = findChild<QLabel*>("key_6")) k6->setText(tr("Upload Speed"));
+    if (const auto k7 = findChild<QLabel*>("key_7")) k7->setText(tr("Downloaded"));
+    if (const auto k8 = findChild<QLabel*>("key_8")) k8->setText(tr("Uploaded"));
+    if (const auto k9 = findChild<QLabel*>("key_9")) k9->setText(tr("Wasted"));
+    if (const auto k10 = findChild<QLabel*>("key_10")) k10->setText(tr("ETA"));
+    if (const auto k11 = findChild<QLabel*>("key_11")) k11->setText(tr("Seeding"));
+    if (const auto k12 = findChild<QLabel*>("key_12")) k12->setText(tr("File"));
     if (const auto kp = findChild<QLabel*>("detailKey")) kp->setText(tr("Progress"));
 }
 
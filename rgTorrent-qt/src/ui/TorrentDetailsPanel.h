@@ -21,9 +21,12 @@ signals:
 
 private:
     static void addRow(QWidget *grid, int row, const QString &key, QLabel **valueOut);
+    static QString formatBytes(quint64 bytes);
+    static QString formatEta(qint64 seconds);
 
     QLabel *m_lName, *m_lSize, *m_lStatus, *m_lSeeds,
-           *m_lPeers, *m_lProgress, *m_lSeeding, *m_lPath;
+           *m_lPeers, *m_lDownRate, *m_lUpRate, *m_lDownloaded,
+           *m_lUploaded, *m_lWasted, *m_lEta, *m_lProgress, *m_lSeeding, *m_lPath;
     QProgressBar *m_progressBar;
     QFrame       *m_card;
     QPushButton *m_closeBtn;